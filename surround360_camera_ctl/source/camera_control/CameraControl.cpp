@@ -7,6 +7,10 @@
 */
 
 #include <CameraControl.hpp>
+#include <BayerCodec.h>
+#include <ConsumerDispatch.h>
+#include <FramePool.h>
+#include <FrameWriter.h>
 
 #include <algorithm>
 #include <atomic>
@@ -73,6 +77,10 @@ static const int kNumPreviewCams = 4;
 static const int kAlignment = 4096;
 static const int kMaxDigits = 4;
 
+// Extra slots in each camera's ring, for the frames the camera and the
+// producer are working on
+static const int kSlackFrames = 20;
+
 #define D(x) if (FLAGS_debug) {cout << x << endl;}
 
 DEFINE_bool(debug,          false,                    "Enable printing of debugging statements.");
@@ -96,13 +104,19 @@ DEFINE_double(shutter,      20.0,                     "Set shutter speed.");
 DEFINE_bool(stop,           false,                    "Stop capturing.");
 DEFINE_string(whitebalance, "450 796",                "Set red, blue white balance values.");
 DEFINE_bool(cli,            false,                    "Enable CLI mode");
+DEFINE_bool(compress,       false,                    "Compress frames losslessly before writing them. 8 bit only.");
+DEFINE_int32(compress_threads, 4,                     "Threads compressing each consumer's frames.");
+DEFINE_int32(write_queue_depth, 4,                    "Disk writes each consumer keeps in flight.");
+DEFINE_int32(frames_per_write, 8,                     "Most consecutive frames a consumer writes at once.");
+DEFINE_int32(consumers,     2,                        "Number of consumer threads, each writing its own .bin file.");
+DEFINE_bool(balance_consumers, false,                 "Queue frames on the least loaded consumer when their camera's consumer falls behind, rather than always on camera % consumers.");
 
 typedef pair<unsigned int, unsigned int> SerialIndexPair;
 typedef vector<SerialIndexPair> SerialIndexVector;
 typedef SerialIndexVector::iterator SerialIndexIterator;
 
 // The output disk prefix name. There is one per consumer thread
-// (CONSUMER_COUNT).
+// (--consumers).
 static const string kFramesDisk = "/media/snoraid";
 
 // Compute a time difference in seconds
@@ -255,7 +269,10 @@ static int setPreviewCam(int k, int m) {
 
 void cameraProducer(
   ConsumerBuffer *consumerBuffer,
+  const int nConsumers,
+  const bool balanceConsumers,
   ConsumerBuffer *previewBuffer,
+  FramePool *framePool,
   PointGreyCameraPtr ppCameras[],
   const unsigned int nCameras,
   const unsigned int nImages,
@@ -319,11 +336,13 @@ void cameraProducer(
 
   int frameNumber = 0;
   int frameCount = 0;
+  int countRerouted = 0;
   const int intFps = int(FLAGS_fps);
 
   while (keepRunning) {
     for (unsigned int i = cameraOffset; i < lastCamera; ++i) {
-      const int cid = i % CONSUMER_COUNT; // ping-pong between output threads
+      // ping-pong between output threads, or whichever is least loaded
+      const int cid = pickConsumer(consumerBuffer, nConsumers, i, balanceConsumers);
       ++frameCount;
 
       if (i == 0 && startRecording) {
@@ -337,21 +356,20 @@ void cameraProducer(
       }
 
       // Retrieve an image from buffer
-      FramePacket* nextFrame = nullptr;
-
       try {
         void *bytes = ppCameras[i]->getFrame();
         // loop invariant; if this fails, it means the program is not written correctly
         assert(bytes != nullptr);
 
+        // The consumer gets the frame where the camera captured it, and
+        // checks it against the camera's frame counter once it's written
         if (recording) {
-          nextFrame = consumerBuffer[cid].getHead();
-          nextFrame->frameNumber = frameNumber;
-          nextFrame->cameraNumber = i;
-          memcpy(nextFrame->imageBytes, bytes, FRAME_SIZE);
-
-          // We're done with the head of the queue - move on...
-          consumerBuffer[cid].advanceHead();
+          handOffFrame(
+            *framePool, consumerBuffer[cid], i, frameNumber, bytes,
+            ppCameras[i]->getDroppedFramesCounter());
+          if (cid != i % nConsumers) {
+            ++countRerouted;
+          }
         }
 
         FramePacket *previewFrame = nullptr;
@@ -406,13 +424,16 @@ void cameraProducer(
           if (FLAGS_cli) {
             D("Press 'r' to start recording, 's' to stop recording, 'q' to quit.");
           }
+          string consumerStates;
+          for (int cid = 0; cid < nConsumers; ++cid) {
+            consumerStates += " " + consumerBuffer[cid].stateString();
+          }
           D("Elapsed time = " << timeDiff(tStart, tCurr)
             << " FPS = " << fps / 10.0
             << " frame # = " << frameNumber
             << " Frames captured = " << frameCount
             << " Dropped frames = " << dpf
-            << " " << consumerBuffer[0].stateString()
-            << " " << consumerBuffer[1].stateString());
+            << consumerStates);
         }
         tLast = tCurr;
       }
@@ -420,7 +441,7 @@ void cameraProducer(
     ++frameNumber;
   }
 
-  for (int cid = 0; cid < CONSUMER_COUNT; ++cid) {
+  for (int cid = 0; cid < nConsumers; ++cid) {
     consumerBuffer[cid].done();
   }
 
@@ -441,6 +462,7 @@ void cameraProducer(
   *statsStream << "Data writen: " << sizeGB << " GB" << endl;
   *statsStream << "Images count: " << nImagesTotal << endl;
   *statsStream << "Images count/camera: " << nImagesTotal / nCameras << endl;
+  *statsStream << "Images queued off their camera's consumer: " << countRerouted << endl;
   *statsStream << "Elapsed time: " << tDiff << " s" << endl;
   *statsStream << "Producer speed: " << (8 * sizeGB / tDiff) << " Gb/s" << endl;
   *statsStream << "Producer speed (theory): " << speedTheory << " Gb/s" << endl;
@@ -794,30 +816,97 @@ static void preview(ConsumerBuffer* previewBuffer) {
   }
 }
 
+// A frame on its way to disk. imageBytes is null once the frame's slot
+// has been given back, and encodeBuffer is set if the frame was compressed.
+struct WrittenFrame {
+  int frameNumber;
+  int cameraNumber;
+  uint32_t frameCounter;
+  uint8_t* imageBytes;
+  uint8_t* encodeBuffer;
+};
+
 void frameConsumer(
   ConsumerBuffer consumerBuffer[],
+  FramePool* framePool,
   const int cid,
+  const int nConsumers,
   const int nCameras,
   const int nImages,
   const string& dir,
   const string& label,
+  const bool compress,
   stringstream* statsStream) {
 
   const string filenameFrames = dir + "/" + to_string(cid) + ".bin";
   int fd = open(filenameFrames.c_str(),
-                O_WRONLY | O_NONBLOCK | O_CREAT | O_DIRECT, 0644);
+                O_WRONLY | O_CREAT | O_DIRECT, 0644);
 
   if (fd < 0) {
     printAndSaveError(strerror(errno), dir);
     exit(EXIT_FAILURE);
   }
 
-  size_t fileSize = FRAME_SIZE * nCameras * size_t(nImages) / CONSUMER_COUNT;
+  size_t fileSize = FRAME_SIZE * nCameras * size_t(nImages) / nConsumers;
   posix_fadvise(fd, 0, fileSize, POSIX_FADV_DONTNEED);
   posix_fadvise(fd, 0, fileSize, POSIX_FADV_SEQUENTIAL);
 
+  // Which frame of which camera each slot of the file holds, one
+  // "frame camera" line per slot, as frames go to whichever consumer the
+  // producer picks
+  const string filenameRouting = dir + "/" + to_string(cid) + ".routing";
+  ofstream routingFile(filenameRouting);
+  if (!routingFile) {
+    printAndSaveError("can't open " + filenameRouting, dir);
+    exit(EXIT_FAILURE);
+  }
+
+  // The frames of the file the camera came round to capture over before
+  // they were written, one "frame camera" line each, for the unpacker to
+  // leave out
+  const string filenameOverwritten = dir + "/" + to_string(cid) + ".overwritten";
+  ofstream overwrittenFile(filenameOverwritten);
+  if (!overwrittenFile) {
+    printAndSaveError("can't open " + filenameOverwritten, dir);
+    exit(EXIT_FAILURE);
+  }
+
   int countImg = 0;
-  size_t bytesWritten = 0;
+  size_t bytesCaptured = 0;
+
+  // Frames the camera came round to capture over before they were written.
+  // They are still written, so the file keeps its layout, but hold part or
+  // all of a later frame of the same camera, so they are listed as
+  // overwritten and unpacked as if the camera had dropped them.
+  int countOverwritten = 0;
+  auto finishFrame = [&](const WrittenFrame& frame, const uint8_t* bytes) {
+    if (!framePool->isIntact(frame.cameraNumber, bytes, frame.frameCounter)) {
+      overwrittenFile << frame.frameNumber << " " << frame.cameraNumber << "\n";
+      ++countOverwritten;
+    }
+    framePool->release(frame.cameraNumber, bytes);
+  };
+
+  // Compressed frames keep the slot of the raw frame, so the file can be
+  // read like an uncompressed one, and the rest of the slot is left as a
+  // hole. Frames that don't compress are written raw. A write holds at
+  // most one compressed frame, its last, so with one buffer for each write
+  // in flight, one for the write being put together and one to encode
+  // into, there is always a buffer free.
+  vector<uint8_t*> freeEncodeBuffers;
+  if (compress) {
+    const size_t maxEncodedSize = BayerCodec::getMaxEncodedSize(FRAME_W, FRAME_H, 8);
+    for (int k = 0; k < FLAGS_write_queue_depth + 2; ++k) {
+      uint8_t* encodeBuffer = nullptr;
+      int ret = posix_memalign(
+        (void **)&encodeBuffer,
+        kAlignment,
+        (maxEncodedSize + kAlignment - 1) / kAlignment * kAlignment);
+      assert(ret == 0);
+      freeEncodeBuffers.push_back(encodeBuffer);
+    }
+  }
+  vector<uint8_t*> encodeBuffers(freeEncodeBuffers);
 
   // move outside of the region of CPUs where the kernel's MSI/MSI-X/IRQ handlers run
   cpu_set_t threadCpuAffinity;
@@ -825,33 +914,122 @@ void frameConsumer(
   CPU_SET(10 + cid + PRODUCER_COUNT, &threadCpuAffinity);
   sched_setaffinity(0, sizeof(threadCpuAffinity), &threadCpuAffinity);
 
-  // Using UNIX open/write to avoid I/O buffering
+  // Using UNIX open/write to avoid I/O buffering. Frames are written
+  // straight from their slots of the frame pool, several writes at a time,
+  // and a slot is only given back once its frame is written.
+  FrameWriter<WrittenFrame> writer(
+    fd,
+    FLAGS_write_queue_depth,
+    FLAGS_frames_per_write,
+    [&](const WrittenFrame& written) {
+      if (written.imageBytes != nullptr) {
+        finishFrame(written, written.imageBytes);
+      }
+      if (written.encodeBuffer != nullptr) {
+        freeEncodeBuffers.push_back(written.encodeBuffer);
+      }
+    });
+
   timespec tStart, tEnd;
   long double tDiff;
   clock_gettime(CLOCK_REALTIME, &tStart);
 
-  FramePacket* nextFrame;
-  while ((nextFrame = consumerBuffer[cid].getTail()) != nullptr) {
-    int count = write(fd, nextFrame->imageBytes, FRAME_SIZE);
-    if (count < 0) {
-      printAndSaveError(strerror(errno), dir);
-      exit(EXIT_FAILURE);
+  try {
+    while (true) {
+      writer.reap();
+
+      // With nothing to coalesce the frames with, send what there is. Don't
+      // sleep on an empty queue with writes in flight: the producer may be
+      // waiting for their slots.
+      if (consumerBuffer[cid].isEmpty()) {
+        writer.flush();
+        if (writer.getInFlight() > 0) {
+          writer.waitForWrite();
+          continue;
+        }
+      }
+
+      FramePacket* nextFrame = consumerBuffer[cid].getTail();
+      if (nextFrame == nullptr) {
+        break;
+      }
+      const int camera = nextFrame->cameraNumber;
+      const WrittenFrame frame{
+        nextFrame->frameNumber, camera, nextFrame->frameCounter, nullptr, nullptr};
+      uint8_t* imageBytes = nextFrame->imageBytes;
+      routingFile << nextFrame->frameNumber << " " << camera << "\n";
+      consumerBuffer[cid].advanceTail();
+
+      const uint64_t offset = uint64_t(countImg) * FRAME_SIZE;
+      bytesCaptured += FRAME_SIZE;
+      countImg++;
+
+      if (compress) {
+        while (freeEncodeBuffers.empty()) {
+          writer.flush();
+          writer.waitForWrite();
+        }
+        uint8_t* encodeBuffer = freeEncodeBuffers.back();
+        const size_t encodedSize = BayerCodec::encode(
+          imageBytes, FRAME_W, FRAME_H, 8, encodeBuffer, FLAGS_compress_threads);
+        const size_t paddedSize = (encodedSize + kAlignment - 1) / kAlignment * kAlignment;
+        if (paddedSize < FRAME_SIZE) {
+          memset(encodeBuffer + encodedSize, 0, paddedSize - encodedSize);
+          freeEncodeBuffers.pop_back();
+          // The raw frame has been read
+          finishFrame(frame, imageBytes);
+          WrittenFrame encoded = frame;
+          encoded.encodeBuffer = encodeBuffer;
+          writer.write(offset, encodeBuffer, paddedSize, encoded);
+          continue;
+        }
+      }
+
+      WrittenFrame raw = frame;
+      raw.imageBytes = imageBytes;
+      writer.write(offset, imageBytes, FRAME_SIZE, raw);
     }
-    bytesWritten += count;
-    countImg++;
-    consumerBuffer[cid].advanceTail();
+    writer.drain();
+  } catch (const exception& e) {
+    printAndSaveError(e.what(), dir);
+    exit(EXIT_FAILURE);
   }
 
+  // Give a compressed last frame its whole slot
+  if (ftruncate(fd, off_t(countImg) * FRAME_SIZE) < 0) {
+    printAndSaveError(strerror(errno), dir);
+  }
   fsync(fd);
   close(fd);
+  routingFile.close();
+  overwrittenFile.close();
+  for (uint8_t* encodeBuffer : encodeBuffers) {
+    free(encodeBuffer);
+  }
   clock_gettime(CLOCK_REALTIME, &tEnd);
 
   tDiff = timeDiff(tStart, tEnd);
 
+  const size_t bytesWritten = writer.getBytesWritten();
   float sizeGB = float(bytesWritten) / float(1024 * 1024 * 1024);
   *statsStream << "--- Consumer " << cid << "---" << endl;
   *statsStream << "Data writen: " << sizeGB << " GB" << endl;
   *statsStream << "Images count: " << countImg << endl;
+  *statsStream << "Images overwritten before written: " << countOverwritten << endl;
+  if (compress && bytesWritten > 0) {
+    *statsStream << "Compression ratio: "
+                 << float(bytesCaptured) / float(bytesWritten) << endl;
+  }
+  if (writer.getWriteCount() > 0) {
+    *statsStream << "Writes: " << writer.getWriteCount() << " ("
+                 << FrameWriter<WrittenFrame>::getBackendName(writer.getBackend()) << "), "
+                 << float(writer.getFrameCount()) / writer.getWriteCount()
+                 << " images per write" << endl;
+    *statsStream << "Write queue depth: " << writer.getAverageInFlight() << " average, "
+                 << writer.getMaxInFlight() << " max" << endl;
+    *statsStream << "Write latency: " << writer.getAverageLatency() * 1000 << " ms average, "
+                 << writer.getMaxLatency() * 1000 << " ms max" << endl;
+  }
   *statsStream << "Elapsed time: " << tDiff << " s" << endl;
   *statsStream << "Consumer speed: "
                << (8 * sizeGB / tDiff) << " Gb/s" << endl;
@@ -1059,6 +1237,22 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  // Frames are FRAME_SIZE bytes, one byte per pixel
+  if (FLAGS_compress && FLAGS_nbits != 8) {
+    cerr << "--compress needs --nbits 8." << endl;
+    return -1;
+  }
+
+  if (FLAGS_write_queue_depth < 1 || FLAGS_frames_per_write < 1) {
+    cerr << "--write_queue_depth and --frames_per_write must be at least 1." << endl;
+    return -1;
+  }
+
+  if (FLAGS_consumers < 1) {
+    cerr << "--consumers must be at least 1." << endl;
+    return -1;
+  }
+
   if (FLAGS_cli) {
     tcgetattr(STDIN_FILENO, &origTermSettings);
     tattr = origTermSettings;
@@ -1137,20 +1331,9 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  // Create the producer/consumer buffer object
-  ConsumerBuffer* consumerBuffer = new ConsumerBuffer[CONSUMER_COUNT];
-  uint8_t* frameBytes[CONSUMER_COUNT];
-  for (int k = 0; k < CONSUMER_COUNT; k++) {
-    int ret = posix_memalign(
-      (void **)&frameBytes[k],
-      kAlignment,
-      FRAME_SIZE * BUFFER_SIZE);
-    assert(ret == 0);
-    mlock(frameBytes[k], FRAME_SIZE * BUFFER_SIZE);
-    memset(frameBytes[k], 0, FRAME_SIZE * BUFFER_SIZE);
-    madvise(frameBytes, FRAME_SIZE * BUFFER_SIZE, MADV_SEQUENTIAL);
-    consumerBuffer[k].setBuffers(frameBytes[k], FRAME_SIZE);
-  }
+  // Create the producer/consumer buffer object. Frames live in the frame
+  // pool; the buffers only pass pointers to them.
+  ConsumerBuffer* consumerBuffer = new ConsumerBuffer[FLAGS_consumers];
 
   ConsumerBuffer* previewBuffer = new ConsumerBuffer[kNumPreviewCams];
 
@@ -1326,6 +1509,30 @@ int main(int argc, char *argv[]) {
   statsFile.open(filenameStats.c_str(), std::fstream::app);
 
 
+  // Lend each camera a ring of frame buffers to capture into. A consumer
+  // holds at most BUFFER_SIZE frames in its queue and a write more than
+  // it keeps in flight, as many of each of its cameras, so one that keeps
+  // up is done with a frame long before its camera comes round to its
+  // slot again.
+  const int camerasPerConsumer = (FLAGS_numcams + FLAGS_consumers - 1) / FLAGS_consumers;
+  const int framesWriting = (FLAGS_write_queue_depth + 1) * FLAGS_frames_per_write;
+  FramePool* framePool = new FramePool(
+    nCameras,
+    (BUFFER_SIZE + framesWriting) / max(camerasPerConsumer, 1) + kSlackFrames,
+    FRAME_SIZE,
+    kAlignment);
+
+  for (unsigned int i = 0; i < nCameras; i++) {
+    const int err = ppCameras[i]->setUserBuffers(
+      framePool->getRing(i), FRAME_SIZE, framePool->getFramesPerCamera());
+    if (err == PGRERROR_OK) {
+      framePool->setCapturing(i, ppCameras[i]->getFrameCounterOffset());
+    } else {
+      cerr << "Warning: camera " << i << " can't capture into lent buffers ("
+           << err << "). Its frames will be copied." << endl;
+    }
+  }
+
   // Start capture on all slave cameras
   for (unsigned int i = 0; i < nCameras; i++) {
     if (i != iCamMaster) {
@@ -1375,7 +1582,10 @@ int main(int argc, char *argv[]) {
       new std::thread(
         cameraProducer,
         consumerBuffer,
+        FLAGS_consumers,
+        FLAGS_balance_consumers,
         previewBuffer,
+        framePool,
         ppCameras,
         FLAGS_numcams,
         FLAGS_nframes,
@@ -1394,22 +1604,24 @@ int main(int argc, char *argv[]) {
   }
 
   // Create consumer threads
-  thread* frameConsumerThread[CONSUMER_COUNT];
-  stringstream* consumerStatsString[CONSUMER_COUNT];
-  int fp[CONSUMER_COUNT];
+  vector<thread*> frameConsumerThread(FLAGS_consumers);
+  vector<stringstream*> consumerStatsString(FLAGS_consumers);
 
-  for (int cid = 0; cid < CONSUMER_COUNT; ++cid) {
+  for (int cid = 0; cid < FLAGS_consumers; ++cid) {
     consumerStatsString[cid] = new stringstream;
 
     frameConsumerThread[cid] =
       new std::thread(
         frameConsumer,
         consumerBuffer,
+        framePool,
         cid,
+        FLAGS_consumers,
         FLAGS_numcams,
         FLAGS_nframes,
         captureDir,
         label,
+        FLAGS_compress,
         consumerStatsString[cid]);
   }
 
@@ -1488,7 +1700,7 @@ int main(int argc, char *argv[]) {
   D("Done");
 
   // Join frame consumer threads
-  for (int cid = 0; cid < CONSUMER_COUNT; ++cid) {
+  for (int cid = 0; cid < FLAGS_consumers; ++cid) {
     frameConsumerThread[cid]->join();
     statsFile << consumerStatsString[cid]->str();
     delete consumerStatsString[cid];
@@ -1504,6 +1716,9 @@ int main(int argc, char *argv[]) {
   statsFile.close();
   stopCapturing(ppCameras, nCameras);
 
+  // The cameras capture into the frame pool until they stop
+  delete framePool;
+
   for (unsigned int i = 0; i < nCameras; i++) {
     D("Camera " << ppCameras[i]->getSerialNumber()
       << " dropped " << droppedFramesCount[i] << " frame(s).");
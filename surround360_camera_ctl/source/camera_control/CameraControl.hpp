@@ -17,7 +17,6 @@
 #include "ProducerConsumer.h"
 
 #define PRODUCER_COUNT 1
-#define CONSUMER_COUNT 2
 #define FRAME_H        2048ULL
 #define FRAME_W        2048ULL
 #define FRAME_SIZE     (FRAME_H * FRAME_W)
@@ -26,13 +25,19 @@
 namespace surround360 {
   namespace fc = FlyCapture2;
 
+  // Each ConsumerBuffer is a single producer ring, and the producer feeds
+  // every consumer
+  static_assert(PRODUCER_COUNT == 1, "ConsumerBuffer takes a single producer");
+
   struct FramePacket{
     int frameNumber;
     int cameraNumber;
-    uint8_t* imageBytes;
+    uint8_t* imageBytes; // a slot of the frame pool
+    uint32_t frameCounter; // embedded in the frame by the camera, see FramePool
   };
 
-  // What we pass between the producer and consumer.
+  // What we pass between the producer and consumer. One producer thread
+  // and one consumer thread per buffer.
   typedef ProducerConsumer<FramePacket, BUFFER_SIZE> ConsumerBuffer;
 
 }
@@ -0,0 +1,47 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the license found in the
+* LICENSE_camera_ctl file in the root directory of this subproject.
+*/
+
+#pragma once
+
+namespace surround360 {
+  /// Called by the producer to pick the consumer a frame of a camera goes
+  /// to. Each camera has a consumer of its own, camera % consumerCount,
+  /// which gets the frame unless balance is set, its queue is over half
+  /// full and another consumer has fewer frames queued; then the least
+  /// loaded one gets it. Consumers that keep up have nearly empty queues,
+  /// so frames only leave their camera's consumer when it falls well
+  /// behind, e.g. while its disk is slow, and not over the odd frame or
+  /// two a consumer is behind at any time.
+  template <typename Buffer>
+  int pickConsumer(
+      Buffer buffers[],
+      const int consumerCount,
+      const int camera,
+      const bool balance) {
+
+    const int own = camera % consumerCount;
+    if (!balance) {
+      return own;
+    }
+
+    int best = own;
+    auto bestSize = buffers[own].size();
+    if (bestSize <= Buffer::capacity() / 2) {
+      return own;
+    }
+    for (int k = 1; k < consumerCount && bestSize > 0; ++k) {
+      const int cid = (own + k) % consumerCount;
+      const auto size = buffers[cid].size();
+      if (size < bestSize) {
+        best = cid;
+        bestSize = size;
+      }
+    }
+    return best;
+  }
+}
@@ -0,0 +1,209 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the license found in the
+* LICENSE_camera_ctl file in the root directory of this subproject.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <sys/mman.h>
+
+namespace surround360 {
+/// The frame buffers the consumers write to disk from
+///
+/// One aligned, locked allocation, so frames can be written with
+/// O_DIRECT, split into a ring of slots per camera. The rings are lent to
+/// the cameras, which capture straight into them; the producer then
+/// passes a frame to its consumer by queueing a pointer to its slot
+/// instead of copying it.
+///
+/// A camera fills its slots in order whether or not the consumer is done
+/// with them, and keeps doing so while the producer is held up, so a
+/// frame is only good until the camera comes round to its slot again. The
+/// cameras embed their frame counter in the first pixels of each frame,
+/// and write a frame from its first byte on, so the producer notes the
+/// counter of each frame it hands off and the consumer, once done reading
+/// the frame, checks the slot still holds that counter: if the camera has
+/// started on the slot again, it has overwritten the counter first. The
+/// counter follows whatever other image info the camera embeds. The
+/// rings are sized so a consumer that keeps up never sees that happen.
+///
+/// A camera that can't capture into its ring has its frames copied into
+/// it by the producer, which then waits for the consumer to give a slot
+/// back before reusing it.
+///
+  class FramePool {
+  public:
+    FramePool(
+        const int cameraCount,
+        const size_t framesPerCamera,
+        const size_t frameSize,
+        const size_t alignment)
+      : cameraCount(cameraCount),
+        framesPerCamera(framesPerCamera),
+        frameSize(frameSize),
+        bytes(nullptr),
+        capturing(new bool[cameraCount]),
+        counterOffset(new size_t[cameraCount]),
+        nextCopySlot(new size_t[cameraCount]),
+        held(new std::atomic<bool>[cameraCount * framesPerCamera]) {
+
+      const size_t size = getSize();
+      if (posix_memalign(reinterpret_cast<void**>(&bytes), alignment, size) != 0) {
+        throw std::runtime_error(
+          "can't allocate " + std::to_string(size >> 20) + " MB of frame buffers");
+      }
+      mlock(bytes, size);
+      memset(bytes, 0, size);
+      for (int camera = 0; camera < cameraCount; ++camera) {
+        capturing[camera] = false;
+        counterOffset[camera] = 0;
+        nextCopySlot[camera] = 0;
+      }
+      for (size_t k = 0; k < cameraCount * framesPerCamera; ++k) {
+        held[k] = false;
+      }
+    }
+
+    ~FramePool() {
+      munlock(bytes, getSize());
+      free(bytes);
+    }
+
+    FramePool(FramePool const&) = delete;
+    FramePool& operator=(FramePool const&) = delete;
+
+    size_t getFramesPerCamera() const {
+      return framesPerCamera;
+    }
+
+    size_t getFrameSize() const {
+      return frameSize;
+    }
+
+    /// The ring of a camera, framesPerCamera slots of frameSize bytes
+    uint8_t* getRing(const int camera) const {
+      return bytes + camera * framesPerCamera * frameSize;
+    }
+
+    /// Records that a camera captures into its ring, embedding its frame
+    /// counter frameCounterOffset bytes into each frame. Call before the
+    /// producer starts.
+    void setCapturing(const int camera, const size_t frameCounterOffset) {
+      capturing[camera] = true;
+      counterOffset[camera] = frameCounterOffset;
+    }
+
+    bool isCapturing(const int camera) const {
+      return capturing[camera];
+    }
+
+    /// The big-endian frame counter a camera embedded at counterBytes
+    static uint32_t readFrameCounter(const uint8_t* counterBytes) {
+      return uint32_t(counterBytes[0]) << 24 | uint32_t(counterBytes[1]) << 16
+        | uint32_t(counterBytes[2]) << 8 | uint32_t(counterBytes[3]);
+    }
+
+    /// Called by the consumer once it is done reading a frame. Whether the
+    /// frame with this counter was still in its slot all along.
+    bool isIntact(const int camera, const uint8_t* slotBytes, const uint32_t frameCounter) const {
+      if (!capturing[camera]) {
+        return true;
+      }
+      // The counter is read after the rest of the frame
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return readFrameCounter(slotBytes + counterOffset[camera]) == frameCounter;
+    }
+
+    /// The slot of a camera's ring that holds a frame, or nullptr if the
+    /// frame isn't in the ring
+    uint8_t* findSlot(const int camera, const void* frameBytes) const {
+      uint8_t* ring = getRing(camera);
+      const uint8_t* p = static_cast<const uint8_t*>(frameBytes);
+      if (p < ring || p >= ring + framesPerCamera * frameSize
+          || (p - ring) % frameSize != 0) {
+        return nullptr;
+      }
+      return ring + (p - ring);
+    }
+
+    /// Called by the producer for cameras that don't capture into their
+    /// ring. Waits for the next slot of the camera's ring to be given back
+    /// and copies the frame into it.
+    uint8_t* copyFrame(const int camera, const void* frameBytes) {
+      const size_t slot = camera * framesPerCamera + nextCopySlot[camera];
+      nextCopySlot[camera] = (nextCopySlot[camera] + 1) % framesPerCamera;
+      while (held[slot].load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      held[slot].store(true, std::memory_order_relaxed);
+      uint8_t* slotBytes = bytes + slot * frameSize;
+      memcpy(slotBytes, frameBytes, frameSize);
+      return slotBytes;
+    }
+
+    /// Called by the consumer when it is done with a frame
+    void release(const int camera, const uint8_t* frameBytes) {
+      if (!capturing[camera]) {
+        held[(frameBytes - bytes) / frameSize].store(false, std::memory_order_release);
+      }
+    }
+
+  private:
+    const int cameraCount;
+    const size_t framesPerCamera;
+    const size_t frameSize;
+    uint8_t* bytes;
+    std::unique_ptr<bool[]> capturing;
+    std::unique_ptr<size_t[]> counterOffset;
+    std::unique_ptr<size_t[]> nextCopySlot;
+    std::unique_ptr<std::atomic<bool>[]> held;
+
+    size_t getSize() const {
+      return cameraCount * framesPerCamera * frameSize;
+    }
+  };
+
+  /// Called by the producer for each frame it records. Hands the frame to
+  /// its consumer through buffer, without copying it if the camera
+  /// captured it into its ring. frameCounter is the camera's counter for
+  /// the frame, as reported when the frame was retrieved.
+  template <typename Buffer>
+  void handOffFrame(
+      FramePool& pool,
+      Buffer& buffer,
+      const int camera,
+      const int frameNumber,
+      const void* frameBytes,
+      const uint32_t frameCounter) {
+
+    uint8_t* slotBytes;
+    if (pool.isCapturing(camera)) {
+      slotBytes = pool.findSlot(camera, frameBytes);
+      if (slotBytes == nullptr) {
+        throw std::runtime_error(
+          "camera " + std::to_string(camera) + " captured outside its buffers");
+      }
+    } else {
+      slotBytes = pool.copyFrame(camera, frameBytes);
+    }
+
+    auto* packet = buffer.getHead();
+    packet->frameNumber = frameNumber;
+    packet->cameraNumber = camera;
+    packet->imageBytes = slotBytes;
+    packet->frameCounter = frameCounter;
+    buffer.advanceHead();
+  }
+}
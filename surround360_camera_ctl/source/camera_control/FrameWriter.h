@@ -0,0 +1,526 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the license found in the
+* LICENSE_camera_ctl file in the root directory of this subproject.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace surround360 {
+/// Writes frames to a file, several writes at a time
+///
+/// Frames that follow each other in the file are coalesced into one
+/// write of up to maxFramesPerWrite frames, gathered from wherever they
+/// are in memory, and up to queueDepth writes are kept in flight. Writes
+/// go through io_uring when the kernel has it; otherwise each one is made
+/// with pwritev as soon as it is submitted. For O_DIRECT files, frame
+/// buffers, lengths and offsets must be block aligned.
+///
+/// Every frame comes with a tag, handed to onWritten once the frame is on
+/// its way to the disk; until then the frame's bytes must stay put. Only
+/// one thread may use a writer, and onWritten runs on it, from any of the
+/// calls that wait for or reap writes. Errors are thrown.
+///
+  template <typename Tag>
+  class FrameWriter {
+  public:
+    enum Backend {
+      BACKEND_AUTO,
+      BACKEND_IO_URING,
+      BACKEND_PWRITE
+    };
+
+    typedef std::function<void(const Tag&)> WrittenCallback;
+
+    FrameWriter(
+        const int fd,
+        const size_t queueDepth,
+        const size_t maxFramesPerWrite,
+        const WrittenCallback& onWritten,
+        const Backend requestedBackend = BACKEND_AUTO)
+      : fd(fd),
+        queueDepth(std::max(queueDepth, size_t(1))),
+        maxFramesPerWrite(std::min(std::max(maxFramesPerWrite, size_t(1)), size_t(IOV_MAX))),
+        onWritten(onWritten),
+        backend(requestedBackend),
+        writes(this->queueDepth + 1), // and one being put together
+        current(-1),
+        inFlight(0),
+        writeCount(0),
+        frameCount(0),
+        bytesWritten(0),
+        maxInFlight(0),
+        inFlightSum(0),
+        doneCount(0),
+        latencySum(0),
+        maxLatency(0) {
+
+      for (Write& write : writes) {
+        write.iovecs.reserve(this->maxFramesPerWrite);
+        write.tags.reserve(this->maxFramesPerWrite);
+        write.inFlight = false;
+      }
+
+#ifdef USE_IO_URING
+      if (backend == BACKEND_AUTO || backend == BACKEND_IO_URING) {
+        if (uring.setup(writes.size())) {
+          backend = BACKEND_IO_URING;
+        } else {
+          uring.close();
+        }
+      }
+#endif
+      if (backend == BACKEND_IO_URING && !isUring()) {
+        throw std::runtime_error("io_uring is not available");
+      }
+      if (!isUring()) {
+        backend = BACKEND_PWRITE;
+      }
+    }
+
+    /// Waits for the writes in flight, as the kernel may still be reading
+    /// their frames, without handing out their tags
+    ~FrameWriter() {
+#ifdef USE_IO_URING
+      try {
+        while (isUring() && inFlight > 0) {
+          uring.enter(0, 1);
+          uring.reap([this](const int index, int) {
+            writes[index].inFlight = false;
+            --inFlight;
+          });
+        }
+      } catch (...) {
+      }
+#endif
+    }
+
+    FrameWriter(FrameWriter const&) = delete;
+    FrameWriter& operator=(FrameWriter const&) = delete;
+
+    /// Queues length bytes of data to be written at offset. The frame is
+    /// added to the write being put together if it carries on from it,
+    /// which is submitted once it's full.
+    void write(const uint64_t offset, const uint8_t* data, const size_t length, const Tag& tag) {
+      if (current >= 0) {
+        const Write& write = writes[current];
+        if (write.offset + write.length != offset
+            || write.tags.size() == maxFramesPerWrite) {
+          flush();
+        }
+      }
+      if (current < 0) {
+        current = getFreeWrite();
+        writes[current].offset = offset;
+        writes[current].length = 0;
+      }
+
+      Write& write = writes[current];
+      iovec iov;
+      iov.iov_base = const_cast<uint8_t*>(data);
+      iov.iov_len = length;
+      write.iovecs.push_back(iov);
+      write.tags.push_back(tag);
+      write.length += length;
+      if (write.tags.size() == maxFramesPerWrite) {
+        flush();
+      }
+    }
+
+    /// Submits the write being put together, if any
+    void flush() {
+      if (current < 0) {
+        return;
+      }
+      while (inFlight == queueDepth) {
+        waitForWrite();
+      }
+      const int index = current;
+      current = -1;
+
+      Write& write = writes[index];
+      write.inFlight = true;
+      write.submitted = std::chrono::steady_clock::now();
+      ++inFlight;
+      ++writeCount;
+      frameCount += write.tags.size();
+      inFlightSum += inFlight;
+      maxInFlight = std::max(maxInFlight, inFlight);
+
+      if (isUring()) {
+#ifdef USE_IO_URING
+        uring.queueWrite(fd, index, write.iovecs.data(), write.iovecs.size(), write.offset);
+        uring.enter(1, 0);
+#endif
+      } else {
+        complete(index, writeFrom(write, 0));
+      }
+    }
+
+    /// Hands out the tags of the writes that are done, without waiting
+    void reap() {
+#ifdef USE_IO_URING
+      if (isUring()) {
+        std::vector<std::pair<int, int>> completions;
+        uring.reap([&completions](const int index, const int result) {
+          completions.push_back(std::make_pair(index, result));
+        });
+        for (const auto& completion : completions) {
+          complete(completion.first, completion.second);
+        }
+      }
+#endif
+    }
+
+    /// Waits for at least one write to be done, if any is in flight
+    void waitForWrite() {
+      reap();
+#ifdef USE_IO_URING
+      const size_t before = inFlight;
+      while (isUring() && inFlight > 0 && inFlight == before) {
+        uring.enter(0, 1);
+        reap();
+      }
+#endif
+    }
+
+    /// Submits what is left and waits for every write
+    void drain() {
+      flush();
+      while (inFlight > 0) {
+        waitForWrite();
+      }
+    }
+
+    size_t getInFlight() const {
+      return inFlight;
+    }
+
+    Backend getBackend() const {
+      return backend;
+    }
+
+    static const char* getBackendName(const Backend backend) {
+      switch (backend) {
+        case BACKEND_AUTO: return "auto";
+        case BACKEND_IO_URING: return "io_uring";
+        case BACKEND_PWRITE: return "pwrite";
+      }
+      return "unknown";
+    }
+
+    uint64_t getWriteCount() const {
+      return writeCount;
+    }
+
+    uint64_t getFrameCount() const {
+      return frameCount;
+    }
+
+    uint64_t getBytesWritten() const {
+      return bytesWritten;
+    }
+
+    /// The most writes in flight at once, and how many there were on
+    /// average, counting the new one, when a write was submitted
+    size_t getMaxInFlight() const {
+      return maxInFlight;
+    }
+
+    double getAverageInFlight() const {
+      return writeCount > 0 ? double(inFlightSum) / writeCount : 0.0;
+    }
+
+    /// Seconds from submitting a write to finding it done
+    double getAverageLatency() const {
+      return doneCount > 0 ? latencySum / doneCount : 0.0;
+    }
+
+    double getMaxLatency() const {
+      return maxLatency;
+    }
+
+  private:
+    struct Write {
+      std::vector<iovec> iovecs; // one per frame, alive until the write is done
+      std::vector<Tag> tags;
+      uint64_t offset;
+      size_t length;
+      std::chrono::steady_clock::time_point submitted;
+      bool inFlight;
+    };
+
+#ifdef USE_IO_URING
+    // A submission and a completion queue shared with the kernel, set up
+    // with the raw system calls so there is no library to depend on
+    struct IoUring {
+      int ringFd;
+      void* sqRing;
+      size_t sqRingSize;
+      void* cqRing;
+      size_t cqRingSize;
+      io_uring_sqe* sqes;
+      size_t sqesSize;
+      unsigned* sqTail;
+      unsigned* sqMask;
+      unsigned* sqArray;
+      unsigned* cqHead;
+      unsigned* cqTail;
+      unsigned* cqMask;
+      io_uring_cqe* cqes;
+
+      IoUring() : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(nullptr) {
+      }
+
+      ~IoUring() {
+        close();
+      }
+
+      void close() {
+        if (sqes != nullptr) {
+          munmap(sqes, sqesSize);
+          sqes = nullptr;
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing) {
+          munmap(cqRing, cqRingSize);
+        }
+        cqRing = MAP_FAILED;
+        if (sqRing != MAP_FAILED) {
+          munmap(sqRing, sqRingSize);
+          sqRing = MAP_FAILED;
+        }
+        if (ringFd != -1) {
+          ::close(ringFd);
+          ringFd = -1;
+        }
+      }
+
+      // False if the kernel doesn't support io_uring or doesn't allow it
+      bool setup(const unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd == -1) {
+          return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) {
+          sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+          return false;
+        }
+        cqRing = singleMmap
+          ? sqRing
+          : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+          return false;
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqesAddr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqesAddr == MAP_FAILED) {
+          return false;
+        }
+        sqes = reinterpret_cast<io_uring_sqe*>(sqesAddr);
+
+        uint8_t* sq = reinterpret_cast<uint8_t*>(sqRing);
+        uint8_t* cq = reinterpret_cast<uint8_t*>(cqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+      }
+
+      void queueWrite(
+          const int fd,
+          const int index,
+          const iovec* iovecs,
+          const size_t iovecCount,
+          const uint64_t offset) {
+        const unsigned tail = *sqTail;
+        const unsigned slot = tail & *sqMask;
+        io_uring_sqe& sqe = sqes[slot];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(iovecs);
+        sqe.len = iovecCount;
+        sqe.off = offset;
+        sqe.user_data = index;
+        sqArray[slot] = slot;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+      }
+
+      // Submits what was queued and waits for at least minComplete
+      // completions
+      void enter(const unsigned toSubmit, const unsigned minComplete) {
+        const unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        unsigned submitted = 0;
+        while (true) {
+          const int ret = syscall(
+            __NR_io_uring_enter, ringFd, toSubmit - submitted, minComplete, flags, nullptr, 0);
+          if (ret >= 0) {
+            submitted += ret;
+            if (submitted >= toSubmit) {
+              return;
+            }
+          } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            throw std::runtime_error(
+              std::string("error in io_uring_enter(): ") + strerror(errno));
+          }
+        }
+      }
+
+      // Calls f(index, result) for every completion available
+      template <typename F>
+      void reap(F f) {
+        unsigned head = *cqHead;
+        const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+          const io_uring_cqe& cqe = cqes[head & *cqMask];
+          f(int(cqe.user_data), int(cqe.res));
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+      }
+    };
+
+    IoUring uring;
+#endif
+
+    const int fd;
+    const size_t queueDepth;
+    const size_t maxFramesPerWrite;
+    const WrittenCallback onWritten;
+    Backend backend;
+    std::vector<Write> writes;
+    int current; // the write being put together, -1 if none
+    size_t inFlight;
+
+    uint64_t writeCount;
+    uint64_t frameCount;
+    uint64_t bytesWritten;
+    size_t maxInFlight;
+    uint64_t inFlightSum;
+    uint64_t doneCount;
+    double latencySum;
+    double maxLatency;
+
+    bool isUring() const {
+#ifdef USE_IO_URING
+      return uring.ringFd != -1;
+#else
+      return false;
+#endif
+    }
+
+    int getFreeWrite() {
+      while (true) {
+        for (int i = 0; i < int(writes.size()); ++i) {
+          if (!writes[i].inFlight && i != current) {
+            return i;
+          }
+        }
+        waitForWrite();
+      }
+    }
+
+    // Writes what is left of a write after its first done bytes. Returns
+    // the number of bytes written, or -errno.
+    ssize_t writeFrom(const Write& write, size_t done) const {
+      std::vector<iovec> left;
+      while (done < write.length) {
+        left.clear();
+        size_t skip = done;
+        for (const iovec& iov : write.iovecs) {
+          if (skip >= iov.iov_len) {
+            skip -= iov.iov_len;
+            continue;
+          }
+          iovec rest;
+          rest.iov_base = static_cast<uint8_t*>(iov.iov_base) + skip;
+          rest.iov_len = iov.iov_len - skip;
+          left.push_back(rest);
+          skip = 0;
+        }
+        const ssize_t count = pwritev(fd, left.data(), left.size(), write.offset + done);
+        if (count < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return -errno;
+        }
+        if (count == 0) {
+          return -EIO;
+        }
+        done += count;
+      }
+      return done;
+    }
+
+    // Finishes a write with the result of its first attempt, writing the
+    // rest of a short write synchronously. io_uring fails writes to files
+    // opened with O_NONBLOCK with -EAGAIN when they would block; those are
+    // also written synchronously.
+    void complete(const int index, ssize_t result) {
+      Write& write = writes[index];
+      if (result == -EAGAIN) {
+        result = writeFrom(write, 0);
+      } else if (result >= 0 && size_t(result) < write.length) {
+        result = writeFrom(write, result);
+      }
+      write.inFlight = false;
+      --inFlight;
+      if (result < 0) {
+        throw std::runtime_error(
+          "error writing " + std::to_string(write.length) + " bytes at "
+          + std::to_string(write.offset) + ": " + strerror(-result));
+      }
+
+      const double latency = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - write.submitted).count();
+      ++doneCount;
+      latencySum += latency;
+      maxLatency = std::max(maxLatency, latency);
+      bytesWritten += write.length;
+
+      for (const Tag& tag : write.tags) {
+        onWritten(tag);
+      }
+      write.iovecs.clear();
+      write.tags.clear();
+    }
+  };
+}
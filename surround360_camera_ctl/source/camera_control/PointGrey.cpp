@@ -29,6 +29,8 @@ PointGreyCamera::PointGreyCamera(
   fc::PGRGuid& guid)
   : m_camera(camera),
     isMaster(false),
+    droppedFramesCounter(0),
+    frameCounterOffset(0),
     m_guid(guid),
     m_shutterSpeedUpdate(0.0),
     m_shutterSpeed(FLAGS_shutter),
@@ -122,6 +124,10 @@ unsigned int PointGreyCamera::getDroppedFramesCounter() const {
   return droppedFramesCounter;
 }
 
+size_t PointGreyCamera::getFrameCounterOffset() const {
+  return frameCounterOffset;
+}
+
 int PointGreyCamera::startCapture() {
   fc::Error error = m_camera->StartCapture();
   if (error != PGRERROR_OK) {
@@ -133,6 +139,17 @@ int PointGreyCamera::startCapture() {
   return error.GetType();
 }
 
+// Makes the camera capture into count buffers of frameSize bytes at
+// buffers, in order, instead of its own. Call before startCapture.
+int PointGreyCamera::setUserBuffers(
+  uint8_t* buffers,
+  size_t frameSize,
+  int count) {
+
+  fc::Error error = m_camera->SetUserBuffers(buffers, frameSize, count);
+  return error.GetType();
+}
+
 int PointGreyCamera::stopCapture() {
   fc::Error error = m_camera->StopCapture();
   if (error != PGRERROR_OK) {
@@ -314,6 +331,22 @@ void PointGreyCamera::embedImageInfo() {
   embeddedInfo.gain.onOff = false;
   m_camera->SetEmbeddedImageInfo(&embeddedInfo);
 
+  // The enabled fields are embedded in this order, a 32 bit word each, so
+  // the frame counter comes after those of them that are on
+  m_camera->GetEmbeddedImageInfo(&embeddedInfo);
+  const bool before[] = {
+    embeddedInfo.timestamp.onOff,
+    embeddedInfo.gain.onOff,
+    embeddedInfo.shutter.onOff,
+    embeddedInfo.brightness.onOff,
+    embeddedInfo.exposure.onOff,
+    embeddedInfo.whiteBalance.onOff,
+  };
+  frameCounterOffset = 0;
+  for (const bool on : before) {
+    frameCounterOffset += on ? sizeof(uint32_t) : 0;
+  }
+
 }
 
 std::ostream& PointGreyCamera::printCameraInfo(std::ostream& stream) const {
@@ -36,10 +36,13 @@ namespace surround360 {
     int init(bool isMaster = false);
     int stopCapture();
     int startCapture();
+    int setUserBuffers(uint8_t* buffers, size_t frameSize, int count);
     int setMaster();
 
     void* getFrame();
     unsigned int getDroppedFramesCounter() const;
+    // Where in a frame the camera embeds its frame counter
+    size_t getFrameCounterOffset() const;
     int getSerialNumber() const;
     int reset();
     int powerCamera(bool onOff);
@@ -69,6 +72,7 @@ namespace surround360 {
     std::shared_ptr<fc::Camera> m_camera;
     bool isMaster;
     unsigned int droppedFramesCounter;
+    size_t frameCounterOffset;
     fc::PGRGuid m_guid;
     fc::InterfaceType m_ifaceType;
 
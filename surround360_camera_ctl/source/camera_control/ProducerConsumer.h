@@ -8,41 +8,143 @@
 
 #pragma once
 
-#include <mutex>
-#include <thread>
+#include <atomic>
+#include <climits>
+#include <cstdint>
 #include <sstream>
+#include <string>
 #include <string.h>
-#include <condition_variable>
+#include <thread>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace surround360 {
-/// An in-place, thread-aware producer consumer messaging class
+/// A single producer, single consumer, in-place circular buffer
 ///
-/// This is an implementation of a thread aware producer/consumer
-/// class that uses an in-place circular buffer.  In-place means that
-/// the circular buffer directly stores the items messaged from the
-/// producer to the consumer. As such, care must be taken to insure
-/// that both head/tail access and head/tail advancement are mutually
-/// protected from overwrite and wrap around.  We achieve this using
-/// two condition variables that "signal" when the producer and
-/// consumer can proceed.  The circular buffer state is protected
-/// using a single mutex.  Strictly speaking only a head and tail
-/// pointer are necessary and sufficient for proper operation of the
-/// circular buffer, however a count is added to make the code easier
-/// read and maintain. An additional "done" routine is provided so
-/// that the producer can signal the consumer when the producer is
-/// truly done producing items.
+/// The circular buffer directly stores the items messaged from the
+/// producer to the consumer: the producer fills the item at the head
+/// and advances the head, the consumer reads the item at the tail and
+/// advances the tail. Exactly one thread may be the producer and one the
+/// consumer. Neither takes a lock: the head is only written by the
+/// producer and the tail by the consumer, each on its own cache line,
+/// and each side keeps a copy of the other's index so it only reads the
+/// shared one when the buffer looks full or empty.
+///
+/// A side that finds the buffer full (producer) or empty (consumer)
+/// spins for a while, then sleeps on a futex until the other side makes
+/// progress. The other side only makes a system call when somebody
+/// sleeps. With blocking turned off, a waiting side yields instead of
+/// sleeping. An additional "done" routine is provided so that the
+/// producer can signal the consumer when the producer is truly done
+/// producing items.
+///
+/// Shared by the capture front ends, CameraControl and CameraControlUI.
 ///
   template <typename T, int LENGTH>
     class ProducerConsumer {
   private :
+    static const size_t kCacheLine = 64;
+    static const uint32_t kLength = LENGTH;
+
+    // Indices run over [0, 2 * LENGTH), so a full buffer (LENGTH apart)
+    // and an empty one (equal) can be told apart
+    static uint32_t nextIndex(const uint32_t index) {
+      return index + 1 == 2 * kLength ? 0 : index + 1;
+    }
+
+    static uint32_t slot(const uint32_t index) {
+      return index < kLength ? index : index - kLength;
+    }
+
+    static uint32_t itemCount(const uint32_t head, const uint32_t tail) {
+      return head >= tail ? head - tail : head + 2 * kLength - tail;
+    }
+
+    /// Where a side waits for the other. The waiting side registers, reads
+    /// the epoch and checks its condition once more before sleeping, and
+    /// the other side bumps the epoch before waking it, so a wakeup
+    /// between the check and the sleep isn't lost.
+    class Waiter {
+    public:
+      Waiter() : epoch(0), sleepers(0) {}
+
+      uint32_t prepareWait() {
+        sleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch.load();
+      }
+
+      void cancelWait() {
+        sleepers.fetch_sub(1);
+      }
+
+      void wait(const uint32_t observedEpoch) {
+        syscall(SYS_futex, reinterpret_cast<int*>(&epoch), FUTEX_WAIT_PRIVATE,
+                observedEpoch, nullptr, nullptr, 0);
+        sleepers.fetch_sub(1);
+      }
+
+      void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0) {
+          epoch.fetch_add(1);
+          syscall(SYS_futex, reinterpret_cast<int*>(&epoch), FUTEX_WAKE_PRIVATE,
+                  INT_MAX, nullptr, nullptr, 0);
+        }
+      }
+
+    private:
+      std::atomic<uint32_t> epoch;
+      std::atomic<uint32_t> sleepers;
+    };
+
+    // Padding rather than alignas, which operator new ignores before
+    // C++17, keeps each side's fields off the other side's cache lines
     T items[LENGTH];
-    std::mutex m;
-    std::condition_variable dataAvailable;
-    std::condition_variable spaceAvailable;
-    int head;
-    int tail;
-    int count;
-    bool fini;
+    char pad0[kCacheLine];
+
+    // Producer side
+    std::atomic<uint32_t> head;
+    uint32_t producerTail; // the tail as the producer last saw it
+    Waiter spaceAvailable;
+    char pad1[kCacheLine];
+
+    // Consumer side
+    std::atomic<uint32_t> tail;
+    uint32_t consumerHead; // the head as the consumer last saw it
+    Waiter dataAvailable;
+    char pad2[kCacheLine];
+
+    std::atomic<bool> fini;
+    int spinCount;
+    bool blocking;
+
+    /// Spins, then yields or sleeps, until ready() holds
+    template <typename Ready>
+    void waitFor(Waiter& waiter, Ready ready) {
+      for (int i = 0; i < spinCount; ++i) {
+        if (ready()) {
+          return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+      }
+      while (!ready()) {
+        if (!blocking) {
+          std::this_thread::yield();
+          continue;
+        }
+        const uint32_t observedEpoch = waiter.prepareWait();
+        if (ready()) {
+          waiter.cancelWait();
+          return;
+        }
+        waiter.wait(observedEpoch);
+      }
+    }
 
   public:
     // Don't allow any assignment or copies
@@ -55,7 +157,8 @@ namespace surround360 {
     /// share data between the producer and consumer is statically
     /// allocated.
     ProducerConsumer()
-      : head(0), tail(0), count(0), fini(false)
+      : head(0), producerTail(0), tail(0), consumerHead(0), fini(false),
+        spinCount(1000), blocking(true)
     {
       memset(items, 0, LENGTH * sizeof(T));
     }
@@ -68,15 +171,50 @@ namespace surround360 {
       }
     }
 
-    /// Signal the consuemr that producer is done producing.
+    /// How long a side busy waits before it yields or sleeps, and whether
+    /// it sleeps. Set before the producer and consumer start.
+    void setWaitPolicy(const int spins, const bool block) {
+      spinCount = spins;
+      blocking = block;
+    }
+
+    /// Signal the consumer that producer is done producing.
     ///
     /// Used by the producer to notify the consumer that when the queue
     /// empty it can exit.
     void done() {
-      std::unique_lock<std::mutex> lk(m);
-      fini = true;
-      lk.unlock();
-      dataAvailable.notify_one();
+      fini.store(true);
+      dataAvailable.notify();
+    }
+
+    /// Makes the buffer empty and not done. Only call while neither the
+    /// producer nor the consumer is using it.
+    void reset() {
+      fini = false;
+      head = 0;
+      tail = 0;
+      producerTail = 0;
+      consumerHead = 0;
+    }
+
+    bool isDone() {
+      return fini.load();
+    }
+
+    bool isEmpty() {
+      return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+
+    /// How many items fit in the queue
+    static uint32_t capacity() {
+      return kLength;
+    }
+
+    /// How many items are queued, at most. Any thread may ask; the tail is
+    /// read first so the head read after it is never behind it.
+    uint32_t size() {
+      const uint32_t t = tail.load(std::memory_order_acquire);
+      return itemCount(head.load(std::memory_order_acquire), t);
     }
 
     /// Access the head of the message queue.
@@ -86,21 +224,22 @@ namespace surround360 {
     ///
     /// @return Returns a poimnter to the head of the queue.
     T* getHead() {
-      std::unique_lock<std::mutex> lk(m);
-      spaceAvailable.wait(lk, [this]{return this->count < LENGTH;});
-      lk.unlock();
-      return &items[head];
+      const uint32_t h = head.load(std::memory_order_relaxed);
+      if (itemCount(h, producerTail) == kLength) {
+        waitFor(spaceAvailable, [this, h] {
+          producerTail = tail.load(std::memory_order_acquire);
+          return itemCount(h, producerTail) < kLength;
+        });
+      }
+      return &items[slot(h)];
     }
 
     /// Sends the message the value onto the queue.
     ///
-    /// Thread safe queue state update.
+    /// Publishes the item filled at the head to the consumer.
     void advanceHead() {
-      std::unique_lock<std::mutex> lk(m);
-      head = (head + 1) % LENGTH;
-      ++count;
-      lk.unlock();
-      dataAvailable.notify_one();
+      head.store(nextIndex(head.load(std::memory_order_relaxed)), std::memory_order_release);
+      dataAvailable.notify();
     }
 
     /// Accesses data at the tail of the message queue.
@@ -113,14 +252,20 @@ namespace surround360 {
     // @return Returns the pointer to the data or null if the queue is
     // empty and the producer has called done().
     T* getTail() {
-      T* val = nullptr;
-      std::unique_lock<std::mutex> lk(m);
-      dataAvailable.wait(lk, [this]{return this->count > 0 || fini;});
-      if (this->count > 0) {
-        val = &items[tail];
+      const uint32_t t = tail.load(std::memory_order_relaxed);
+      if (consumerHead == t) {
+        waitFor(dataAvailable, [this, t] {
+          // The producer sets fini after its last item, so an empty
+          // buffer seen after fini stays empty
+          const bool producerDone = fini.load(std::memory_order_acquire);
+          consumerHead = head.load(std::memory_order_acquire);
+          return consumerHead != t || producerDone;
+        });
+        if (consumerHead == t) {
+          return nullptr;
+        }
       }
-      lk.unlock();
-      return val;
+      return &items[slot(t)];
     }
 
     /// Advances the tail pointer indicating tail consumption.
@@ -128,25 +273,27 @@ namespace surround360 {
     /// Used by the consumer to signal that it has infact
     /// consumed/used/copied the last getTail.
     void advanceTail() {
-      std::unique_lock<std::mutex> lk(m);
-      if (this->count > 0) {
-        tail = (tail + 1) % LENGTH;
-        --count;
+      const uint32_t t = tail.load(std::memory_order_relaxed);
+      if (t == consumerHead) {
+        consumerHead = head.load(std::memory_order_acquire);
+        if (t == consumerHead) {
+          return;
+        }
       }
-      lk.unlock();
-      spaceAvailable.notify_one();
+      tail.store(nextIndex(t), std::memory_order_release);
+      spaceAvailable.notify();
     }
 
     // Used to debug the state of the circular buffer
     std::string stateString() {
       std::stringstream ss;
-      m.lock();
-      ss << "[head=" << tail
-         << " tail=" << head
-         << " count=" << count
-         << " fini=" << fini
+      const uint32_t h = head.load();
+      const uint32_t t = tail.load();
+      ss << "[head=" << slot(h)
+         << " tail=" << slot(t)
+         << " count=" << itemCount(h, t)
+         << " fini=" << fini.load()
          << "]";
-      m.unlock();
       return ss.str();
     }
   };
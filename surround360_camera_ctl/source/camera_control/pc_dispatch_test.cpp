@@ -0,0 +1,161 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the license found in the
+* LICENSE_camera_ctl file in the root directory of this subproject.
+*/
+
+// Simulates capture with one consumer slowed down for a while, as by a
+// throttled disk, and frames routed round-robin or to the least loaded
+// consumer. The cameras deliver a frame each per period and hold a few
+// frames; a frame the producer doesn't get to in time is dropped, which
+// happens when it blocks on a full queue. Time is simulated, so the run
+// is the same every time: round-robin must drop frames and balancing must
+// not. Either way, the frames each consumer records taking must put
+// every frame that wasn't dropped back in its place.
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "ConsumerDispatch.h"
+#include "ProducerConsumer.h"
+
+using namespace std;
+using namespace surround360;
+
+static const int kCameraCount = 6;
+static const int kFrameCount = 1200;
+static const int kQueueLength = 32;
+static const int kPeriodUs = 2000;
+static const int kCameraBuffers = 4;
+static const int kWriteUs = 200;
+static const int kSlowWriteUs = 2000;
+static const int kSlowFrom = 300;
+static const int kSlowTo = 700;
+
+struct FramePacket {
+  int frameNumber;
+  int cameraNumber;
+  long queuedAt;
+};
+
+typedef ProducerConsumer<FramePacket, kQueueLength> FrameQueue;
+
+// A consumer, as in frameConsumer: it takes the next frame off its queue
+// once it is done writing the last one
+class Consumer {
+ public:
+  Consumer(const int cid, FrameQueue& queue) : cid(cid), queue(queue), freeAt(0) {}
+
+  // When the frame at the tail of the queue is taken, if there is one
+  long nextTake() {
+    return queue.isEmpty() ? -1 : max(freeAt, queue.getTail()->queuedAt);
+  }
+
+  // Takes the frames it gets to by now
+  void runUntil(const long now) {
+    long take;
+    while ((take = nextTake()) >= 0 && take <= now) {
+      const FramePacket* packet = queue.getTail();
+      routing.push_back(make_pair(packet->frameNumber, packet->cameraNumber));
+      const bool slow =
+        cid == 1 && packet->frameNumber >= kSlowFrom && packet->frameNumber < kSlowTo;
+      queue.advanceTail();
+      freeAt = take + (slow ? kSlowWriteUs : kWriteUs);
+    }
+  }
+
+  // What it would write to its routing file
+  vector<pair<int, int>> routing;
+
+ private:
+  const int cid;
+  FrameQueue& queue;
+  long freeAt;
+};
+
+static bool runTest(const int consumerCount, const bool balance) {
+  FrameQueue* queues = new FrameQueue[consumerCount];
+  vector<Consumer> consumers;
+  for (int cid = 0; cid < consumerCount; ++cid) {
+    consumers.emplace_back(cid, queues[cid]);
+  }
+  auto runConsumers = [&](const long now) {
+    for (Consumer& consumer : consumers) {
+      consumer.runUntil(now);
+    }
+  };
+
+  // The producer, as in cameraProducer
+  vector<vector<bool>> dropped(kFrameCount, vector<bool>(kCameraCount, false));
+  int droppedCount = 0;
+  int reroutedCount = 0;
+  long now = 0;
+  for (int frame = 0; frame < kFrameCount; ++frame) {
+    const long due = long(frame) * kPeriodUs;
+    now = max(now, due);
+    for (int camera = 0; camera < kCameraCount; ++camera) {
+      runConsumers(now);
+      if (now - due > kCameraBuffers * kPeriodUs) {
+        dropped[frame][camera] = true;
+        ++droppedCount;
+        continue;
+      }
+      const int cid = pickConsumer(queues, consumerCount, camera, balance);
+      reroutedCount += cid != camera % consumerCount;
+      // Blocks until the consumer takes a frame off a full queue
+      if (queues[cid].size() == FrameQueue::capacity()) {
+        now = consumers[cid].nextTake();
+        runConsumers(now);
+      }
+      FramePacket* packet = queues[cid].getHead();
+      packet->frameNumber = frame;
+      packet->cameraNumber = camera;
+      packet->queuedAt = now;
+      queues[cid].advanceHead();
+    }
+  }
+  runConsumers(numeric_limits<long>::max());
+  delete [] queues;
+
+  // Put the frames back in place from the routing
+  vector<vector<int>> timesWritten(kFrameCount, vector<int>(kCameraCount, 0));
+  bool inOrder = true;
+  for (const Consumer& consumer : consumers) {
+    const auto& consumerRouting = consumer.routing;
+    for (size_t k = 0; k < consumerRouting.size(); ++k) {
+      ++timesWritten[consumerRouting[k].first][consumerRouting[k].second];
+      inOrder &= k == 0 || consumerRouting[k - 1].first <= consumerRouting[k].first;
+    }
+  }
+  bool complete = true;
+  for (int frame = 0; frame < kFrameCount; ++frame) {
+    for (int camera = 0; camera < kCameraCount; ++camera) {
+      complete &= timesWritten[frame][camera] == (dropped[frame][camera] ? 0 : 1);
+    }
+  }
+
+  const bool passed = complete && inOrder
+    && (balance ? droppedCount == 0 && reroutedCount > 0 : droppedCount > 0);
+  cout << (passed ? "passed" : "FAILED") << ": " << consumerCount << " consumers, "
+       << (balance ? "least loaded" : "round-robin") << ": "
+       << droppedCount << " frames dropped, " << reroutedCount << " rerouted, "
+       << (complete ? "" : "not ") << "reconstructed, "
+       << (inOrder ? "" : "not ") << "in order" << endl;
+  return passed;
+}
+
+int main(int argc, char* argv[]) {
+  bool passed = true;
+  for (const int consumerCount : {3, 4}) {
+    passed &= runTest(consumerCount, false);
+    passed &= runTest(consumerCount, true);
+  }
+  exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,289 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the license found in the
+* LICENSE_camera_ctl file in the root directory of this subproject.
+*/
+
+// Runs the frame hand-off between the camera producer and the disk
+// consumers against synthetic cameras, which fill their rings in order at
+// a fixed rate whatever the producer and consumers are doing, like the
+// camera driver does: a camera only skips the frame the producer last
+// retrieved, and the producer gets the oldest frame still in the ring.
+// Frames carry the camera's frame counter after some other image info in
+// their first bytes, written before the rest of the frame. Every frame a consumer takes for intact
+// must be; a consumer that stalls must find frames overwritten. Covers
+// cameras that capture into the frame pool, and cameras whose frames get
+// copied into it, which are never overwritten. Needs no cameras.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "FramePool.h"
+#include "ProducerConsumer.h"
+
+using namespace std;
+using namespace surround360;
+
+static const int kCameraCount = 6;
+static const int kConsumerCount = 2;
+static const int kFramesPerCamera = 1500;
+static const size_t kFrameSize = 16384;
+static const size_t kAlignment = 4096;
+static const int kQueueLength = 60;
+static const int kSlackFrames = 8;
+static const int kCameraPeriodUs = 300;
+static const int kStallUs = 20000;
+// The counter follows a word of other image info, then the pixels start
+static const size_t kCounterOffset = 8;
+static const size_t kFirstPixelWord = 2;
+
+struct FramePacket {
+  int frameNumber;
+  int cameraNumber;
+  uint8_t* imageBytes;
+  uint32_t frameCounter;
+};
+
+typedef ProducerConsumer<FramePacket, kQueueLength> FrameQueue;
+
+static uint64_t patternWord(const int camera, const int frame, const size_t k) {
+  return (uint64_t(frame) << 32 | uint64_t(camera) << 24 | k) * 0x9e3779b97f4a7c15ULL;
+}
+
+// The counters start close to wrapping around
+static uint32_t frameCounter(const int camera, const int frame) {
+  return 0xfffffe00U + camera * 16 + frame;
+}
+
+// A camera filling a ring of frames, the pool's or its own, in order,
+// whether or not the producer keeps up. The frame the producer last
+// retrieved is locked, and a frame due to go in its slot is lost; the
+// frames the producer skips over are lost too.
+class SyntheticCamera {
+ public:
+  SyntheticCamera(const int camera, uint8_t* ring, const size_t ringFrames)
+    : camera(camera), ring(ring), ringFrames(ringFrames),
+      slotFrame(ringFrames, -1), captured(0), next(0), lockedSlot(-1),
+      finished(false), lost(0) {}
+
+  // Camera thread
+  void capture(const int frameCount) {
+    auto due = chrono::steady_clock::now();
+    for (int frame = 0; frame < frameCount; ++frame) {
+      due += chrono::microseconds(kCameraPeriodUs);
+      this_thread::sleep_until(due);
+      const size_t slot = frame % ringFrames;
+      {
+        lock_guard<mutex> lock(state);
+        if (int(slot) == lockedSlot) {
+          ++lost;
+          continue;
+        }
+        slotFrame[slot] = -1;
+      }
+
+      // The image info, counter included, goes first
+      uint8_t* bytes = ring + slot * kFrameSize;
+      uint64_t* words = reinterpret_cast<uint64_t*>(bytes);
+      words[0] = patternWord(camera, frame, 0);
+      const uint32_t counter = frameCounter(camera, frame);
+      for (int b = 0; b < 4; ++b) {
+        bytes[kCounterOffset + b] = uint8_t(counter >> (24 - 8 * b));
+      }
+      atomic_thread_fence(memory_order_release);
+      for (size_t k = kFirstPixelWord; k < kFrameSize / sizeof(uint64_t); ++k) {
+        words[k] = patternWord(camera, frame, k);
+      }
+
+      lock_guard<mutex> lock(state);
+      slotFrame[slot] = frame;
+      captured = frame + 1;
+    }
+    lock_guard<mutex> lock(state);
+    finished = true;
+  }
+
+  // Producer thread: waits for the oldest frame still in the ring and
+  // locks it, or returns nullptr once the camera is done and every frame
+  // was retrieved or lost
+  const uint8_t* getFrame(int& frame, uint32_t& counter) {
+    while (true) {
+      {
+        lock_guard<mutex> lock(state);
+        lockedSlot = -1;
+        for (int f = max(next, captured - int(ringFrames)); f < captured; ++f) {
+          if (slotFrame[f % ringFrames] == f) {
+            lost += f - next;
+            next = f + 1;
+            lockedSlot = f % ringFrames;
+            frame = f;
+            counter = frameCounter(camera, f);
+            return ring + lockedSlot * kFrameSize;
+          }
+        }
+        if (finished) {
+          lost += captured - next;
+          next = captured;
+          return nullptr;
+        }
+      }
+      this_thread::yield();
+    }
+  }
+
+  int getLost() {
+    lock_guard<mutex> lock(state);
+    return lost;
+  }
+
+ private:
+  const int camera;
+  uint8_t* const ring;
+  const size_t ringFrames;
+  mutex state;
+  vector<int> slotFrame;
+  int captured;
+  int next;
+  int lockedSlot;
+  bool finished;
+  int lost;
+};
+
+static bool runTest(const bool captureIntoPool, const int stallEvery) {
+  FramePool pool(
+    kCameraCount,
+    kQueueLength / (kCameraCount / kConsumerCount) + kSlackFrames,
+    kFrameSize,
+    kAlignment);
+
+  // Cameras that don't capture into the pool get a ring of their own
+  vector<uint8_t> ownRings(kCameraCount * pool.getFramesPerCamera() * kFrameSize);
+  vector<SyntheticCamera*> cameras;
+  for (int camera = 0; camera < kCameraCount; ++camera) {
+    uint8_t* ring = captureIntoPool
+      ? pool.getRing(camera)
+      : &ownRings[camera * pool.getFramesPerCamera() * kFrameSize];
+    cameras.push_back(new SyntheticCamera(camera, ring, pool.getFramesPerCamera()));
+    if (captureIntoPool) {
+      pool.setCapturing(camera, kCounterOffset);
+    }
+  }
+
+  FrameQueue* queues = new FrameQueue[kConsumerCount];
+  atomic<int> corrupted(0);
+  atomic<int> overwritten(0);
+  atomic<int> outOfOrder(0);
+  atomic<int> written(0);
+  vector<thread> consumers;
+  for (int cid = 0; cid < kConsumerCount; ++cid) {
+    consumers.emplace_back([&, cid] {
+      mt19937 rng(cid);
+      vector<int> lastFrame(kCameraCount, -1);
+      vector<uint64_t> copy(kFrameSize / sizeof(uint64_t));
+      FramePacket* packet;
+      while ((packet = queues[cid].getTail()) != nullptr) {
+        // The write, slow now and then
+        if (stallEvery > 0 && rng() % stallEvery == 0) {
+          usleep(kStallUs);
+        }
+        memcpy(copy.data(), packet->imageBytes, kFrameSize);
+        if (!pool.isIntact(packet->cameraNumber, packet->imageBytes, packet->frameCounter)) {
+          ++overwritten;
+        } else {
+          bool intact = copy[0] == patternWord(packet->cameraNumber, packet->frameNumber, 0)
+            && FramePool::readFrameCounter(
+              reinterpret_cast<const uint8_t*>(copy.data()) + kCounterOffset)
+              == packet->frameCounter;
+          for (size_t k = kFirstPixelWord; intact && k < copy.size(); ++k) {
+            intact = copy[k] == patternWord(packet->cameraNumber, packet->frameNumber, k);
+          }
+          corrupted += !intact;
+        }
+        if (packet->frameNumber <= lastFrame[packet->cameraNumber]) {
+          ++outOfOrder;
+        }
+        lastFrame[packet->cameraNumber] = packet->frameNumber;
+        ++written;
+        pool.release(packet->cameraNumber, packet->imageBytes);
+        queues[cid].advanceTail();
+      }
+    });
+  }
+
+  vector<thread> cameraThreads;
+  for (SyntheticCamera* camera : cameras) {
+    cameraThreads.emplace_back([camera] { camera->capture(kFramesPerCamera); });
+  }
+
+  // The producer, as in cameraProducer, recording most of the time. It
+  // blocks while a consumer's queue is full, and the cameras carry on.
+  int recorded = 0;
+  vector<bool> finished(kCameraCount, false);
+  for (int done = 0; done < kCameraCount; ) {
+    for (int camera = 0; camera < kCameraCount; ++camera) {
+      if (finished[camera]) {
+        continue;
+      }
+      int frame;
+      uint32_t counter;
+      const uint8_t* bytes = cameras[camera]->getFrame(frame, counter);
+      if (bytes == nullptr) {
+        finished[camera] = true;
+        ++done;
+        continue;
+      }
+      if (frame % 1000 < 800) {
+        handOffFrame(pool, queues[camera % kConsumerCount], camera, frame, bytes, counter);
+        ++recorded;
+      }
+    }
+  }
+
+  for (thread& t : cameraThreads) {
+    t.join();
+  }
+  for (int cid = 0; cid < kConsumerCount; ++cid) {
+    queues[cid].done();
+  }
+  for (thread& t : consumers) {
+    t.join();
+  }
+
+  int lost = 0;
+  for (SyntheticCamera* camera : cameras) {
+    lost += camera->getLost();
+    delete camera;
+  }
+  delete [] queues;
+
+  // A stall outlasts a lap of the ring, so a stalled consumer finds the
+  // frame it was about to write overwritten
+  const bool passed = corrupted == 0 && outOfOrder == 0 && written == recorded
+    && (captureIntoPool ? stallEvery == 0 || overwritten > 0 : overwritten == 0);
+  cout << (passed ? "passed" : "FAILED") << ": "
+       << (captureIntoPool ? "capturing into the pool" : "copying into the pool")
+       << ", consumer stalls 1/" << stallEvery << ": " << written << " written, "
+       << overwritten << " found overwritten, " << corrupted << " overwritten unnoticed, "
+       << outOfOrder << " out of order, " << lost << " lost by the cameras" << endl;
+  return passed;
+}
+
+int main(int argc, char* argv[]) {
+  bool passed = true;
+  for (const bool captureIntoPool : {true, false}) {
+    passed &= runTest(captureIntoPool, 0);
+    passed &= runTest(captureIntoPool, 200);
+    passed &= runTest(captureIntoPool, 20);
+  }
+  exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,193 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the license found in the
+* LICENSE_camera_ctl file in the root directory of this subproject.
+*/
+
+// Measures what a producer consumer buffer costs the producer per push,
+// which is time stolen from the camera threads, and how long an item takes
+// to reach the consumer, for ProducerConsumer with each wait policy and for
+// a buffer guarded by a mutex and condition variables, as ProducerConsumer
+// used to be. The producer is paced like a camera rig; then it pushes as
+// fast as it can. Needs no cameras.
+//
+// Usage: pc_latency [items per second] [seconds]
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ProducerConsumer.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace surround360;
+
+static const int kLength = 1000;
+
+struct Item {
+  int64_t pushTimeNs;
+};
+
+static int64_t nowNs() {
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// The mutex and condition variable buffer, for reference
+class LockedBuffer {
+ public:
+  Item* getHead() {
+    unique_lock<mutex> lk(m);
+    spaceAvailable.wait(lk, [this] { return count < kLength; });
+    return &items[head];
+  }
+
+  void advanceHead() {
+    unique_lock<mutex> lk(m);
+    head = (head + 1) % kLength;
+    ++count;
+    lk.unlock();
+    dataAvailable.notify_one();
+  }
+
+  Item* getTail() {
+    unique_lock<mutex> lk(m);
+    dataAvailable.wait(lk, [this] { return count > 0 || fini; });
+    return count > 0 ? &items[tail] : nullptr;
+  }
+
+  void advanceTail() {
+    unique_lock<mutex> lk(m);
+    tail = (tail + 1) % kLength;
+    --count;
+    lk.unlock();
+    spaceAvailable.notify_one();
+  }
+
+  void done() {
+    unique_lock<mutex> lk(m);
+    fini = true;
+    lk.unlock();
+    dataAvailable.notify_one();
+  }
+
+ private:
+  Item items[kLength];
+  mutex m;
+  condition_variable dataAvailable;
+  condition_variable spaceAvailable;
+  int head = 0;
+  int tail = 0;
+  int count = 0;
+  bool fini = false;
+};
+
+static string percentiles(vector<int64_t>& samples) {
+  sort(samples.begin(), samples.end());
+  auto at = [&](const double p) {
+    return samples[min(samples.size() - 1, size_t(p * samples.size()))] / 1000.0;
+  };
+  ostringstream ss;
+  ss << fixed << setprecision(2)
+     << "p50 " << at(0.5) << " p99 " << at(0.99) << " p99.9 " << at(0.999)
+     << " max " << samples.back() / 1000.0 << " us";
+  return ss.str();
+}
+
+// itemsPerSecond 0 pushes as fast as possible
+template <typename Buffer>
+static void measure(
+    const string& name,
+    Buffer& buffer,
+    const int itemsPerSecond,
+    const int itemCount) {
+
+  vector<int64_t> latencies;
+  latencies.reserve(itemCount);
+  thread consumer([&] {
+    Item* item;
+    while ((item = buffer.getTail()) != nullptr) {
+      latencies.push_back(nowNs() - item->pushTimeNs);
+      buffer.advanceTail();
+    }
+  });
+
+  vector<int64_t> pushCosts;
+  pushCosts.reserve(itemCount);
+  const int64_t startNs = nowNs();
+  for (int i = 0; i < itemCount; ++i) {
+    if (itemsPerSecond > 0) {
+      const int64_t dueNs = startNs + int64_t(i) * 1000000000 / itemsPerSecond;
+      while (nowNs() < dueNs) {
+      }
+    }
+    const int64_t pushStartNs = nowNs();
+    Item* item = buffer.getHead();
+    item->pushTimeNs = pushStartNs;
+    buffer.advanceHead();
+    pushCosts.push_back(nowNs() - pushStartNs);
+  }
+  buffer.done();
+  consumer.join();
+  const double elapsed = (nowNs() - startNs) / 1e9;
+
+  cout << name << endl;
+  cout << "  push:    " << percentiles(pushCosts) << endl;
+  cout << "  latency: " << percentiles(latencies) << endl;
+  if (itemsPerSecond == 0) {
+    cout << "  throughput: " << itemCount / elapsed / 1e6 << " M items/s" << endl;
+  }
+}
+
+template <typename Buffer>
+static void measureBoth(
+    const string& name,
+    Buffer* paced,
+    Buffer* unpaced,
+    const int itemsPerSecond,
+    const int seconds) {
+  measure(name + ", paced at " + to_string(itemsPerSecond) + "/s",
+          *paced, itemsPerSecond, itemsPerSecond * seconds);
+  measure(name + ", unpaced", *unpaced, 0, 2000000);
+  delete paced;
+  delete unpaced;
+}
+
+int main(int argc, char* argv[]) {
+  // 17 cameras at 30 fps split between 2 consumers by default, times 10
+  // so a run gives enough samples
+  const int itemsPerSecond = argc > 1 ? atoi(argv[1]) : 17 * 30 / 2 * 10;
+  const int seconds = argc > 2 ? atoi(argv[2]) : 2;
+
+  typedef ProducerConsumer<Item, kLength> LockFree;
+  struct Policy {
+    const char* name;
+    int spins;
+    bool blocking;
+  };
+  for (const Policy& policy : {
+      Policy{"lock free, sleeping", 0, true},
+      Policy{"lock free, spinning then sleeping", 1000, true},
+      Policy{"lock free, yielding", 0, false}}) {
+    LockFree* paced = new LockFree();
+    LockFree* unpaced = new LockFree();
+    paced->setWaitPolicy(policy.spins, policy.blocking);
+    unpaced->setWaitPolicy(policy.spins, policy.blocking);
+    measureBoth(policy.name, paced, unpaced, itemsPerSecond, seconds);
+  }
+  measureBoth(
+    "mutex and condition variables", new LockedBuffer(), new LockedBuffer(),
+    itemsPerSecond, seconds);
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,126 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the license found in the
+* LICENSE_camera_ctl file in the root directory of this subproject.
+*/
+
+// Pushes millions of items through producer consumer buffers of several
+// lengths and wait policies, with the producer or the consumer stalling
+// now and then so the buffer keeps going full and empty, and checks that
+// every item arrives once and in order. Needs no cameras.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <random>
+#include <thread>
+
+#include "ProducerConsumer.h"
+
+using namespace std;
+using namespace surround360;
+
+static const int kItemCount = 500000;
+
+struct Item {
+  uint64_t sequence;
+  uint64_t check;
+};
+
+static uint64_t checkValue(const uint64_t sequence) {
+  return sequence * 0x9e3779b97f4a7c15ULL;
+}
+
+// Stalls for up to a few hundred microseconds once every stallEvery calls
+static void maybeStall(mt19937& rng, const int stallEvery) {
+  if (stallEvery > 0 && rng() % stallEvery == 0) {
+    usleep(rng() % 300);
+  }
+}
+
+template <int LENGTH>
+static bool runTest(
+    const int spins,
+    const bool blocking,
+    const int producerStallEvery,
+    const int consumerStallEvery) {
+
+  ProducerConsumer<Item, LENGTH>* cb = new ProducerConsumer<Item, LENGTH>();
+  cb->setWaitPolicy(spins, blocking);
+
+  uint64_t received = 0;
+  bool ordered = true;
+  thread consumer([&] {
+    mt19937 rng(1);
+    Item* item;
+    while ((item = cb->getTail()) != nullptr) {
+      if (item->sequence != received || item->check != checkValue(received)) {
+        ordered = false;
+      }
+      ++received;
+      cb->advanceTail();
+      maybeStall(rng, consumerStallEvery);
+    }
+  });
+
+  mt19937 rng(2);
+  for (int i = 0; i < kItemCount; ++i) {
+    Item* item = cb->getHead();
+    item->sequence = i;
+    item->check = checkValue(i);
+    cb->advanceHead();
+    maybeStall(rng, producerStallEvery);
+  }
+  cb->done();
+  consumer.join();
+  delete cb;
+
+  const bool passed = ordered && received == kItemCount;
+  cout << (passed ? "passed" : "FAILED") << ": length " << LENGTH
+       << ", " << spins << " spins, " << (blocking ? "blocking" : "yielding")
+       << ", producer stalls 1/" << producerStallEvery
+       << ", consumer stalls 1/" << consumerStallEvery
+       << ": " << received << " of " << kItemCount << " items"
+       << (ordered ? "" : " out of order") << endl;
+  return passed;
+}
+
+template <int LENGTH>
+static bool runPolicies() {
+  bool passed = true;
+  // No stalls, a slow consumer (mostly full) and a slow producer (mostly
+  // empty), sleeping right away, after spinning, and never
+  for (const int spins : {0, 1000}) {
+    passed &= runTest<LENGTH>(spins, true, 0, 0);
+    passed &= runTest<LENGTH>(spins, true, 0, 20000);
+    passed &= runTest<LENGTH>(spins, true, 20000, 0);
+  }
+  passed &= runTest<LENGTH>(100, false, 20000, 20000);
+  return passed;
+}
+
+int main(int argc, char* argv[]) {
+  bool passed = true;
+  passed &= runPolicies<1>();
+  passed &= runPolicies<2>();
+  passed &= runPolicies<47>();
+  passed &= runPolicies<1000>();
+
+  // done() must wake a consumer sleeping on an empty buffer
+  ProducerConsumer<Item, 4> cb;
+  cb.setWaitPolicy(0, true);
+  thread consumer([&] {
+    if (cb.getTail() != nullptr) {
+      cerr << "FAILED: item from an empty buffer" << endl;
+      passed = false;
+    }
+  });
+  usleep(100000);
+  cb.done();
+  consumer.join();
+
+  exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
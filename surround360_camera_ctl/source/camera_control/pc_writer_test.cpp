@@ -0,0 +1,193 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the license found in the
+* LICENSE_camera_ctl file in the root directory of this subproject.
+*/
+
+// Writes a capture file through FrameWriter the way frameConsumer does,
+// each frame at its slot and some of them shorter than a slot, like
+// compressed frames, then reads the file back and checks its layout:
+// every slot holds its frame followed by zeros, and the file ends after
+// the last slot. Frame buffers are reused as soon as their frames are
+// written, so a frame written after its buffer was given back shows up.
+// Runs every backend with and without coalescing, and once with the file
+// opened O_NONBLOCK, as frameConsumer once did, where io_uring may fail
+// writes with EAGAIN. The file goes to the directory given as the first
+// argument, /tmp by default, with O_DIRECT if the file system allows it.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "FrameWriter.h"
+
+using namespace std;
+using namespace surround360;
+
+static const int kFrameCount = 600;
+static const size_t kFrameSize = 65536;
+static const size_t kAlignment = 4096;
+static const int kBufferCount = 48;
+
+struct WrittenFrame {
+  int frame;
+  int buffer;
+};
+
+typedef FrameWriter<WrittenFrame> Writer;
+
+static uint64_t patternWord(const int frame, const size_t k) {
+  return (uint64_t(frame) << 32 | k) * 0x9e3779b97f4a7c15ULL;
+}
+
+// Every fourth frame is shorter, by a random number of blocks
+static size_t frameLength(const int frame, mt19937& rng) {
+  return frame % 4 == 3 ? (1 + rng() % (kFrameSize / kAlignment - 1)) * kAlignment : kFrameSize;
+}
+
+static bool checkFile(const string& path, const vector<size_t>& lengths) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool intact = lseek(fd, 0, SEEK_END) == off_t(kFrameCount * kFrameSize);
+  vector<uint64_t> words(kFrameSize / sizeof(uint64_t));
+  for (int frame = 0; intact && frame < kFrameCount; ++frame) {
+    intact = pread(fd, words.data(), kFrameSize, off_t(frame) * kFrameSize)
+      == ssize_t(kFrameSize);
+    const size_t length = lengths[frame] / sizeof(uint64_t);
+    for (size_t k = 0; intact && k < words.size(); ++k) {
+      intact = words[k] == (k < length ? patternWord(frame, k) : 0);
+    }
+    if (!intact) {
+      cout << "frame " << frame << " is wrong" << endl;
+    }
+  }
+  close(fd);
+  return intact;
+}
+
+static bool runTest(
+    const string& dir,
+    const Writer::Backend backend,
+    const size_t queueDepth,
+    const size_t framesPerWrite,
+    const bool nonBlocking = false) {
+
+  string path = dir + "/pc_writer_test.XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0) {
+    cout << "FAILED: can't create a file in " << dir << endl;
+    return false;
+  }
+  close(fd);
+  const int flags = O_WRONLY | (nonBlocking ? O_NONBLOCK : 0);
+  fd = open(path.c_str(), flags | O_DIRECT);
+  const bool direct = fd >= 0;
+  if (!direct) {
+    fd = open(path.c_str(), flags);
+  }
+
+  uint8_t* buffers;
+  if (posix_memalign(
+      reinterpret_cast<void**>(&buffers), kAlignment, kBufferCount * kFrameSize) != 0) {
+    return false;
+  }
+  vector<bool> held(kBufferCount, false);
+  vector<int> timesWritten(kFrameCount, 0);
+  int reusedEarly = 0;
+
+  vector<size_t> lengths(kFrameCount);
+  mt19937 rng(queueDepth * 100 + framesPerWrite);
+  bool passed = true;
+  try {
+    Writer writer(fd, queueDepth, framesPerWrite, [&](const WrittenFrame& written) {
+      ++timesWritten[written.frame];
+      held[written.buffer] = false;
+    }, backend);
+
+    for (int frame = 0; frame < kFrameCount; ++frame) {
+      // As in frameConsumer, the next buffer may still be on its way out
+      const int buffer = frame % kBufferCount;
+      while (held[buffer] && writer.getInFlight() > 0) {
+        writer.waitForWrite();
+      }
+      if (held[buffer]) {
+        ++reusedEarly;
+      }
+
+      uint64_t* words = reinterpret_cast<uint64_t*>(buffers + buffer * kFrameSize);
+      lengths[frame] = frameLength(frame, rng);
+      for (size_t k = 0; k < kFrameSize / sizeof(uint64_t); ++k) {
+        words[k] = k < lengths[frame] / sizeof(uint64_t) ? patternWord(frame, k) : 0;
+      }
+      held[buffer] = true;
+      writer.write(
+        uint64_t(frame) * kFrameSize,
+        buffers + buffer * kFrameSize,
+        lengths[frame],
+        WrittenFrame{frame, buffer});
+
+      // Now and then the consumer's queue runs dry
+      writer.reap();
+      if (rng() % 16 == 0) {
+        writer.flush();
+      }
+    }
+    writer.drain();
+
+    if (ftruncate(fd, off_t(kFrameCount) * kFrameSize) < 0) {
+      passed = false;
+    }
+    for (int frame = 0; frame < kFrameCount; ++frame) {
+      passed &= timesWritten[frame] == 1;
+    }
+    passed &= reusedEarly == 0
+      && writer.getFrameCount() == kFrameCount
+      && writer.getMaxInFlight() <= queueDepth
+      && (framesPerWrite == 1 || writer.getWriteCount() < kFrameCount);
+
+    cout << Writer::getBackendName(writer.getBackend())
+         << (direct ? ", O_DIRECT" : "")
+         << (nonBlocking ? ", O_NONBLOCK" : "")
+         << ", queue depth " << queueDepth << ", " << framesPerWrite << " frames per write: "
+         << writer.getWriteCount() << " writes, "
+         << writer.getAverageInFlight() << " in flight on average, "
+         << writer.getMaxInFlight() << " at most, "
+         << writer.getAverageLatency() * 1000 << " ms average latency" << endl;
+  } catch (const exception& e) {
+    cout << e.what() << endl;
+    passed = false;
+  }
+  close(fd);
+  free(buffers);
+
+  passed &= checkFile(path, lengths);
+  unlink(path.c_str());
+  cout << (passed ? "passed" : "FAILED") << endl;
+  return passed;
+}
+
+int main(int argc, char* argv[]) {
+  const string dir = argc > 1 ? argv[1] : "/tmp";
+  vector<Writer::Backend> backends = { Writer::BACKEND_PWRITE };
+#ifdef USE_IO_URING
+  backends.push_back(Writer::BACKEND_IO_URING);
+#endif
+
+  bool passed = true;
+  for (const Writer::Backend backend : backends) {
+    passed &= runTest(dir, backend, 1, 1);
+    passed &= runTest(dir, backend, 4, 1);
+    passed &= runTest(dir, backend, 4, 8);
+    passed &= runTest(dir, backend, 4, 8, true);
+  }
+  exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
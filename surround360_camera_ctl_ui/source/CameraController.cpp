@@ -58,6 +58,11 @@ CameraController::CameraController(
     m_consumerCount(nconsumers),
     m_consumerBuf(nconsumers),
     m_dirname(nconsumers) {
+  // The consumer buffers take a single producer each, and the producer
+  // feeds every consumer
+  if (nproducers != 1) {
+    throw "CameraController supports one producer, not " + to_string(nproducers);
+  }
   m_width = PointGreyCamera::getCamera(0)->frameWidth();
   m_height = PointGreyCamera::getCamera(0)->frameHeight();
 }
@@ -162,6 +167,9 @@ bool CameraController::updateCameraParams(
 }
 
 void CameraController::startProducer(const unsigned int count) {
+  if (count != m_producerCount) {
+    throw "CameraController supports one producer, not " + to_string(count);
+  }
   pthread_barrier_init(&startBarrier, nullptr, m_producerCount + m_consumerCount);
 
   for (int pid = 0; pid < count; ++pid) {
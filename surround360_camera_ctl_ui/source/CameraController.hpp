@@ -10,7 +10,7 @@
 
 #include "CameraView.hpp"
 #include "PointGrey.hpp"
-#include "ProducerConsumer.h"
+#include "camera_control/ProducerConsumer.h"
 #include <condition_variable>
 #include <mutex>
 #include <string>
@@ -28,6 +28,9 @@ struct FramePacket{
   void* imageBytes;
 };
 
+// One producer thread and one consumer thread per buffer, as the buffers
+// are single producer, single consumer rings; the one producer feeds all
+// of them
 typedef ProducerConsumer<FramePacket, 250ULL> ConsumerBuffer;
 
 class CameraController {
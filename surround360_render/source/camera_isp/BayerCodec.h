@@ -0,0 +1,481 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace surround360 {
+
+// Lossless compression of raw Bayer frames, 8 bit or 12 bit pixel pairs
+// packed into 3 bytes as Raw12Converter reads them. Each pixel is predicted
+// from the pixels of the same color to its left and above, with the median
+// edge detector of LOCO-I, and the residuals are Rice coded with the
+// parameter chosen per block of pixels. The frame is cut into strips of
+// rows coded independently, so they can be decoded in parallel.
+//
+// An encoded frame starts with a Header, which keeps a copy of the frame's
+// tag (its first 8 bytes), followed by the end offset of each strip and the
+// strips. Encoded frames are written in place of raw frames, so readers
+// tell them apart with isEncoded(). Shared by the capture and render code,
+// so it sticks to C++11.
+class BayerCodec {
+ public:
+  static const uint32_t kMagic = 0x5a594142; // "BAYZ"
+  static const uint32_t kVersion = 1;
+  static const uint32_t kStripHeight = 64;
+  static const int kBlockSize = 32;  // pixels sharing a Rice parameter
+  static const int kEscape = 16;     // longer unary prefixes store the value raw
+
+  struct Header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t bitsPerPixel;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tag[2];
+    uint32_t stripHeight;
+    uint32_t numStrips;
+    uint32_t encodedSize; // header, strip offsets and strips
+    uint32_t reserved;
+  } __attribute__((packed));
+
+  static size_t getRawSize(
+      const uint32_t width,
+      const uint32_t height,
+      const uint32_t bitsPerPixel) {
+    return size_t(width) * height * bitsPerPixel / 8;
+  }
+
+  static uint32_t getNumStrips(const uint32_t height) {
+    return (height + kStripHeight - 1) / kStripHeight;
+  }
+
+  // Bound on the encoded size of rows rows, a strip or a whole frame
+  static size_t getMaxRowsSize(
+      const uint32_t width,
+      const uint32_t rows,
+      const uint32_t bitsPerPixel) {
+    const size_t pixels = size_t(width) * rows;
+    const size_t blocks = size_t(rows) * ((width + kBlockSize - 1) / kBlockSize);
+    return (pixels * (kEscape + bitsPerPixel) + blocks * 4 + 7) / 8;
+  }
+
+  // Bound on the encoded size, for sizing the output of encode()
+  static size_t getMaxEncodedSize(
+      const uint32_t width,
+      const uint32_t height,
+      const uint32_t bitsPerPixel) {
+    return sizeof(Header) + getNumStrips(height) * (sizeof(uint32_t) + 1)
+      + getMaxRowsSize(width, height, bitsPerPixel);
+  }
+
+  static bool isSupported(const uint32_t width, const uint32_t bitsPerPixel) {
+    return bitsPerPixel == 8 || (bitsPerPixel == 12 && width % 2 == 0);
+  }
+
+  // True if frame, of at least sizeof(Header) bytes, is an encoded frame
+  // of this size and depth
+  static bool isEncoded(
+      const void* frame,
+      const uint32_t width,
+      const uint32_t height,
+      const uint32_t bitsPerPixel) {
+    const Header* header = reinterpret_cast<const Header*>(frame);
+    return header->magic == kMagic &&
+      header->version == kVersion &&
+      header->width == width &&
+      header->height == height &&
+      header->bitsPerPixel == bitsPerPixel &&
+      header->numStrips == getNumStrips(height) &&
+      header->encodedSize <= getMaxEncodedSize(width, height, bitsPerPixel);
+  }
+
+  static const Header& getHeader(const void* encoded) {
+    return *reinterpret_cast<const Header*>(encoded);
+  }
+
+  // Encodes raw into encoded, which holds getMaxEncodedSize() bytes.
+  // Returns the encoded size. With several threads, each encodes a share
+  // of the strips where the strip could end up at the longest, and the
+  // strips are then moved next to each other.
+  static size_t encode(
+      const void* raw,
+      const uint32_t width,
+      const uint32_t height,
+      const uint32_t bitsPerPixel,
+      void* encoded,
+      const int numThreads = 1) {
+
+    if (!isSupported(width, bitsPerPixel)) {
+      throw std::runtime_error(
+        "Bayer codec can't encode " + std::to_string(width) + " pixel wide "
+        + std::to_string(bitsPerPixel) + " bit frames");
+    }
+    uint8_t* out = reinterpret_cast<uint8_t*>(encoded);
+    Header& header = *reinterpret_cast<Header*>(out);
+    memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.bitsPerPixel = bitsPerPixel;
+    header.width = width;
+    header.height = height;
+    memcpy(header.tag, raw, std::min(sizeof(header.tag), getRawSize(width, height, bitsPerPixel)));
+    header.stripHeight = kStripHeight;
+    header.numStrips = getNumStrips(height);
+
+    uint32_t* stripEnds = reinterpret_cast<uint32_t*>(out + sizeof(Header));
+    uint8_t* data = out + sizeof(Header) + header.numStrips * sizeof(uint32_t);
+    const uint32_t numStrips = header.numStrips;
+    if (numThreads <= 1) {
+      uint8_t* stripOut = data;
+      for (uint32_t strip = 0; strip < numStrips; ++strip) {
+        stripOut = encodeStrip(raw, width, height, bitsPerPixel, strip, stripOut);
+        stripEnds[strip] = stripOut - data;
+      }
+      header.encodedSize = stripOut - out;
+      return header.encodedSize;
+    }
+
+    // Every strip but the last is kStripHeight rows
+    const size_t maxStripSize = getMaxRowsSize(width, kStripHeight, bitsPerPixel);
+    std::vector<uint32_t> stripSizes(numStrips);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+      threads.emplace_back([&, t] {
+        for (uint32_t strip = t; strip < numStrips; strip += numThreads) {
+          uint8_t* stripOut = data + strip * maxStripSize;
+          stripSizes[strip] =
+            encodeStrip(raw, width, height, bitsPerPixel, strip, stripOut) - stripOut;
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    uint32_t end = 0;
+    for (uint32_t strip = 0; strip < numStrips; ++strip) {
+      memmove(data + end, data + strip * maxStripSize, stripSizes[strip]);
+      end += stripSizes[strip];
+      stripEnds[strip] = end;
+    }
+    header.encodedSize = data + end - out;
+    return header.encodedSize;
+  }
+
+  // Decodes a whole frame into raw, which holds getRawSize() bytes
+  static void decode(const void* encoded, void* raw) {
+    const Header& header = checkHeader(encoded);
+    for (uint32_t strip = 0; strip < header.numStrips; ++strip) {
+      decodeStrip(encoded, strip, raw);
+    }
+  }
+
+  // Decodes one strip, so strips can be decoded in parallel
+  static void decodeStrip(const void* encoded, const uint32_t strip, void* raw) {
+    const Header& header = checkHeader(encoded);
+    if (strip >= header.numStrips) {
+      throw std::runtime_error("strip out of range");
+    }
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(encoded);
+    const uint32_t* stripEnds = reinterpret_cast<const uint32_t*>(in + sizeof(Header));
+    const uint8_t* data = in + sizeof(Header) + header.numStrips * sizeof(uint32_t);
+    const uint32_t begin = strip == 0 ? 0 : stripEnds[strip - 1];
+    const uint32_t end = stripEnds[strip];
+    if (begin > end || data + end > in + header.encodedSize) {
+      throw std::runtime_error("corrupt Bayer encoded frame");
+    }
+
+    const int bpp = header.bitsPerPixel;
+    const uint32_t width = header.width;
+    const uint32_t firstRow = strip * kStripHeight;
+    const uint32_t endRow = std::min(header.height, firstRow + kStripHeight);
+    const int mask = (1 << bpp) - 1;
+
+    BitReader reader(data + begin, data + end);
+    std::vector<int> rows(3 * width);
+    std::vector<int> residuals(width);
+    for (uint32_t y = firstRow; y < endRow; ++y) {
+      int* row = &rows[(y % 3) * width];
+      const int* up = y >= firstRow + 2 ? &rows[((y + 1) % 3) * width] : nullptr;
+
+      // A refill leaves room for two codes of at most kEscape + bpp bits
+      for (uint32_t blockStart = 0; blockStart < width; blockStart += kBlockSize) {
+        const uint32_t blockEnd = std::min(width, blockStart + kBlockSize);
+        reader.refill();
+        const int k = reader.get(4);
+        for (uint32_t x = blockStart; x < blockEnd; ++x) {
+          if (((x - blockStart) & 1) == 0) {
+            reader.refill();
+          }
+          const int q = reader.countOnes();
+          const uint32_t u = q < kEscape
+            ? (uint32_t(q) << k) | reader.get(k)
+            : reader.get(bpp);
+          residuals[x] = (u >> 1) ^ -int(u & 1);
+        }
+      }
+
+      const uint32_t head = std::min(width, 2u);
+      for (uint32_t x = 0; x < head; ++x) {
+        row[x] = ((up ? up[x] : 1 << (bpp - 1)) + residuals[x]) & mask;
+      }
+      if (up == nullptr) {
+        for (uint32_t x = 2; x < width; ++x) {
+          row[x] = (row[x - 2] + residuals[x]) & mask;
+        }
+      } else {
+        for (uint32_t x = 2; x < width; ++x) {
+          row[x] = (med(row[x - 2], up[x], up[x - 2]) + residuals[x]) & mask;
+        }
+      }
+      storeRow(row, width, bpp, raw, y);
+    }
+  }
+
+ private:
+  // Median edge detector of the same color neighbors to the left (a),
+  // above (b) and above left (c). The first two rows of a strip predict
+  // from the left only, and the first two columns from above only.
+  static inline int med(const int a, const int b, const int c) {
+    const int lo = std::min(a, b);
+    const int hi = std::max(a, b);
+    return c >= hi ? lo : (c <= lo ? hi : a + b - c);
+  }
+
+  static void predictRow(const int* row, const int* up, const uint32_t width, const int bpp, int* prediction) {
+    const uint32_t head = std::min(width, 2u);
+    for (uint32_t x = 0; x < head; ++x) {
+      prediction[x] = up ? up[x] : 1 << (bpp - 1);
+    }
+    if (up == nullptr) {
+      for (uint32_t x = 2; x < width; ++x) {
+        prediction[x] = row[x - 2];
+      }
+    } else {
+      for (uint32_t x = 2; x < width; ++x) {
+        prediction[x] = med(row[x - 2], up[x], up[x - 2]);
+      }
+    }
+  }
+
+  static void loadRow(
+      const void* raw,
+      const uint32_t width,
+      const int bpp,
+      const uint32_t y,
+      int* row) {
+    if (bpp == 8) {
+      const uint8_t* src = reinterpret_cast<const uint8_t*>(raw) + size_t(y) * width;
+      for (uint32_t x = 0; x < width; ++x) {
+        row[x] = src[x];
+      }
+    } else {
+      const uint8_t* src = reinterpret_cast<const uint8_t*>(raw) + size_t(y) * width / 2 * 3;
+      for (uint32_t x = 0; x < width; x += 2, src += 3) {
+        row[x] = src[0] << 4 | (src[1] & 0xF);
+        row[x + 1] = src[2] << 4 | src[1] >> 4;
+      }
+    }
+  }
+
+  static void storeRow(
+      const int* row,
+      const uint32_t width,
+      const int bpp,
+      void* raw,
+      const uint32_t y) {
+    if (bpp == 8) {
+      uint8_t* dst = reinterpret_cast<uint8_t*>(raw) + size_t(y) * width;
+      for (uint32_t x = 0; x < width; ++x) {
+        dst[x] = row[x];
+      }
+    } else {
+      uint8_t* dst = reinterpret_cast<uint8_t*>(raw) + size_t(y) * width / 2 * 3;
+      for (uint32_t x = 0; x < width; x += 2, dst += 3) {
+        dst[0] = row[x] >> 4;
+        dst[1] = (row[x] & 0xF) | (row[x + 1] & 0xF) << 4;
+        dst[2] = row[x + 1] >> 4;
+      }
+    }
+  }
+
+  // Writes bits most significant first
+  class BitWriter {
+   public:
+    explicit BitWriter(uint8_t* out) : out(out), acc(0), bits(0) {
+    }
+
+    // n <= 32
+    void put(const uint32_t value, const int n) {
+      acc = (acc << n) | value;
+      bits += n;
+      if (bits >= 32) {
+        bits -= 32;
+        const uint32_t word = uint32_t(acc >> bits);
+        out[0] = word >> 24;
+        out[1] = word >> 16;
+        out[2] = word >> 8;
+        out[3] = word;
+        out += 4;
+      }
+    }
+
+    uint8_t* flush() {
+      while (bits >= 8) {
+        bits -= 8;
+        *out++ = uint8_t(acc >> bits);
+      }
+      if (bits > 0) {
+        *out++ = uint8_t(acc << (8 - bits));
+        bits = 0;
+      }
+      return out;
+    }
+
+   private:
+    uint8_t* out;
+    uint64_t acc;
+    int bits;
+  };
+
+  // Reads what BitWriter wrote. Reading past the end gives zeros.
+  class BitReader {
+   public:
+    BitReader(const uint8_t* in, const uint8_t* end) : in(in), end(end), acc(0), bits(0) {
+    }
+
+    // Makes at least 57 bits available. Away from the end, 8 bytes are
+    // loaded at once; the bits past the whole bytes taken are loaded again
+    // by the next refill at the same position, so or-ing them is harmless.
+    void refill() {
+      if (bits > 56) {
+        return;
+      }
+      if (end - in >= 8) {
+        uint64_t next;
+        memcpy(&next, in, sizeof(next));
+        acc |= __builtin_bswap64(next) >> bits;
+        const int bytes = (63 - bits) >> 3;
+        in += bytes;
+        bits += bytes * 8;
+        return;
+      }
+      while (bits <= 56) {
+        acc |= uint64_t(in < end ? *in++ : 0) << (56 - bits);
+        bits += 8;
+      }
+    }
+
+    // n <= 32
+    uint32_t get(const int n) {
+      const uint32_t value = uint32_t((acc >> 1) >> (63 - n));
+      acc <<= n;
+      bits -= n;
+      return value;
+    }
+
+    // Consumes a unary prefix of up to kEscape ones and its zero
+    int countOnes() {
+      const uint64_t inverted = ~acc;
+      const int ones = inverted == 0 ? 64 : __builtin_clzll(inverted);
+      const int q = ones < kEscape ? ones : kEscape;
+      const int consumed = q < kEscape ? q + 1 : q;
+      acc <<= consumed;
+      bits -= consumed;
+      return q;
+    }
+
+   private:
+    const uint8_t* in;
+    const uint8_t* end;
+    uint64_t acc; // next bits, most significant first
+    int bits;
+  };
+
+  static const Header& checkHeader(const void* encoded) {
+    const Header& header = getHeader(encoded);
+    if (header.magic != kMagic || header.version != kVersion ||
+        !isSupported(header.width, header.bitsPerPixel) ||
+        header.numStrips != getNumStrips(header.height)) {
+      throw std::runtime_error("not a Bayer encoded frame");
+    }
+    return header;
+  }
+
+  static uint8_t* encodeStrip(
+      const void* raw,
+      const uint32_t width,
+      const uint32_t height,
+      const int bpp,
+      const uint32_t strip,
+      uint8_t* out) {
+
+    const uint32_t firstRow = strip * kStripHeight;
+    const uint32_t endRow = std::min(height, firstRow + kStripHeight);
+    const int mask = (1 << bpp) - 1;
+    const int half = 1 << (bpp - 1);
+
+    BitWriter writer(out);
+    std::vector<int> rows(3 * width);
+    std::vector<int> prediction(width);
+    std::vector<uint32_t> mapped(width);
+    for (uint32_t y = firstRow; y < endRow; ++y) {
+      int* row = &rows[(y % 3) * width];
+      const int* up = y >= firstRow + 2 ? &rows[((y + 1) % 3) * width] : nullptr;
+      loadRow(raw, width, bpp, y, row);
+      predictRow(row, up, width, bpp, prediction.data());
+
+      // Residuals modulo 2^bpp, centered on 0 and interleaved as
+      // 0, -1, 1, -2, 2...
+      for (uint32_t x = 0; x < width; ++x) {
+        int residual = (row[x] - prediction[x]) & mask;
+        if (residual >= half) {
+          residual -= 1 << bpp;
+        }
+        mapped[x] = (uint32_t(residual) << 1) ^ uint32_t(residual >> 31);
+      }
+
+      for (uint32_t blockStart = 0; blockStart < width; blockStart += kBlockSize) {
+        const uint32_t blockEnd = std::min(width, blockStart + kBlockSize);
+        uint64_t sum = 0;
+        for (uint32_t x = blockStart; x < blockEnd; ++x) {
+          sum += mapped[x];
+        }
+        // The Rice parameter closest to log2 of the mean
+        const uint64_t n = blockEnd - blockStart;
+        int k = 0;
+        while (k < bpp - 1 && (n << (k + 1)) <= sum) {
+          ++k;
+        }
+        writer.put(k, 4);
+        const uint32_t lowMask = (1u << k) - 1;
+        for (uint32_t x = blockStart; x < blockEnd; ++x) {
+          // q ones and a zero, then the low k bits
+          const uint32_t u = mapped[x];
+          const uint32_t q = u >> k;
+          if (q < kEscape) {
+            writer.put((((2u << q) - 2) << k) | (u & lowMask), q + 1 + k);
+          } else {
+            writer.put((((1u << kEscape) - 1) << bpp) | u, kEscape + bpp);
+          }
+        }
+      }
+    }
+    return writer.flush();
+  }
+};
+
+} // namespace surround360
@@ -10,11 +10,13 @@ extern "C" {
 #include <libgen.h>
 }
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 
+#include "BayerCodec.h"
 #include "CvUtil.h"
 #include "SystemUtil.h"
 #include "VrCamException.h"
@@ -22,12 +24,24 @@ extern "C" {
 using namespace surround360;
 using namespace std;
 
+const uint32_t BinaryFootageFile::kDefaultFramesAhead;
+const uint32_t BinaryFootageFile::kDefaultFramesBehind;
+
+// basename() and dirname() may write to the path they're given
+static string baseName(string path) {
+  return basename(&path[0]);
+}
+
+static string dirName(string path) {
+  return dirname(&path[0]);
+}
+
 BinaryFootageFile::BinaryFootageFile(const string& filePath)
   : fileDescriptor(-1),
     baseAddress(nullptr),
     mappingSize(0),
-    filename(basename(const_cast<char*>(filePath.c_str()))),
-    directory(dirname(const_cast<char*>(filePath.c_str()))) {
+    filename(baseName(filePath)),
+    directory(dirName(filePath)) {
 }
 
 int BinaryFootageFile::openFile() {
@@ -88,6 +102,13 @@ void BinaryFootageFile::open() {
   mappingSize = getFileSize();
   baseAddress = mapFile();
   readMetadataHeader();
+
+  lock_guard<mutex> lock(windowMutex);
+  cameraCursors.assign(metadata.numberOfCameras, -1);
+  framesInUse.clear();
+  prefetchedEnd = 0;
+  evictedEnd = -1; // set by the first frame read
+  readaheadStats = ReadaheadStats();
 }
 
 void BinaryFootageFile::unmapFile() {
@@ -131,18 +152,191 @@ const std::string BinaryFootageFile::getFilename() const {
 
 const uint8_t* BinaryFootageFile::getFrame(
   const uint32_t frameNumber, const uint32_t cameraNumber) const {
-  // frame access pattern is sequential. when we reach next frame,
-  // mark memory range corresponding to the previous frame as not
-  // needed
-  if (cameraNumber == 0 && frameNumber > 0) {
-    discardFrameMemory(frameNumber - 1, cameraNumber);
-  }
   const uint8_t* frameAddr =
     reinterpret_cast<const uint8_t*>(calculateFrameAddress(frameNumber, cameraNumber));
 
+  advanceWindow(frameNumber, cameraNumber);
+  pageInFrame(frameAddr);
   return frameAddr;
 }
 
+const uint8_t* BinaryFootageFile::getFrame(
+  const uint32_t frameNumber,
+  const uint32_t cameraNumber,
+  vector<uint8_t>& decodeBuffer) const {
+  const uint8_t* frameAddr = getFrame(frameNumber, cameraNumber);
+  if (!BayerCodec::isEncoded(frameAddr, metadata.width, metadata.height, metadata.bitsPerPixel)) {
+    return frameAddr;
+  }
+  if (BayerCodec::getHeader(frameAddr).encodedSize > getFrameSize()) {
+    throw runtime_error("Encoded frame overflows its slot in " + filename);
+  }
+  decodeBuffer.resize(getFrameSize());
+  BayerCodec::decode(frameAddr, decodeBuffer.data());
+  return decodeBuffer.data();
+}
+
+bool BinaryFootageFile::isFrameEncoded(
+  const uint32_t frameNumber, const uint32_t cameraNumber) const {
+  return BayerCodec::isEncoded(
+    calculateFrameAddress(frameNumber, cameraNumber),
+    metadata.width,
+    metadata.height,
+    metadata.bitsPerPixel);
+}
+
+void BinaryFootageFile::setReadaheadWindow(
+  const uint32_t framesAhead, const uint32_t framesBehind, const bool trackReleases) {
+  lock_guard<mutex> lock(windowMutex);
+  this->framesAhead = framesAhead;
+  this->framesBehind = framesBehind;
+  this->trackReleases = trackReleases;
+  framesInUse.clear();
+}
+
+void BinaryFootageFile::releaseFrame(const uint32_t frameNumber) const {
+  lock_guard<mutex> lock(windowMutex);
+  auto inUse = framesInUse.find(frameNumber);
+  if (inUse == framesInUse.end()) {
+    return;
+  }
+  if (--inUse->second == 0) {
+    framesInUse.erase(inUse);
+    evictBehindWindow();
+  }
+}
+
+BinaryFootageFile::ReadaheadStats BinaryFootageFile::getReadaheadStats() const {
+  lock_guard<mutex> lock(windowMutex);
+  return readaheadStats;
+}
+
+double BinaryFootageFile::getResidency(
+  const uint32_t firstFrame, const uint32_t frameCount) const {
+  const size_t kMetadataSize(4096);
+  const size_t kPageSize = sysconf(_SC_PAGESIZE);
+  const size_t begin = kMetadataSize
+    + size_t(firstFrame) * metadata.numberOfCameras * getFrameSize();
+  const size_t end = min(
+    mappingSize,
+    begin + size_t(frameCount) * metadata.numberOfCameras * getFrameSize());
+  if (begin >= end) {
+    return 0.0;
+  }
+
+  const size_t alignedBegin = begin / kPageSize * kPageSize;
+  vector<unsigned char> resident((end - alignedBegin + kPageSize - 1) / kPageSize);
+  if (mincore(
+        reinterpret_cast<uint8_t*>(baseAddress) + alignedBegin,
+        end - alignedBegin,
+        resident.data()) == -1) {
+    ostringstream errStream;
+    errStream << "Error mincore()ing file " << directory
+              << "/" << filename
+              << ": " << strerror(errno);
+    throw runtime_error(errStream.str());
+  }
+  const size_t residentPages =
+    count_if(resident.begin(), resident.end(), [](unsigned char r) { return r & 1; });
+  return double(residentPages) / resident.size();
+}
+
+// The window spans from the slowest to the fastest camera. Only frames
+// entering or leaving it are advised, so each range is advised once.
+void BinaryFootageFile::advanceWindow(
+  const uint32_t frameNumber, const uint32_t cameraNumber) const {
+  lock_guard<mutex> lock(windowMutex);
+  if (trackReleases) {
+    ++framesInUse[frameNumber];
+  }
+  int64_t& cursor = cameraCursors[cameraNumber];
+  if (int64_t(frameNumber) <= cursor) {
+    return; // going back, e.g. a random access
+  }
+  cursor = frameNumber;
+
+  int64_t slowest = frameNumber;
+  int64_t fastest = frameNumber;
+  for (const int64_t c : cameraCursors) {
+    if (c >= 0) {
+      slowest = min(slowest, c);
+      fastest = max(fastest, c);
+    }
+  }
+
+  const int64_t numberOfFrames = getNumberOfFrames();
+  const int64_t prefetchEnd = min(numberOfFrames, fastest + 1 + framesAhead);
+  if (prefetchEnd > prefetchedEnd) {
+    const int64_t prefetchBegin = max(prefetchedEnd, slowest);
+    adviseFrames(prefetchBegin, prefetchEnd, MADV_WILLNEED);
+    readaheadStats.bytesPrefetched +=
+      (prefetchEnd - prefetchBegin) * metadata.numberOfCameras * getFrameSize();
+    prefetchedEnd = prefetchEnd;
+  }
+
+  evictBehindWindow();
+}
+
+// Frames still in use are kept, with every frame after them, so a frame
+// is never dropped from the page cache while a caller reads it
+void BinaryFootageFile::evictBehindWindow() const {
+  int64_t slowest = -1;
+  for (const int64_t c : cameraCursors) {
+    if (c >= 0) {
+      slowest = slowest < 0 ? c : min(slowest, c);
+    }
+  }
+  if (slowest < 0) {
+    return;
+  }
+
+  int64_t evictEnd = slowest - framesBehind;
+  if (!framesInUse.empty()) {
+    evictEnd = min(evictEnd, framesInUse.begin()->first);
+  }
+  if (evictedEnd < 0) {
+    evictedEnd = max(int64_t(0), evictEnd);
+  } else if (evictEnd > evictedEnd) {
+    adviseFrames(evictedEnd, evictEnd, MADV_DONTNEED);
+    readaheadStats.bytesEvicted +=
+      (evictEnd - evictedEnd) * metadata.numberOfCameras * getFrameSize();
+    evictedEnd = evictEnd;
+  }
+}
+
+void BinaryFootageFile::pageInFrame(const uint8_t* frameAddr) const {
+  const size_t kPageSize = sysconf(_SC_PAGESIZE);
+  const size_t offset = frameAddr - reinterpret_cast<const uint8_t*>(baseAddress);
+  const size_t alignedOffset = offset / kPageSize * kPageSize;
+  const size_t length = min(getFrameSize(), mappingSize - offset) + offset - alignedOffset;
+  const uint8_t* alignedAddr = reinterpret_cast<const uint8_t*>(baseAddress) + alignedOffset;
+
+  vector<unsigned char> resident((length + kPageSize - 1) / kPageSize);
+  bool stalled = false;
+  double stallSec = 0;
+  if (mincore(const_cast<uint8_t*>(alignedAddr), length, resident.data()) == 0 &&
+      !all_of(resident.begin(), resident.end(), [](unsigned char r) { return r & 1; })) {
+    // Touch every page so the wait is counted here rather than wherever
+    // the frame is first used
+    stalled = true;
+    const double startTime = getCurrTimeSec();
+    volatile uint8_t sink = 0;
+    for (size_t page = 0; page < resident.size(); ++page) {
+      if (!(resident[page] & 1)) {
+        sink += alignedAddr[page * kPageSize];
+      }
+    }
+    stallSec = getCurrTimeSec() - startTime;
+  }
+
+  lock_guard<mutex> lock(windowMutex);
+  ++readaheadStats.framesRead;
+  if (stalled) {
+    ++readaheadStats.framesStalled;
+    readaheadStats.stallSec += stallSec;
+  }
+}
+
 const size_t BinaryFootageFile::getNumberOfCameras() const {
   return metadata.numberOfCameras;
 }
@@ -187,14 +381,24 @@ const void* BinaryFootageFile::calculateFrameAddress(const uint32_t frameNumber,
   return frameAddr;
 }
 
-void BinaryFootageFile::discardFrameMemory(
-  const uint32_t frameNumber,
-  const uint32_t cameraNumber) const {
-  auto frameAddress = const_cast<void*>(calculateFrameAddress(frameNumber, cameraNumber));
-
-  auto rangeSize = getFrameSize();
-  int err = madvise(frameAddress, rangeSize, MADV_DONTNEED);
+void BinaryFootageFile::adviseFrames(
+  const int64_t firstFrame,
+  const int64_t endFrame,
+  const int advice) const {
+  const size_t kMetadataSize(4096);
+  const size_t kPageSize = sysconf(_SC_PAGESIZE);
+  const size_t frameRowSize = metadata.numberOfCameras * getFrameSize();
+  const size_t begin = kMetadataSize + firstFrame * frameRowSize;
+  const size_t end = min(mappingSize, kMetadataSize + endFrame * frameRowSize);
+  if (begin >= end) {
+    return;
+  }
 
+  const size_t alignedBegin = begin / kPageSize * kPageSize;
+  const int err = madvise(
+    reinterpret_cast<uint8_t*>(baseAddress) + alignedBegin,
+    end - alignedBegin,
+    advice);
   if (err == -1) {
     ostringstream errStream;
     errStream << "Error madvising() file " << directory
@@ -202,4 +406,20 @@ void BinaryFootageFile::discardFrameMemory(
               << ": " << strerror(errno);
     throw runtime_error(errStream.str());
   }
+
+  // Unmapping alone leaves the pages in the page cache
+#if _XOPEN_SOURCE >= 600 || _POSIX_C_SOURCE >= 200112L
+  if (advice == MADV_DONTNEED) {
+    // Returns the error number rather than setting errno
+    const int fadviseErr = posix_fadvise(
+      fileDescriptor, alignedBegin, end - alignedBegin, POSIX_FADV_DONTNEED);
+    if (fadviseErr != 0) {
+      ostringstream errStream;
+      errStream << "Error fadvising() file " << directory
+                << "/" << filename
+                << ": " << strerror(fadviseErr);
+      throw runtime_error(errStream.str());
+    }
+  }
+#endif
 }
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <map>
+#include <mutex>
 #include <string>
+#include <vector>
 
 namespace surround360
 {
@@ -17,6 +20,18 @@ class BinaryFootageFile {
     uint32_t numberOfCameras;
   } __attribute__((packed));
 
+  // Counters of the readahead window since open()
+  struct ReadaheadStats {
+    uint64_t framesRead;      // getFrame() calls
+    uint64_t framesStalled;   // frames not fully in the page cache when requested
+    double stallSec;          // time spent paging in those frames
+    uint64_t bytesPrefetched; // advised with MADV_WILLNEED
+    uint64_t bytesEvicted;    // advised with MADV_DONTNEED
+  };
+
+  static const uint32_t kDefaultFramesAhead = 2;
+  static const uint32_t kDefaultFramesBehind = 0;
+
   BinaryFootageFile() = default;
   BinaryFootageFile(const std::string& filePath);
   ~BinaryFootageFile();
@@ -24,7 +39,37 @@ class BinaryFootageFile {
   void open();
   void close();
   const std::string getFilename() const;
+
+  // Frames are read through a window that follows the frames requested of
+  // each camera. The next framesAhead frames of all cameras are prefetched
+  // and frames more than framesBehind behind the slowest camera are
+  // released from the page cache. A frame is paged in before it is
+  // returned. Safe to call from several threads.
+  //
+  // Callers that read frames of one camera out of order, e.g. a pool of
+  // workers, turn on trackReleases in setReadaheadWindow() and hand every
+  // frame back with releaseFrame() once done with it. A frame is then only
+  // released from the page cache after it and every frame before it are.
   const uint8_t* getFrame(const uint32_t frameNumber, const uint32_t cameraNumber) const;
+
+  // Same, but frames stored compressed by BayerCodec are decoded into
+  // decodeBuffer and the raw frame is returned from there. The plain
+  // getFrame() returns frames as stored.
+  const uint8_t* getFrame(
+    const uint32_t frameNumber,
+    const uint32_t cameraNumber,
+    std::vector<uint8_t>& decodeBuffer) const;
+  bool isFrameEncoded(const uint32_t frameNumber, const uint32_t cameraNumber) const;
+  void setReadaheadWindow(
+    const uint32_t framesAhead,
+    const uint32_t framesBehind,
+    const bool trackReleases = false);
+  void releaseFrame(const uint32_t frameNumber) const;
+  ReadaheadStats getReadaheadStats() const;
+
+  // Fraction of the pages of frames [firstFrame, firstFrame + frameCount)
+  // that are in the page cache
+  double getResidency(const uint32_t firstFrame, const uint32_t frameCount) const;
   const size_t getNumberOfCameras() const;
   const size_t getNumberOfFrames() const;
   const size_t getFrameSize() const;
@@ -41,7 +86,10 @@ class BinaryFootageFile {
   void* mapFile();
   void unmapFile();
   const void* calculateFrameAddress(const uint32_t frameNumber, const uint32_t cameraNumber) const;
-  void discardFrameMemory(const uint32_t frameNumber, const uint32_t cameraNumber) const;
+  void adviseFrames(const int64_t firstFrame, const int64_t endFrame, const int advice) const;
+  void advanceWindow(const uint32_t frameNumber, const uint32_t cameraNumber) const;
+  void evictBehindWindow() const;
+  void pageInFrame(const uint8_t* frameAddr) const;
 
  private:
   mutable int fileDescriptor;
@@ -50,5 +98,15 @@ class BinaryFootageFile {
   const std::string filename;
   const std::string directory;
   MetadataHeader metadata;
+
+  uint32_t framesAhead = kDefaultFramesAhead;
+  uint32_t framesBehind = kDefaultFramesBehind;
+  bool trackReleases = false;
+  mutable std::mutex windowMutex;
+  mutable std::vector<int64_t> cameraCursors; // last frame requested, -1 if none
+  mutable int64_t prefetchedEnd;              // frames below were prefetched
+  mutable int64_t evictedEnd;                 // frames below were released
+  mutable std::map<int64_t, int> framesInUse; // getFrame() calls not yet released
+  mutable ReadaheadStats readaheadStats;
 };
 }
@@ -13,18 +13,27 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <functional>
 #include <thread>
 
 #include "ColorspaceConversion.h"
+#include "CompiledIspConfig.h"
 #include "CvUtil.h"
+#include "DefectPixelMap.h"
 #include "Filter.h"
+#include "IspStatistics.h"
 #include "JsonUtil.h"
 #include "MathUtil.h"
+#include "MikeUtil.h"
 #include "MonotonicTable.h"
 #include "VrCamException.h"
 
 #include <glog/logging.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace surround360 {
 
 using namespace std;
@@ -41,6 +50,74 @@ enum DemosaicFilter {
 
 const int kToneCurveLutSize = 4096;
 
+// Number of rows handed to each task by the row parallel stages
+const int kIspRowGrain = 16;
+
+// Compare and swap used by the median networks. Works on scalars and on
+// SSE registers so the same network filters one or four pixels at a time.
+template <typename T>
+inline void sortPair(T& a, T& b) {
+  const T t = std::min(a, b);
+  b = std::max(a, b);
+  a = t;
+}
+
+#ifdef __SSE2__
+inline void sortPair(__m128& a, __m128& b) {
+  const __m128 t = _mm_min_ps(a, b);
+  b = _mm_max_ps(a, b);
+  a = t;
+}
+#endif
+
+// Median of nine values with a 19 exchange sorting network. p is clobbered.
+template <typename T>
+inline T median9(T* p) {
+  sortPair(p[1], p[2]); sortPair(p[4], p[5]); sortPair(p[7], p[8]);
+  sortPair(p[0], p[1]); sortPair(p[3], p[4]); sortPair(p[6], p[7]);
+  sortPair(p[1], p[2]); sortPair(p[4], p[5]); sortPair(p[7], p[8]);
+  sortPair(p[0], p[3]); sortPair(p[5], p[8]); sortPair(p[4], p[7]);
+  sortPair(p[3], p[6]); sortPair(p[1], p[4]); sortPair(p[2], p[5]);
+  sortPair(p[4], p[7]); sortPair(p[4], p[2]); sortPair(p[6], p[4]);
+  sortPair(p[4], p[2]);
+  return p[4];
+}
+
+// Tiles of the tiled RGB stages. A tile of the edge aware demosaic with its
+// halo and intermediate planes stays within a typical L2 cache.
+const int kIspTileWidth = 128;
+const int kIspTileHeight = 64;
+
+// Pixels of the raw image beyond a tile that each demosaic filter reads
+const int kBilinearDemosaicHalo = 1;
+const int kEdgeAwareDemosaicHalo = 8;
+
+// A float plane covering extent and addressed in image coordinates, so the
+// demosaic filters run unchanged on a whole image or on a single tile.
+struct IspPlane {
+  Mat mat;
+  int x0;
+  int y0;
+
+  IspPlane(const Rect& extent) :
+      mat(extent.height, extent.width, CV_32F),
+      x0(extent.x),
+      y0(extent.y) {
+  }
+
+  inline float& operator()(const int i, const int j) {
+    return mat.at<float>(i - y0, j - x0);
+  }
+
+  inline float operator()(const int i, const int j) const {
+    return mat.at<float>(i - y0, j - x0);
+  }
+
+  Rect extent() const {
+    return Rect(x0, y0, mat.cols, mat.rows);
+  }
+};
+
 class CameraIsp {
  protected:
   string bayerPattern;
@@ -54,6 +131,7 @@ class CameraIsp {
   int stuckPixelThreshold;
   float stuckPixelDarknessThreshold;
   int stuckPixelRadius;
+  DefectPixelMap defectPixelMap;
   int bitsPerPixel;
   int maxPixelValue;
   cv::Point3f whiteBalanceGain;
@@ -75,6 +153,10 @@ class CameraIsp {
   DemosaicFilter demosaicFilter;
   int resize;
   bool disableToneCurve;
+  bool fuseRawStages;
+  bool tiledRgbStages;
+  bool collectStatistics;
+  IspStatistics statistics;
   vector<Vec3f> toneCurveLut;
   BezierCurve<float, Vec3f> vignetteCurveH;
   BezierCurve<float, Vec3f> vignetteCurveV;
@@ -86,8 +168,14 @@ class CameraIsp {
   const float maxD; // max diagonal distance
   const float sqrtMaxD; // max diagonal distance
 
-  void demosaicBilinearFilter(Mat& r,  Mat& g, Mat& b) const {
-    for (int i = 0; i < height; ++i) {
+  // Fills in the missing colors of region. The planes must cover region
+  // plus kBilinearDemosaicHalo, clipped to the image.
+  void demosaicBilinearFilter(
+      IspPlane& r,
+      IspPlane& g,
+      IspPlane& b,
+      const Rect& region) const {
+    for (int i = region.y; i < region.y + region.height; ++i) {
       const int i_1 = reflect(i - 1, height);
       const int i1  = reflect(i + 1, height);
 
@@ -95,52 +183,52 @@ class CameraIsp {
         (redPixel(i, 0) && greenPixel(i, 1)) ||
         (redPixel(i, 1) && greenPixel(i, 0));
 
-      for (int j = 0; j < width; ++j) {
+      for (int j = region.x; j < region.x + region.width; ++j) {
         const int j_1 = reflect(j - 1, width);
         const int j1  = reflect(j + 1, width);
 
         if (redPixel(i, j)) {
-          g.at<float>(i, j) =
-            bilerp(g.at<float>(i_1, j),
-                   g.at<float>(i1, j),
-                   g.at<float>(i, j_1),
-                   g.at<float>(i, j1),
+          g(i, j) =
+            bilerp(g(i_1, j),
+                   g(i1, j),
+                   g(i, j_1),
+                   g(i, j1),
                    0.5f, 0.5f);
 
-          b.at<float>(i, j) =
-            bilerp(b.at<float>(i_1, j_1),
-                   b.at<float>(i1, j_1),
-                   b.at<float>(i_1, j1),
-                   b.at<float>(i1, j1),
+          b(i, j) =
+            bilerp(b(i_1, j_1),
+                   b(i1, j_1),
+                   b(i_1, j1),
+                   b(i1, j1),
                    0.5f, 0.5f);
 
         } else if (greenPixel(i, j)) {
           if (redGreenRow) {
-            b.at<float>(i, j) = (b.at<float>(i_1, j) +
-                                 b.at<float>(i1, j)) / 2.0f;
+            b(i, j) = (b(i_1, j) +
+                                 b(i1, j)) / 2.0f;
 
-            r.at<float>(i, j) = (r.at<float>(i, j_1) +
-                                 r.at<float>(i, j1)) / 2.0f;
+            r(i, j) = (r(i, j_1) +
+                                 r(i, j1)) / 2.0f;
           } else {
-            r.at<float>(i, j) = (r.at<float>(i_1, j) +
-                                 r.at<float>(i1, j)) / 2.0f;
+            r(i, j) = (r(i_1, j) +
+                                 r(i1, j)) / 2.0f;
 
-            b.at<float>(i, j) = (b.at<float>(i, j_1) +
-                                 b.at<float>(i, j1)) / 2.0f;
+            b(i, j) = (b(i, j_1) +
+                                 b(i, j1)) / 2.0f;
           }
         } else {
-          g.at<float>(i, j) =
-            bilerp(g.at<float>(i_1, j),
-                   g.at<float>(i1, j),
-                   g.at<float>(i, j_1),
-                   g.at<float>(i, j1),
+          g(i, j) =
+            bilerp(g(i_1, j),
+                   g(i1, j),
+                   g(i, j_1),
+                   g(i, j1),
                    0.5f, 0.5f);
 
-          r.at<float>(i, j) =
-            bilerp(r.at<float>(i_1, j_1),
-                   r.at<float>(i1, j_1),
-                   r.at<float>(i_1, j1),
-                   r.at<float>(i1, j1),
+          r(i, j) =
+            bilerp(r(i_1, j_1),
+                   r(i1, j_1),
+                   r(i_1, j1),
+                   r(i1, j1),
                    0.5f, 0.5f);
         }
       }
@@ -154,7 +242,7 @@ class CameraIsp {
     const Butterworth dcFilter(0.0f, 2.0f, width + height, 1.0f, 2.0f);
 
     //  Do a per pixel filtering in DCT space
-    for (int i = 0; i < height; ++i) {
+    parallel_for_<int>(0, height, [&](int i) {
       const float y = float(i) / float(height - 1);
       for (int j = 0; j < width; ++j) {
         const float x = float(j) / float(width - 1);
@@ -174,92 +262,105 @@ class CameraIsp {
         r.at<float>(i, j) = lerp(g.at<float>(i, j), r.at<float>(i, j) * rbGain, alpha);
         b.at<float>(i, j) = lerp(g.at<float>(i, j), b.at<float>(i, j) * rbGain, alpha);
       }
-    }
+    }, kIspRowGrain);
   }
 
 
-  void demosaicEdgeAware(Mat& red, Mat& green, Mat& blue) const {
+  // Fills in the missing colors of region. The planes must cover region
+  // plus kEdgeAwareDemosaicHalo, clipped to the image.
+  void demosaicEdgeAware(
+      IspPlane& red,
+      IspPlane& green,
+      IspPlane& blue,
+      const Rect& region) const {
+    // Homogeneity test radius
+    const int w = 4;
+    const int diameter = 2 * w + 1;
+    const int diameterSquared = square(diameter);
+
+    // Each step reads the one before it up to two (or w) pixels away
+    const Rect greenRegion = growRegion(region, 2);
+    const Rect gradientRegion = growRegion(greenRegion, w);
+    const Rect extent = red.extent();
+
     // Horizontal and vertical green values
-    Mat gV(height, width, CV_32F);
-    Mat gH(height, width, CV_32F);
+    IspPlane gV(extent);
+    IspPlane gH(extent);
 
     // And their first and second order derivatives
-    Mat dV(height, width, CV_32F);
-    Mat dH(height, width, CV_32F);
+    IspPlane dV(extent);
+    IspPlane dH(extent);
 
     // Compute green gradients
-    for (int i = 0; i < height; ++i) {
+    for (int i = gradientRegion.y; i < gradientRegion.y + gradientRegion.height; ++i) {
       const int i_1 = reflect(i - 1, height);
       const int i1  = reflect(i + 1, height);
       const int i_2 = reflect(i - 2, height);
       const int i2  = reflect(i + 2, height);
 
-      for (int j = 0; j < width; ++j) {
+      for (int j = gradientRegion.x; j < gradientRegion.x + gradientRegion.width; ++j) {
         const int j_1 = reflect(j - 1, width);
         const int j1  = reflect(j + 1, width);
         const int j_2 = reflect(j - 2, width);
         const int j2  = reflect(j + 2, width);
         if (greenPixel(i, j)) {
-          gV.at<float>(i, j) = green.at<float>(i, j);
-          gH.at<float>(i, j) = green.at<float>(i, j);
+          gV(i, j) = green(i, j);
+          gH(i, j) = green(i, j);
 
-          dV.at<float>(i, j) =
-            (fabsf(green.at<float>(i2, j) - green.at<float>(i, j)) +
-             fabsf(green.at<float>(i, j) - green.at<float>(i_2, j))) / 2.0f;
+          dV(i, j) =
+            (fabsf(green(i2, j) - green(i, j)) +
+             fabsf(green(i, j) - green(i_2, j))) / 2.0f;
 
-          dH.at<float>(i, j) =
-            (fabsf(green.at<float>(i,  j2) - green.at<float>(i, j)) +
-             fabsf(green.at<float>(i, j) - green.at<float>(i,  j_2))) / 2.0f;
+          dH(i, j) =
+            (fabsf(green(i,  j2) - green(i, j)) +
+             fabsf(green(i, j) - green(i,  j_2))) / 2.0f;
         } else {
-          gV.at<float>(i, j) = (green.at<float>(i_1, j) + green.at<float>(i1, j)) / 2.0f;
-          gH.at<float>(i, j) = (green.at<float>(i, j_1) + green.at<float>(i, j1)) / 2.0f;
-          dV.at<float>(i, j) = (fabsf(green.at<float>(i_1, j) - green.at<float>(i1, j))) / 2.0f;
-          dH.at<float>(i, j) = (fabsf(green.at<float>(i, j_1) - green.at<float>(i, j1))) / 2.0f;
-
-          Mat& ch = redPixel(i, j) ? red : blue;
-          gV.at<float>(i, j) += (2.0f * ch.at<float>(i, j) - ch.at<float>(i_2, j) - ch.at<float>(i2, j)) / 4.0f;
-          gH.at<float>(i, j) += (2.0f * ch.at<float>(i, j) - ch.at<float>(i, j_2) - ch.at<float>(i, j2)) / 4.0f;
-          dV.at<float>(i, j) += fabsf(-2.0f * ch.at<float>(i, j) + ch.at<float>(i_2, j) + ch.at<float>(i2, j)) / 2.0f;
-          dH.at<float>(i, j) += fabsf(-2.0f * ch.at<float>(i, j) + ch.at<float>(i, j_2) + ch.at<float>(i, j2)) / 2.0f;
+          gV(i, j) = (green(i_1, j) + green(i1, j)) / 2.0f;
+          gH(i, j) = (green(i, j_1) + green(i, j1)) / 2.0f;
+          dV(i, j) = (fabsf(green(i_1, j) - green(i1, j))) / 2.0f;
+          dH(i, j) = (fabsf(green(i, j_1) - green(i, j1))) / 2.0f;
+
+          const IspPlane& ch = redPixel(i, j) ? red : blue;
+          gV(i, j) += (2.0f * ch(i, j) - ch(i_2, j) - ch(i2, j)) / 4.0f;
+          gH(i, j) += (2.0f * ch(i, j) - ch(i, j_2) - ch(i, j2)) / 4.0f;
+          dV(i, j) += fabsf(-2.0f * ch(i, j) + ch(i_2, j) + ch(i2, j)) / 2.0f;
+          dH(i, j) += fabsf(-2.0f * ch(i, j) + ch(i, j_2) + ch(i, j2)) / 2.0f;
         }
       }
     }
-    const int w = 4;
-    const int diameter = 2 * w + 1;
-    const int diameterSquared = square(diameter);
 
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; ++j) {
+    for (int i = greenRegion.y; i < greenRegion.y + greenRegion.height; ++i) {
+      for (int j = greenRegion.x; j < greenRegion.x + greenRegion.width; ++j) {
         // Homogenity test
         int hCount = 0;
         for (int l = -w; l <= w; ++l) {
           const int il = reflect(i + l, height);
           for (int k = -w; k <= w; ++k) {
             const int jk = reflect(j + k, width);
-            hCount += (dH.at<float>(il, jk) <= dV.at<float>(il, jk));
+            hCount += (dH(il, jk) <= dV(il, jk));
           }
         }
-        green.at<float>(i, j) = hCount < diameterSquared / 2 ? gV.at<float>(i, j) : gH.at<float>(i, j);
+        green(i, j) = hCount < diameterSquared / 2 ? gV(i, j) : gH(i, j);
       }
     }
 
     // compute r-b
-    Mat redMinusGreen(height, width, CV_32F);
-    Mat blueMinusGreen(height, width, CV_32F);
-    Mat pGreen(height, width, CV_32F);
+    IspPlane redMinusGreen(extent);
+    IspPlane blueMinusGreen(extent);
+    IspPlane pGreen(extent);
 
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; ++j) {
-        pGreen.at<float>(i, j) = green.at<float>(i, j);
+    for (int i = greenRegion.y; i < greenRegion.y + greenRegion.height; ++i) {
+      for (int j = greenRegion.x; j < greenRegion.x + greenRegion.width; ++j) {
+        pGreen(i, j) = green(i, j);
         if (redPixel(i, j)) {
-          redMinusGreen.at<float>(i, j) = red.at<float>(i, j) - pGreen.at<float>(i, j);
+          redMinusGreen(i, j) = red(i, j) - pGreen(i, j);
         } else if (!greenPixel(i, j)) {
-          blueMinusGreen.at<float>(i, j) = blue.at<float>(i, j) - pGreen.at<float>(i, j);
+          blueMinusGreen(i, j) = blue(i, j) - pGreen(i, j);
         }
       }
     }
     // Now use a constant hue based red/blue bilinear interpolation
-    for (int i = 0; i < height; ++i) {
+    for (int i = region.y; i < region.y + region.height; ++i) {
       const int i_1 = reflect(i - 1, height);
       const int i1  = reflect(i + 1, height);
       const int i_2 = reflect(i - 2, height);
@@ -269,66 +370,66 @@ class CameraIsp {
         (redPixel(i, 0) && greenPixel(i, 1)) ||
         (redPixel(i, 1) && greenPixel(i, 0));
 
-      for (int j = 0; j < width; ++j) {
+      for (int j = region.x; j < region.x + region.width; ++j) {
         const int j_1 = reflect(j - 1, width);
         const int j1  = reflect(j + 1, width);
         const int j_2 = reflect(j - 2, width);
         const int j2  = reflect(j + 2, width);
 
         if (redPixel(i, j)) {
-          blue.at<float>(i, j) =
-            (blueMinusGreen.at<float>(i_1, j_1) +
-             blueMinusGreen.at<float>(i1, j_1) +
-             blueMinusGreen.at<float>(i_1, j1) +
-             blueMinusGreen.at<float>(i1, j1)) / 4.0f +
-            pGreen.at<float>(i, j);
-
-          red.at<float>(i, j) =
-            (redMinusGreen.at<float>(i, j) +
-             redMinusGreen.at<float>(i_2, j) +
-             redMinusGreen.at<float>(i2, j) +
-             redMinusGreen.at<float>(i, j_2) +
-             redMinusGreen.at<float>(i, j2)) / 5.0f +
-            pGreen.at<float>(i, j);
+          blue(i, j) =
+            (blueMinusGreen(i_1, j_1) +
+             blueMinusGreen(i1, j_1) +
+             blueMinusGreen(i_1, j1) +
+             blueMinusGreen(i1, j1)) / 4.0f +
+            pGreen(i, j);
+
+          red(i, j) =
+            (redMinusGreen(i, j) +
+             redMinusGreen(i_2, j) +
+             redMinusGreen(i2, j) +
+             redMinusGreen(i, j_2) +
+             redMinusGreen(i, j2)) / 5.0f +
+            pGreen(i, j);
         } else if (greenPixel(i, j)) {
-          Mat& diffCh1 = redGreenRow ? blueMinusGreen : redMinusGreen;
-          Mat& diffCh2 = redGreenRow ? redMinusGreen :  blueMinusGreen;
-
-          Mat& ch1 = redGreenRow ? blue : red;
-          Mat& ch2 = redGreenRow ? red :  blue;
-
-          ch1.at<float>(i, j) =
-            (diffCh1.at<float>(i_1, j_2) +
-             diffCh1.at<float>(i_1, j) +
-             diffCh1.at<float>(i_1, j2) +
-             diffCh1.at<float>(i1,  j_2) +
-             diffCh1.at<float>(i1,  j2) +
-             diffCh1.at<float>(i1,  j2)) / 6.0f +
-            pGreen.at<float>(i, j);
-
-          ch2.at<float>(i, j) =
-            (diffCh2.at<float>(i_2, j_1) +
-             diffCh2.at<float>(i,   j_1) +
-             diffCh2.at<float>(i2,  j_1) +
-             diffCh2.at<float>(i_2, j1) +
-             diffCh2.at<float>(i,   j1) +
-             diffCh2.at<float>(i2,  j1)) / 6.0f +
-            pGreen.at<float>(i, j);
+          const IspPlane& diffCh1 = redGreenRow ? blueMinusGreen : redMinusGreen;
+          const IspPlane& diffCh2 = redGreenRow ? redMinusGreen :  blueMinusGreen;
+
+          IspPlane& ch1 = redGreenRow ? blue : red;
+          IspPlane& ch2 = redGreenRow ? red :  blue;
+
+          ch1(i, j) =
+            (diffCh1(i_1, j_2) +
+             diffCh1(i_1, j) +
+             diffCh1(i_1, j2) +
+             diffCh1(i1,  j_2) +
+             diffCh1(i1,  j2) +
+             diffCh1(i1,  j2)) / 6.0f +
+            pGreen(i, j);
+
+          ch2(i, j) =
+            (diffCh2(i_2, j_1) +
+             diffCh2(i,   j_1) +
+             diffCh2(i2,  j_1) +
+             diffCh2(i_2, j1) +
+             diffCh2(i,   j1) +
+             diffCh2(i2,  j1)) / 6.0f +
+            pGreen(i, j);
         } else {
-          red.at<float>(i, j) =
-            (redMinusGreen.at<float>(i_1, j_1) +
-             redMinusGreen.at<float>(i1, j_1) +
-             redMinusGreen.at<float>(i_1, j1) +
-             redMinusGreen.at<float>(i1, j1)) / 4.0f +
-            pGreen.at<float>(i, j);
-
-          blue.at<float>(i, j) =
-            (blueMinusGreen.at<float>(i,  j) +
-             blueMinusGreen.at<float>(i_2, j) +
-             blueMinusGreen.at<float>(i2, j) +
-             blueMinusGreen.at<float>(i, j_2) +
-             blueMinusGreen.at<float>(i, j2)) / 5.0f +
-            pGreen.at<float>(i, j);
+          red(i, j) =
+            (redMinusGreen(i_1, j_1) +
+             redMinusGreen(i1, j_1) +
+             redMinusGreen(i_1, j1) +
+             redMinusGreen(i1, j1)) / 4.0f +
+            pGreen(i, j);
+
+          blue(i, j) =
+            (blueMinusGreen(i,  j) +
+             blueMinusGreen(i_2, j) +
+             blueMinusGreen(i2, j) +
+             blueMinusGreen(i, j_2) +
+             blueMinusGreen(i, j2)) / 5.0f +
+            pGreen(i, j);
         }
       }
     }
@@ -430,6 +531,9 @@ class CameraIsp {
       demosaicFilter(EDGE_AWARE_DM_FILTER),
       resize(1),
       disableToneCurve(false),
+      fuseRawStages(false),
+      tiledRgbStages(false),
+      collectStatistics(false),
       outputBpp(outputBpp),
       width(0),
       height(0),
@@ -609,8 +713,35 @@ class CameraIsp {
     setup();
   }
 
+  // Constructs from a config compiled by saveCompiledConfig, which must be
+  // valid. The output bits per pixel are the ones it was compiled for.
+  CameraIsp(const CompiledIspConfig& compiled) :
+      demosaicFilter(EDGE_AWARE_DM_FILTER),
+      resize(1),
+      disableToneCurve(false),
+      fuseRawStages(false),
+      tiledRgbStages(false),
+      collectStatistics(false),
+      outputBpp(compiled.getHeader().outputBpp),
+      width(0),
+      height(0),
+      maxDimension(0),
+      maxD(0),
+      sqrtMaxD(0) {
+
+    loadCompiledConfig(compiled);
+  }
+
+  // Builds the bayer tables, the vignetting curves, the composite CCM and
+  // the tone curve from the current settings
   void setup() {
-    // Build the bayer pattern tables
+    setupBayerPattern();
+    setupVignetteCurves();
+    setupColorCorrection();
+    buildToneCurveLut();
+  }
+
+  void setupBayerPattern() {
     if (bayerPattern.find("RGGB") != std::string::npos) {
       filters = 0x94949494;
       redBayerPixel[0][0] = true;
@@ -657,7 +788,9 @@ class CameraIsp {
       greenBayerPixel[1][0] = true;
       greenBayerPixel[1][1] = false;
     }
+  }
 
+  void setupVignetteCurves() {
     vignetteCurveH.clearPoints();
     for (auto p : vignetteRollOffH) {
       vignetteCurveH.addPoint(p);
@@ -667,7 +800,9 @@ class CameraIsp {
     for (auto p : vignetteRollOffV) {
       vignetteCurveV.addPoint(p);
     }
+  }
 
+  void setupColorCorrection() {
     // If saturation is unit this satMat will be the identity matrix.
     Mat satMat = Mat::zeros(3, 3, CV_32F);
     satMat.at<float>(0, 0) = 1.0f;
@@ -684,12 +819,96 @@ class CameraIsp {
     // scale the pixel by the lut size here once instead of doing it
     // for every pixel.
     compositeCCM *= float(kToneCurveLutSize - 1);
+  }
 
-    // Build the tone curve table
-    buildToneCurveLut();
+  // Restores the settings and derived tables saved by saveCompiledConfig.
+  // Only the bayer tables and vignetting curves, which are cheap and hold
+  // pointers, are rebuilt.
+  void loadCompiledConfig(const CompiledIspConfig& compiled) {
+    const CompiledIspConfigHeader& h = compiled.getHeader();
+    if (h.outputBpp != outputBpp) {
+      throw VrCamException(
+        "compiled ISP config is for " + to_string(h.outputBpp)
+        + " bpp output, expecting " + to_string(outputBpp));
+    }
+
+    bitsPerPixel = h.bitsPerPixel;
+    maxPixelValue = (1 << bitsPerPixel) - 1;
+    compandingLut = compiled.getCompandingLut();
+    blackLevel = Point3f(h.blackLevel[0], h.blackLevel[1], h.blackLevel[2]);
+    clampMin = Point3f(h.clampMin[0], h.clampMin[1], h.clampMin[2]);
+    clampMax = Point3f(h.clampMax[0], h.clampMax[1], h.clampMax[2]);
+    stuckPixelThreshold = h.stuckPixelThreshold;
+    stuckPixelDarknessThreshold = h.stuckPixelDarknessThreshold;
+    stuckPixelRadius = h.stuckPixelRadius;
+    vignetteRollOffH = compiled.getVignetteRollOffH();
+    vignetteRollOffV = compiled.getVignetteRollOffV();
+    whiteBalanceGain = Point3f(
+      h.whiteBalanceGain[0], h.whiteBalanceGain[1], h.whiteBalanceGain[2]);
+    ccm = Mat(3, 3, CV_32F, const_cast<float*>(h.ccm)).clone();
+    compositeCCM = Mat(3, 3, CV_32F, const_cast<float*>(h.compositeCCM)).clone();
+    saturation = h.saturation;
+    gamma = Point3f(h.gamma[0], h.gamma[1], h.gamma[2]);
+    lowKeyBoost = Point3f(h.lowKeyBoost[0], h.lowKeyBoost[1], h.lowKeyBoost[2]);
+    highKeyBoost = Point3f(h.highKeyBoost[0], h.highKeyBoost[1], h.highKeyBoost[2]);
+    contrast = h.contrast;
+    sharpening = Point3f(h.sharpening[0], h.sharpening[1], h.sharpening[2]);
+    sharpeningSupport = h.sharpeningSupport;
+    noiseCore = h.noiseCore;
+    bayerPattern = string(h.bayerPattern, strnlen(h.bayerPattern, sizeof(h.bayerPattern)));
+    disableToneCurve = h.disableToneCurve;
+    toneCurveLut = compiled.getToneCurveLut();
+
+    setupBayerPattern();
+    setupVignetteCurves();
+  }
+
+  // Writes the current settings and derived tables so that loading them
+  // skips the JSON parsing and table building. jsonInput is the config they
+  // came from, its hash is what CompiledIspConfig::matches checks. Returns
+  // false if the file couldn't be written.
+  bool saveCompiledConfig(const string& filename, const string& jsonInput) const {
+    CompiledIspConfigHeader h;
+    memset(&h, 0, sizeof(h));
+    h.jsonHash = CompiledIspConfig::hashJson(jsonInput);
+    h.outputBpp = outputBpp;
+    h.disableToneCurve = disableToneCurve;
+    h.bitsPerPixel = bitsPerPixel;
+    h.stuckPixelThreshold = stuckPixelThreshold;
+    h.stuckPixelDarknessThreshold = stuckPixelDarknessThreshold;
+    h.stuckPixelRadius = stuckPixelRadius;
+    copyPoint(blackLevel, h.blackLevel);
+    copyPoint(clampMin, h.clampMin);
+    copyPoint(clampMax, h.clampMax);
+    copyPoint(whiteBalanceGain, h.whiteBalanceGain);
+    for (int i = 0; i < 9; ++i) {
+      h.ccm[i] = ccm.at<float>(i / 3, i % 3);
+      h.compositeCCM[i] = compositeCCM.at<float>(i / 3, i % 3);
+    }
+    h.saturation = saturation;
+    copyPoint(gamma, h.gamma);
+    copyPoint(lowKeyBoost, h.lowKeyBoost);
+    copyPoint(highKeyBoost, h.highKeyBoost);
+    h.contrast = contrast;
+    copyPoint(sharpening, h.sharpening);
+    h.sharpeningSupport = sharpeningSupport;
+    h.noiseCore = noiseCore;
+    if (bayerPattern.size() >= sizeof(h.bayerPattern)) {
+      throw VrCamException("unexpected bayer pattern " + bayerPattern);
+    }
+    bayerPattern.copy(h.bayerPattern, bayerPattern.size());
+
+    return CompiledIspConfig::write(
+      filename, h, compandingLut, vignetteRollOffH, vignetteRollOffV, toneCurveLut);
   }
 
   // Helper functions
+  static void copyPoint(const Point3f& p, float* dst) {
+    dst[0] = p.x;
+    dst[1] = p.y;
+    dst[2] = p.z;
+  }
+
   inline bool redPixel(const int i, const int j) const {
     return redBayerPixel[i % 2][j % 2];
   }
@@ -702,10 +921,124 @@ class CameraIsp {
     return !(greenBayerPixel[i % 2][j % 2] || redBayerPixel[i % 2][j % 2]);
   }
 
-  inline int getChannelNumber(const int i, const int j) {
+  inline int getChannelNumber(const int i, const int j) const {
     return redPixel(i, j) ? 0 : greenPixel(i, j) ? 1 : 2;
   }
 
+  // Channels of the 2x2 bayer tile, as expected by IspStatistics
+  void getBayerChannels(int channels[2][2]) const {
+    for (int i = 0; i < 2; ++i) {
+      for (int j = 0; j < 2; ++j) {
+        channels[i][j] = getChannelNumber(i, j);
+      }
+    }
+  }
+
+  // The largest region around region within the image
+  inline Rect growRegion(const Rect& region, const int halo) const {
+    return Rect(
+      region.x - halo,
+      region.y - halo,
+      region.width + 2 * halo,
+      region.height + 2 * halo) & Rect(0, 0, width, height);
+  }
+
+  // Copies the raw pixels within the planes' extent to the plane of their
+  // color
+  void splitBayerPlanes(IspPlane& r, IspPlane& g, IspPlane& b) const {
+    const Rect extent = r.extent();
+    for (int i = extent.y; i < extent.y + extent.height; ++i) {
+      for (int j = extent.x; j < extent.x + extent.width; ++j) {
+        if (redPixel(i, j)) {
+          r(i, j) = rawImage.at<float>(i, j);
+        } else if (greenPixel(i, j)) {
+          g(i, j) = rawImage.at<float>(i, j);
+        } else {
+          b(i, j) = rawImage.at<float>(i, j);
+        }
+      }
+    }
+  }
+
+  // Color correction matrix followed by the tone curve
+  inline Vec3f colorCorrectPixel(const Vec3f& p) const {
+    const float kToneCurveLutRange = kToneCurveLutSize - 1;
+    return Vec3f(
+      toneCurveLut[
+          clamp(
+              compositeCCM.at<float>(0,0) * p[0] +
+              compositeCCM.at<float>(0,1) * p[1] +
+              compositeCCM.at<float>(0,2) * p[2], 0.0f, kToneCurveLutRange)][0],
+      toneCurveLut[
+          clamp(
+              compositeCCM.at<float>(1,0) * p[0] +
+              compositeCCM.at<float>(1,1) * p[1] +
+              compositeCCM.at<float>(1,2) * p[2], 0.0f, kToneCurveLutRange)][1],
+      toneCurveLut[
+          clamp(
+              compositeCCM.at<float>(2,0) * p[0] +
+              compositeCCM.at<float>(2,1) * p[1] +
+              compositeCCM.at<float>(2,2) * p[2], 0.0f, kToneCurveLutRange)][2]);
+  }
+
+  // 2D DCT as two passes of row transforms split across all cores, with a
+  // transpose after each pass.
+  static void dctParallel(Mat& plane, const int flags) {
+    Mat transposed;
+    for (int pass = 0; pass < 2; ++pass) {
+      const int rows = plane.rows;
+      const int blocks = (rows + kIspRowGrain - 1) / kIspRowGrain;
+      parallel_for_<int>(0, blocks, [&](int block) {
+        Mat band = plane.rowRange(
+          block * kIspRowGrain, std::min((block + 1) * kIspRowGrain, rows));
+        dct(band, band, flags | DCT_ROWS);
+      }, 1);
+      transpose(plane, transposed);
+      cv::swap(plane, transposed);
+    }
+  }
+
+  bool useDefectPixelMap(const int imageWidth, const int imageHeight) const {
+    if (defectPixelMap.empty()) {
+      return false;
+    }
+    if (defectPixelMap.width != imageWidth || defectPixelMap.height != imageHeight) {
+      throw VrCamException(
+        "defect pixel map of camera " + to_string(defectPixelMap.serial)
+        + " is " + to_string(defectPixelMap.width) + "x"
+        + to_string(defectPixelMap.height) + " but the image is "
+        + to_string(imageWidth) + "x" + to_string(imageHeight));
+    }
+    return true;
+  }
+
+  // Stuck pixel filter for a single pixel of row r1; r0 and r2 are the
+  // same color rows two above and below.
+  inline float stuckPixelMedian9(
+      const float* r0,
+      const float* r1,
+      const float* r2,
+      const int j) const {
+    const int j_2 = reflect(j - 2, width);
+    const int j2  = reflect(j + 2, width);
+    float p[9] = {
+      r0[j_2], r0[j], r0[j2],
+      r1[j_2], r1[j], r1[j2],
+      r2[j_2], r2[j], r2[j2]
+    };
+    const float center = r1[j];
+    float sum = 0.0f;
+    int brighter = 0;
+    for (int k = 0; k < 9; ++k) {
+      sum += p[k];
+      brighter += p[k] > center;
+    }
+    const bool stuck =
+      sum / 9.0f < stuckPixelDarknessThreshold && brighter < stuckPixelThreshold;
+    const float median = median9(p);
+    return stuck ? median : center;
+  }
+
   inline Vec3f curveHAtPixel(const int x) {
     return vignetteCurveH(float(x) / float(maxDimension));
   }
@@ -851,6 +1184,19 @@ class CameraIsp {
     } else {
       throw VrCamException("input is larger that 16 bits per pixel");
     }
+
+    if (collectStatistics) {
+      int channels[2][2];
+      getBayerChannels(channels);
+      const Mat input = inputImage.isContinuous() ? inputImage : inputImage.clone();
+      if (depth == CV_8U) {
+        statistics.computeRaw(
+          input.ptr<uint8_t>(0), input.cols, input.rows, 255, channels);
+      } else {
+        statistics.computeRaw(
+          input.ptr<uint16_t>(0), input.cols, input.rows, 65535, channels);
+      }
+    }
   }
 
   int getBitsPerPixel() const {
@@ -975,6 +1321,51 @@ class CameraIsp {
     }
   }
 
+  // When enabled the black level, vignetting, white balance and
+  // clamp stages run as a single row parallel pass over the raw image.
+  void setFuseRawStages(const bool fuseRawStages) {
+    this->fuseRawStages = fuseRawStages;
+  }
+
+  bool getFuseRawStages() const {
+    return fuseRawStages;
+  }
+
+  // When enabled demosaicing, color correction and sharpening run tiled
+  // and in parallel over all cores.
+  void setTiledRgbStages(const bool tiledRgbStages) {
+    this->tiledRgbStages = tiledRgbStages;
+  }
+
+  bool getTiledRgbStages() const {
+    return tiledRgbStages;
+  }
+
+  // With a defect pixel map only the listed pixels are corrected and the
+  // statistical stuck pixel detection is skipped.
+  void setDefectPixelMap(const DefectPixelMap& defectPixelMap) {
+    this->defectPixelMap = defectPixelMap;
+  }
+
+  const DefectPixelMap& getDefectPixelMap() const {
+    return defectPixelMap;
+  }
+
+  // When enabled the statistics of the raw input, before binning, and of
+  // the output are computed for every image processed.
+  void setCollectStatistics(const bool collectStatistics) {
+    this->collectStatistics = collectStatistics;
+    statistics.clear();
+  }
+
+  bool getCollectStatistics() const {
+    return collectStatistics;
+  }
+
+  const IspStatistics& getStatistics() const {
+    return statistics;
+  }
+
   void setResize(const int resize) {
     if (resize == 1 ||
         resize == 2 ||
@@ -1021,7 +1412,90 @@ class CameraIsp {
   }
 
 
+  // Replaces each pixel of the defect map with the median of its 3x3 same
+  // color lattice. Defects are visited in raster order and corrected in
+  // place, so a cluster is filled from its already corrected neighbors.
+  template <typename T>
+  void correctDefectPixels(T* image, const int imageWidth, const int imageHeight) const {
+    for (const Point& p : defectPixelMap.defects) {
+      const T* r0 = image + reflect(p.y - 2, imageHeight) * imageWidth;
+      const T* r1 = image + p.y * imageWidth;
+      const T* r2 = image + reflect(p.y + 2, imageHeight) * imageWidth;
+      const int j_2 = reflect(p.x - 2, imageWidth);
+      const int j2  = reflect(p.x + 2, imageWidth);
+      T v[9] = {
+        r0[j_2], r0[p.x], r0[j2],
+        r1[j_2], r1[p.x], r1[j2],
+        r2[j_2], r2[p.x], r2[j2]
+      };
+      image[p.y * imageWidth + p.x] = median9(v);
+    }
+  }
+
+  // Replaces pixels in dark regions that are among the stuckPixelThreshold
+  // brightest of their same color neighborhood with the neighborhood median.
+  // A radius of 2, the same color pixels 2 apart that make up the 3x3
+  // lattice around a pixel (stuckPixelRadius 1 in the config), uses a
+  // branch free median network, larger radii fall back to sorting each
+  // neighborhood.
+  // A defect pixel map replaces the detection with its fixed list.
   void removeStuckPixels() {
+    if (useDefectPixelMap(width, height)) {
+      correctDefectPixels(rawImage.ptr<float>(0), width, height);
+    } else if (stuckPixelRadius == 2) {
+      removeStuckPixelsMedian9();
+    } else if (stuckPixelRadius > 0) {
+      removeStuckPixelsSorted();
+    }
+  }
+
+  void removeStuckPixelsMedian9() {
+    // Read from a copy so rows can be filtered independently
+    const Mat src = rawImage.clone();
+    parallel_for_<int>(0, height, [&](int i) {
+      const float* r0 = src.ptr<float>(reflect(i - 2, height));
+      const float* r1 = src.ptr<float>(i);
+      const float* r2 = src.ptr<float>(reflect(i + 2, height));
+      float* dst = rawImage.ptr<float>(i);
+      int j = 0;
+      for (; j < min(2, width); ++j) {
+        dst[j] = stuckPixelMedian9(r0, r1, r2, j);
+      }
+#ifdef __SSE2__
+      const __m128 nine = _mm_set1_ps(9.0f);
+      const __m128 darkness = _mm_set1_ps(stuckPixelDarknessThreshold);
+      const __m128i threshold = _mm_set1_epi32(stuckPixelThreshold);
+      for (; j + 6 <= width; j += 4) {
+        __m128 p[9] = {
+          _mm_loadu_ps(r0 + j - 2), _mm_loadu_ps(r0 + j), _mm_loadu_ps(r0 + j + 2),
+          _mm_loadu_ps(r1 + j - 2), _mm_loadu_ps(r1 + j), _mm_loadu_ps(r1 + j + 2),
+          _mm_loadu_ps(r2 + j - 2), _mm_loadu_ps(r2 + j), _mm_loadu_ps(r2 + j + 2)
+        };
+        const __m128 center = p[4];
+        __m128 sum = _mm_setzero_ps();
+        __m128i brighter = _mm_setzero_si128();
+        for (int k = 0; k < 9; ++k) {
+          sum = _mm_add_ps(sum, p[k]);
+          // Compare masks are -1 so subtracting counts the brighter pixels
+          brighter = _mm_sub_epi32(
+            brighter, _mm_castps_si128(_mm_cmpgt_ps(p[k], center)));
+        }
+        const __m128 stuck = _mm_and_ps(
+          _mm_cmplt_ps(_mm_div_ps(sum, nine), darkness),
+          _mm_castsi128_ps(_mm_cmplt_epi32(brighter, threshold)));
+        const __m128 median = median9(p);
+        _mm_storeu_ps(
+          dst + j,
+          _mm_or_ps(_mm_and_ps(stuck, median), _mm_andnot_ps(stuck, center)));
+      }
+#endif
+      for (; j < width; ++j) {
+        dst[j] = stuckPixelMedian9(r0, r1, r2, j);
+      }
+    }, kIspRowGrain);
+  }
+
+  void removeStuckPixelsSorted() {
     if (stuckPixelRadius > 0) {
       struct Pval {
         float val;
@@ -1087,8 +1561,8 @@ class CameraIsp {
             sort(region.begin(), region.end());
 
             // See if the middle pixel is above the stack at pixel threshold and an outlier
-            for (int k = region.size() - 1;
-                 k <= region.size() - stuckPixelThreshold;
+            for (int k = int(region.size()) - 1;
+                 k >= max(0, int(region.size()) - stuckPixelThreshold);
                  k--) {
               if (region[k].i == i && region[k].j == j) {
                 rawImage.at<float>(i, j) = region[region.size()/2].val;
@@ -1153,24 +1627,111 @@ class CameraIsp {
     }
   }
 
+  // Fused equivalent of blackLevelAdjust(), antiVignette(),
+  // whiteBalance() and clampAndStretch(). The result is bit identical to
+  // running the four stages in sequence, but each raw row is loaded and
+  // stored once while it is hot in L1, and strips of rows are processed
+  // in parallel.
+  void rawStagesFused() {
+    // Per channel constants indexed by getChannelNumber()
+    const float bl[3] = {
+      blackLevel.x / float(maxPixelValue),
+      blackLevel.y / float(maxPixelValue),
+      blackLevel.z / float(maxPixelValue)
+    };
+    const float bs[3] = {
+      1.0f / (1.0f - bl[0]),
+      1.0f / (1.0f - bl[1]),
+      1.0f / (1.0f - bl[2])
+    };
+    const float wb[3] = { whiteBalanceGain.x, whiteBalanceGain.y, whiteBalanceGain.z };
+    const float cMin[3] = { clampMin.x, clampMin.y, clampMin.z };
+    const float cMax[3] = { clampMax.x, clampMax.y, clampMax.z };
+    const float cRange[3] = {
+      clampMax.x - clampMin.x,
+      clampMax.y - clampMin.y,
+      clampMax.z - clampMin.z
+    };
+
+    // The horizontal vignetting curve only depends on the column and
+    // the row parity so it is tabulated once per image.
+    vector<float> vignetteH[2];
+    for (int p = 0; p < 2; ++p) {
+      vignetteH[p].resize(width);
+      for (int j = 0; j < width; ++j) {
+        vignetteH[p][j] = curveHAtPixel(j)[getChannelNumber(p, j)];
+      }
+    }
+
+    parallel_for_<int>(0, height, [&](int i) {
+      const Vec3f vV = curveVAtPixel(i);
+      const int ch0 = getChannelNumber(i, 0);
+      const int ch1 = getChannelNumber(i, 1);
+      const float* vH = vignetteH[i % 2].data();
+      float* row = rawImage.ptr<float>(i);
+
+      int j = 0;
+#ifdef __SSE2__
+      // Lanes alternate between the two bayer channels of this row
+      const __m128 zero = _mm_setzero_ps();
+      const __m128 one = _mm_set1_ps(1.0f);
+      const __m128 bl4 = _mm_setr_ps(bl[ch0], bl[ch1], bl[ch0], bl[ch1]);
+      const __m128 bs4 = _mm_setr_ps(bs[ch0], bs[ch1], bs[ch0], bs[ch1]);
+      const __m128 vV4 = _mm_setr_ps(vV[ch0], vV[ch1], vV[ch0], vV[ch1]);
+      const __m128 wb4 = _mm_setr_ps(wb[ch0], wb[ch1], wb[ch0], wb[ch1]);
+      const __m128 cMin4 = _mm_setr_ps(cMin[ch0], cMin[ch1], cMin[ch0], cMin[ch1]);
+      const __m128 cMax4 = _mm_setr_ps(cMax[ch0], cMax[ch1], cMax[ch0], cMax[ch1]);
+      const __m128 cRange4 = _mm_setr_ps(cRange[ch0], cRange[ch1], cRange[ch0], cRange[ch1]);
+
+      for (; j + 4 <= width; j += 4) {
+        __m128 v = _mm_loadu_ps(row + j);
+
+        // Black level only applies to unsaturated pixels
+        const __m128 unsaturated = _mm_cmplt_ps(v, one);
+        const __m128 adjusted = _mm_mul_ps(_mm_sub_ps(v, bl4), bs4);
+        v = _mm_or_ps(
+          _mm_and_ps(unsaturated, adjusted),
+          _mm_andnot_ps(unsaturated, v));
+
+        v = _mm_mul_ps(v, _mm_mul_ps(_mm_loadu_ps(vH + j), vV4));
+
+        // The pixel is the second operand of min/max so that ties
+        // resolve exactly like clamp()
+        v = _mm_mul_ps(v, wb4);
+        v = _mm_min_ps(one, _mm_max_ps(zero, v));
+
+        v = _mm_min_ps(cMax4, _mm_max_ps(cMin4, v));
+        v = _mm_div_ps(_mm_sub_ps(v, cMin4), cRange4);
+
+        _mm_storeu_ps(row + j, v);
+      }
+#endif
+      for (; j < width; ++j) {
+        const int ch = (j % 2) == 0 ? ch0 : ch1;
+        float v = row[j];
+        if (v < 1.0f) {
+          v = (v - bl[ch]) * bs[ch];
+        }
+        v *= vH[j] * vV[ch];
+        v = clamp(v * wb[ch], 0.0f, 1.0f);
+        v = clamp(v, cMin[ch], cMax[ch]);
+        row[j] = (v - cMin[ch]) / cRange[ch];
+      }
+    }, kIspRowGrain);
+  }
+
   void demosaic() {
-    Mat r(height, width, CV_32F);
-    Mat g(height, width, CV_32F);
-    Mat b(height, width, CV_32F);
+    const Rect image(0, 0, width, height);
+    IspPlane rPlane(image);
+    IspPlane gPlane(image);
+    IspPlane bPlane(image);
 
     // Break out each plane into a separate image so we can demosaicFilter
     // them seperately and then recombine them.
-    for (int i = 0; i < height; ++i) {
-      for (int j = 0; j < width; j++) {
-        if (redPixel(i, j)) {
-          r.at<float>(i, j) = rawImage.at<float>(i, j);
-        } else if (greenPixel(i, j)) {
-          g.at<float>(i, j) = rawImage.at<float>(i, j);
-        } else {
-          b.at<float>(i,j) = rawImage.at<float>(i, j);
-        }
-      }
-    }
+    splitBayerPlanes(rPlane, gPlane, bPlane);
+    Mat& r = rPlane.mat;
+    Mat& g = gPlane.mat;
+    Mat& b = bPlane.mat;
 
     if (demosaicFilter == FREQUENCY_DM_FILTER) {
       // Move into the frequency domain
@@ -1196,9 +1757,9 @@ class CameraIsp {
       t6.join();
 #endif
     } else if (demosaicFilter == BILINEAR_DM_FILTER) {
-      demosaicBilinearFilter(r, g, b);
+      demosaicBilinearFilter(rPlane, gPlane, bPlane, image);
     } else {
-      demosaicEdgeAware(r, g, b);
+      demosaicEdgeAware(rPlane, gPlane, bPlane, image);
    }
 
     demosaicedImage = Mat::zeros(height, width, CV_32FC3);
@@ -1212,29 +1773,13 @@ class CameraIsp {
   }
 
   void colorCorrect() {
-    const float kToneCurveLutRange = kToneCurveLutSize - 1;
     for (int i = 0; i < height; ++i) {
       for (int j = 0; j < width; j++) {
         Vec3f p =  demosaicedImage.at<Vec3f>(i, j);
 #ifdef DEBUG_DCT
         Vec3f v(logf(square(p[0]) + 1.0f) * 255.0f, logf(square(p[1]) + 1.0f) * 255.0f, logf(square(p[2]) + 1.0f) * 255.0f);
 #else
-        Vec3f v(
-          toneCurveLut[
-              clamp(
-                  compositeCCM.at<float>(0,0) * p[0] +
-                  compositeCCM.at<float>(0,1) * p[1] +
-                  compositeCCM.at<float>(0,2) * p[2], 0.0f, kToneCurveLutRange)][0],
-          toneCurveLut[
-              clamp(
-                  compositeCCM.at<float>(1,0) * p[0] +
-                  compositeCCM.at<float>(1,1) * p[1] +
-                  compositeCCM.at<float>(1,2) * p[2], 0.0f, kToneCurveLutRange)][1],
-          toneCurveLut[
-              clamp(
-                  compositeCCM.at<float>(2,0) * p[0] +
-                  compositeCCM.at<float>(2,1) * p[1] +
-                  compositeCCM.at<float>(2,2) * p[2], 0.0f, kToneCurveLutRange)][2]);
+        Vec3f v = colorCorrectPixel(p);
 #endif
         demosaicedImage.at<Vec3f>(i, j) = v;
       }
@@ -1257,18 +1802,135 @@ class CameraIsp {
     }
   }
 
+  // Same result as sharpen() with the IIR passes split across blocks of
+  // rows and then blocks of columns.
+  void sharpenParallel() {
+    if (sharpening.x != 0.0 && sharpening.y != 0.0 && sharpening.z != 0.0) {
+      Mat lowPass(height, width, CV_32FC3);
+      const ReflectBoundary<int> reflectB;
+      const float maxVal = (1 << outputBpp) - 1.0f;
+      const float alpha = powf(sharpeningSupport, 1.0f/4.0f);
+
+      const int rowBlocks = (height + kIspRowGrain - 1) / kIspRowGrain;
+      parallel_for_<int>(0, rowBlocks, [&](int block) {
+        Mat buffer(width, 1, CV_32FC3);
+        const int iEnd = std::min((block + 1) * kIspRowGrain, height);
+        for (int i = block * kIspRowGrain; i < iEnd; ++i) {
+          iirLowPassRow<ReflectBoundary<int>, Vec3f>(
+            demosaicedImage, alpha, lowPass, i, reflectB, maxVal, buffer);
+        }
+      }, 1);
+
+      const int columnBlocks = (width + kIirColumnBlock - 1) / kIirColumnBlock;
+      parallel_for_<int>(0, columnBlocks, [&](int block) {
+        Mat buffer(height, kIirColumnBlock, CV_32FC3);
+        const int j0 = block * kIirColumnBlock;
+        iirLowPassColumns<ReflectBoundary<int>, Vec3f>(
+          lowPass, alpha, j0, std::min(j0 + kIirColumnBlock, width),
+          reflectB, maxVal, buffer);
+      }, 1);
+
+      parallel_for_<int>(0, height, [&](int i) {
+        Vec3f* p = demosaicedImage.ptr<Vec3f>(i);
+        const Vec3f* lp = lowPass.ptr<Vec3f>(i);
+        for (int j = 0; j < width; ++j) {
+          sharpenPixelWithIirLowPass<Vec3f>(
+            p[j],
+            lp[j],
+            1.0f + sharpening.x,
+            1.0f + sharpening.y,
+            1.0f + sharpening.z,
+            noiseCore,
+            maxVal);
+        }
+      }, kIspRowGrain);
+    }
+  }
+
+  // demosaic(), colorCorrect() and sharpen() using all cores. The bilinear
+  // and edge aware filters demosaic one tile at a time from the raw image
+  // plus a halo, and color correct it while it is still in cache. Their
+  // output is identical to the full frame stages. The frequency filter is
+  // global so it runs full frame with row parallel DCTs, which can round
+  // differently from the full frame DCT.
+  void rgbStagesTiled() {
+    const Rect image(0, 0, width, height);
+    demosaicedImage = Mat(height, width, CV_32FC3);
+
+    if (demosaicFilter == FREQUENCY_DM_FILTER) {
+      IspPlane r(image);
+      IspPlane g(image);
+      IspPlane b(image);
+      splitBayerPlanes(r, g, b);
+      dctParallel(r.mat, 0);
+      dctParallel(g.mat, 0);
+      dctParallel(b.mat, 0);
+      demosaicFrequencyFilter(r.mat, g.mat, b.mat);
+      dctParallel(r.mat, DCT_INVERSE);
+      dctParallel(g.mat, DCT_INVERSE);
+      dctParallel(b.mat, DCT_INVERSE);
+
+      parallel_for_<int>(0, height, [&](int i) {
+        Vec3f* dst = demosaicedImage.ptr<Vec3f>(i);
+        for (int j = 0; j < width; ++j) {
+          dst[j] = colorCorrectPixel(Vec3f(r(i, j), g(i, j), b(i, j)));
+        }
+      }, kIspRowGrain);
+    } else {
+      const bool bilinear = demosaicFilter == BILINEAR_DM_FILTER;
+      const int halo = bilinear ? kBilinearDemosaicHalo : kEdgeAwareDemosaicHalo;
+      const int tilesX = (width + kIspTileWidth - 1) / kIspTileWidth;
+      const int tilesY = (height + kIspTileHeight - 1) / kIspTileHeight;
+
+      parallel_for_<int>(0, tilesX * tilesY, [&](int t) {
+        const Rect tile = Rect(
+          (t % tilesX) * kIspTileWidth,
+          (t / tilesX) * kIspTileHeight,
+          kIspTileWidth,
+          kIspTileHeight) & image;
+        const Rect extent = growRegion(tile, halo);
+        IspPlane r(extent);
+        IspPlane g(extent);
+        IspPlane b(extent);
+        splitBayerPlanes(r, g, b);
+        if (bilinear) {
+          demosaicBilinearFilter(r, g, b, tile);
+        } else {
+          demosaicEdgeAware(r, g, b, tile);
+        }
+
+        for (int i = tile.y; i < tile.y + tile.height; ++i) {
+          Vec3f* dst = demosaicedImage.ptr<Vec3f>(i);
+          for (int j = tile.x; j < tile.x + tile.width; ++j) {
+            dst[j] = colorCorrectPixel(Vec3f(r(i, j), g(i, j), b(i, j)));
+          }
+        }
+      }, 1);
+    }
+
+    sharpenParallel();
+  }
+
  protected:
   // Replacable pipeline
   virtual void executePipeline(const bool swizzle) {
     // Apply the pipeline
-    blackLevelAdjust();
-    antiVignette();
-    whiteBalance();
-    clampAndStretch();
+    if (fuseRawStages) {
+      rawStagesFused();
+    } else {
+      blackLevelAdjust();
+      antiVignette();
+      whiteBalance();
+      clampAndStretch();
+    }
     removeStuckPixels();
-    demosaic();
-    colorCorrect();
-    sharpen();
+    if (tiledRgbStages) {
+      rgbStagesTiled();
+    } else {
+      demosaic();
+      colorCorrect();
+      sharpen();
+    }
   }
 
  public:
@@ -1295,6 +1957,16 @@ class CameraIsp {
         }
       }
     }
+
+    if (collectStatistics) {
+      if (outputBpp == 8) {
+        statistics.computeOutput(
+          outputImage.ptr<uint8_t>(0), width, height, 255, swizzle);
+      } else {
+        statistics.computeOutput(
+          outputImage.ptr<uint16_t>(0), width, height, 65535, swizzle);
+      }
+    }
   }
 };
 
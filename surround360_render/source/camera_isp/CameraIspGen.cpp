@@ -12,6 +12,8 @@
 #include <gflags/gflags.h>
 
 DEFINE_int32(output_bpp, 8,  "output image bits per pixel, either 8 or 16");
+DEFINE_bool(packed_input, false, "take 12 bit pixel pairs packed into 3 bytes as input instead of 16 bit pixels");
+DEFINE_string(target_variant, "", "CPU specific variant to generate, avx2 or avx512, empty for the generic pipeline");
 
 using namespace std;
 using namespace Halide;
@@ -69,6 +71,21 @@ class CameraIspGen
   }
 
 
+  // Bins the raw image down by binning in both directions while keeping
+  // the bayer pattern, so the rest of the pipeline runs at the output
+  // resolution. Each output pixel is the mean of binning x binning input
+  // pixels of the same color, as in CameraIsp::resizeInput.
+  Func bin(Func raw, Expr binning) {
+    RDom r(0, binning, 0, binning);
+    Expr binned2x2 = binning > 1;
+    Expr xp = x * binning + 2 * r.x + select(binned2x2, x % 2, 0);
+    Expr yp = y * binning + 2 * r.y + select(binned2x2, y % 2, 0);
+
+    Func binned("binned");
+    binned(x, y) = sum(cast<float>(raw(xp, yp))) / cast<float>(binning * binning);
+    return binned;
+  }
+
   Func deinterleave(Func raw, Expr bayerPattern) {
     // Deinterleave the color channels
     Func deinterleaved("deinterleaved");
@@ -557,6 +574,7 @@ class CameraIspGen
       Func raw,
       Param<int> width,
       Param<int> height,
+      Param<int> binning,
       Func vignetteTableH,
       Func vignetteTableV,
       Param<float> blackLevelR,
@@ -587,14 +605,20 @@ class CameraIspGen
     Expr sG = 1.0f + cast<float>(sharpenningG);
     Expr sB = 1.0f + cast<float>(sharpenningB);
 
-    // This is the ISP pipeline
+    // This is the ISP pipeline. width and height are the output size, the
+    // raw input is binning times larger.
     Func vignettingGain("vignettingGain");
+    Func binned("binned");
+    Func unbinned("unbinned");
     Func deinterleaved("deinterleaved");
     Func demosaiced("demosaiced");
     Func colorCorrected("ccm");
     Func sharpened("sharpened");
 
-    deinterleaved   = deinterleave(raw, bayerPattern);
+    binned          = bin(raw, binning);
+    // At full resolution there is nothing to bin
+    unbinned(x, y)  = select(binning == 1, cast<float>(raw(x, y)), binned(x, y));
+    deinterleaved   = deinterleave(unbinned, bayerPattern);
     demosaiced      = demosaic(
       deinterleaved,
       vignetteTableH, vignetteTableV,
@@ -617,12 +641,21 @@ class CameraIspGen
     const int kStripSize = 32;
     const int kVec = target.natural_vector_size(Int(16));
 
+    binned
+      .compute_at(toneCorrected, yi)
+      .store_at(toneCorrected, yo)
+      .vectorize(x, 2 * kVec, TailStrategy::RoundUp);
+
+    // Full resolution output reads the raw pixels directly: the select in
+    // unbinned folds away in the specialized copy, which then needs none
+    // of binned, so binned is only computed when binning > 1
     deinterleaved
       .compute_at(toneCorrected, yi)
       .store_at(toneCorrected, yo)
       .vectorize(x, 2 * kVec, TailStrategy::RoundUp)
       .reorder(c, x, y)
-      .unroll(c);
+      .unroll(c)
+      .specialize(binning == 1);
 
     toneCorrected
       .compute_root()
@@ -648,9 +681,10 @@ class CameraIspGen
 int main(int argc, char **argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
-  ImageParam input(UInt(16), 2);
+  ImageParam input(FLAGS_packed_input ? UInt(8) : UInt(16), 2);
   Param<int> width;
   Param<int> height;
+  Param<int> binning("binning");
   ImageParam vignetteTableH(Float(32), 2, "vignetteH");
   ImageParam vignetteTableV(Float(32), 2, "vignetteV");
   Param<float> blackLevelR("blackLevelR");
@@ -675,15 +709,47 @@ int main(int argc, char **argv) {
   Param<bool> BGR;
   Param<int> bayerPattern("bayerPattern");
 
-  // Pick a target architecture
+  // Pick a target architecture. A variant adds its CPU features to it and
+  // is suffixed with its name. It leaves the Halide runtime to the generic
+  // pipeline, so the runtime every variant links against runs on any CPU.
   Target target = get_target_from_environment();
+  string suffix;
+  if (!FLAGS_target_variant.empty()) {
+    string features;
+    if (FLAGS_target_variant == "avx2") {
+      features = "-sse41-avx-avx2-fma-f16c";
+    } else if (FLAGS_target_variant == "avx512") {
+      features = "-sse41-avx-avx2-fma-f16c-avx512-avx512_skylake";
+    } else {
+      std::cerr << "Unknown target variant " << FLAGS_target_variant << std::endl;
+      return EXIT_FAILURE;
+    }
+    target = Target(target.to_string() + features + "-no_runtime");
+    suffix = "_" + FLAGS_target_variant;
+  }
 
   // Build variants of the pipeline
   CameraIspGen<false> cameraIspGen;
   CameraIspGen<true> cameraIspGenFast;
 
   Func rawM("rawm");
-  rawM = BoundaryConditions::mirror_interior(input);
+  if (FLAGS_packed_input) {
+    // Unpack as Raw12Converter does. This is inlined into the binning stage
+    // so it runs per strip instead of as a separate full frame pass.
+    Var x("x"), y("y");
+    Expr pair = x / 2 * 3;
+    Expr b0 = cast<uint16_t>(input(pair, y));
+    Expr b1 = cast<uint16_t>(input(pair + 1, y));
+    Expr b2 = cast<uint16_t>(input(pair + 2, y));
+    Expr p = select(x % 2 == 0, b0 * 16 + b1 % 16, b2 * 16 + b1 / 16);
+
+    Func unpacked("unpacked");
+    unpacked(x, y) = p * 16 + p / 256;
+    rawM = BoundaryConditions::mirror_interior(
+      unpacked, {{0, input.width() / 3 * 2}, {0, input.height()}});
+  } else {
+    rawM = BoundaryConditions::mirror_interior(input);
+  }
 
   Func vignetteTableHM("vhm");
   vignetteTableHM = BoundaryConditions::mirror_image(vignetteTableH);
@@ -692,7 +758,7 @@ int main(int argc, char **argv) {
   vignetteTableVM = BoundaryConditions::mirror_image(vignetteTableV);
 
   Func cameraIsp = cameraIspGen.generate(
-      target, rawM, width, height, vignetteTableHM, vignetteTableVM,
+      target, rawM, width, height, binning, vignetteTableHM, vignetteTableVM,
       blackLevelR, blackLevelG, blackLevelB,
       whiteBalanceGainR, whiteBalanceGainG, whiteBalanceGainB,
       clampMinR, clampMinG, clampMinB, clampMaxR, clampMaxG, clampMaxB,
@@ -701,7 +767,7 @@ int main(int argc, char **argv) {
 
   Func cameraIspFast =
     cameraIspGenFast.generate(
-        target, rawM, width, height, vignetteTableHM, vignetteTableVM,
+        target, rawM, width, height, binning, vignetteTableHM, vignetteTableVM,
         blackLevelR, blackLevelG, blackLevelB,
         whiteBalanceGainR, whiteBalanceGainG, whiteBalanceGainB,
         clampMinR, clampMinG, clampMinB, clampMaxR, clampMaxG, clampMaxB,
@@ -709,7 +775,7 @@ int main(int argc, char **argv) {
         ccm, toneTable, BGR, bayerPattern, FLAGS_output_bpp);
 
   std::vector<Argument> args = {
-    input, width, height, vignetteTableH, vignetteTableV,
+    input, width, height, binning, vignetteTableH, vignetteTableV,
     blackLevelR, blackLevelG, blackLevelB,
     whiteBalanceGainR, whiteBalanceGainG, whiteBalanceGainB,
     clampMinR, clampMinG, clampMinB, clampMaxR, clampMaxG, clampMaxB,
@@ -717,13 +783,14 @@ int main(int argc, char **argv) {
 
   // Compile the pipelines
   // Use to cameraIsp.print_loop_nest() here to debug loop unrolling
-  std::cout << "Halide: " << "Generating " << FLAGS_output_bpp << " bit isp" << std::endl;
-  string cigName = "CameraIspGen" + to_string(FLAGS_output_bpp);
+  std::cout << "Halide: " << "Generating " << FLAGS_output_bpp << " bit isp for " << target.to_string() << std::endl;
+  const string layout = FLAGS_packed_input ? "Packed" : "";
+  string cigName = "CameraIspGen" + layout + to_string(FLAGS_output_bpp) + suffix;
   cameraIsp.compile_to_static_library(cigName, args, cigName, target);
   cameraIsp.compile_to_assembly(cigName + ".s", args, target);
 
   std::cout << "Halide: " << "Generating " << FLAGS_output_bpp << " bit fastest isp" << std::endl;
-  cigName = "CameraIspGenFast" + to_string(FLAGS_output_bpp);
+  cigName = "CameraIspGenFast" + layout + to_string(FLAGS_output_bpp) + suffix;
   cameraIspFast.compile_to_static_library(cigName, args,  cigName, target);
   cameraIspFast.compile_to_assembly(cigName + ".s", args, target);
 
@@ -14,8 +14,35 @@
 #include "CameraIspGenFast8.h"
 #include "CameraIspGen16.h"
 #include "CameraIspGenFast16.h"
+#include "CameraIspGenPacked8.h"
+#include "CameraIspGenFastPacked8.h"
+#include "CameraIspGenPacked16.h"
+#include "CameraIspGenFastPacked16.h"
+#include "CpuFeatures.h"
 #include "Halide.h"
 
+// CPU specific variants of the pipelines, see CAMERA_ISP_VARIANTS
+#ifdef CAMERA_ISP_AVX2
+#include "CameraIspGen8_avx2.h"
+#include "CameraIspGenFast8_avx2.h"
+#include "CameraIspGen16_avx2.h"
+#include "CameraIspGenFast16_avx2.h"
+#include "CameraIspGenPacked8_avx2.h"
+#include "CameraIspGenFastPacked8_avx2.h"
+#include "CameraIspGenPacked16_avx2.h"
+#include "CameraIspGenFastPacked16_avx2.h"
+#endif
+#ifdef CAMERA_ISP_AVX512
+#include "CameraIspGen8_avx512.h"
+#include "CameraIspGenFast8_avx512.h"
+#include "CameraIspGen16_avx512.h"
+#include "CameraIspGenFast16_avx512.h"
+#include "CameraIspGenPacked8_avx512.h"
+#include "CameraIspGenFastPacked8_avx512.h"
+#include "CameraIspGenPacked16_avx512.h"
+#include "CameraIspGenFastPacked16_avx512.h"
+#endif
+
 namespace surround360 {
 
 using namespace std;
@@ -28,6 +55,7 @@ using namespace Halide;
 class CameraIspPipe : public CameraIsp {
  protected:
   Mat inputImage;
+  Mat correctedInput; // the input with its defect pixels corrected
   buffer_t inputBufferBp;
   buffer_t outputBufferBp;
 
@@ -43,12 +71,80 @@ class CameraIspPipe : public CameraIsp {
 
   const bool fast;
 
+  // All variants are generated from the same pipeline and share a signature
+  using IspPipeline = decltype(&CameraIspGen8);
+  IspPipeline pipeline;
+  IspPipeline packedPipeline;
+  string pipelineTarget;
+
+  // True if the loaded image is 12 bit packed rather than 16 bit
+  bool packedInput;
+
+  IspPipeline pickPipeline(
+      IspPipeline gen8,
+      IspPipeline fast8,
+      IspPipeline gen16,
+      IspPipeline fast16) const {
+    return outputBpp == 8 ? (fast ? fast8 : gen8) : (fast ? fast16 : gen16);
+  }
+
+  // Picks the variant for the widest vectors this CPU supports, falling
+  // back to the generic pipeline
+  void selectPipeline() {
+    pipelineTarget = "generic";
+    pipeline = pickPipeline(
+      CameraIspGen8, CameraIspGenFast8, CameraIspGen16, CameraIspGenFast16);
+    packedPipeline = pickPipeline(
+      CameraIspGenPacked8, CameraIspGenFastPacked8,
+      CameraIspGenPacked16, CameraIspGenFastPacked16);
+#ifdef CAMERA_ISP_AVX2
+    if (CpuFeatures::get().avx2) {
+      pipelineTarget = "avx2";
+      pipeline = pickPipeline(
+        CameraIspGen8_avx2, CameraIspGenFast8_avx2,
+        CameraIspGen16_avx2, CameraIspGenFast16_avx2);
+      packedPipeline = pickPipeline(
+        CameraIspGenPacked8_avx2, CameraIspGenFastPacked8_avx2,
+        CameraIspGenPacked16_avx2, CameraIspGenFastPacked16_avx2);
+    }
+#endif
+#ifdef CAMERA_ISP_AVX512
+    if (CpuFeatures::get().avx512) {
+      pipelineTarget = "avx512";
+      pipeline = pickPipeline(
+        CameraIspGen8_avx512, CameraIspGenFast8_avx512,
+        CameraIspGen16_avx512, CameraIspGenFast16_avx512);
+      packedPipeline = pickPipeline(
+        CameraIspGenPacked8_avx512, CameraIspGenFastPacked8_avx512,
+        CameraIspGenPacked16_avx512, CameraIspGenFastPacked16_avx512);
+    }
+#endif
+    VLOG(1) << "Using the " << pipelineTarget << " Halide ISP pipeline";
+  }
+
  public:
   CameraIspPipe(string jsonInput,
       const bool fast = false,
       const int outputBpp = 8) :
       CameraIsp(jsonInput, outputBpp),
-      fast(fast) {
+      fast(fast),
+      packedInput(false) {
+    memset(&inputBufferBp, 0, sizeof(buffer_t));
+    memset(&outputBufferBp, 0, sizeof(buffer_t));
+    memset(&ccMatBp, 0, sizeof(buffer_t));
+    memset(&toneTableBp, 0, sizeof(buffer_t));
+    memset(&vignetteTableHBp, 0, sizeof(buffer_t));
+    memset(&vignetteTableVBp, 0, sizeof(buffer_t));
+
+    selectPipeline();
+    initPipe();
+  }
+
+  // Constructs from a config compiled by CameraIsp::saveCompiledConfig
+  CameraIspPipe(const CompiledIspConfig& compiled, const bool fast = false) :
+      CameraIsp(compiled),
+      fast(fast),
+      packedInput(false) {
     memset(&inputBufferBp, 0, sizeof(buffer_t));
     memset(&outputBufferBp, 0, sizeof(buffer_t));
     memset(&ccMatBp, 0, sizeof(buffer_t));
@@ -56,6 +152,7 @@ class CameraIspPipe : public CameraIsp {
     memset(&vignetteTableHBp, 0, sizeof(buffer_t));
     memset(&vignetteTableVBp, 0, sizeof(buffer_t));
 
+    selectPipeline();
     initPipe();
   }
 
@@ -129,7 +226,27 @@ class CameraIspPipe : public CameraIsp {
     vignetteTableVBp.elem_size = sizeof(float);
   }
 
+  // A defect pixel map, if set, is applied to a copy of the 16 bit input
+  // before the Halide pipeline runs, so at the resolution before binning.
+  // The loaded image is left as it was. Packed input can't be corrected
+  // and must be unpacked first.
   void runPipe(const bool swizzle) {
+    const int inputWidth = packedInput
+      ? inputBufferBp.extent[0] / 3 * 2
+      : inputBufferBp.extent[0];
+    const int inputHeight = inputBufferBp.extent[1];
+    buffer_t correctedBufferBp = inputBufferBp;
+    if (useDefectPixelMap(inputWidth, inputHeight)) {
+      if (packedInput) {
+        throw VrCamException(
+          "defect pixel map of camera " + to_string(defectPixelMap.serial)
+          + " needs unpacked input");
+      }
+      Mat(inputHeight, inputWidth, CV_16U, inputBufferBp.host).copyTo(correctedInput);
+      correctDefectPixels(correctedInput.ptr<uint16_t>(0), inputWidth, inputHeight);
+      correctedBufferBp.host = correctedInput.data;
+    }
+
     // Call apropos the Halide generated ISP pipeline
     int pattern = 0;
     if (bayerPattern.find("GBRG") != std::string::npos) {
@@ -139,43 +256,14 @@ class CameraIspPipe : public CameraIsp {
     } else {
     }
 
-    if (outputBpp == 8) {
-      if (fast) {
-        CameraIspGenFast8(
-            &inputBufferBp, width, height, &vignetteTableHBp, &vignetteTableVBp,
-            blackLevel.x, blackLevel.y, blackLevel.z, whiteBalanceGain.x, whiteBalanceGain.y, whiteBalanceGain.z,
-            clampMin.x, clampMin.y, clampMin.z, clampMax.x, clampMax.y, clampMax.z,
-            sharpening.x, sharpening.y, sharpening.z, sharpeningSupport, noiseCore,
-            &ccMatBp, &toneTableBp, swizzle, pattern, &outputBufferBp);
-      } else {
-        CameraIspGen8(
-            &inputBufferBp, width, height, &vignetteTableHBp, &vignetteTableVBp,
-            blackLevel.x, blackLevel.y, blackLevel.z, whiteBalanceGain.x, whiteBalanceGain.y, whiteBalanceGain.z,
-            clampMin.x, clampMin.y, clampMin.z, clampMax.x, clampMax.y, clampMax.z,
-            sharpening.x, sharpening.y, sharpening.z,  sharpeningSupport, noiseCore,
-            &ccMatBp, &toneTableBp, swizzle, pattern, &outputBufferBp);
-      }
-    } else {
-      if (fast) {
-        CameraIspGenFast16(
-            &inputBufferBp, width, height, &vignetteTableHBp, &vignetteTableVBp,
-            blackLevel.x, blackLevel.y, blackLevel.z, whiteBalanceGain.x, whiteBalanceGain.y, whiteBalanceGain.z,
-            clampMin.x, clampMin.y, clampMin.z, clampMax.x, clampMax.y, clampMax.z,
-            sharpening.x, sharpening.y, sharpening.z,  sharpeningSupport, noiseCore,
-            &ccMatBp, &toneTableBp, swizzle, pattern, &outputBufferBp);
-      } else {
-        CameraIspGen16(
-            &inputBufferBp, width, height, &vignetteTableHBp, &vignetteTableVBp,
-            blackLevel.x, blackLevel.y, blackLevel.z, whiteBalanceGain.x, whiteBalanceGain.y, whiteBalanceGain.z,
-            clampMin.x, clampMin.y, clampMin.z, clampMax.x, clampMax.y, clampMax.z,
-            sharpening.x, sharpening.y, sharpening.z,  sharpeningSupport, noiseCore,
-            &ccMatBp, &toneTableBp, swizzle, pattern, &outputBufferBp);
-      }
-    }
+    (packedInput ? packedPipeline : pipeline)(
+        &correctedBufferBp, width, height, resize, &vignetteTableHBp, &vignetteTableVBp,
+        blackLevel.x, blackLevel.y, blackLevel.z, whiteBalanceGain.x, whiteBalanceGain.y, whiteBalanceGain.z,
+        clampMin.x, clampMin.y, clampMin.z, clampMax.x, clampMax.y, clampMax.z,
+        sharpening.x, sharpening.y, sharpening.z, sharpeningSupport, noiseCore,
+        &ccMatBp, &toneTableBp, swizzle, pattern, &outputBufferBp);
   }
 
-  // Used for streaming of in place updates of input and output images
-  // as in live-preview.
   void runPipe(void* inputImageData, void* outputImageData, const bool swizzle) {
     inputBufferBp.host = reinterpret_cast<uint8_t*>(inputImageData);
     outputBufferBp.host = reinterpret_cast<uint8_t*>(outputImageData);
@@ -188,18 +276,38 @@ class CameraIspPipe : public CameraIsp {
     loadImage(inputImage.data, inputImage.cols, inputImage.rows);
   }
 
+  // The output is the input binned down by the resize factor, which has to
+  // be set before the image is loaded and the pipe initialized
   void loadImage(uint8_t* inputImageData, const int xRes, const int yRes) {
-    *const_cast<int*>(&width) = xRes;
-    *const_cast<int*>(&height) = yRes;
+    *const_cast<int*>(&width) = xRes / resize;
+    *const_cast<int*>(&height) = yRes / resize;
     *const_cast<int*>(&maxDimension) = std::max(width, height);
     *const_cast<float*>(&maxD) = square(width) + square(width);
     *const_cast<float*>(&sqrtMaxD) = sqrt(maxD);
     inputBufferBp.host = inputImageData;
-    inputBufferBp.extent[0] = width;
-    inputBufferBp.extent[1] = height;
+    inputBufferBp.extent[0] = xRes;
+    inputBufferBp.extent[1] = yRes;
     inputBufferBp.stride[0] = 1;
-    inputBufferBp.stride[1] = width;
+    inputBufferBp.stride[1] = xRes;
     inputBufferBp.elem_size = 2;
+    packedInput = false;
+  }
+
+  // Loads 12 bit pixel pairs packed into 3 bytes, as stored in the .bin
+  // files, which the pipeline unpacks itself. The width has to be even.
+  void loadPackedImage(const void* inputImageData, const int xRes, const int yRes) {
+    if (xRes % 2 != 0) {
+      throw VrCamException(
+        "packed input needs an even width, got " + to_string(xRes));
+    }
+    loadImage(nullptr, xRes, yRes);
+    const int rowBytes = xRes / 2 * 3;
+    inputBufferBp.host =
+      reinterpret_cast<uint8_t*>(const_cast<void*>(inputImageData));
+    inputBufferBp.extent[0] = rowBytes;
+    inputBufferBp.stride[1] = rowBytes;
+    inputBufferBp.elem_size = 1;
+    packedInput = true;
   }
 
   // Called at least one to setup the output image size and process
@@ -216,10 +324,44 @@ class CameraIspPipe : public CameraIsp {
 
     // Pull the first image through the pipe
     runPipe(swizzle);
+
+    if (collectStatistics) {
+      computeStatistics(swizzle);
+    }
+  }
+
+  // The Halide pipeline has a single output, so the statistics are a row
+  // parallel pass over its input and output buffers while they are still
+  // resident
+  void computeStatistics(const bool swizzle) {
+    int channels[2][2];
+    getBayerChannels(channels);
+    const int inputHeight = inputBufferBp.extent[1];
+    if (packedInput) {
+      statistics.computeRawPacked(
+        inputBufferBp.host, inputBufferBp.extent[0] / 3 * 2, inputHeight, channels);
+    } else {
+      statistics.computeRaw(
+        reinterpret_cast<const uint16_t*>(inputBufferBp.host),
+        inputBufferBp.extent[0], inputHeight, 65535, channels);
+    }
+    if (outputBpp == 8) {
+      statistics.computeOutput(
+        outputBufferBp.host, width, height, 255, swizzle);
+    } else {
+      statistics.computeOutput(
+        reinterpret_cast<const uint16_t*>(outputBufferBp.host),
+        width, height, 65535, swizzle);
+    }
   }
 
   void getImage(Mat& outputImage, const bool swizzle = true) {
     getImage(outputImage.data, swizzle);
   }
+
+  // Name of the CPU variant the pipeline runs, "generic" if none applies
+  const string& getPipelineTarget() const {
+    return pipelineTarget;
+  }
 };
 }
@@ -0,0 +1,95 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "CameraIspPipe.h"
+
+namespace surround360 {
+
+using namespace std;
+
+// Initialized Halide ISP pipelines, kept so that the config parsing and
+// table building of a pipeline happen once per camera instead of once per
+// frame. Pipelines are keyed by camera serial, output bits per pixel and
+// the image size the tables were built for. An acquired pipeline belongs
+// to the caller until it is released; only its input and output buffers
+// should be rebound in between.
+class CameraIspPipePool {
+ public:
+  // Builds a fully set up pipeline for a key that has no idle one
+  using Factory = function<unique_ptr<CameraIspPipe>()>;
+
+  CameraIspPipePool() :
+      constructedCount(0),
+      reusedCount(0) {
+  }
+
+  unique_ptr<CameraIspPipe> acquire(
+      const uint32_t serial,
+      const int outputBpp,
+      const int width,
+      const int height,
+      const Factory& create) {
+
+    const Key key(serial, outputBpp, width, height);
+    {
+      lock_guard<mutex> lock(poolMutex);
+      vector<unique_ptr<CameraIspPipe>>& idle = pool[key];
+      if (!idle.empty()) {
+        unique_ptr<CameraIspPipe> isp = move(idle.back());
+        idle.pop_back();
+        ++reusedCount;
+        return isp;
+      }
+    }
+
+    // Construct outside the lock, it is the expensive part
+    ++constructedCount;
+    return create();
+  }
+
+  void release(
+      const uint32_t serial,
+      const int outputBpp,
+      const int width,
+      const int height,
+      unique_ptr<CameraIspPipe> isp) {
+
+    const Key key(serial, outputBpp, width, height);
+    lock_guard<mutex> lock(poolMutex);
+    pool[key].push_back(move(isp));
+  }
+
+  size_t getConstructedCount() const {
+    return constructedCount;
+  }
+
+  size_t getReusedCount() const {
+    return reusedCount;
+  }
+
+ private:
+  using Key = tuple<uint32_t, int, int, int>;
+
+  mutex poolMutex;
+  map<Key, vector<unique_ptr<CameraIspPipe>>> pool;
+  atomic<size_t> constructedCount;
+  atomic<size_t> reusedCount;
+};
+
+} // namespace surround360
@@ -0,0 +1,226 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+}
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "CvUtil.h"
+#include "VrCamException.h"
+
+namespace surround360 {
+
+using namespace std;
+using namespace cv;
+
+const uint32_t kCompiledIspConfigMagic = 0x43505349; // "ISPC"
+const uint32_t kCompiledIspConfigVersion = 1;
+
+// Everything CameraIsp derives from its JSON config. The header is followed
+// by the companding lut, the horizontal and vertical vignetting roll off
+// points and the tone curve lut, each as float triples.
+struct CompiledIspConfigHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t jsonHash;
+  int32_t outputBpp;
+  int32_t disableToneCurve;
+  int32_t bitsPerPixel;
+  int32_t stuckPixelThreshold;
+  float stuckPixelDarknessThreshold;
+  int32_t stuckPixelRadius;
+  float blackLevel[3];
+  float clampMin[3];
+  float clampMax[3];
+  float whiteBalanceGain[3];
+  float ccm[9];
+  float compositeCCM[9];
+  float saturation;
+  float gamma[3];
+  float lowKeyBoost[3];
+  float highKeyBoost[3];
+  float contrast;
+  float sharpening[3];
+  float sharpeningSupport;
+  float noiseCore;
+  char bayerPattern[8];
+  uint32_t compandingLutSize;
+  uint32_t vignetteRollOffHSize;
+  uint32_t vignetteRollOffVSize;
+  uint32_t toneCurveLutSize;
+};
+
+// A compiled ISP config file mapped read only. Missing, truncated or
+// outdated files are not errors, they just aren't valid, so callers can
+// fall back to the JSON config and rewrite the file.
+class CompiledIspConfig {
+ public:
+  CompiledIspConfig(const string& filename) :
+      baseAddress(MAP_FAILED),
+      mappingSize(0) {
+
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return;
+    }
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) == 0 &&
+        size_t(fileInfo.st_size) >= sizeof(CompiledIspConfigHeader)) {
+      mappingSize = fileInfo.st_size;
+      baseAddress = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+  }
+
+  ~CompiledIspConfig() {
+    if (baseAddress != MAP_FAILED) {
+      munmap(baseAddress, mappingSize);
+    }
+  }
+
+  CompiledIspConfig(const CompiledIspConfig&) = delete;
+  CompiledIspConfig& operator=(const CompiledIspConfig&) = delete;
+
+  bool isValid() const {
+    if (baseAddress == MAP_FAILED) {
+      return false;
+    }
+    const CompiledIspConfigHeader& h = getHeader();
+    const size_t points =
+      size_t(h.compandingLutSize) + h.vignetteRollOffHSize +
+      h.vignetteRollOffVSize + h.toneCurveLutSize;
+    return
+      h.magic == kCompiledIspConfigMagic &&
+      h.version == kCompiledIspConfigVersion &&
+      mappingSize == sizeof(CompiledIspConfigHeader) + points * sizeof(Point3f);
+  }
+
+  // True if this was compiled from jsonInput for the given output
+  bool matches(
+      const string& jsonInput,
+      const int outputBpp,
+      const bool disableToneCurve) const {
+    return
+      isValid() &&
+      getHeader().jsonHash == hashJson(jsonInput) &&
+      getHeader().outputBpp == outputBpp &&
+      bool(getHeader().disableToneCurve) == disableToneCurve;
+  }
+
+  const CompiledIspConfigHeader& getHeader() const {
+    return *reinterpret_cast<const CompiledIspConfigHeader*>(baseAddress);
+  }
+
+  vector<Point3f> getCompandingLut() const {
+    return getPoints<Point3f>(0, getHeader().compandingLutSize);
+  }
+
+  vector<Point3f> getVignetteRollOffH() const {
+    return getPoints<Point3f>(
+      getHeader().compandingLutSize,
+      getHeader().vignetteRollOffHSize);
+  }
+
+  vector<Point3f> getVignetteRollOffV() const {
+    return getPoints<Point3f>(
+      getHeader().compandingLutSize + getHeader().vignetteRollOffHSize,
+      getHeader().vignetteRollOffVSize);
+  }
+
+  vector<Vec3f> getToneCurveLut() const {
+    return getPoints<Vec3f>(
+      getHeader().compandingLutSize + getHeader().vignetteRollOffHSize +
+      getHeader().vignetteRollOffVSize,
+      getHeader().toneCurveLutSize);
+  }
+
+  // 64 bit FNV-1a of the JSON text
+  static uint64_t hashJson(const string& jsonInput) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char c : jsonInput) {
+      hash = (hash ^ uint8_t(c)) * 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  // Fills in the magic, version and table sizes of header and writes it
+  // and the tables with a single write. The file is written under a
+  // temporary name of its own and renamed so readers never map a partial
+  // file and writers of the same config don't trip over each other.
+  // Returns false if it couldn't be written.
+  static bool write(
+      const string& filename,
+      CompiledIspConfigHeader header,
+      const vector<Point3f>& compandingLut,
+      const vector<Point3f>& vignetteRollOffH,
+      const vector<Point3f>& vignetteRollOffV,
+      const vector<Vec3f>& toneCurveLut) {
+
+    header.magic = kCompiledIspConfigMagic;
+    header.version = kCompiledIspConfigVersion;
+    header.compandingLutSize = compandingLut.size();
+    header.vignetteRollOffHSize = vignetteRollOffH.size();
+    header.vignetteRollOffVSize = vignetteRollOffV.size();
+    header.toneCurveLutSize = toneCurveLut.size();
+
+    vector<uint8_t> buffer(sizeof(header));
+    memcpy(buffer.data(), &header, sizeof(header));
+    appendPoints(buffer, compandingLut);
+    appendPoints(buffer, vignetteRollOffH);
+    appendPoints(buffer, vignetteRollOffV);
+    appendPoints(buffer, toneCurveLut);
+
+    string tempFilename = filename + ".XXXXXX";
+    const int fd = mkstemp(&tempFilename[0]);
+    if (fd < 0) {
+      return false;
+    }
+    const bool written = fchmod(fd, 0644) == 0 &&
+      ::write(fd, buffer.data(), buffer.size()) == ssize_t(buffer.size());
+    if (close(fd) != 0 || !written ||
+        rename(tempFilename.c_str(), filename.c_str()) != 0) {
+      remove(tempFilename.c_str());
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  void* baseAddress;
+  size_t mappingSize;
+
+  template <typename P>
+  vector<P> getPoints(const size_t first, const size_t count) const {
+    const P* points = reinterpret_cast<const P*>(
+      reinterpret_cast<const uint8_t*>(baseAddress) +
+      sizeof(CompiledIspConfigHeader)) + first;
+    return vector<P>(points, points + count);
+  }
+
+  template <typename P>
+  static void appendPoints(vector<uint8_t>& buffer, const vector<P>& points) {
+    static_assert(sizeof(P) == 3 * sizeof(float), "expecting float triples");
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(points.data());
+    buffer.insert(buffer.end(), data, data + points.size() * sizeof(P));
+  }
+};
+
+} // namespace surround360
@@ -0,0 +1,110 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "CvUtil.h"
+#include "JsonUtil.h"
+#include "VrCamException.h"
+
+namespace surround360 {
+
+using namespace std;
+using namespace cv;
+
+// Stuck and hot pixels of a single sensor, as found by FindDefectPixels
+// over many frames. The defects are sorted in raster order so correcting
+// them in place is deterministic.
+struct DefectPixelMap {
+  int serial;
+  int width;
+  int height;
+  int frameCount;
+  vector<Point> defects;
+
+  DefectPixelMap() :
+      serial(0),
+      width(0),
+      height(0),
+      frameCount(0) {
+  }
+
+  bool empty() const {
+    return defects.empty();
+  }
+
+  static DefectPixelMap load(const string& filename) {
+    ifstream ifs(filename, ios::in);
+    if (!ifs) {
+      throw VrCamException("failed to open defect pixel map " + filename);
+    }
+    const string jsonInput(
+      (istreambuf_iterator<char>(ifs)),
+      (istreambuf_iterator<char>()));
+    const json::Object config = json::Deserialize(jsonInput);
+
+    DefectPixelMap map;
+    map.serial = getInteger(config, "DefectPixelMap", "serial");
+    map.width = getInteger(config, "DefectPixelMap", "width");
+    map.height = getInteger(config, "DefectPixelMap", "height");
+    map.frameCount = getInteger(config, "DefectPixelMap", "frameCount");
+
+    const json::Array defects = getArray(config, "DefectPixelMap", "defects");
+    for (int i = 0; i < defects.size(); ++i) {
+      const json::Array p = defects[i].ToArray();
+      if (p.size() != 2) {
+        throw VrCamException(
+          "JSON error. Expecting defect pixels as [x, y] in " + filename);
+      }
+      const Point defect(p[0].ToInt(), p[1].ToInt());
+      if (defect.x < 0 || defect.x >= map.width ||
+          defect.y < 0 || defect.y >= map.height) {
+        throw VrCamException(
+          "defect pixel outside of the " + to_string(map.width) + "x"
+          + to_string(map.height) + " sensor in " + filename);
+      }
+      map.defects.push_back(defect);
+    }
+    // Whatever order the file lists them in
+    sort(map.defects.begin(), map.defects.end(), [](const Point& a, const Point& b) {
+      return a.y < b.y || (a.y == b.y && a.x < b.x);
+    });
+    return map;
+  }
+
+  void save(const string& filename) const {
+    ofstream ofs(filename, ios::out);
+    if (!ofs) {
+      throw VrCamException("failed to write defect pixel map " + filename);
+    }
+    ofs << "{\n";
+    ofs << "   \"DefectPixelMap\" : {\n";
+    ofs << "        \"serial\" : " << serial << ",\n";
+    ofs << "        \"width\" : " << width << ",\n";
+    ofs << "        \"height\" : " << height << ",\n";
+    ofs << "        \"frameCount\" : " << frameCount << ",\n";
+    ofs << "        \"defects\" : [";
+    for (int i = 0; i < defects.size(); ++i) {
+      ofs << (i % 8 == 0 ? "\n            " : " ")
+          << "[" << defects[i].x << ", " << defects[i].y << "]"
+          << (i < defects.size() - 1 ? "," : "");
+    }
+    ofs << "]\n";
+    ofs << "   }\n";
+    ofs << "}\n";
+  }
+};
+
+} // namespace surround360
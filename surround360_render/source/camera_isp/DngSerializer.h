@@ -0,0 +1,298 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "CameraIsp.h"
+#include "CvUtil.h"
+#include "DngTags.h"
+#include "VrCamException.h"
+
+namespace surround360 {
+
+using namespace std;
+using namespace cv;
+
+// Assembles a whole DNG of a 16 bit bayer image in one buffer, so it can
+// be written with a single call. Tag values that don't fit in their IFD
+// entry follow the IFD in tag order, then the image data.
+class DngSerializer {
+ public:
+  // Serializes rawImage with the bayer pattern, black level, white balance
+  // and color matrix of cameraIsp
+  static vector<uint8_t> serialize(const CameraIsp& cameraIsp, const Mat& rawImage) {
+    if (rawImage.type() != CV_16UC1) {
+      throw VrCamException("DNG output expects a 16 bit single channel raw image");
+    }
+    const uint32_t width = rawImage.cols;
+    const uint32_t height = rawImage.rows;
+
+    // TIFF data layout calculations (64k strip for 16bit data)
+    const uint32_t rowsPerStrip = std::max(1u, (32 * 1024) / width);
+    const uint32_t stripsPerImg = (height + rowsPerStrip - 1) / rowsPerStrip;
+
+    const string cameraManufacturer("Facebook");
+    const string cameraModel("Surround 360");
+    const string cameraSoftware("Raw2Rgb");
+
+    // Map Surround's ISP cfa pattern code to DNG's
+    uint32_t cfaFilter;
+    switch (cameraIsp.getFilters()) {
+      case 0x94949494:
+        cfaFilter = 0x02010100;
+        break;
+      case 0x16161616:
+        cfaFilter = 0x00010102;
+        break;
+      case 0x49494949:
+        cfaFilter = 0x01000201;
+        break;
+      case 0x61616161:
+        cfaFilter = 0x01020001;
+        break;
+      default:
+        throw VrCamException("unknown bayer pattern found while writing DNG file");
+    }
+
+    const uint16_t kIfdCount = 42;
+    const uint32_t kIfdEntrySize = sizeof(uint16_t) * 2 + sizeof(uint32_t) * 2;
+    const uint32_t kHeaderSize = 8;
+    const uint32_t dataStart =
+      kHeaderSize + sizeof(uint16_t) + kIfdCount * kIfdEntrySize + sizeof(uint32_t);
+
+    vector<uint8_t> ifd;
+    ifd.reserve(dataStart);
+    vector<uint8_t> data;
+    data.reserve(4096);
+    uint32_t dOffset = dataStart;
+
+    auto inlineEntry = [&](
+        const uint16_t tag,
+        const uint16_t type,
+        const uint32_t count,
+        const uint32_t value) {
+      append(ifd, &tag, 1);
+      append(ifd, &type, 1);
+      append(ifd, &count, 1);
+      append(ifd, &value, 1);
+    };
+    // Values of up to 4 bytes are stored in the entry itself, larger ones
+    // in the data area
+    auto dataEntry = [&](
+        const uint16_t tag,
+        const uint16_t type,
+        const uint32_t count,
+        const void* values,
+        const uint32_t size) {
+      if (size <= sizeof(uint32_t)) {
+        uint32_t value = 0;
+        memcpy(&value, values, size);
+        inlineEntry(tag, type, count, value);
+      } else {
+        inlineEntry(tag, type, count, dOffset);
+        append(data, reinterpret_cast<const uint8_t*>(values), size);
+        dOffset += size;
+      }
+    };
+    auto stringEntry = [&](const uint16_t tag, const string& s) {
+      dataEntry(tag, kTiffTypeASCII, s.size() + 1, s.c_str(), s.size() + 1);
+    };
+
+    // Image data follows all of the tag data
+    const uint32_t kStripOffsetsSize = stripsPerImg * sizeof(uint32_t);
+    const uint32_t kStripByteCountsSize = stripsPerImg * sizeof(uint32_t);
+    vector<uint32_t> stripOff(stripsPerImg);
+    vector<uint32_t> stripCnt(stripsPerImg);
+    for (uint32_t s = 0; s < stripsPerImg; ++s) {
+      const uint32_t rows = std::min(rowsPerStrip, height - s * rowsPerStrip);
+      stripOff[s] = s * rowsPerStrip * width * sizeof(uint16_t);
+      stripCnt[s] = rows * width * sizeof(uint16_t);
+    }
+
+    char szDateTime[20];
+    const time_t time = 0; // Need to get this from the camera meta data.
+    struct tm tlocal;
+    localtime_r(&time, &tlocal);
+    snprintf(
+      szDateTime,
+      sizeof(szDateTime),
+      "%04d-%02d-%02d %02d:%02d:%02d",
+      tlocal.tm_year + 1900,
+      tlocal.tm_mon,
+      tlocal.tm_mday,
+      tlocal.tm_hour,
+      tlocal.tm_min,
+      tlocal.tm_sec);
+    szDateTime[19] = '\0';
+
+    // Conversion to XYZ - Bradford adapted using D50 reference white point
+    Mat sRgbToXyzD50 = (Mat_<float>(3, 3) <<
+      0.4360747, 0.3850649, 0.1430804,
+      0.2225045, 0.7168786, 0.0606169,
+      0.0139322, 0.0971045, 0.7141733);
+    const Mat camToXyz = cameraIsp.getCCM() * sRgbToXyzD50;
+    Mat xyzToCam;
+    invert(camToXyz, xyzToCam);
+
+    uint16_t uBlackLevel[4]; // {G, R, B, G}
+    const Point3f bl = cameraIsp.getBlackLevel();
+    uBlackLevel[0] = bl.y;
+    uBlackLevel[3] = bl.y;
+    uBlackLevel[1] = bl.x;
+    uBlackLevel[2] = bl.z;
+
+    const uint32_t defaultScale[4] = { 1, 1, 1, 1 };
+
+    int32_t colorMatrix[18];
+    for (int i = 0; i < 9; i++) {
+      colorMatrix[2 * i] = xyzToCam.at<float>(i / 3, i % 3) * (1 << 28);
+      colorMatrix[2 * i + 1] = (1 << 28);
+    }
+
+    const uint32_t analogBalance[6] = { 256, 256, 256, 256, 256, 256 };
+
+    const Point3f whitePoint = cameraIsp.getWhiteBalanceGain();
+    const float minChannel = std::min(std::min(whitePoint.x, whitePoint.y), whitePoint.z);
+    const uint32_t asShotNeutral[6] = {
+      uint32_t((minChannel / whitePoint.x) * float(1 << 28)), 1 << 28,
+      uint32_t((minChannel / whitePoint.y) * float(1 << 28)), 1 << 28,
+      uint32_t((minChannel / whitePoint.z) * float(1 << 28)), 1 << 28
+    };
+
+    const int32_t baseExposure[2] = {
+      int32_t(-log2f(1.0f / minChannel) * (1 << 28)), (1 << 28)
+    };
+    const uint32_t baseSharp[2] = { 1, 1 };
+    const uint32_t linearLimit[2] = { 1, 1 }; // 1.0 = sensor is linear
+    const uint32_t lensInfo[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    const uint32_t antiAlias[2] = { 0, 1 }; // Turn off antiAliasStrength
+    const uint32_t bestScale[2] = { 1, 1 }; // use 1:1 scaling
+    const uint16_t bitsPerPixel = cameraIsp.getBitsPerPixel();
+
+    // Strip offsets are patched in once the size of the tag data is known
+    const size_t kStripOffsetsEntry = 8;
+    size_t stripOffsetsPosition;
+
+    inlineEntry(kTiffTagNewSubFileType,             kTiffTypeLONG,      1, 0);
+    inlineEntry(kTiffTagImageWidth,                 kTiffTypeLONG,      1, width);
+    inlineEntry(kTiffTagImageLength,                kTiffTypeLONG,      1, height);
+    inlineEntry(kTiffTagBitsPerSample,              kTiffTypeSHORT,     1, bitsPerPixel);
+    inlineEntry(kTiffTagCompression,                kTiffTypeSHORT,     1, 1);
+    inlineEntry(kTiffTagPhotometricInterpretation,  kTiffTypeSHORT,     1, 32803);
+    stringEntry(kTiffTagMake,                       cameraManufacturer);
+    stringEntry(kTiffTagModel,                      cameraModel);
+    stripOffsetsPosition = data.size();
+    dataEntry(kTiffTagStripOffsets,                 kTiffTypeLONG,      stripsPerImg, stripOff.data(), kStripOffsetsSize);
+    inlineEntry(kTiffTagOrientation,                kTiffTypeSHORT,     1, 1);
+    inlineEntry(kTiffTagSamplesPerPixel,            kTiffTypeSHORT,     1, 1);
+    inlineEntry(kTiffTagRowsPerStrip,               kTiffTypeSHORT,     1, rowsPerStrip);
+    dataEntry(kTiffTagStripByteCounts,              kTiffTypeLONG,      stripsPerImg, stripCnt.data(), kStripByteCountsSize);
+    inlineEntry(kTiffTagPlanarConfiguration,        kTiffTypeSHORT,     1, 1);
+    inlineEntry(kTiffTagResolutionUnit,             kTiffTypeSHORT,     1, 2);
+    stringEntry(kTiffTagSoftware,                   cameraSoftware);
+    dataEntry(kTiffTagDateTime,                     kTiffTypeASCII,     20, szDateTime, 20);
+    inlineEntry(kTiffEpTagCFARepeatPatternDim,      kTiffTypeSHORT,     2, 0x00020002);
+    inlineEntry(kTiffEpTagCFAPattern,               kTiffTypeBYTE,      4, cfaFilter);
+    inlineEntry(kDngTagDNGVersion,                  kTiffTypeBYTE,      4, 0x00000301);
+    inlineEntry(kDngTagDNGBackwardVersion,          kTiffTypeBYTE,      4, 0x00000101);
+    stringEntry(kDngTagUniqueCameraModel,           cameraModel);
+    stringEntry(kDngTagLocalizedCameraModel,        cameraModel);
+    inlineEntry(kDngTagCFAPlaneColor,               kTiffTypeBYTE,      3, 0x00020100);
+    inlineEntry(kDngTagCFALayout,                   kTiffTypeSHORT,     1, 1);
+    inlineEntry(kDngTagBlackLevelRepeatDim,         kTiffTypeSHORT,     2, 0x00020002);
+    dataEntry(kDngTagBlackLevel,                    kTiffTypeSHORT,     4, uBlackLevel, sizeof(uBlackLevel));
+    inlineEntry(kDngTagWhiteLevel,                  kTiffTypeLONG,      1, (1 << bitsPerPixel) - 1);
+    dataEntry(kDngTagDefaultScale,                  kTiffTypeRATIONAL,  2, defaultScale, sizeof(defaultScale));
+    inlineEntry(kDngTagDefaultCropOrigin,           kTiffTypeSHORT,     2, 0);
+    inlineEntry(kDngTagDefaultCropSize,             kTiffTypeSHORT,     2, (height << 16) | width);
+    dataEntry(kDngTagColorMatrix1,                  kTiffTypeSRATIONAL, 9, colorMatrix, sizeof(colorMatrix));
+    dataEntry(kDngTagAnalogBalance,                 kTiffTypeRATIONAL,  3, analogBalance, sizeof(analogBalance));
+    dataEntry(kDngTagAsShotNeutral,                 kTiffTypeRATIONAL,  3, asShotNeutral, sizeof(asShotNeutral));
+    dataEntry(kDngTagBaselineExposure,              kTiffTypeSRATIONAL, 1, baseExposure, sizeof(baseExposure));
+    dataEntry(kDngTagBaselineSharpness,             kTiffTypeRATIONAL,  1, baseSharp, sizeof(baseSharp));
+    inlineEntry(kDngTagBayerGreenSplit,             kTiffTypeLONG,      1, 0);
+    dataEntry(kDngTagLinearResponseLimit,           kTiffTypeRATIONAL,  1, linearLimit, sizeof(linearLimit));
+    dataEntry(kDngTagLensInfo,                      kTiffTypeRATIONAL,  4, lensInfo, sizeof(lensInfo));
+    dataEntry(kDngTagAntiAliasStrength,             kTiffTypeRATIONAL,  1, antiAlias, sizeof(antiAlias));
+    inlineEntry(kDngTagCalibrationIlluminant1,      kTiffTypeSHORT,     1, 23);
+    dataEntry(kDngTagBestQualityScale,              kTiffTypeRATIONAL,  1, bestScale, sizeof(bestScale));
+
+    if (ifd.size() != kIfdCount * kIfdEntrySize) {
+      throw VrCamException("DNG IFD entry count mismatch");
+    }
+
+    // A single strip offset is stored in the entry itself
+    const uint32_t imageOffset = dOffset;
+    if (stripsPerImg == 1) {
+      memcpy(
+        &ifd[kStripOffsetsEntry * kIfdEntrySize + 8],
+        &imageOffset,
+        sizeof(imageOffset));
+    } else {
+      uint32_t* offsets = reinterpret_cast<uint32_t*>(&data[stripOffsetsPosition]);
+      for (uint32_t s = 0; s < stripsPerImg; ++s) {
+        offsets[s] = stripOff[s] + imageOffset;
+      }
+    }
+
+    // TIFF header, IFD, tag data and image data in one buffer
+    const size_t imageBytes = size_t(width) * height * sizeof(uint16_t);
+    vector<uint8_t> buffer;
+    buffer.reserve(imageOffset + imageBytes);
+    const char byteOrder[2] = { 'I', 'I' };
+    const uint16_t version = 42;
+    const uint32_t ifd0Offset = kHeaderSize;
+    const uint32_t nextIfdOffset = 0;
+    append(buffer, reinterpret_cast<const uint8_t*>(byteOrder), 2);
+    append(buffer, &version, 1);
+    append(buffer, &ifd0Offset, 1);
+    append(buffer, &kIfdCount, 1);
+    append(buffer, ifd.data(), ifd.size());
+    append(buffer, &nextIfdOffset, 1);
+    append(buffer, data.data(), data.size());
+    for (uint32_t i = 0; i < height; ++i) {
+      append(buffer, rawImage.ptr<uint16_t>(i), width);
+    }
+    return buffer;
+  }
+
+  // Writes the serialized DNG with a single call
+  static void write(
+      const CameraIsp& cameraIsp,
+      const string& filename,
+      const Mat& rawImage) {
+
+    const vector<uint8_t> buffer = serialize(cameraIsp, rawImage);
+    FILE* fDng = fopen(filename.c_str(), "wb");
+    if (fDng == nullptr) {
+      throw VrCamException("failed to open DNG file " + filename);
+    }
+    const size_t written = fwrite(buffer.data(), 1, buffer.size(), fDng);
+    fclose(fDng);
+    if (written != buffer.size()) {
+      throw VrCamException("DNG write error: " + filename);
+    }
+  }
+
+ private:
+  template <typename T>
+  static void append(vector<uint8_t>& buffer, const T* values, const size_t count) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values);
+    buffer.insert(buffer.end(), bytes, bytes + count * sizeof(T));
+  }
+};
+
+} // namespace surround360
@@ -0,0 +1,186 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+// Finds the stuck and hot pixels of every camera in a set of .bin files and
+// writes one DefectPixelMap per camera serial to <output_dir>/<serial>.json.
+// A pixel is a defect when it differs from the median of its same color
+// neighborhood by more than defect_threshold in at least min_defect_fraction
+// of the frames.
+
+#include <cmath>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "BinaryFootageFile.hpp"
+#include "CameraIsp.h"
+#include "DefectPixelMap.h"
+#include "MikeUtil.h"
+#include "Raw12Converter.hpp"
+#include "SystemUtil.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace cv;
+using namespace std;
+using namespace surround360;
+using namespace surround360::math_util;
+using namespace surround360::util;
+
+DEFINE_string(bin_list,             "",     "comma-separated list of .bin files");
+DEFINE_string(output_dir,           "",     "output directory for the defect pixel maps");
+DEFINE_int32(start_frame,           0,      "start frame (per camera)");
+DEFINE_int32(frame_count,           100,    "number of frames to accumulate (per camera), 0 for all");
+DEFINE_double(defect_threshold,     0.2,    "difference from the neighborhood median, as a fraction of full scale, that makes a pixel an outlier");
+DEFINE_double(min_defect_fraction,  0.9,    "fraction of frames a pixel must be an outlier in to be listed as a defect");
+
+// Per pixel count of the frames in which the pixel was an outlier
+struct DefectStatistics {
+  int width;
+  int height;
+  int frameCount;
+  vector<uint32_t> outlierCount;
+
+  DefectStatistics(const int width, const int height) :
+      width(width),
+      height(height),
+      frameCount(0),
+      outlierCount(width * height, 0) {
+  }
+
+  void accumulate(const uint16_t* image, const int threshold) {
+    parallel_for_<int>(0, height, [&](int i) {
+      const uint16_t* r0 = image + reflect(i - 2, height) * width;
+      const uint16_t* r1 = image + i * width;
+      const uint16_t* r2 = image + reflect(i + 2, height) * width;
+      uint32_t* count = outlierCount.data() + i * width;
+      for (int j = 0; j < width; ++j) {
+        const int j_2 = reflect(j - 2, width);
+        const int j2  = reflect(j + 2, width);
+        uint16_t p[9] = {
+          r0[j_2], r0[j], r0[j2],
+          r1[j_2], r1[j], r1[j2],
+          r2[j_2], r2[j], r2[j2]
+        };
+        const int median = median9(p);
+        count[j] += abs(int(r1[j]) - median) > threshold;
+      }
+    }, kIspRowGrain);
+    ++frameCount;
+  }
+
+  DefectPixelMap getDefectPixelMap(
+      const uint32_t serial,
+      const float minDefectFraction) const {
+
+    DefectPixelMap map;
+    map.serial = serial;
+    map.width = width;
+    map.height = height;
+    map.frameCount = frameCount;
+
+    const uint32_t minCount =
+      max(uint32_t(1), uint32_t(ceilf(minDefectFraction * frameCount)));
+    for (int i = 0; i < height; ++i) {
+      for (int j = 0; j < width; ++j) {
+        if (outlierCount[i * width + j] >= minCount) {
+          map.defects.push_back(Point(j, i));
+        }
+      }
+    }
+    return map;
+  }
+};
+
+int main(int argc, char *argv[]) {
+  initSurround360(argc, argv);
+  requireArg(FLAGS_bin_list, "bin_list");
+  requireArg(FLAGS_output_dir, "output_dir");
+
+  vector<unique_ptr<BinaryFootageFile>> footageFiles;
+  std::istringstream binList(FLAGS_bin_list);
+  std::string binFile;
+  while (std::getline(binList, binFile, ',')) {
+    footageFiles.emplace_back(new BinaryFootageFile(binFile));
+  }
+
+  // A camera serial appears at most once per file, so each task owns the
+  // statistics of its camera while the file is being read.
+  map<uint32_t, unique_ptr<DefectStatistics>> statistics;
+  mutex statisticsMutex;
+
+  const int threshold = lrint(FLAGS_defect_threshold * 0xffff);
+
+  for (auto& footageFilePtr : footageFiles) {
+    BinaryFootageFile& footageFile = *footageFilePtr;
+    LOG(INFO) << "Reading " << footageFile.getFilename() << "...";
+
+    footageFile.open();
+    const int numCameras = footageFile.getNumberOfCameras();
+    const int width = footageFile.getMetadata().width;
+    const int height = footageFile.getMetadata().height;
+
+    const int startFrame = FLAGS_start_frame;
+    const int endFrame = FLAGS_frame_count == 0
+      ? footageFile.getNumberOfFrames() - 1
+      : min(
+          startFrame + FLAGS_frame_count,
+          int(footageFile.getNumberOfFrames())) - 1;
+
+    vector<future<void>> taskHandles;
+    for (int cameraIndex = 0; cameraIndex < numCameras; ++cameraIndex) {
+      taskHandles.push_back(std::async(
+        std::launch::async,
+        [=, &footageFile, &statistics, &statisticsMutex] {
+          DefectStatistics* cameraStatistics = nullptr;
+          vector<uint8_t> decodeBuffer;
+          for (int frameIndex = startFrame; frameIndex <= endFrame; ++frameIndex) {
+            auto frame = footageFile.getFrame(frameIndex, cameraIndex, decodeBuffer);
+            const auto serial = reinterpret_cast<const uint32_t*>(frame)[1];
+
+            if (cameraStatistics == nullptr) {
+              lock_guard<mutex> lock(statisticsMutex);
+              auto& entry = statistics[serial];
+              if (!entry) {
+                entry.reset(new DefectStatistics(width, height));
+              } else if (entry->width != width || entry->height != height) {
+                throw VrCamException(
+                  "camera " + to_string(serial) + " changes resolution in "
+                  + footageFile.getFilename());
+              }
+              cameraStatistics = entry.get();
+            }
+
+            auto upscaled = Raw12Converter::convertFrame(frame, width, height);
+            cameraStatistics->accumulate(upscaled->data(), threshold);
+          }
+        }));
+    }
+
+    for (auto& taskHandle : taskHandles) {
+      taskHandle.get();
+    }
+  }
+
+  for (const auto& entry : statistics) {
+    const DefectPixelMap defectPixelMap =
+      entry.second->getDefectPixelMap(entry.first, FLAGS_min_defect_fraction);
+    const string filename =
+      FLAGS_output_dir + "/" + to_string(entry.first) + ".json";
+    defectPixelMap.save(filename);
+    LOG(INFO) << "Camera " << entry.first << ": "
+              << defectPixelMap.defects.size() << " defects in "
+              << defectPixelMap.frameCount << " frames";
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,478 @@
+#include "FootageReader.hpp"
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+using namespace surround360;
+using namespace std;
+
+const size_t FootageReader::kDirectAlignment;
+
+#ifdef USE_IO_URING
+
+// A submission and a completion queue shared with the kernel, set up with
+// the raw system calls so there is no library to depend on
+struct FootageReader::IoUring {
+  int ringFd;
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  io_uring_sqe* sqes;
+  size_t sqesSize;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  io_uring_cqe* cqes;
+  vector<iovec> iovecs; // one per slot, alive until the read completes
+  size_t pending;       // submitted but not completed
+
+  IoUring() : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(nullptr), pending(0) {
+  }
+
+  ~IoUring() {
+    if (sqes != nullptr) {
+      munmap(sqes, sqesSize);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing) {
+      munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != MAP_FAILED) {
+      munmap(sqRing, sqRingSize);
+    }
+    if (ringFd != -1) {
+      ::close(ringFd);
+    }
+  }
+
+  // False if the kernel doesn't support io_uring or doesn't allow it
+  bool setup(const unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd == -1) {
+      return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+      sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+    }
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+      return false;
+    }
+    cqRing = singleMmap
+      ? sqRing
+      : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) {
+      return false;
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqesAddr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqesAddr == MAP_FAILED) {
+      return false;
+    }
+    sqes = reinterpret_cast<io_uring_sqe*>(sqesAddr);
+
+    uint8_t* sq = reinterpret_cast<uint8_t*>(sqRing);
+    uint8_t* cq = reinterpret_cast<uint8_t*>(cqRing);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  void queueRead(const int fd, const int slot, void* buffer, const size_t length, const uint64_t offset) {
+    iovec& iov = iovecs[slot];
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+
+    const unsigned tail = *sqTail;
+    const unsigned index = tail & *sqMask;
+    io_uring_sqe& sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(&iov);
+    sqe.len = 1;
+    sqe.off = offset;
+    sqe.user_data = slot;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++pending;
+  }
+
+  // Submits what was queued and waits for at least minComplete completions
+  void enter(const unsigned toSubmit, const unsigned minComplete) {
+    const unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    unsigned submitted = 0;
+    while (true) {
+      const int ret = syscall(
+        __NR_io_uring_enter, ringFd, toSubmit - submitted, minComplete, flags, nullptr, 0);
+      if (ret >= 0) {
+        submitted += ret;
+        if (submitted >= toSubmit) {
+          return;
+        }
+      } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        ostringstream errStream;
+        errStream << "Error in io_uring_enter(): " << strerror(errno);
+        throw runtime_error(errStream.str());
+      }
+    }
+  }
+
+  // Calls f(slot, result) for every completion available
+  template <typename F>
+  void reap(F f) {
+    unsigned head = *cqHead;
+    const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes[head & *cqMask];
+      --pending;
+      f(int(cqe.user_data), ssize_t(cqe.res));
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  }
+};
+
+#else
+
+struct FootageReader::IoUring {
+};
+
+#endif
+
+static size_t alignUp(const size_t value, const size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+FootageReader::FootageReader(
+  const vector<string>& filePaths,
+  const size_t maxReadSize,
+  const size_t queueDepth,
+  const Backend requestedBackend,
+  const size_t numPreadThreads)
+  : backend(requestedBackend),
+    direct(true),
+    nextToIssue(0),
+    nextToServe(0),
+    bytesRead(0) {
+  if (queueDepth == 0) {
+    throw runtime_error("Queue depth must be at least 1");
+  }
+  openFiles(filePaths);
+
+  // A read that doesn't start on a block boundary needs a block more
+  bufferSize = alignUp(maxReadSize, kDirectAlignment) + kDirectAlignment;
+  slots.resize(queueDepth);
+  for (Slot& slot : slots) {
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, kDirectAlignment, bufferSize) != 0) {
+      throw runtime_error("Failed to allocate footage read buffers");
+    }
+    slot.buffer = reinterpret_cast<uint8_t*>(buffer);
+    slot.state = SLOT_FREE;
+  }
+
+#ifdef USE_IO_URING
+  if (backend == BACKEND_AUTO || backend == BACKEND_IO_URING) {
+    uring.reset(new IoUring());
+    if (uring->setup(queueDepth)) {
+      uring->iovecs.resize(queueDepth);
+      backend = BACKEND_IO_URING;
+    } else {
+      uring.reset();
+    }
+  }
+#endif
+  if (backend == BACKEND_IO_URING && !uring) {
+    throw runtime_error("io_uring is not available");
+  }
+
+  if (!uring) {
+    backend = BACKEND_PREAD;
+    preadQueue.reset(new util::BoundedQueue<int>(queueDepth));
+    const size_t threads = numPreadThreads > 0 ? numPreadThreads : queueDepth;
+    for (size_t i = 0; i < threads; ++i) {
+      preadThreads.emplace_back(&FootageReader::preadWorker, this);
+    }
+  }
+}
+
+FootageReader::~FootageReader() {
+  if (preadQueue) {
+    preadQueue->close();
+  }
+  for (thread& preadThread : preadThreads) {
+    preadThread.join();
+  }
+#ifdef USE_IO_URING
+  // The kernel may still be writing to the buffers
+  if (uring) {
+    while (uring->pending > 0) {
+      uring->enter(0, 1);
+      uring->reap([](int, ssize_t) {});
+    }
+  }
+#endif
+  uring.reset();
+  for (Slot& slot : slots) {
+    free(slot.buffer);
+  }
+  for (const int fd : fileDescriptors) {
+    ::close(fd);
+  }
+}
+
+void FootageReader::openFiles(const vector<string>& filePaths) {
+  for (const string& path : filePaths) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+    if (fd == -1 && errno == EINVAL) {
+      // e.g. tmpfs
+      direct = false;
+      fd = ::open(path.c_str(), O_RDONLY);
+    }
+    if (fd == -1) {
+      ostringstream errStream;
+      errStream << "Error opening file " << path << ": " << strerror(errno);
+      for (const int openFd : fileDescriptors) {
+        ::close(openFd);
+      }
+      throw runtime_error(errStream.str());
+    }
+    fileDescriptors.push_back(fd);
+  }
+}
+
+const char* FootageReader::getBackendName(const Backend backend) {
+  switch (backend) {
+    case BACKEND_AUTO: return "auto";
+    case BACKEND_IO_URING: return "io_uring";
+    case BACKEND_PREAD: return "pread";
+  }
+  return "unknown";
+}
+
+void FootageReader::enqueue(const vector<Request>& newRequests) {
+  unique_lock<mutex> lock(slotMutex);
+  for (const Request& request : newRequests) {
+    if (request.fileIndex >= fileDescriptors.size()) {
+      throw runtime_error("File index out of range");
+    }
+    if (request.size + kDirectAlignment > bufferSize) {
+      throw runtime_error("Read larger than the footage read buffers");
+    }
+    requests.push_back(request);
+  }
+  issueReads(lock);
+}
+
+// Starts reads of the next requests into the free slots
+void FootageReader::issueReads(unique_lock<mutex>& lock) {
+  vector<int> started;
+  for (int i = 0; i < slots.size() && nextToIssue < requests.size(); ++i) {
+    Slot& slot = slots[i];
+    if (slot.state != SLOT_FREE) {
+      continue;
+    }
+    const Request& request = requests[nextToIssue];
+    slot.state = SLOT_READING;
+    slot.requestIndex = nextToIssue++;
+    slot.fd = fileDescriptors[request.fileIndex];
+    slot.alignedOffset = request.offset / kDirectAlignment * kDirectAlignment;
+    slot.alignedLength =
+      alignUp(request.offset + request.size - slot.alignedOffset, kDirectAlignment);
+    slot.bytesDone = 0;
+    slot.error = 0;
+    issuedSlots.push_back(i);
+    started.push_back(i);
+  }
+  if (started.empty()) {
+    return;
+  }
+
+  if (uring) {
+    submitUringReads(started);
+  } else {
+    // The queue holds at most one entry per slot, so this never blocks
+    lock.unlock();
+    for (const int i : started) {
+      preadQueue->push(i);
+    }
+    lock.lock();
+  }
+}
+
+bool FootageReader::next(Frame& frame) {
+  unique_lock<mutex> lock(slotMutex);
+  while (true) {
+    issueReads(lock);
+    if (!issuedSlots.empty()) {
+      break;
+    }
+    if (nextToIssue == requests.size()) {
+      return false;
+    }
+    // every slot is handed out
+    slotReady.wait(lock);
+  }
+
+  const int i = issuedSlots.front();
+  Slot& slot = slots[i];
+  if (uring) {
+    waitForUring(slot, lock);
+  } else {
+    slotReady.wait(lock, [&slot] { return slot.state == SLOT_READY; });
+  }
+  issuedSlots.pop_front();
+  ++nextToServe;
+
+  const Request& request = requests[slot.requestIndex];
+  if (slot.error != 0) {
+    slot.state = SLOT_FREE;
+    ostringstream errStream;
+    errStream << "Error reading " << request.size << " bytes at " << request.offset
+              << " of file " << request.fileIndex << ": " << strerror(slot.error);
+    throw runtime_error(errStream.str());
+  }
+
+  const size_t skip = request.offset - slot.alignedOffset;
+  slot.state = SLOT_HANDED_OUT;
+  frame.data = slot.buffer + skip;
+  frame.size = slot.bytesDone > skip ? min(size_t(request.size), slot.bytesDone - skip) : 0;
+  frame.requestIndex = slot.requestIndex;
+  frame.slot = i;
+  bytesRead += frame.size;
+  return true;
+}
+
+void FootageReader::release(const Frame& frame) {
+  lock_guard<mutex> lock(slotMutex);
+  slots[frame.slot].state = SLOT_FREE;
+  slotReady.notify_all();
+}
+
+uint64_t FootageReader::getBytesRead() const {
+  lock_guard<mutex> lock(slotMutex);
+  return bytesRead;
+}
+
+// Records the result of a read. A read that stopped short of the end of
+// the file is continued from where it stopped.
+void FootageReader::completeRead(Slot& slot, const ssize_t result) {
+  if (result < 0) {
+    slot.error = -result;
+  } else {
+    slot.bytesDone += result;
+    if (result > 0 && slot.bytesDone < slot.alignedLength) {
+      return;
+    }
+  }
+  slot.state = SLOT_READY;
+}
+
+// The slot's read parameters are set before it is queued and only the
+// worker touches its buffer until the read is complete
+void FootageReader::preadWorker() {
+  int i;
+  while (preadQueue->pop(i)) {
+    Slot& slot = slots[i];
+    const int fd = slot.fd;
+    size_t bytesDone = slot.bytesDone;
+    ssize_t result;
+    do {
+      result = pread(
+        fd,
+        slot.buffer + bytesDone,
+        slot.alignedLength - bytesDone,
+        slot.alignedOffset + bytesDone);
+      if (result > 0) {
+        bytesDone += result;
+      }
+    } while ((result > 0 && bytesDone < slot.alignedLength) ||
+             (result == -1 && errno == EINTR));
+    const ssize_t lastResult = result == -1 ? -errno : 0;
+
+    lock_guard<mutex> lock(slotMutex);
+    slot.bytesDone = bytesDone;
+    completeRead(slot, lastResult);
+    slotReady.notify_all();
+  }
+}
+
+#ifdef USE_IO_URING
+
+void FootageReader::submitUringReads(const vector<int>& slotIndices) {
+  for (const int i : slotIndices) {
+    Slot& slot = slots[i];
+    uring->queueRead(
+      slot.fd,
+      i,
+      slot.buffer + slot.bytesDone,
+      slot.alignedLength - slot.bytesDone,
+      slot.alignedOffset + slot.bytesDone);
+  }
+  uring->enter(slotIndices.size(), 0);
+}
+
+// The ring is only used from next(), so it is safe to wait on it with the
+// lock released
+void FootageReader::waitForUring(Slot& slot, unique_lock<mutex>& lock) {
+  while (slot.state == SLOT_READING) {
+    lock.unlock();
+    uring->enter(0, 1);
+    lock.lock();
+
+    vector<int> continued;
+    uring->reap([&](const int i, const ssize_t result) {
+      completeRead(slots[i], result);
+      if (slots[i].state == SLOT_READING) {
+        continued.push_back(i);
+      }
+    });
+    if (!continued.empty()) {
+      submitUringReads(continued);
+    }
+  }
+}
+
+#else
+
+void FootageReader::submitUringReads(const vector<int>& slotIndices) {
+}
+
+void FootageReader::waitForUring(Slot& slot, unique_lock<mutex>& lock) {
+}
+
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+
+namespace surround360
+{
+// Streams a list of reads from footage files into a ring of aligned
+// buffers, keeping up to queueDepth reads in flight. Files are opened with
+// O_DIRECT where the file system allows it, so frames go from the disk to
+// the buffers without passing through the page cache. Reads are submitted
+// through io_uring when the kernel has it, otherwise a pool of threads
+// issues them with pread.
+class FootageReader {
+ public:
+  enum Backend {
+    BACKEND_AUTO,
+    BACKEND_IO_URING,
+    BACKEND_PREAD
+  };
+
+  struct Request {
+    uint32_t fileIndex;
+    uint64_t offset;
+    uint32_t size;
+  };
+
+  // A completed read. data stays valid until the frame is released.
+  struct Frame {
+    const uint8_t* data;
+    size_t size;          // less than requested past the end of the file
+    size_t requestIndex;
+    int slot;
+  };
+
+  // O_DIRECT needs offsets, lengths and buffers aligned to the logical
+  // block size of the device, which is at most a page
+  static const size_t kDirectAlignment = 4096;
+
+  // maxReadSize bounds the size of any request. preadThreads is the number
+  // of threads of the pread backend, 0 for queueDepth.
+  FootageReader(
+    const std::vector<std::string>& filePaths,
+    const size_t maxReadSize,
+    const size_t queueDepth,
+    const Backend backend = BACKEND_AUTO,
+    const size_t preadThreads = 0);
+  ~FootageReader();
+
+  FootageReader(const FootageReader&) = delete;
+  FootageReader& operator=(const FootageReader&) = delete;
+
+  // Queues requests after the ones already queued
+  void enqueue(const std::vector<Request>& requests);
+
+  // Blocks until the next request in order has been read. Returns false
+  // once every queued request has been handed out. Throws if a read failed.
+  // Only one thread may call next(); any thread may release().
+  bool next(Frame& frame);
+  void release(const Frame& frame);
+
+  Backend getBackend() const {
+    return backend;
+  }
+
+  static const char* getBackendName(const Backend backend);
+
+  // False if a file system refused O_DIRECT and reads go through the page
+  // cache
+  bool isDirect() const {
+    return direct;
+  }
+
+  uint64_t getBytesRead() const;
+
+ private:
+  enum SlotState {
+    SLOT_FREE,
+    SLOT_READING,
+    SLOT_READY,
+    SLOT_HANDED_OUT
+  };
+
+  struct Slot {
+    uint8_t* buffer;
+    SlotState state;
+    size_t requestIndex;
+    int fd;
+    uint64_t alignedOffset; // where the read starts
+    size_t alignedLength;   // how much it reads
+    size_t bytesDone;
+    int error;              // errno of a failed read
+  };
+
+  struct IoUring;
+
+  void openFiles(const std::vector<std::string>& filePaths);
+  void issueReads(std::unique_lock<std::mutex>& lock);
+  void preadWorker();
+  void submitUringReads(const std::vector<int>& slotIndices);
+  void waitForUring(Slot& slot, std::unique_lock<std::mutex>& lock);
+  void completeRead(Slot& slot, const ssize_t result);
+
+ private:
+  Backend backend;
+  bool direct;
+  std::vector<int> fileDescriptors;
+  size_t bufferSize;
+  std::vector<Slot> slots;
+  std::vector<Request> requests;
+  size_t nextToIssue;
+  size_t nextToServe;
+  std::deque<int> issuedSlots; // in request order
+  uint64_t bytesRead;
+
+  mutable std::mutex slotMutex;
+  std::condition_variable slotReady;
+
+  std::unique_ptr<IoUring> uring;
+  std::unique_ptr<util::BoundedQueue<int>> preadQueue;
+  std::vector<std::thread> preadThreads;
+};
+}
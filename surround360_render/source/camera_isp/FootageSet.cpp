@@ -0,0 +1,419 @@
+#include "FootageSet.hpp"
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BayerCodec.h"
+
+#include <glog/logging.h>
+
+using namespace surround360;
+using namespace std;
+
+const uint32_t FootageSet::kIndexMagic;
+const uint32_t FootageSet::kIndexVersion;
+
+namespace {
+
+const size_t kMetadataSize(4096);
+
+struct IndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t fileCount;
+  uint32_t cameraCount;
+  uint64_t frameCount;
+  uint64_t frameSize;
+} __attribute__((packed));
+
+// The tag at the start of every raw frame. Frames compressed by BayerCodec
+// keep a copy in their header.
+struct FrameTag {
+  uint32_t timestamp;
+  uint32_t serial;
+} __attribute__((packed));
+
+}
+
+FootageSet::FootageSet(const vector<string>& filePaths, const string& indexPath)
+  : filePaths(filePaths),
+    indexPath(indexPath) {
+  if (filePaths.empty()) {
+    throw runtime_error("No footage files given");
+  }
+  if (this->indexPath.empty()) {
+    this->indexPath = filePaths.front() + ".idx";
+  }
+}
+
+vector<string> FootageSet::splitFileList(const string& fileList) {
+  vector<string> paths;
+  istringstream listStream(fileList);
+  string path;
+  while (getline(listStream, path, ',')) {
+    if (!path.empty()) {
+      paths.push_back(path);
+    }
+  }
+  return paths;
+}
+
+void FootageSet::open() {
+  for (const string& path : filePaths) {
+    files.emplace_back(new BinaryFootageFile(path));
+    files.back()->open();
+  }
+
+  // Files are numbered in the order they were written, whatever the order
+  // they were listed in
+  vector<size_t> order(files.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  sort(order.begin(), order.end(), [this](const size_t a, const size_t b) {
+    return files[a]->getMetadata().fileIndex < files[b]->getMetadata().fileIndex;
+  });
+  vector<unique_ptr<BinaryFootageFile>> sortedFiles;
+  vector<string> sortedPaths;
+  for (const size_t i : order) {
+    sortedFiles.push_back(move(files[i]));
+    sortedPaths.push_back(filePaths[i]);
+  }
+  files.swap(sortedFiles);
+  filePaths.swap(sortedPaths);
+  checkMetadata();
+
+  numberOfFrames = files.front()->getNumberOfFrames();
+  for (const auto& file : files) {
+    numberOfFrames = min(numberOfFrames, file->getNumberOfFrames());
+  }
+  if (numberOfFrames == 0) {
+    throw runtime_error("No complete frame in " + filePaths.front());
+  }
+
+  indexCached = loadIndex();
+  if (!indexCached) {
+    buildIndex();
+    saveIndex();
+  }
+}
+
+void FootageSet::close() {
+  for (auto& file : files) {
+    file->close();
+  }
+  files.clear();
+  cameras.clear();
+  entries.clear();
+  numberOfFrames = 0;
+}
+
+void FootageSet::checkMetadata() const {
+  const BinaryFootageFile::MetadataHeader& first = files.front()->getMetadata();
+  for (size_t i = 0; i < files.size(); ++i) {
+    const BinaryFootageFile::MetadataHeader& metadata = files[i]->getMetadata();
+    ostringstream errStream;
+    if (metadata.magic != 0xfaceb00c) {
+      errStream << "Footage file not tagged: " << filePaths[i];
+    } else if (i > 0 && metadata.fileIndex == files[i - 1]->getMetadata().fileIndex) {
+      errStream << "Footage files " << filePaths[i - 1] << " and " << filePaths[i]
+                << " have the same file index " << metadata.fileIndex;
+    } else if (
+        metadata.timestamp != first.timestamp ||
+        metadata.width != first.width ||
+        metadata.height != first.height ||
+        metadata.bitsPerPixel != first.bitsPerPixel) {
+      errStream << "Footage file " << filePaths[i]
+                << " is not from the same capture as " << filePaths.front();
+    } else {
+      continue;
+    }
+    throw runtime_error(errStream.str());
+  }
+}
+
+vector<FootageSet::FileSignature> FootageSet::getFileSignatures() const {
+  vector<FileSignature> signatures;
+  for (size_t i = 0; i < files.size(); ++i) {
+    struct stat fileInfo;
+    if (stat(filePaths[i].c_str(), &fileInfo) == -1) {
+      ostringstream errStream;
+      errStream << "Error retrieving stat() information for file "
+                << filePaths[i] << ": " << strerror(errno);
+      throw runtime_error(errStream.str());
+    }
+    FileSignature signature;
+    signature.size = fileInfo.st_size;
+    signature.modificationTime =
+      int64_t(fileInfo.st_mtim.tv_sec) * 1000000000 + fileInfo.st_mtim.tv_nsec;
+    signature.sessionTimestamp = files[i]->getMetadata().timestamp;
+    signature.fileIndex = files[i]->getMetadata().fileIndex;
+    signatures.push_back(signature);
+  }
+  return signatures;
+}
+
+bool FootageSet::loadIndex() {
+  ifstream indexFile(indexPath, ios::in | ios::binary);
+  if (!indexFile) {
+    return false;
+  }
+
+  IndexHeader header;
+  indexFile.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!indexFile ||
+      header.magic != kIndexMagic ||
+      header.version != kIndexVersion ||
+      header.fileCount != files.size() ||
+      header.frameCount != numberOfFrames ||
+      header.frameSize != getFrameSize()) {
+    return false;
+  }
+
+  const vector<FileSignature> signatures = getFileSignatures();
+  vector<FileSignature> indexedSignatures(header.fileCount);
+  indexFile.read(
+    reinterpret_cast<char*>(indexedSignatures.data()),
+    indexedSignatures.size() * sizeof(FileSignature));
+  if (!indexFile ||
+      memcmp(indexedSignatures.data(), signatures.data(),
+        signatures.size() * sizeof(FileSignature)) != 0) {
+    return false;
+  }
+
+  cameras.resize(header.cameraCount);
+  entries.resize(header.frameCount * header.cameraCount);
+  indexFile.read(
+    reinterpret_cast<char*>(cameras.data()), cameras.size() * sizeof(Camera));
+  indexFile.read(
+    reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(FrameEntry));
+  if (!indexFile) {
+    cameras.clear();
+    entries.clear();
+    return false;
+  }
+  return true;
+}
+
+// Written to a temporary file first so a reader never sees half an index.
+// The index is only a cache, so failing to write it is not an error.
+void FootageSet::saveIndex() const {
+  IndexHeader header;
+  header.magic = kIndexMagic;
+  header.version = kIndexVersion;
+  header.fileCount = files.size();
+  header.cameraCount = cameras.size();
+  header.frameCount = numberOfFrames;
+  header.frameSize = getFrameSize();
+  const vector<FileSignature> signatures = getFileSignatures();
+
+  const string tempPath = indexPath + ".tmp";
+  ofstream indexFile(tempPath, ios::out | ios::binary | ios::trunc);
+  indexFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  indexFile.write(
+    reinterpret_cast<const char*>(signatures.data()),
+    signatures.size() * sizeof(FileSignature));
+  indexFile.write(
+    reinterpret_cast<const char*>(cameras.data()), cameras.size() * sizeof(Camera));
+  indexFile.write(
+    reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(FrameEntry));
+  indexFile.close();
+  if (!indexFile || rename(tempPath.c_str(), indexPath.c_str()) != 0) {
+    LOG(WARNING) << "Could not save footage index " << indexPath;
+    remove(tempPath.c_str());
+  }
+}
+
+// Reads the tag of every frame. Each file is scanned on its own thread,
+// since the files of a session are usually on different disks.
+void FootageSet::buildIndex() {
+  const size_t frameSize = getFrameSize();
+  vector<vector<FrameTag>> tags(files.size());
+  vector<future<void>> scans;
+  for (size_t fileIndex = 0; fileIndex < files.size(); ++fileIndex) {
+    scans.push_back(async(launch::async, [&, fileIndex] {
+      const string& path = filePaths[fileIndex];
+      const size_t numberOfCameras = files[fileIndex]->getNumberOfCameras();
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd == -1) {
+        ostringstream errStream;
+        errStream << "Error opening file " << path << ": " << strerror(errno);
+        throw runtime_error(errStream.str());
+      }
+
+      vector<FrameTag>& fileTags = tags[fileIndex];
+      fileTags.resize(numberOfFrames * numberOfCameras);
+      const BinaryFootageFile::MetadataHeader& metadata = files[fileIndex]->getMetadata();
+      for (size_t i = 0; i < fileTags.size(); ++i) {
+        const off_t offset = kMetadataSize + i * frameSize;
+        BayerCodec::Header header;
+        const size_t headerSize = min(sizeof(header), frameSize);
+        if (pread(fd, &header, headerSize, offset) != ssize_t(headerSize)) {
+          ::close(fd);
+          ostringstream errStream;
+          errStream << "Error reading frame tag at " << offset
+                    << " in " << path << ": " << strerror(errno);
+          throw runtime_error(errStream.str());
+        }
+        memcpy(
+          &fileTags[i],
+          BayerCodec::isEncoded(&header, metadata.width, metadata.height, metadata.bitsPerPixel)
+            ? static_cast<const void*>(header.tag)
+            : static_cast<const void*>(&header),
+          sizeof(FrameTag));
+
+        // A camera keeps its place in the file for the whole capture
+        const size_t cameraIndex = i % numberOfCameras;
+        if (fileTags[i].serial != fileTags[cameraIndex].serial) {
+          ::close(fd);
+          ostringstream errStream;
+          errStream << "Frame " << i / numberOfCameras << " of camera "
+                    << fileTags[cameraIndex].serial << " in " << path
+                    << " is tagged with serial " << fileTags[i].serial;
+          throw runtime_error(errStream.str());
+        }
+      }
+      ::close(fd);
+    }));
+  }
+  for (auto& scan : scans) {
+    scan.get();
+  }
+
+  cameras.clear();
+  for (uint32_t fileIndex = 0; fileIndex < files.size(); ++fileIndex) {
+    for (uint32_t cameraIndex = 0;
+         cameraIndex < files[fileIndex]->getNumberOfCameras();
+         ++cameraIndex) {
+      cameras.push_back({fileIndex, cameraIndex, tags[fileIndex][cameraIndex].serial});
+    }
+  }
+  sort(cameras.begin(), cameras.end(), [](const Camera& a, const Camera& b) {
+    return a.serial < b.serial;
+  });
+  for (size_t i = 1; i < cameras.size(); ++i) {
+    if (cameras[i].serial == cameras[i - 1].serial) {
+      throw runtime_error(
+        "Camera " + to_string(cameras[i].serial) + " appears more than once");
+    }
+  }
+
+  entries.resize(numberOfFrames * cameras.size());
+  for (size_t frame = 0; frame < numberOfFrames; ++frame) {
+    for (size_t camera = 0; camera < cameras.size(); ++camera) {
+      const Camera& c = cameras[camera];
+      const size_t slot =
+        frame * files[c.fileIndex]->getNumberOfCameras() + c.cameraIndex;
+      FrameEntry& entry = entries[frame * cameras.size() + camera];
+      entry.offset = kMetadataSize + slot * frameSize;
+      entry.timestamp = tags[c.fileIndex][slot].timestamp;
+      entry.fileIndex = c.fileIndex;
+    }
+  }
+}
+
+size_t FootageSet::getNumberOfFrames() const {
+  return numberOfFrames;
+}
+
+size_t FootageSet::getNumberOfCameras() const {
+  return cameras.size();
+}
+
+const FootageSet::Camera& FootageSet::getCamera(const uint32_t cameraNumber) const {
+  if (cameraNumber >= cameras.size()) {
+    throw runtime_error("Camera number out of range");
+  }
+  return cameras[cameraNumber];
+}
+
+int FootageSet::findCamera(const uint32_t serial) const {
+  for (size_t i = 0; i < cameras.size(); ++i) {
+    if (cameras[i].serial == serial) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const FootageSet::FrameEntry& FootageSet::getFrameEntry(
+  const uint32_t frameNumber, const uint32_t cameraNumber) const {
+  if (frameNumber >= numberOfFrames || cameraNumber >= cameras.size()) {
+    ostringstream errStream;
+    errStream << "Frame " << frameNumber << " of camera " << cameraNumber
+              << " is out of range for this footage";
+    throw runtime_error(errStream.str());
+  }
+  return entries[size_t(frameNumber) * cameras.size() + cameraNumber];
+}
+
+uint32_t FootageSet::getTimestamp(
+  const uint32_t frameNumber, const uint32_t cameraNumber) const {
+  return getFrameEntry(frameNumber, cameraNumber).timestamp;
+}
+
+const uint8_t* FootageSet::getFrame(
+  const uint32_t frameNumber, const uint32_t cameraNumber) const {
+  getFrameEntry(frameNumber, cameraNumber); // range check
+  const Camera& camera = cameras[cameraNumber];
+  return files[camera.fileIndex]->getFrame(frameNumber, camera.cameraIndex);
+}
+
+const uint8_t* FootageSet::getFrame(
+  const uint32_t frameNumber,
+  const uint32_t cameraNumber,
+  vector<uint8_t>& decodeBuffer) const {
+  getFrameEntry(frameNumber, cameraNumber); // range check
+  const Camera& camera = cameras[cameraNumber];
+  return files[camera.fileIndex]->getFrame(frameNumber, camera.cameraIndex, decodeBuffer);
+}
+
+void FootageSet::forEachFrame(
+  const uint32_t firstFrame,
+  const uint32_t frameCount,
+  const function<void(uint32_t, uint32_t, const uint8_t*)>& f) const {
+  const size_t endFrame = min(numberOfFrames, size_t(firstFrame) + frameCount);
+  vector<uint8_t> decodeBuffer;
+  for (uint32_t frame = firstFrame; frame < endFrame; ++frame) {
+    for (uint32_t camera = 0; camera < cameras.size(); ++camera) {
+      f(frame, camera, getFrame(frame, camera, decodeBuffer));
+    }
+  }
+}
+
+void FootageSet::setReadaheadWindow(
+  const uint32_t framesAhead, const uint32_t framesBehind, const bool trackReleases) {
+  for (auto& file : files) {
+    file->setReadaheadWindow(framesAhead, framesBehind, trackReleases);
+  }
+}
+
+void FootageSet::releaseFrame(
+  const uint32_t frameNumber, const uint32_t cameraNumber) const {
+  files[cameras[cameraNumber].fileIndex]->releaseFrame(frameNumber);
+}
+
+const BinaryFootageFile::MetadataHeader& FootageSet::getMetadata() const {
+  return files.front()->getMetadata();
+}
+
+size_t FootageSet::getFrameSize() const {
+  return files.front()->getFrameSize();
+}
+
+size_t FootageSet::getBitsPerPixel() const {
+  return files.front()->getBitsPerPixel();
+}
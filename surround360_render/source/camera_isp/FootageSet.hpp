@@ -0,0 +1,127 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BinaryFootageFile.hpp"
+
+namespace surround360
+{
+// All the .bin files of a capture session read as one rig. Cameras are
+// numbered by increasing serial number across files, so camera N is camN
+// wherever its frames are stored. An index from (frame, camera) to the file,
+// offset and capture timestamp of the frame is built on open() and cached
+// next to the footage, so reopening a session reads no frame data.
+class FootageSet {
+ public:
+  struct Camera {
+    uint32_t fileIndex;   // position in getFiles()
+    uint32_t cameraIndex; // camera number within that file
+    uint32_t serial;
+  } __attribute__((packed));
+
+  struct FrameEntry {
+    uint64_t offset;      // from the start of the file
+    uint32_t timestamp;   // first word of the frame tag
+    uint32_t fileIndex;
+  } __attribute__((packed));
+
+  static const uint32_t kIndexMagic = 0x58444e49; // "INDX"
+  static const uint32_t kIndexVersion = 1;
+
+  // indexPath defaults to the first file's path with .idx appended
+  FootageSet(const std::vector<std::string>& filePaths, const std::string& indexPath = "");
+
+  // Splits a comma separated --bin_list
+  static std::vector<std::string> splitFileList(const std::string& fileList);
+
+  // Opens every file, then loads the index, or builds and saves it if the
+  // footage changed since it was written. Throws if the files don't belong
+  // together or a frame is tagged with the wrong camera.
+  void open();
+  void close();
+
+  // False if the index had to be rebuilt from the frame tags
+  bool isIndexCached() const {
+    return indexCached;
+  }
+
+  // Frames every camera has
+  size_t getNumberOfFrames() const;
+  size_t getNumberOfCameras() const;
+  const Camera& getCamera(const uint32_t cameraNumber) const;
+
+  // -1 if no camera has this serial number
+  int findCamera(const uint32_t serial) const;
+
+  const FrameEntry& getFrameEntry(const uint32_t frameNumber, const uint32_t cameraNumber) const;
+  uint32_t getTimestamp(const uint32_t frameNumber, const uint32_t cameraNumber) const;
+
+  // Random access through the file's readahead window. Frames are returned
+  // as stored unless a decodeBuffer is given, see BinaryFootageFile.
+  const uint8_t* getFrame(const uint32_t frameNumber, const uint32_t cameraNumber) const;
+  const uint8_t* getFrame(
+    const uint32_t frameNumber,
+    const uint32_t cameraNumber,
+    std::vector<uint8_t>& decodeBuffer) const;
+
+  // Sequential access: calls f(frameNumber, cameraNumber, frame) with the
+  // raw frames of frameCount frames from firstFrame, every camera of a frame
+  // before the next frame
+  void forEachFrame(
+    const uint32_t firstFrame,
+    const uint32_t frameCount,
+    const std::function<void(uint32_t, uint32_t, const uint8_t*)>& f) const;
+
+  // See BinaryFootageFile. With trackReleases every getFrame() is handed
+  // back with releaseFrame() once the caller is done with the frame.
+  void setReadaheadWindow(
+    const uint32_t framesAhead,
+    const uint32_t framesBehind,
+    const bool trackReleases = false);
+  void releaseFrame(const uint32_t frameNumber, const uint32_t cameraNumber) const;
+
+  // Width, height and bits per pixel are the same in every file
+  const BinaryFootageFile::MetadataHeader& getMetadata() const;
+  size_t getFrameSize() const;
+  size_t getBitsPerPixel() const;
+
+  // Ordered by the file index in their metadata
+  const std::vector<std::unique_ptr<BinaryFootageFile>>& getFiles() const {
+    return files;
+  }
+
+  const std::string& getFilePath(const uint32_t fileIndex) const {
+    return filePaths[fileIndex];
+  }
+
+  const std::string& getIndexPath() const {
+    return indexPath;
+  }
+
+ private:
+  struct FileSignature {
+    uint64_t size;
+    int64_t modificationTime; // nanoseconds
+    uint32_t sessionTimestamp;
+    uint32_t fileIndex;
+  } __attribute__((packed));
+
+  std::vector<FileSignature> getFileSignatures() const;
+  bool loadIndex();
+  void saveIndex() const;
+  void buildIndex();
+  void checkMetadata() const;
+
+ private:
+  std::vector<std::string> filePaths;
+  std::string indexPath;
+  std::vector<std::unique_ptr<BinaryFootageFile>> files;
+  std::vector<Camera> cameras;
+  std::vector<FrameEntry> entries; // frame major
+  size_t numberOfFrames = 0;
+  bool indexCached = false;
+};
+}
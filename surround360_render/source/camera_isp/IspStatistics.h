@@ -0,0 +1,291 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "CvUtil.h"
+#include "MikeUtil.h"
+#include "VrCamException.h"
+
+namespace surround360 {
+
+using namespace std;
+using namespace cv;
+
+// Per frame exposure and white balance statistics of the ISP: per channel
+// histograms of the raw input and of the output, counts of clipped pixels
+// and the mean output color over a coarse grid. Channels are R, G, B.
+struct IspStatistics {
+  static const int kHistogramBins = 256;
+  static const int kGridSize = 8; // cells along each dimension
+
+  int rawWidth;
+  int rawHeight;
+  int outputWidth;
+  int outputHeight;
+  uint64_t rawHistogram[3][kHistogramBins];
+  uint64_t outputHistogram[3][kHistogramBins];
+  uint64_t rawClipped[3];
+  uint64_t outputClipped[3];
+  Vec3f gridMean[kGridSize][kGridSize]; // normalized to [0, 1]
+
+  IspStatistics() {
+    clear();
+  }
+
+  void clear() {
+    rawWidth = rawHeight = outputWidth = outputHeight = 0;
+    memset(rawHistogram, 0, sizeof(rawHistogram));
+    memset(outputHistogram, 0, sizeof(outputHistogram));
+    memset(rawClipped, 0, sizeof(rawClipped));
+    memset(outputClipped, 0, sizeof(outputClipped));
+    for (int y = 0; y < kGridSize; ++y) {
+      for (int x = 0; x < kGridSize; ++x) {
+        gridMean[y][x] = Vec3f(0, 0, 0);
+      }
+    }
+  }
+
+  // Raw bayer image with values in [0, maxValue]. channels[i % 2][j % 2]
+  // is the channel of pixel (i, j).
+  template <typename T>
+  void computeRaw(
+      const T* image,
+      const int width,
+      const int height,
+      const int maxValue,
+      const int channels[2][2]) {
+
+    computeRawRows(width, height, maxValue, channels,
+      [=](const int i, int* row) {
+        const T* src = image + size_t(i) * width;
+        for (int j = 0; j < width; ++j) {
+          row[j] = src[j];
+        }
+      });
+  }
+
+  // 12 bit pixel pairs packed into 3 bytes, see Raw12Converter
+  void computeRawPacked(
+      const uint8_t* image,
+      const int width,
+      const int height,
+      const int channels[2][2]) {
+
+    const size_t rowBytes = width / 2 * 3;
+    computeRawRows(width, height, 4095, channels,
+      [=](const int i, int* row) {
+        const uint8_t* src = image + i * rowBytes;
+        for (int j = 0; j < width; j += 2, src += 3) {
+          row[j] = src[0] << 4 | (src[1] & 0xF);
+          row[j + 1] = src[2] << 4 | src[1] >> 4;
+        }
+      });
+  }
+
+  // Interleaved RGB, or BGR if swizzled, with values in [0, maxValue]
+  template <typename T>
+  void computeOutput(
+      const T* image,
+      const int width,
+      const int height,
+      const int maxValue,
+      const bool swizzle) {
+
+    outputWidth = width;
+    outputHeight = height;
+    memset(outputHistogram, 0, sizeof(outputHistogram));
+    memset(outputClipped, 0, sizeof(outputClipped));
+
+    // Each strip of rows accumulates its own counts and sums, which are
+    // merged once per strip
+    Vec3d gridSum[kGridSize][kGridSize];
+    int gridCount[kGridSize][kGridSize];
+    memset(gridCount, 0, sizeof(gridCount));
+    int cellWidth[kGridSize];
+    memset(cellWidth, 0, sizeof(cellWidth));
+    for (int j = 0; j < width; ++j) {
+      ++cellWidth[j * kGridSize / width];
+    }
+    const int c0 = swizzle ? 2 : 0;
+    const int c2 = swizzle ? 0 : 2;
+    mutex mergeLock;
+    forEachStrip(height, [&](const int begin, const int end) {
+      uint64_t histogram[3][kHistogramBins];
+      uint64_t clipped[3] = { 0, 0, 0 };
+      memset(histogram, 0, sizeof(histogram));
+      Vec3d sum[kGridSize];
+      Vec3d stripSum[kGridSize][kGridSize];
+      int stripCount[kGridSize][kGridSize];
+      memset(stripCount, 0, sizeof(stripCount));
+
+      for (int i = begin; i < end; ++i) {
+        const T* row = image + size_t(i) * width * 3;
+        const int cellY = i * kGridSize / height;
+        for (int cellX = 0; cellX < kGridSize; ++cellX) {
+          sum[cellX] = Vec3d(0, 0, 0);
+        }
+        for (int j = 0; j < width; ++j) {
+          const int rgb[3] = { row[3 * j + c0], row[3 * j + 1], row[3 * j + c2] };
+          for (int c = 0; c < 3; ++c) {
+            ++histogram[c][bin(rgb[c], maxValue)];
+            clipped[c] += rgb[c] >= maxValue;
+          }
+          sum[j * kGridSize / width] += Vec3d(rgb[0], rgb[1], rgb[2]);
+        }
+        for (int cellX = 0; cellX < kGridSize; ++cellX) {
+          stripSum[cellY][cellX] += sum[cellX];
+          stripCount[cellY][cellX] += cellWidth[cellX];
+        }
+      }
+
+      lock_guard<mutex> lock(mergeLock);
+      for (int c = 0; c < 3; ++c) {
+        for (int b = 0; b < kHistogramBins; ++b) {
+          outputHistogram[c][b] += histogram[c][b];
+        }
+        outputClipped[c] += clipped[c];
+      }
+      for (int y = 0; y < kGridSize; ++y) {
+        for (int x = 0; x < kGridSize; ++x) {
+          gridSum[y][x] += stripSum[y][x];
+          gridCount[y][x] += stripCount[y][x];
+        }
+      }
+    });
+
+    for (int y = 0; y < kGridSize; ++y) {
+      for (int x = 0; x < kGridSize; ++x) {
+        const double scale = gridCount[y][x] > 0
+          ? 1.0 / (double(gridCount[y][x]) * maxValue)
+          : 0.0;
+        gridMean[y][x] = Vec3f(gridSum[y][x] * scale);
+      }
+    }
+  }
+
+  // Writes the statistics as a JSON sidecar
+  void save(const string& filename) const {
+    ofstream ofs(filename, ios::out);
+    if (!ofs) {
+      throw VrCamException("failed to write ISP statistics " + filename);
+    }
+    ofs << "{\n";
+    ofs << "   \"IspStatistics\" : {\n";
+    ofs << "        \"rawWidth\" : " << rawWidth << ",\n";
+    ofs << "        \"rawHeight\" : " << rawHeight << ",\n";
+    ofs << "        \"outputWidth\" : " << outputWidth << ",\n";
+    ofs << "        \"outputHeight\" : " << outputHeight << ",\n";
+    ofs << "        \"rawClipped\" : ["
+        << rawClipped[0] << ", " << rawClipped[1] << ", " << rawClipped[2] << "],\n";
+    ofs << "        \"outputClipped\" : ["
+        << outputClipped[0] << ", " << outputClipped[1] << ", " << outputClipped[2] << "],\n";
+    saveHistogram(ofs, "rawHistogram", rawHistogram);
+    saveHistogram(ofs, "outputHistogram", outputHistogram);
+    ofs.precision(5);
+    ofs << fixed;
+    ofs << "        \"gridSize\" : " << kGridSize << ",\n";
+    ofs << "        \"gridMean\" : [";
+    for (int y = 0; y < kGridSize; ++y) {
+      ofs << "\n            [";
+      for (int x = 0; x < kGridSize; ++x) {
+        const Vec3f& m = gridMean[y][x];
+        ofs << "[" << m[0] << ", " << m[1] << ", " << m[2] << "]"
+            << (x < kGridSize - 1 ? ", " : "");
+      }
+      ofs << "]" << (y < kGridSize - 1 ? "," : "");
+    }
+    ofs << "]\n";
+    ofs << "   }\n";
+    ofs << "}\n";
+  }
+
+ private:
+  static inline int bin(const int value, const int maxValue) {
+    return std::min(
+      kHistogramBins - 1,
+      int(int64_t(std::max(value, 0)) * kHistogramBins / (int64_t(maxValue) + 1)));
+  }
+
+  // Calls f(begin, end) on strips of rows in parallel
+  static void forEachStrip(
+      const int height,
+      const function<void(int, int)>& f) {
+    const int kStripHeight = 64;
+    const int strips = (height + kStripHeight - 1) / kStripHeight;
+    parallel_for_<int>(0, strips, [&](int s) {
+      f(s * kStripHeight, std::min(height, (s + 1) * kStripHeight));
+    }, 1);
+  }
+
+  // loadRow(i, row) fills row with the raw values of image row i
+  void computeRawRows(
+      const int width,
+      const int height,
+      const int maxValue,
+      const int channels[2][2],
+      const function<void(int, int*)>& loadRow) {
+
+    rawWidth = width;
+    rawHeight = height;
+    memset(rawHistogram, 0, sizeof(rawHistogram));
+    memset(rawClipped, 0, sizeof(rawClipped));
+
+    mutex mergeLock;
+    forEachStrip(height, [&](const int begin, const int end) {
+      uint64_t histogram[3][kHistogramBins];
+      uint64_t clipped[3] = { 0, 0, 0 };
+      memset(histogram, 0, sizeof(histogram));
+      vector<int> row(width + 1);
+
+      for (int i = begin; i < end; ++i) {
+        loadRow(i, row.data());
+        const int ch[2] = { channels[i % 2][0], channels[i % 2][1] };
+        for (int j = 0; j < width; ++j) {
+          const int c = ch[j % 2];
+          ++histogram[c][bin(row[j], maxValue)];
+          clipped[c] += row[j] >= maxValue;
+        }
+      }
+
+      lock_guard<mutex> lock(mergeLock);
+      for (int c = 0; c < 3; ++c) {
+        for (int b = 0; b < kHistogramBins; ++b) {
+          rawHistogram[c][b] += histogram[c][b];
+        }
+        rawClipped[c] += clipped[c];
+      }
+    });
+  }
+
+  static void saveHistogram(
+      ofstream& ofs,
+      const string& name,
+      const uint64_t (&histogram)[3][kHistogramBins]) {
+    ofs << "        \"" << name << "\" : [";
+    for (int c = 0; c < 3; ++c) {
+      ofs << "\n            [";
+      for (int b = 0; b < kHistogramBins; ++b) {
+        ofs << (b > 0 && b % 16 == 0 ? ",\n             " : b > 0 ? ", " : "")
+            << histogram[c][b];
+      }
+      ofs << "]" << (c < 2 ? "," : "");
+    }
+    ofs << "],\n";
+  }
+};
+
+} // namespace surround360
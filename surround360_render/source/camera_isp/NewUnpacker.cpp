@@ -12,16 +12,24 @@ extern "C" {
 #include <sys/types.h>
 }
 
+#include <algorithm>
 #include <functional>
 #include <future>
 #include <iomanip>
-#include <queue>
+#include <memory>
+#include <mutex>
 #include <set>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
 #include "BinaryFootageFile.hpp"
+#include "BoundedQueue.h"
 #include "CameraIspPipe.h"
+#include "CameraIspPipePool.h"
+#include "CompiledIspConfig.h"
+#include "DefectPixelMap.h"
+#include "FootageSet.hpp"
+#include "FrameFile.h"
 #include "Raw12Converter.hpp"
 #include "StringUtil.h"
 #include "SystemUtil.h"
@@ -34,11 +42,20 @@ using namespace surround360;
 using namespace surround360::util;
 
 DEFINE_string(isp_dir,          "",     "directory containing ISP config files");
+DEFINE_string(isp_cache_dir,    "",     "directory for <serial>.ispc compiled ISP configs, rebuilt when the JSON config changes (optional)");
+DEFINE_string(defect_map_dir,   "",     "directory containing <serial>.json defect pixel maps from FindDefectPixels (optional)");
 DEFINE_string(output_dir,       "",     "output directory");
 DEFINE_string(output_raw_dir,   "",     "output directory for raw images (will not save if empty)");
+DEFINE_string(output_stats_dir, "",     "output directory for per frame ISP statistics as JSON (will not save if empty)");
+DEFINE_string(output_format,    "png",  "output image format: png, or frm for frame files that load without decoding");
+DEFINE_bool(compress_frames,    false,  "LZ4 compress frm output");
 DEFINE_string(bin_list,         "",     "comma-separated list of .bin files");
+DEFINE_string(footage_index,    "",     "footage index file, cached next to the first .bin file if empty");
 DEFINE_int32(start_frame,       0,      "start frame (per camera)");
 DEFINE_int32(frame_count,       0,      "number of frames to unpack (per camera)");
+DEFINE_int32(frames_in_flight,  0,      "number of frames processed at once, each holding one output image; 0 for one per core");
+DEFINE_double(progress_interval, 10.0,  "seconds between per camera progress reports");
+DEFINE_int32(readahead_frames,  BinaryFootageFile::kDefaultFramesAhead, "frames of all cameras to prefetch ahead of the slowest camera");
 
 void makeCameraDir(const string outDir, const uint32_t serial) {
   const string dir = outDir + "/" + to_string(serial);
@@ -56,107 +73,279 @@ string createFilename(
     + "/" + intToStringZeroPad(frameIndex, kNumDigits) + extension;
 }
 
+// One camera of the rig and everything needed to process its frames. Set
+// up before any frame is scheduled, so workers only read it.
+struct CameraJob {
+  const FootageSet* footage;
+  int cameraNumber;
+  uint32_t serial;
+  int startFrame;
+  int endFrame;
+  string json;
+  DefectPixelMap defectPixelMap;
+
+  // Progress, guarded by the scheduler's progress lock
+  int framesDone;
+  double busySec;
+};
+
+// A frame of a camera to unpack
+struct FrameTask {
+  CameraJob* camera;
+  int frameIndex;
+};
+
+void processFrame(
+    const CameraJob& camera,
+    const int frameIndex,
+    CameraIspPipePool& ispPool,
+    vector<uint8_t>& decodeBuffer,
+    vector<uint8_t>& coloredImage) {
+
+  const FootageSet& footage = *camera.footage;
+  const uint32_t serial = camera.serial;
+  const DefectPixelMap& defectPixelMap = camera.defectPixelMap;
+  auto frame = footage.getFrame(frameIndex, camera.cameraNumber, decodeBuffer);
+  const auto width = footage.getMetadata().width;
+  const auto height = footage.getMetadata().height;
+
+  // The ISP unpacks the frame itself unless the raw image is saved
+  // or has defect pixels to correct first
+  const bool unpack =
+    !FLAGS_output_raw_dir.empty() || !defectPixelMap.empty();
+  unique_ptr<vector<uint16_t>> upscaled;
+  if (unpack) {
+    upscaled = Raw12Converter::convertFrame(frame, width, height);
+  }
+
+  if (!FLAGS_output_raw_dir.empty()) {
+    const string filenameRaw =
+      createFilename(FLAGS_output_raw_dir, serial, frameIndex, ".tiff");
+    Mat rawImage(height, width, CV_16UC1, upscaled->data());
+    imwriteExceptionOnFail(filenameRaw, rawImage, util::tiffParams);
+  }
+
+  static const bool kFast = false;
+  static const int kOutputBpp = 16;
+  auto isp = ispPool.acquire(serial, kOutputBpp, width, height, [&] {
+    unique_ptr<CameraIspPipe> newIsp;
+    const string compiledFilename =
+      FLAGS_isp_cache_dir + "/" + to_string(serial) + ".ispc";
+    if (!FLAGS_isp_cache_dir.empty()) {
+      const CompiledIspConfig compiled(compiledFilename);
+      if (compiled.matches(camera.json, kOutputBpp, false)) {
+        newIsp = make_unique<CameraIspPipe>(compiled, kFast);
+      }
+    }
+    if (!newIsp) {
+      newIsp = make_unique<CameraIspPipe>(camera.json, kFast, kOutputBpp);
+      newIsp->enableToneMap();
+      // Only a cache, and other workers may be writing the same one
+      if (!FLAGS_isp_cache_dir.empty() &&
+          !newIsp->saveCompiledConfig(compiledFilename, camera.json)) {
+        LOG(WARNING) << "Could not save compiled ISP config " << compiledFilename;
+      }
+    }
+    newIsp->setBitsPerPixel(footage.getBitsPerPixel());
+    newIsp->setDefectPixelMap(defectPixelMap);
+    newIsp->setCollectStatistics(!FLAGS_output_stats_dir.empty());
+    // Sizes the tables, the input is bound per frame
+    newIsp->loadImage(nullptr, width, height);
+    newIsp->initPipe();
+    return newIsp;
+  });
+
+  // Only the buffers change from frame to frame
+  if (unpack) {
+    isp->loadImage(reinterpret_cast<uint8_t*>(upscaled->data()), width, height);
+  } else {
+    isp->loadPackedImage(frame, width, height);
+  }
+  coloredImage.resize(width * height * 3 * sizeof(uint16_t));
+  isp->getImage(coloredImage.data());
+  footage.releaseFrame(frameIndex, camera.cameraNumber);
+  if (!FLAGS_output_stats_dir.empty()) {
+    isp->getStatistics().save(
+      createFilename(FLAGS_output_stats_dir, serial, frameIndex, ".json"));
+  }
+  ispPool.release(serial, kOutputBpp, width, height, move(isp));
+
+  Mat outputImage(height, width, CV_16UC3, coloredImage.data());
+  const string filename = createFilename(
+    FLAGS_output_dir, serial, frameIndex, "." + FLAGS_output_format);
+  if (FLAGS_output_format == kFrameFileExtension) {
+    writeFrameFile(
+      filename,
+      outputImage,
+      serial,
+      frameIndex,
+      FLAGS_compress_frames ? FRAME_FILE_LZ4 : FRAME_FILE_UNCOMPRESSED);
+  } else {
+    imwriteExceptionOnFail(filename, outputImage);
+  }
+}
+
+void logProgress(const vector<unique_ptr<CameraJob>>& cameras, const double elapsedSec) {
+  int framesDone = 0;
+  int framesTotal = 0;
+  for (const auto& camera : cameras) {
+    const int frames = camera->endFrame - camera->startFrame + 1;
+    framesDone += camera->framesDone;
+    framesTotal += frames;
+    LOG(INFO) << "Camera " << camera->serial << ": "
+              << camera->framesDone << "/" << frames << " frames, "
+              << (camera->framesDone > 0 ? camera->busySec / camera->framesDone : 0.0)
+              << " sec/frame";
+  }
+  LOG(INFO) << "Percent done " << (framesTotal > 0 ? framesDone * 100 / framesTotal : 100)
+            << "% (" << framesDone / elapsedSec << " frames/sec)";
+}
+
 int main(int argc, char *argv[]) {
   initSurround360(argc, argv);
   requireArg(FLAGS_isp_dir, "isp_dir");
   requireArg(FLAGS_output_dir, "output_dir");
   requireArg(FLAGS_bin_list, "bin_list");
-
-  static unordered_map<uint32_t, string> ispConfigurations;
-  vector<BinaryFootageFile> footageFiles;
-
-  std::istringstream binList(FLAGS_bin_list);
-  std::string binFile;
-  while (std::getline(binList, binFile, ',')) {
-    footageFiles.emplace_back(binFile);
+  if (FLAGS_output_format != "png" && FLAGS_output_format != kFrameFileExtension) {
+    throw VrCamException("unsupported output format: " + FLAGS_output_format);
+  }
+  if (FLAGS_compress_frames && !frameFileLz4Available()) {
+    throw VrCamException("--compress_frames needs a build with LZ4");
   }
 
+  FootageSet footage(FootageSet::splitFileList(FLAGS_bin_list), FLAGS_footage_index);
+  LOG(INFO) << "Reading " << FLAGS_bin_list << "...";
+  footage.open();
+  LOG(INFO) << (footage.isIndexCached() ? "Loaded" : "Built") << " footage index "
+            << footage.getIndexPath() << ": " << footage.getNumberOfCameras()
+            << " cameras, " << footage.getNumberOfFrames() << " frames";
+  // Workers finish frames out of order, so a frame stays in the page
+  // cache until its worker releases it
+  footage.setReadaheadWindow(
+    FLAGS_readahead_frames, BinaryFootageFile::kDefaultFramesBehind, true);
+
+  // Set up every camera on this thread, so the output directories are
+  // settled before any work starts
   set<uint32_t> serialNumbers;
+  vector<unique_ptr<CameraJob>> cameras;
+  int lastFrame = FLAGS_start_frame;
+  for (int cameraNumber = 0; cameraNumber < footage.getNumberOfCameras(); ++cameraNumber) {
+    unique_ptr<CameraJob> camera(new CameraJob());
+    camera->footage = &footage;
+    camera->cameraNumber = cameraNumber;
+    camera->startFrame = FLAGS_start_frame;
+    camera->endFrame = FLAGS_frame_count == 0
+      ? footage.getNumberOfFrames() - 1
+      : min(int(footage.getNumberOfFrames()) - 1, FLAGS_start_frame + FLAGS_frame_count - 1);
+    camera->framesDone = 0;
+    camera->busySec = 0;
+    camera->serial = footage.getCamera(cameraNumber).serial;
+    serialNumbers.insert(camera->serial);
+    makeCameraDir(FLAGS_output_dir, camera->serial);
+
+    if (!FLAGS_output_raw_dir.empty()) {
+      makeCameraDir(FLAGS_output_raw_dir, camera->serial);
+    }
 
-  for (auto& footageFile : footageFiles) {
-    LOG(INFO) << "Reading " << footageFile.getFilename() << "...";
-
-    footageFile.open();
-    using futureType = std::future<void>;
-    vector<futureType> taskHandles;
-    const int numCameras = footageFile.getNumberOfCameras();
-    vector<uint32_t> cameraIndexToSerial(numCameras);
-
-    const int startFrame = FLAGS_start_frame;
-    const int endFrame = FLAGS_frame_count == 0
-      ? footageFile.getNumberOfFrames() - 1
-      : startFrame + FLAGS_frame_count - 1;
-
-    for (int cameraIndex = 0; cameraIndex < numCameras; ++cameraIndex) {
-      auto taskHandle = std::async(
-        std::launch::async,
-        [=, &footageFile, &serialNumbers] {
-          string json;
-          int percentDonePrev = 0;
-          for (int frameIndex = startFrame; frameIndex <= endFrame; ++frameIndex) {
-            auto frame = footageFile.getFrame(frameIndex, cameraIndex);
-            const auto serial = reinterpret_cast<const uint32_t*>(frame)[1];
-
-            if (frameIndex == startFrame) {
-              serialNumbers.insert(serial);
-              makeCameraDir(FLAGS_output_dir, serial);
-
-              if (!FLAGS_output_raw_dir.empty()) {
-                makeCameraDir(FLAGS_output_raw_dir, serial);
-              }
-
-              const string fname(FLAGS_isp_dir + "/" + to_string(serial) + ".json");
-              ifstream ifs(fname, std::ios::in);
-              json = string(
-                (std::istreambuf_iterator<char>(ifs)),
-                (std::istreambuf_iterator<char>()));
-            }
-
-            const auto width = footageFile.getMetadata().width;
-            const auto height = footageFile.getMetadata().height;
-
-            auto upscaled = Raw12Converter::convertFrame(frame, width, height);
-
-            if (!FLAGS_output_raw_dir.empty()) {
-              const string filenameRaw =
-                createFilename(FLAGS_output_raw_dir, serial, frameIndex, ".tiff");
-              Mat rawImage(height, width, CV_16UC1, upscaled->data());
-              imwriteExceptionOnFail(filenameRaw, rawImage, util::tiffParams);
-            }
-
-            const int imageSize = width * height * 3 * sizeof(uint16_t);
-            auto coloredImage = make_unique<vector<uint8_t>>(imageSize);
-
-            static const bool kFast = false;
-            static const int kOutputBpp = 16;
-            CameraIspPipe isp(json, kFast, kOutputBpp);
-            isp.setBitsPerPixel(footageFile.getBitsPerPixel());
-            isp.enableToneMap();
-            isp.loadImage(reinterpret_cast<uint8_t*>(upscaled->data()), width, height);
-            isp.setup();
-            isp.initPipe();
-            isp.getImage(reinterpret_cast<uint8_t*>(coloredImage->data()));
-
-            Mat outputImage(height, width, CV_16UC3, coloredImage->data());
-            const string filename =
-              createFilename(FLAGS_output_dir, serial, frameIndex, ".png");
-            imwriteExceptionOnFail(filename, outputImage);
-
-            if (cameraIndex == 0) {
-              const int percentDoneCurr =
-                (frameIndex - startFrame + 1) * 100 / FLAGS_frame_count;
-              LOG_IF(INFO, percentDoneCurr != percentDonePrev)
-                << "Percent done " << percentDoneCurr << "%";
-              percentDonePrev = percentDoneCurr;
-            }
-          }});
-      taskHandles.push_back(move(taskHandle));
+    if (!FLAGS_output_stats_dir.empty()) {
+      makeCameraDir(FLAGS_output_stats_dir, camera->serial);
     }
 
-    for (auto handleIdx = 0; handleIdx < taskHandles.size(); ++handleIdx) {
-      taskHandles[handleIdx].get();
+    const string fname(FLAGS_isp_dir + "/" + to_string(camera->serial) + ".json");
+    ifstream ifs(fname, std::ios::in);
+    camera->json = string(
+      (std::istreambuf_iterator<char>(ifs)),
+      (std::istreambuf_iterator<char>()));
+
+    if (!FLAGS_defect_map_dir.empty()) {
+      const string defectFilename(
+        FLAGS_defect_map_dir + "/" + to_string(camera->serial) + ".json");
+      if (ifstream(defectFilename).good()) {
+        camera->defectPixelMap = DefectPixelMap::load(defectFilename);
+      } else {
+        LOG(WARNING) << "No defect pixel map for camera " << camera->serial;
+      }
+    }
+
+    lastFrame = max(lastFrame, camera->endFrame);
+    cameras.push_back(move(camera));
+  }
+
+  // Frames are queued in capture order across all cameras and picked up by
+  // whichever worker is free, so cameras with bigger or slower files don't
+  // hold up the rest. Each worker owns one output image, which bounds the
+  // memory in use.
+  const int numWorkers = FLAGS_frames_in_flight > 0
+    ? FLAGS_frames_in_flight
+    : max(1u, std::thread::hardware_concurrency());
+  BoundedQueue<FrameTask> tasks(numWorkers);
+  CameraIspPipePool ispPool;
+  std::mutex progressMutex;
+  const double startTime = getCurrTimeSec();
+  double lastReportTime = startTime;
+
+  vector<std::future<void>> workers;
+  for (int i = 0; i < numWorkers; ++i) {
+    workers.push_back(std::async(std::launch::async, [&] {
+      vector<uint8_t> decodeBuffer;
+      vector<uint8_t> coloredImage;
+      FrameTask task;
+      try {
+        while (tasks.pop(task)) {
+          const double frameStartTime = getCurrTimeSec();
+          processFrame(
+            *task.camera, task.frameIndex, ispPool, decodeBuffer, coloredImage);
+
+          lock_guard<mutex> lock(progressMutex);
+          const double now = getCurrTimeSec();
+          ++task.camera->framesDone;
+          task.camera->busySec += now - frameStartTime;
+          if (now - lastReportTime >= FLAGS_progress_interval) {
+            logProgress(cameras, now - startTime);
+            lastReportTime = now;
+          }
+        }
+      } catch (...) {
+        // Stop scheduling and let the other workers drain
+        tasks.close();
+        throw;
+      }
+    }));
+  }
+
+  bool scheduling = true;
+  for (int frameIndex = FLAGS_start_frame; scheduling && frameIndex <= lastFrame; ++frameIndex) {
+    for (auto& camera : cameras) {
+      if (frameIndex <= camera->endFrame) {
+        // fails once a worker gave up
+        scheduling = tasks.push({camera.get(), frameIndex});
+        if (!scheduling) {
+          break;
+        }
+      }
     }
   }
+  tasks.close();
+
+  for (auto& worker : workers) {
+    worker.get();
+  }
+  logProgress(cameras, getCurrTimeSec() - startTime);
+
+  for (const auto& footageFile : footage.getFiles()) {
+    const BinaryFootageFile::ReadaheadStats stats = footageFile->getReadaheadStats();
+    LOG(INFO) << footageFile->getFilename() << ": "
+              << stats.framesStalled << "/" << stats.framesRead
+              << " frames waited for the disk, for " << stats.stallSec << " sec. "
+              << stats.bytesPrefetched / (1 << 20) << " MB prefetched, "
+              << stats.bytesEvicted / (1 << 20) << " MB evicted, "
+              << int(100 * footageFile->getResidency(
+                   FLAGS_start_frame, lastFrame - FLAGS_start_frame + 1))
+              << "% of the frames read still cached";
+  }
+
+  LOG(INFO) << "ISP pipelines constructed: " << ispPool.getConstructedCount()
+            << " reused: " << ispPool.getReusedCount();
 
   // Rename output directories from serial number to camN, sorted by serial
   // number
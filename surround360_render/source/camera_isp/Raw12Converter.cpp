@@ -1,13 +1,117 @@
 #include "Raw12Converter.hpp"
 
+#include <functional>
+
+#include "CpuFeatures.h"
+#include "MikeUtil.h"
+
+#ifdef __SSSE3__
+#include <immintrin.h>
+#endif
+
 using namespace surround360;
+using namespace surround360::util;
 using namespace std;
 
-unique_ptr<vector<uint16_t>> Raw12Converter::convertFrame(
-  const void* rawFrame, const size_t width, const size_t height) {
-  auto frame = reinterpret_cast<const uint8_t*>(rawFrame);
-  auto result = make_unique<vector<uint16_t>>(width * height);
+namespace {
+
+// A pair of pixels is packed into bytes b0 b1 b2 as
+//   p0 = b0 << 4 | (b1 & 0xF)
+//   p1 = b2 << 4 | b1 >> 4
+// and expanded to 16 bits as p << 4 | p >> 8
+inline void unpackPair(const uint8_t* packed, uint16_t* output) {
+  const uint16_t b0 = packed[0];
+  const uint16_t b1 = packed[1];
+  const uint16_t b2 = packed[2];
+  const uint16_t p0 = b0 << 4 | (b1 & 0xF);
+  const uint16_t p1 = b2 << 4 | b1 >> 4;
+  output[0] = p0 << 4 | p0 >> 8;
+  output[1] = p1 << 4 | p1 >> 8;
+}
+
+#ifdef __SSSE3__
+// Each byte triple is shuffled into two little endian 16 bit lanes,
+// w0 = b0 << 8 | b1 and w1 = b2 << 8 | b1. Both outputs then take the high
+// byte of w, a middle nibble from b1 and the top nibble of w in the low
+// bits. The middle nibble is the low one of b1 for even pixels, so even
+// lanes are shifted up by 4 with a multiply.
+inline __m128i unpack8(const __m128i packed) {
+  const __m128i kShuffle = _mm_setr_epi8(
+    1, 0, 1, 2, 4, 3, 4, 5, 7, 6, 7, 8, 10, 9, 10, 11);
+  const __m128i kMiddleShift = _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1);
+  const __m128i w = _mm_shuffle_epi8(packed, kShuffle);
+  const __m128i high = _mm_and_si128(w, _mm_set1_epi16(int16_t(0xFF00)));
+  const __m128i middle = _mm_and_si128(
+    _mm_mullo_epi16(w, kMiddleShift), _mm_set1_epi16(0x00F0));
+  const __m128i low = _mm_srli_epi16(w, 12);
+  return _mm_or_si128(_mm_or_si128(high, middle), low);
+}
+
+// Unpacks 8 pixels from 12 bytes while 16 bytes can be read
+size_t convertRowSsse3(const uint8_t* row, const size_t width, uint16_t* output) {
+  size_t x = 0;
+  for (; x + 11 <= width; x += 8) {
+    const __m128i packed =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x / 2 * 3));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + x), unpack8(packed));
+  }
+  return x;
+}
+
+// Unpacks 16 pixels from 24 bytes, 12 in each 128 bit lane, while 28 bytes
+// can be read
+__attribute__((target("avx2")))
+size_t convertRowAvx2(const uint8_t* row, const size_t width, uint16_t* output) {
+  const __m256i kShuffle = _mm256_setr_epi8(
+    1, 0, 1, 2, 4, 3, 4, 5, 7, 6, 7, 8, 10, 9, 10, 11,
+    1, 0, 1, 2, 4, 3, 4, 5, 7, 6, 7, 8, 10, 9, 10, 11);
+  const __m256i kMiddleShift = _mm256_setr_epi16(
+    16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1);
+  size_t x = 0;
+  for (; x + 19 <= width; x += 16) {
+    const uint8_t* p = row + x / 2 * 3;
+    const __m256i packed = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+    const __m256i w = _mm256_shuffle_epi8(packed, kShuffle);
+    const __m256i high = _mm256_and_si256(w, _mm256_set1_epi16(int16_t(0xFF00)));
+    const __m256i middle = _mm256_and_si256(
+      _mm256_mullo_epi16(w, kMiddleShift), _mm256_set1_epi16(0x00F0));
+    const __m256i low = _mm256_srli_epi16(w, 12);
+    _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(output + x),
+      _mm256_or_si256(_mm256_or_si256(high, middle), low));
+  }
+  return x;
+}
+#endif
+
+} // namespace
+
+void Raw12Converter::convertRow(
+    const uint8_t* row,
+    const size_t width,
+    uint16_t* output) {
 
+  size_t x = 0;
+#ifdef __SSSE3__
+  static const bool useAvx2 = CpuFeatures::get().avx2;
+  x = useAvx2
+    ? convertRowAvx2(row, width, output)
+    : convertRowSsse3(row, width, output);
+#endif
+  for (; x < width; x += 2) {
+    unpackPair(row + x / 2 * 3, output + x);
+  }
+}
+
+void Raw12Converter::convertFrameScalar(
+    const void* rawFrame,
+    const size_t width,
+    const size_t height,
+    uint16_t* output) {
+
+  auto frame = reinterpret_cast<const uint8_t*>(rawFrame);
   uint32_t index = 0;
 
   for (size_t y = 0; y < height; ++y) {
@@ -24,9 +128,45 @@ unique_ptr<vector<uint16_t>> Raw12Converter::convertFrame(
         unswizzled = lo << 4 | (hi & 0xF);
       }
 
-      (*result)[y * width + x] = unswizzled << 4 | unswizzled >> 8;
+      output[y * width + x] = unswizzled << 4 | unswizzled >> 8;
     }
   }
+}
+
+void Raw12Converter::convertFrame(
+    const void* rawFrame,
+    const size_t width,
+    const size_t height,
+    uint16_t* output,
+    const bool parallel) {
+
+  // Rows of an odd width don't start on a pixel pair
+  if (width % 2 != 0) {
+    convertFrameScalar(rawFrame, width, height, output);
+    return;
+  }
 
+  auto frame = reinterpret_cast<const uint8_t*>(rawFrame);
+  const size_t rowBytes = width / 2 * 3;
+  if (parallel) {
+    const int kRowGrain = 16;
+    parallel_for_<int>(0, height, [&](int y) {
+      convertRow(frame + y * rowBytes, width, output + y * width);
+    }, kRowGrain);
+  } else {
+    for (size_t y = 0; y < height; ++y) {
+      convertRow(frame + y * rowBytes, width, output + y * width);
+    }
+  }
+}
+
+unique_ptr<vector<uint16_t>> Raw12Converter::convertFrame(
+    const void* rawFrame,
+    const size_t width,
+    const size_t height,
+    const bool parallel) {
+
+  auto result = make_unique<vector<uint16_t>>(width * height);
+  convertFrame(rawFrame, width, height, result->data(), parallel);
   return result;
 }
@@ -7,7 +7,32 @@
 namespace surround360 {
 class Raw12Converter {
  public:
+  // Unpacks a frame of 12 bit pixel pairs packed into 3 bytes to 16 bits
+  // per pixel, replicating the top bits into the low nibble. Rows are
+  // unpacked with SSSE3 or AVX2 shuffles when available, and in parallel
+  // if requested.
   static std::unique_ptr<std::vector<uint16_t>> convertFrame(
-    const void* rawFrame, const size_t width, const size_t height);
+    const void* rawFrame,
+    const size_t width,
+    const size_t height,
+    const bool parallel = false);
+
+  // Same as above into an existing buffer of width * height pixels
+  static void convertFrame(
+    const void* rawFrame,
+    const size_t width,
+    const size_t height,
+    uint16_t* output,
+    const bool parallel = false);
+
+  // The scalar reference implementation
+  static void convertFrameScalar(
+    const void* rawFrame,
+    const size_t width,
+    const size_t height,
+    uint16_t* output);
+
+ private:
+  static void convertRow(const uint8_t* row, const size_t width, uint16_t* output);
 };
 }
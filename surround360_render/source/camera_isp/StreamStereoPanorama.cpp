@@ -0,0 +1,358 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+// Renders stereo panoramas straight from capture .bin files in a single
+// process. Each frame of every camera goes through the Halide ISP and the
+// images are handed to the render in memory, so no intermediate images are
+// written unless asked for. The ISP stage runs ahead of the render by at
+// most --queue_frames frames. Rigs in the old format are rectified in the
+// render with --ring_rectify_file, as in TestRenderStereoPanorama.
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "CameraIspPipe.h"
+#include "CameraIspPipePool.h"
+#include "CompiledIspConfig.h"
+#include "DefectPixelMap.h"
+#include "FootageSet.hpp"
+#include "FrameFile.h"
+#include "MikeUtil.h"
+#include "Raw12Converter.hpp"
+#include "StringUtil.h"
+#include "SystemUtil.h"
+#include "VrCamException.h"
+#include "test/RenderStereoPanorama.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace std;
+using namespace cv;
+using namespace surround360;
+using namespace surround360::util;
+
+DEFINE_string(bin_list,         "",     "comma-separated list of .bin files, together holding every camera of the rig");
+DEFINE_string(footage_index,    "",     "footage index file, cached next to the first .bin file if empty");
+DEFINE_string(isp_dir,          "",     "directory containing <serial>.json ISP config files");
+DEFINE_string(isp_cache_dir,    "",     "directory for <serial>.ispc compiled ISP configs, rebuilt when the JSON config changes (optional)");
+DEFINE_string(defect_map_dir,   "",     "directory containing <serial>.json defect pixel maps from FindDefectPixels (optional)");
+DEFINE_int32(start_frame,       0,      "start frame (per camera)");
+DEFINE_int32(frame_count,       0,      "number of frames to render, 0 for all");
+DEFINE_string(output_eqr_dir,   "",     "directory for the eqr_<frame>.png stereo equirects");
+DEFINE_string(output_cube_dir,  "",     "directory for the cube_<frame>.png stereo cubemaps (optional)");
+DEFINE_string(debug_isp_dir,    "",     "directory for the ISP output of every camera as <camera id>/<frame>.frm, which TestRenderStereoPanorama can render from (optional)");
+DEFINE_int32(queue_frames,      2,      "number of frames the ISP may run ahead of the render");
+DEFINE_bool(keep_flow_files,    false,  "keep the flow data of every frame instead of only the previous one");
+
+static const int kNumDigits = 6;
+
+// One camera of the rig
+struct FootageCamera {
+  const FootageSet* footage;
+  int cameraNumber;
+  uint32_t serial;
+  string cameraId;
+  string ispConfig;
+  DefectPixelMap defectPixelMap;
+};
+
+// The ISP output of every camera for one frame, keyed by camera id
+struct RigFrame {
+  int frameIndex;
+  map<string, Mat> images;
+};
+
+static string readFile(const string& filename) {
+  ifstream ifs(filename, std::ios::in);
+  if (!ifs) {
+    throw VrCamException("failed to read " + filename);
+  }
+  return string(
+    (std::istreambuf_iterator<char>(ifs)),
+    (std::istreambuf_iterator<char>()));
+}
+
+static void makeDirs(const string& dir) {
+  system(string("mkdir -p " + dir).c_str());
+}
+
+// The footage numbers cameras by increasing serial number, so camera N is
+// camN, as NewUnpacker names them
+static vector<FootageCamera> findCameras(const FootageSet& footage) {
+  vector<FootageCamera> cameras(footage.getNumberOfCameras());
+  for (int ordinal = 0; ordinal < cameras.size(); ++ordinal) {
+    const FootageSet::Camera& footageCamera = footage.getCamera(ordinal);
+    FootageCamera& camera = cameras[ordinal];
+    camera.footage = &footage;
+    camera.cameraNumber = ordinal;
+    camera.serial = footageCamera.serial;
+    camera.cameraId = "cam" + to_string(ordinal);
+    camera.ispConfig =
+      readFile(FLAGS_isp_dir + "/" + to_string(camera.serial) + ".json");
+    if (!FLAGS_defect_map_dir.empty()) {
+      const string defectFilename(
+        FLAGS_defect_map_dir + "/" + to_string(camera.serial) + ".json");
+      if (ifstream(defectFilename).good()) {
+        camera.defectPixelMap = DefectPixelMap::load(defectFilename);
+      } else {
+        LOG(WARNING) << "No defect pixel map for camera " << camera.serial;
+      }
+    }
+    LOG(INFO) << camera.cameraId << " = " << camera.serial
+              << " (" << footage.getFilePath(footageCamera.fileIndex)
+              << " camera " << footageCamera.cameraIndex << ")";
+  }
+  return cameras;
+}
+
+// Runs one camera's frame through the ISP. The render reads 8 bit images,
+// so the 16 bit output is reduced to its high byte, exactly as loading the
+// 16 bit PNGs NewUnpacker writes would.
+static Mat runIsp(
+    const FootageCamera& camera,
+    const int frameIndex,
+    CameraIspPipePool& ispPool,
+    vector<uint8_t>& decodeBuffer) {
+
+  const FootageSet& footage = *camera.footage;
+  const int width = footage.getMetadata().width;
+  const int height = footage.getMetadata().height;
+  const uint8_t* frame = footage.getFrame(frameIndex, camera.cameraNumber, decodeBuffer);
+
+  static const bool kFast = false;
+  static const int kOutputBpp = 16;
+  auto isp = ispPool.acquire(camera.serial, kOutputBpp, width, height, [&] {
+    unique_ptr<CameraIspPipe> newIsp;
+    const string compiledFilename =
+      FLAGS_isp_cache_dir + "/" + to_string(camera.serial) + ".ispc";
+    if (!FLAGS_isp_cache_dir.empty()) {
+      const CompiledIspConfig compiled(compiledFilename);
+      if (compiled.matches(camera.ispConfig, kOutputBpp, false)) {
+        newIsp = make_unique<CameraIspPipe>(compiled, kFast);
+      }
+    }
+    if (!newIsp) {
+      newIsp = make_unique<CameraIspPipe>(camera.ispConfig, kFast, kOutputBpp);
+      newIsp->enableToneMap();
+      // Only a cache, and other workers may be writing the same one
+      if (!FLAGS_isp_cache_dir.empty() &&
+          !newIsp->saveCompiledConfig(compiledFilename, camera.ispConfig)) {
+        LOG(WARNING) << "Could not save compiled ISP config " << compiledFilename;
+      }
+    }
+    newIsp->setBitsPerPixel(footage.getBitsPerPixel());
+    newIsp->setDefectPixelMap(camera.defectPixelMap);
+    newIsp->loadImage(nullptr, width, height);
+    newIsp->initPipe();
+    return newIsp;
+  });
+
+  Mat image16(height, width, CV_16UC3);
+  if (camera.defectPixelMap.empty()) {
+    isp->loadPackedImage(frame, width, height);
+  } else {
+    auto unpacked = Raw12Converter::convertFrame(frame, width, height);
+    isp->loadImage(reinterpret_cast<uint8_t*>(unpacked->data()), width, height);
+  }
+  isp->getImage(image16.data);
+  ispPool.release(camera.serial, kOutputBpp, width, height, move(isp));
+
+  if (!FLAGS_debug_isp_dir.empty()) {
+    writeFrameFile(
+      FLAGS_debug_isp_dir + "/" + camera.cameraId + "/"
+        + intToStringZeroPad(frameIndex, kNumDigits) + "." + kFrameFileExtension,
+      image16,
+      camera.serial,
+      frameIndex);
+  }
+
+  Mat image8(height, width, CV_8UC3);
+  const int rowLength = width * 3;
+  for (int y = 0; y < height; ++y) {
+    const uint16_t* src = image16.ptr<uint16_t>(y);
+    uint8_t* dst = image8.ptr<uint8_t>(y);
+    for (int x = 0; x < rowLength; ++x) {
+      dst[x] = src[x] >> 8;
+    }
+  }
+  return image8;
+}
+
+// ISP stage. Every camera of a frame is processed in parallel, then the
+// frame is queued for the render. A failure is kept in error and ends the
+// render once the frames before it are done.
+static void runIspStage(
+    const vector<FootageCamera>& cameras,
+    const int startFrame,
+    const int endFrame,
+    BoundedQueue<RigFrame>& renderQueue,
+    exception_ptr& error) {
+
+  CameraIspPipePool ispPool;
+  vector<vector<uint8_t>> decodeBuffers(cameras.size());
+  try {
+    for (int frameIndex = startFrame; frameIndex <= endFrame; ++frameIndex) {
+      const double startTime = getCurrTimeSec();
+      vector<Mat> images(cameras.size());
+      parallel_for_<int>(0, cameras.size(), [&](int i) {
+        images[i] = runIsp(cameras[i], frameIndex, ispPool, decodeBuffers[i]);
+      }, 1);
+
+      RigFrame rigFrame;
+      rigFrame.frameIndex = frameIndex;
+      for (int i = 0; i < cameras.size(); ++i) {
+        rigFrame.images[cameras[i].cameraId] = images[i];
+      }
+      VLOG(1) << "ISP frame " << frameIndex << ": "
+              << getCurrTimeSec() - startTime << " sec";
+      if (!renderQueue.push(move(rigFrame))) {
+        break;
+      }
+    }
+  } catch (...) {
+    error = current_exception();
+  }
+  renderQueue.close();
+
+  LOG(INFO) << "ISP pipelines constructed: " << ispPool.getConstructedCount()
+            << " reused: " << ispPool.getReusedCount();
+}
+
+// Render stage, on the calling thread. Mirrors the per frame flags and
+// directories batch_process_video.py sets up for TestRenderStereoPanorama.
+static void runRenderStage(
+    const int startFrame,
+    const int frameCount,
+    BoundedQueue<RigFrame>& renderQueue) {
+
+  RigFrame rigFrame;
+  string prevFrameNumber = "NONE";
+  while (renderQueue.pop(rigFrame)) {
+    const double startTime = getCurrTimeSec();
+    const string frameNumber =
+      intToStringZeroPad(rigFrame.frameIndex, kNumDigits);
+    const string debugDir = FLAGS_output_data_dir + "/debug/" + frameNumber;
+    makeDirs(FLAGS_output_data_dir + "/flow/" + frameNumber);
+    makeDirs(debugDir + "/flow_images");
+    makeDirs(debugDir + "/projections");
+
+    FLAGS_frame_number = frameNumber;
+    FLAGS_prev_frame_data_dir = prevFrameNumber;
+    FLAGS_output_equirect_path =
+      FLAGS_output_eqr_dir + "/eqr_" + frameNumber + ".png";
+    FLAGS_output_cubemap_path = FLAGS_output_cube_dir.empty()
+      ? ""
+      : FLAGS_output_cube_dir + "/cube_" + frameNumber + ".png";
+
+    const map<string, Mat>& images = rigFrame.images;
+    renderStereoPanorama([&images](const string& cameraId) {
+      auto it = images.find(cameraId);
+      if (it == images.end()) {
+        throw VrCamException("no footage for camera " + cameraId);
+      }
+      return it->second;
+    });
+
+    // only the previous frame's flow is needed for temporal regularization
+    if (!FLAGS_keep_flow_files && prevFrameNumber != "NONE") {
+      system(string("rm -rf " + FLAGS_output_data_dir + "/flow/" + prevFrameNumber).c_str());
+      if (!FLAGS_save_debug_images) {
+        system(string("rm -rf " + FLAGS_output_data_dir + "/debug/" + prevFrameNumber).c_str());
+      }
+    }
+    prevFrameNumber = frameNumber;
+
+    LOG(INFO) << "Rendered frame " << frameNumber << " in "
+              << getCurrTimeSec() - startTime << " sec ("
+              << rigFrame.frameIndex - startFrame + 1 << "/" << frameCount
+              << ", " << renderQueue.size() << " queued)";
+    rigFrame = RigFrame();
+  }
+}
+
+int main(int argc, char** argv) {
+  initSurround360(argc, argv);
+  requireArg(FLAGS_bin_list, "bin_list");
+  requireArg(FLAGS_isp_dir, "isp_dir");
+  requireArg(FLAGS_output_data_dir, "output_data_dir");
+  requireArg(FLAGS_output_eqr_dir, "output_eqr_dir");
+  if (FLAGS_queue_frames < 1) {
+    throw VrCamException("queue_frames must be at least 1");
+  }
+  if (!FLAGS_imgs_dir.empty()) {
+    throw VrCamException("imgs_dir is not used, images come from bin_list");
+  }
+  // the render reads it every frame, so fail before any ISP work
+  if (!FLAGS_new_rig_format && FLAGS_ring_rectify_file != "NONE" &&
+      !ifstream(FLAGS_ring_rectify_file).good()) {
+    throw VrCamException("file read failed: " + FLAGS_ring_rectify_file);
+  }
+
+  FootageSet footage(FootageSet::splitFileList(FLAGS_bin_list), FLAGS_footage_index);
+  footage.open();
+  const size_t numberOfFrames = footage.getNumberOfFrames();
+
+  const int startFrame = FLAGS_start_frame;
+  const int endFrame = FLAGS_frame_count == 0
+    ? int(numberOfFrames) - 1
+    : min(int(numberOfFrames) - 1, startFrame + FLAGS_frame_count - 1);
+  if (startFrame > endFrame) {
+    throw VrCamException("no frames to render from " + FLAGS_bin_list);
+  }
+
+  const vector<FootageCamera> cameras = findCameras(footage);
+  makeDirs(FLAGS_output_eqr_dir);
+  if (!FLAGS_output_cube_dir.empty()) {
+    makeDirs(FLAGS_output_cube_dir);
+  }
+  if (!FLAGS_debug_isp_dir.empty()) {
+    for (const FootageCamera& camera : cameras) {
+      makeDirs(FLAGS_debug_isp_dir + "/" + camera.cameraId);
+    }
+  }
+
+  const double startTime = getCurrTimeSec();
+  BoundedQueue<RigFrame> renderQueue(FLAGS_queue_frames);
+  exception_ptr ispError;
+  std::thread ispThread(
+    runIspStage,
+    cref(cameras),
+    startFrame,
+    endFrame,
+    ref(renderQueue),
+    ref(ispError));
+  try {
+    runRenderStage(startFrame, endFrame - startFrame + 1, renderQueue);
+  } catch (...) {
+    // let the ISP stage finish its frame and stop
+    renderQueue.close();
+    ispThread.join();
+    throw;
+  }
+  ispThread.join();
+  if (ispError) {
+    rethrow_exception(ispError);
+  }
+
+  const int frameCount = endFrame - startFrame + 1;
+  const double totalTime = getCurrTimeSec() - startTime;
+  LOG(INFO) << "Rendered " << frameCount << " frames in " << totalTime
+            << " sec, " << totalTime / frameCount << " sec/frame";
+  return EXIT_SUCCESS;
+}
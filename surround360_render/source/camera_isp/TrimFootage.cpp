@@ -0,0 +1,281 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+// Writes a clip of a capture session: a range of frames of some or all of
+// its cameras, as a new set of .bin files <output_dir>/0.bin, 1.bin... that
+// the render tools read like the original. Frames are copied file to file
+// with copy_file_range, or sendfile where the kernel or file system doesn't
+// support it, so they never pass through this process. Compressed frames
+// are copied as they are.
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "FootageSet.hpp"
+#include "StringUtil.h"
+#include "SystemUtil.h"
+#include "VrCamException.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace std;
+using namespace surround360;
+using namespace surround360::util;
+
+DEFINE_string(bin_list,       "",   "comma-separated list of .bin files");
+DEFINE_string(footage_index,  "",   "footage index file, cached next to the first .bin file if empty");
+DEFINE_string(output_dir,     "",   "output directory for the trimmed .bin files");
+DEFINE_int32(start_frame,     0,    "first frame to keep (per camera)");
+DEFINE_int32(frame_count,     0,    "number of frames to keep (per camera), 0 for all from start_frame");
+DEFINE_string(cameras,        "",   "comma-separated serial numbers of the cameras to keep, all if empty");
+
+static const size_t kMetadataSize = 4096;
+
+enum CopyMethod {
+  COPY_FILE_RANGE,
+  SENDFILE,
+  READ_WRITE
+};
+
+static const char* kCopyMethodNames[] = {"copy_file_range", "sendfile", "read/write"};
+
+// Copies length bytes between offsets of two files, with the most direct
+// method that works. Falls back to the next method, and keeps it for later
+// copies, when a call fails because the method isn't supported for these
+// files.
+static void copyRange(
+    const int inFd,
+    off_t inOffset,
+    const int outFd,
+    off_t outOffset,
+    size_t length,
+    CopyMethod& method) {
+
+  while (length > 0) {
+    ssize_t copied = -1;
+    if (method == COPY_FILE_RANGE) {
+#ifdef SYS_copy_file_range
+      loff_t in = inOffset;
+      loff_t out = outOffset;
+      copied = syscall(SYS_copy_file_range, inFd, &in, outFd, &out, length, 0);
+#else
+      errno = ENOSYS;
+#endif
+      if (copied < 0 && (errno == ENOSYS || errno == EXDEV ||
+          errno == EINVAL || errno == EOPNOTSUPP)) {
+        method = SENDFILE;
+        continue;
+      }
+    } else if (method == SENDFILE) {
+      if (lseek(outFd, outOffset, SEEK_SET) != outOffset) {
+        throw VrCamException("seek failed: " + string(strerror(errno)));
+      }
+      off_t in = inOffset;
+      copied = sendfile(outFd, inFd, &in, length);
+      if (copied < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        method = READ_WRITE;
+        continue;
+      }
+    } else {
+      static const size_t kBufferSize = 1 << 20;
+      static thread_local vector<uint8_t> buffer(kBufferSize);
+      copied = pread(inFd, buffer.data(), min(length, kBufferSize), inOffset);
+      if (copied > 0 && pwrite(outFd, buffer.data(), copied, outOffset) != copied) {
+        copied = -1;
+      }
+    }
+
+    if (copied < 0 && errno == EINTR) {
+      continue;
+    }
+    if (copied <= 0) {
+      throw VrCamException(
+        string(kCopyMethodNames[method]) + " failed: "
+        + (copied == 0 ? string("unexpected end of file") : string(strerror(errno))));
+    }
+    inOffset += copied;
+    outOffset += copied;
+    length -= copied;
+  }
+}
+
+// Runs of cameras stored next to each other in a frame of a file, copied
+// with one call per frame
+struct CameraRun {
+  uint32_t firstCamera;
+  uint32_t cameraCount;
+};
+
+// Cameras of an input file to keep, in file order
+struct TrimmedFile {
+  uint32_t inputFile;
+  vector<uint32_t> cameraIndices;
+  vector<CameraRun> runs;
+};
+
+static vector<CameraRun> findRuns(const vector<uint32_t>& cameraIndices) {
+  vector<CameraRun> runs;
+  for (const uint32_t camera : cameraIndices) {
+    if (!runs.empty() && runs.back().firstCamera + runs.back().cameraCount == camera) {
+      ++runs.back().cameraCount;
+    } else {
+      runs.push_back({camera, 1});
+    }
+  }
+  return runs;
+}
+
+static vector<TrimmedFile> selectCameras(const FootageSet& footage) {
+  vector<bool> keep(footage.getNumberOfCameras(), FLAGS_cameras.empty());
+  if (!FLAGS_cameras.empty()) {
+    for (const string& serial : stringSplit(FLAGS_cameras, ',')) {
+      const int cameraNumber = footage.findCamera(stoul(serial));
+      if (cameraNumber < 0) {
+        throw VrCamException("camera " + serial + " is not in " + FLAGS_bin_list);
+      }
+      keep[cameraNumber] = true;
+    }
+  }
+
+  vector<TrimmedFile> trimmed(footage.getFiles().size());
+  for (uint32_t fileIndex = 0; fileIndex < trimmed.size(); ++fileIndex) {
+    trimmed[fileIndex].inputFile = fileIndex;
+  }
+  for (uint32_t cameraNumber = 0; cameraNumber < keep.size(); ++cameraNumber) {
+    if (keep[cameraNumber]) {
+      const FootageSet::Camera& camera = footage.getCamera(cameraNumber);
+      trimmed[camera.fileIndex].cameraIndices.push_back(camera.cameraIndex);
+    }
+  }
+
+  // Files left without cameras are dropped
+  vector<TrimmedFile> files;
+  for (TrimmedFile& file : trimmed) {
+    if (!file.cameraIndices.empty()) {
+      sort(file.cameraIndices.begin(), file.cameraIndices.end());
+      file.runs = findRuns(file.cameraIndices);
+      files.push_back(file);
+    }
+  }
+  return files;
+}
+
+// Writes the header of the input file, with the metadata of the clip
+static void writeHeader(
+    const int inFd,
+    const int outFd,
+    const BinaryFootageFile::MetadataHeader& metadata) {
+
+  vector<uint8_t> header(kMetadataSize);
+  if (pread(inFd, header.data(), header.size(), 0) != ssize_t(header.size())) {
+    throw VrCamException("failed to read footage header: " + string(strerror(errno)));
+  }
+  memcpy(header.data(), &metadata, sizeof(metadata));
+  if (pwrite(outFd, header.data(), header.size(), 0) != ssize_t(header.size())) {
+    throw VrCamException("failed to write footage header: " + string(strerror(errno)));
+  }
+}
+
+int main(int argc, char** argv) {
+  initSurround360(argc, argv);
+  requireArg(FLAGS_bin_list, "bin_list");
+  requireArg(FLAGS_output_dir, "output_dir");
+
+  FootageSet footage(FootageSet::splitFileList(FLAGS_bin_list), FLAGS_footage_index);
+  footage.open();
+  LOG(INFO) << (footage.isIndexCached() ? "Loaded" : "Built") << " footage index "
+            << footage.getIndexPath() << ": " << footage.getNumberOfCameras()
+            << " cameras, " << footage.getNumberOfFrames() << " frames";
+
+  const size_t numberOfFrames = footage.getNumberOfFrames();
+  if (FLAGS_start_frame < 0 || size_t(FLAGS_start_frame) >= numberOfFrames) {
+    throw VrCamException(
+      "start frame " + to_string(FLAGS_start_frame) + " is past the "
+      + to_string(numberOfFrames) + " frames of the footage");
+  }
+  const size_t startFrame = FLAGS_start_frame;
+  const size_t frameCount = FLAGS_frame_count == 0
+    ? numberOfFrames - startFrame
+    : min(size_t(FLAGS_frame_count), numberOfFrames - startFrame);
+
+  const vector<TrimmedFile> files = selectCameras(footage);
+  const size_t frameSize = footage.getFrameSize();
+  mkdir(FLAGS_output_dir.c_str(), 0755);
+
+  const double startTime = getCurrTimeSec();
+  size_t bytesCopied = 0;
+  CopyMethod method = COPY_FILE_RANGE;
+  for (uint32_t outputIndex = 0; outputIndex < files.size(); ++outputIndex) {
+    const TrimmedFile& file = files[outputIndex];
+    const BinaryFootageFile& input = *footage.getFiles()[file.inputFile];
+    const string& inputPath = footage.getFilePath(file.inputFile);
+    const string outputPath = FLAGS_output_dir + "/" + to_string(outputIndex) + ".bin";
+
+    const int inFd = open(inputPath.c_str(), O_RDONLY);
+    if (inFd < 0) {
+      throw VrCamException("error opening " + inputPath + ": " + strerror(errno));
+    }
+    const int outFd = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd < 0) {
+      throw VrCamException("error opening " + outputPath + ": " + strerror(errno));
+    }
+
+    BinaryFootageFile::MetadataHeader metadata = input.getMetadata();
+    metadata.fileIndex = outputIndex;
+    metadata.fileCount = files.size();
+    metadata.numberOfCameras = file.cameraIndices.size();
+    writeHeader(inFd, outFd, metadata);
+
+    // Every camera of the file in one copy, or a copy per run per frame
+    const size_t inputCameras = input.getNumberOfCameras();
+    off_t outOffset = kMetadataSize;
+    if (file.cameraIndices.size() == inputCameras) {
+      const size_t length = frameCount * inputCameras * frameSize;
+      copyRange(
+        inFd, kMetadataSize + startFrame * inputCameras * frameSize,
+        outFd, outOffset, length, method);
+      outOffset += length;
+    } else {
+      for (size_t frame = startFrame; frame < startFrame + frameCount; ++frame) {
+        for (const CameraRun& run : file.runs) {
+          const size_t length = run.cameraCount * frameSize;
+          copyRange(
+            inFd, kMetadataSize + (frame * inputCameras + run.firstCamera) * frameSize,
+            outFd, outOffset, length, method);
+          outOffset += length;
+        }
+      }
+    }
+    bytesCopied += outOffset - kMetadataSize;
+
+    close(inFd);
+    if (fsync(outFd) != 0 || close(outFd) != 0) {
+      throw VrCamException("error writing " + outputPath + ": " + strerror(errno));
+    }
+    LOG(INFO) << outputPath << ": " << file.cameraIndices.size() << " cameras of "
+              << inputPath << ", frames " << startFrame << " to "
+              << startFrame + frameCount - 1;
+  }
+
+  const double elapsed = getCurrTimeSec() - startTime;
+  LOG(INFO) << "Copied " << bytesCopied / double(1 << 30) << " GB in " << elapsed
+            << " sec with " << kCopyMethodNames[method];
+  return EXIT_SUCCESS;
+}
@@ -14,13 +14,23 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "BayerCodec.h"
+#include "BoundedQueue.h"
 #include "CvUtil.h"
+#include "FootageReader.hpp"
+#include "Raw12Converter.hpp"
+#include "StringUtil.h"
 #include "SystemUtil.h"
 #include "VrCamException.h"
 
@@ -41,13 +51,112 @@ DEFINE_int32(frame_count,     0,      "number of frames to unpack (per camera)")
 DEFINE_string(dest_path,      "",     "path to folder to unpack images");
 DEFINE_int32(nbits,           8,      "number of bits footage was captured in");
 DEFINE_bool(tagged,           false,  "unpack tagged frames");
+DEFINE_int32(threads,         0,      "number of frames unpacked and written at once, 0 for one per core");
+DEFINE_int32(frames_in_flight, 0,     "number of frames read ahead of the writers, at least --threads");
+DEFINE_string(io_backend,     "auto", "how frames are read: io_uring, pread from a pool of threads, or auto for io_uring if available");
+
+// A frame read from disk, waiting to be unpacked and written
+struct RawFrame {
+  int frameNumber;
+  unsigned int cameraNumber;
+  FootageReader::Frame frame;
+};
+
+// Expands 8 or 12 bit pixels to 16 bits by replicating the top bits
+static void unpackFrame(
+    const unsigned char* imgbuf,
+    const uint32_t imageWidth,
+    const uint32_t imageHeight,
+    const uint32_t nBits,
+    Mat& outImage) {
+
+  uint16_t* output = outImage.ptr<uint16_t>(0);
+  if (nBits == 8) {
+    const size_t numPixels = size_t(imageWidth) * imageHeight;
+    for (size_t i = 0; i < numPixels; ++i) {
+      output[i] = imgbuf[i] * 0x101;
+    }
+  } else if (nBits == 12) {
+    Raw12Converter::convertFrame(imgbuf, imageWidth, imageHeight, output);
+  }
+}
+
+// How many frames CameraControl queued off their camera's consumer, from
+// the stats.txt it writes next to the .bin files. 0 if there is none.
+static int countRerouted() {
+  static const string kReroutedStat = "Images queued off their camera's consumer: ";
+  ifstream statsFile(FLAGS_binary_prefix + "/stats.txt");
+  int rerouted = 0;
+  string line;
+  while (getline(statsFile, line)) {
+    if (line.compare(0, kReroutedStat.size(), kReroutedStat) == 0) {
+      rerouted += stoi(line.substr(kReroutedStat.size()));
+    }
+  }
+  return rerouted;
+}
+
+// The frame and camera in each slot of each .bin file, from the .routing
+// files CameraControl writes next to them. Empty if there are none, which
+// is only right if every frame went to its camera's consumer.
+static vector<vector<pair<int, unsigned int>>> readRouting(const int fileCount) {
+  vector<vector<pair<int, unsigned int>>> routing(fileCount);
+  for (int i = 0; i < fileCount; ++i) {
+    const string routingPath = FLAGS_binary_prefix + "/" + to_string(i) + ".routing";
+    ifstream routingFile(routingPath);
+    if (!routingFile) {
+      if (i > 0) {
+        throw VrCamException("file read failed:" + routingPath);
+      }
+      const int rerouted = countRerouted();
+      if (rerouted > 0) {
+        throw VrCamException(
+          to_string(rerouted) + " frames were queued off their camera's consumer, "
+          + "but there are no routing files to place them by: " + routingPath);
+      }
+      return {};
+    }
+    int frameNumber;
+    unsigned int cameraNumber;
+    while (routingFile >> frameNumber >> cameraNumber) {
+      routing[i].push_back(make_pair(frameNumber, cameraNumber));
+    }
+    if (!routingFile.eof()) {
+      throw VrCamException("bad routing file: " + routingPath);
+    }
+  }
+  return routing;
+}
+
+// The frames CameraControl wrote after the camera had started capturing
+// over them, from the .overwritten files next to the .bin files, as
+// (frame, camera)
+static set<pair<int, unsigned int>> readOverwritten(const int fileCount) {
+  set<pair<int, unsigned int>> overwritten;
+  for (int i = 0; i < fileCount; ++i) {
+    const string overwrittenPath = FLAGS_binary_prefix + "/" + to_string(i) + ".overwritten";
+    ifstream overwrittenFile(overwrittenPath);
+    if (!overwrittenFile) {
+      continue;
+    }
+    int frameNumber;
+    unsigned int cameraNumber;
+    while (overwrittenFile >> frameNumber >> cameraNumber) {
+      overwritten.insert(make_pair(frameNumber, cameraNumber));
+    }
+    if (!overwrittenFile.eof()) {
+      throw VrCamException("bad overwritten frames file: " + overwrittenPath);
+    }
+  }
+  return overwritten;
+}
 
 int main(int argc, char** argv) {
   initSurround360(argc, argv);
   requireArg(FLAGS_binary_prefix, "binary_prefix");
   requireArg(FLAGS_dest_path, "dest_path");
 
-  int fd[FLAGS_file_count];
+  vector<int> fd(FLAGS_file_count);
   vector<string> binFilenames;
   for (int i = 0; i < FLAGS_file_count; ++i) {
     string fileName(FLAGS_binary_prefix + "/" + to_string(i) + ".bin");
@@ -161,10 +270,6 @@ int main(int argc, char** argv) {
     cameraCount = cameraNames.size();
   }
 
-  // Preallocate the output image
-  Mat outImage(imageHeight, imageWidth, CV_16U);
-  void* outputPtr = outImage.ptr(0);
-
   // Create dest directory
   struct stat st = {0};
   string destPath(FLAGS_dest_path);
@@ -173,11 +278,10 @@ int main(int argc, char** argv) {
   }
 
   // Read raw bytes and assemble them into images
-  off_t pos[FLAGS_file_count];
+  vector<off_t> pos(FLAGS_file_count);
 
   // Each bin file can have different number of frames
   int frameCount[FLAGS_file_count];
-  size_t readCount[FLAGS_file_count];
 
   // Total number of frames is properly updated later if FLAGS_frame_count is 0
   int totalFrameCount = FLAGS_frame_count * cameraCount;
@@ -209,100 +313,230 @@ int main(int argc, char** argv) {
     if (FLAGS_frame_count == 0) {
       totalFrameCount += frameCount[i];
     }
-
-    readCount[i] = -1;
   }
 
-  const int lastFrame = FLAGS_start_frame * cameraCount + totalFrameCount - 1;
-  std::vector<unsigned char> imgbuf(imageSize);
-
-  bool isDone = false;
-  int percentDonePrev = 0;
+  // Serial numbers of tagged footage are in the frames themselves. Read them
+  // from the start frame of each camera, so that the output directories can
+  // be created once here.
+  vector<string> cameraSerials(cameraCount);
   std::set<std::string> serialNumbers;
-  for (int frameNumber = FLAGS_start_frame; frameNumber < FLAGS_start_frame + totalFrameCount / cameraCount; ++frameNumber) {
-    for (unsigned int cameraNumber = 0; cameraNumber < cameraCount; ++cameraNumber) {
-      const int frameIndex = frameNumber * cameraCount + cameraNumber;
+  for (unsigned int cameraNumber = 0; cameraNumber < cameraCount; ++cameraNumber) {
+    if (FLAGS_tagged) {
       const int idx = cameraNumber % FLAGS_file_count;
-      readCount[idx] = pread(fd[idx], &imgbuf[0], imageSize, pos[idx]);
+      const off_t offset = pos[idx] + imageSize * (cameraNumber / FLAGS_file_count);
+      uint32_t tag[2];
+      if (pread(fd[idx], tag, sizeof(tag), offset) != sizeof(tag)) {
+        continue;
+      }
+      cameraSerials[cameraNumber] = to_string(tag[1]);
+    } else {
+      cameraSerials[cameraNumber] = cameraNames[cameraNumber];
+    }
+    if (serialNumbers.insert(cameraSerials[cameraNumber]).second) {
+      const string destPathSerialNumber(
+        FLAGS_dest_path + "/" + cameraSerials[cameraNumber]);
+      mkdir(destPathSerialNumber.c_str(), 0755);
+    }
+  }
 
-      // Check if we reached EOF (read returns 0)
-      if (readCount[idx] == 0) {
-        // Check if all the files have reached EOF
-        if (!std::all_of(readCount, readCount + FLAGS_file_count, [](int x){ return x == 0; })) {
-          continue;
-        }
+  // Every read is known up front, in file order, and stops at the end of
+  // each file. The reader keeps up to --frames_in_flight of them in flight
+  // with O_DIRECT, and a reader thread hands the frames to the workers,
+  // which unpack and encode them in parallel.
+  const int numThreads = FLAGS_threads > 0
+    ? FLAGS_threads
+    : std::max(1u, std::thread::hardware_concurrency());
+  const int inFlight = std::max(FLAGS_frames_in_flight, numThreads);
 
-        isDone = true;
-        LOG(WARNING) << "Reached EOF";
-        break;
+  vector<off_t> fileSize(FLAGS_file_count);
+  for (int i = 0; i < FLAGS_file_count; ++i) {
+    struct stat st;
+    fstat(fd[i], &st);
+    fileSize[i] = st.st_size;
+  }
+  vector<FootageReader::Request> requests;
+  vector<RawFrame> requestFrames;
+  const vector<vector<pair<int, unsigned int>>> routing = readRouting(FLAGS_file_count);
+  if (!routing.empty()) {
+    // CameraControl queues frames on whichever consumer is least loaded, so
+    // any slot of any file may hold any camera's frame. Its routing files
+    // say which; frames are numbered from 0 in capture order.
+    LOG(INFO) << "Placing frames by the routing files";
+    map<int, int> frameIndices;
+    for (const auto& fileRouting : routing) {
+      for (const auto& slot : fileRouting) {
+        frameIndices[slot.first] = 0;
       }
+    }
+    int frameIndex = 0;
+    for (auto& frame : frameIndices) {
+      frame.second = frameIndex++;
+    }
 
-      uint32_t p = 0;
-      for (uint32_t y = 0; y < imageHeight; ++y) {
-        for (uint32_t x = 0; x < imageWidth; ++x) {
-          uint32_t pixval;
-
-          if (nBits == 8) {
-            pixval = imgbuf[p];
-            outImage.at<uint16_t>(y, x) = pixval * 0x101;
-            ++p;
-          } else if (nBits == 12) {
-            uint16_t lo = imgbuf[p];
-            uint16_t hi = imgbuf[p + 1];
-            uint16_t unswizzled, rep;
-
-            if (x & 1) {
-              p += 2;
-              unswizzled = hi << 4 | lo >> 4;
-            } else {
-              p += 1;
-              unswizzled = lo << 4 | (hi & 0xF);
-            }
-
-            rep = unswizzled << 4 | unswizzled >> 8;
-            outImage.at<uint16_t>(y, x) = rep;
-          }
+    const int endFrame = FLAGS_frame_count > 0
+      ? FLAGS_start_frame + FLAGS_frame_count
+      : frameIndex;
+    // Overwritten frames are left out, like frames the camera dropped
+    const set<pair<int, unsigned int>> overwritten = readOverwritten(FLAGS_file_count);
+    int skipped = 0;
+    map<pair<int, unsigned int>, FootageReader::Request> placed;
+    for (int i = 0; i < FLAGS_file_count; ++i) {
+      for (size_t k = 0; k < routing[i].size(); ++k) {
+        const int frameNumber = frameIndices[routing[i][k].first];
+        const unsigned int cameraNumber = routing[i][k].second;
+        const off_t offset = kHeaderSize + off_t(k) * imageSize;
+        if (cameraNumber >= cameraCount) {
+          throw VrCamException(
+            "camera " + to_string(cameraNumber) + " in the routing of " + binFilenames[i]
+            + ", but there are " + to_string(cameraCount) + " cameras");
+        }
+        if (frameNumber < FLAGS_start_frame || frameNumber >= endFrame ||
+            offset + off_t(imageSize) > fileSize[i]) {
+          continue;
         }
+        if (overwritten.count(routing[i][k]) > 0) {
+          LOG(WARNING) << "Skipping frame " << frameNumber << " of camera " << cameraNumber
+                       << ", overwritten before it was written";
+          ++skipped;
+          continue;
+        }
+        placed[make_pair(frameNumber, cameraNumber)] =
+          {uint32_t(i), uint64_t(offset), uint32_t(imageSize)};
       }
-
-      pos[idx] += readCount[idx];
-
-      if (frameIndex % 10 == 0 || frameIndex == lastFrame) {
-        int percentDoneCurr = (frameIndex + 1) * 100 / (lastFrame + 1);
-        LOG_IF(INFO, percentDoneCurr != percentDonePrev) << "Percent done " << percentDoneCurr << "%";
-        percentDonePrev = percentDoneCurr;
+    }
+    if (skipped > 0) {
+      LOG(WARNING) << skipped << " overwritten frames skipped";
+    }
+    for (const auto& frame : placed) {
+      requests.push_back(frame.second);
+      requestFrames.push_back({frame.first.first, frame.first.second, FootageReader::Frame()});
+    }
+    totalFrameCount = requests.size();
+  } else {
+    // Camera k is in file k % --file_count
+    for (int frameNumber = FLAGS_start_frame; frameNumber < FLAGS_start_frame + totalFrameCount / cameraCount; ++frameNumber) {
+      for (unsigned int cameraNumber = 0; cameraNumber < cameraCount; ++cameraNumber) {
+        const int idx = cameraNumber % FLAGS_file_count;
+        if (pos[idx] + off_t(imageSize) > fileSize[idx]) {
+          continue;
+        }
+        requests.push_back({uint32_t(idx), uint64_t(pos[idx]), uint32_t(imageSize)});
+        requestFrames.push_back({frameNumber, cameraNumber, FootageReader::Frame()});
+        pos[idx] += imageSize;
       }
+    }
+  }
 
-      std::string serialNumber;
-      if (FLAGS_tagged) {
-        auto tag = reinterpret_cast<uint32_t*>(&imgbuf[0]);
-        serialNumber = to_string(tag[1]);
-      } else {
-        serialNumber = cameraNames[cameraNumber];
-      }
+  FootageReader::Backend backend;
+  if (FLAGS_io_backend == "auto") {
+    backend = FootageReader::BACKEND_AUTO;
+  } else if (FLAGS_io_backend == "io_uring") {
+    backend = FootageReader::BACKEND_IO_URING;
+  } else if (FLAGS_io_backend == "pread") {
+    backend = FootageReader::BACKEND_PREAD;
+  } else {
+    throw VrCamException("unknown io_backend: " + FLAGS_io_backend);
+  }
+  // Each worker holds a frame while it unpacks it
+  FootageReader footageReader(binFilenames, imageSize, inFlight + numThreads, backend);
+  LOG(INFO) << "Reading with " << FootageReader::getBackendName(footageReader.getBackend())
+            << (footageReader.isDirect() ? ", direct I/O" : ", buffered I/O");
+  footageReader.enqueue(requests);
+  BoundedQueue<RawFrame> readFrames(inFlight);
 
-      struct stat st = {0};
-      std::string destPathSerialNumber(FLAGS_dest_path + "/" + serialNumber);
-      if (stat(destPathSerialNumber.c_str(), &st) == -1) {
-        mkdir(destPathSerialNumber.c_str(), 0755);
-        serialNumbers.insert(serialNumber);
+  const int lastFrame = FLAGS_start_frame * cameraCount + totalFrameCount - 1;
+  const double startTime = getCurrTimeSec();
+
+  auto reader = std::async(std::launch::async, [&] {
+    try {
+      FootageReader::Frame frame;
+      while (footageReader.next(frame)) {
+        RawFrame rawFrame = requestFrames[frame.requestIndex];
+        rawFrame.frame = frame;
+        if (!readFrames.push(rawFrame)) {
+          return; // a worker failed
+        }
       }
-
-      // Prefix zeros to have a 6 digit number
-      static const int kNumDigits = 6;
-      std::string frameNumberStr = to_string(frameNumber);
-      frameNumberStr =
-        std::string(kNumDigits - frameNumberStr.length(), '0') + frameNumberStr;
-
-      string outFilename =
-        destPathSerialNumber + "/" + frameNumberStr + ".tiff";
-      imwriteExceptionOnFail(outFilename, outImage, tiffParams);
+    } catch (...) {
+      readFrames.close();
+      throw;
     }
+    readFrames.close();
+  });
 
-    if (isDone) {
-      break;
-    }
+  std::mutex progressMutex;
+  int framesDone = 0;
+  int percentDonePrev = 0;
+  vector<std::future<void>> workers;
+  for (int i = 0; i < numThreads; ++i) {
+    workers.push_back(std::async(std::launch::async, [&] {
+      Mat outImage(imageHeight, imageWidth, CV_16U);
+      vector<uint8_t> decodeBuffer;
+      RawFrame rawFrame;
+      bool holdingFrame = false;
+      try {
+        while (readFrames.pop(rawFrame)) {
+          holdingFrame = true;
+          const FootageReader::Frame& frame = rawFrame.frame;
+
+          // Frames captured with --compress are stored Bayer encoded
+          const unsigned char* imgbuf = frame.data;
+          if (frame.size >= sizeof(BayerCodec::Header) &&
+              BayerCodec::isEncoded(frame.data, imageWidth, imageHeight, nBits)) {
+            if (BayerCodec::getHeader(frame.data).encodedSize > frame.size) {
+              throw VrCamException(
+                "truncated encoded frame " + to_string(rawFrame.frameNumber)
+                + " of camera " + to_string(rawFrame.cameraNumber));
+            }
+            decodeBuffer.resize(imageSize);
+            BayerCodec::decode(frame.data, decodeBuffer.data());
+            imgbuf = decodeBuffer.data();
+          }
+          unpackFrame(imgbuf, imageWidth, imageHeight, nBits, outImage);
+
+          const string& serialNumber = cameraSerials[rawFrame.cameraNumber];
+          if (FLAGS_tagged &&
+              to_string(reinterpret_cast<const uint32_t*>(imgbuf)[1]) != serialNumber) {
+            throw VrCamException(
+              "camera " + to_string(rawFrame.cameraNumber) + " changed serial number in frame "
+              + to_string(rawFrame.frameNumber));
+          }
+          footageReader.release(frame);
+          holdingFrame = false;
+
+          // Prefix zeros to have a 6 digit number
+          static const int kNumDigits = 6;
+          const string outFilename = FLAGS_dest_path + "/" + serialNumber + "/"
+            + intToStringZeroPad(rawFrame.frameNumber, kNumDigits) + ".tiff";
+          imwriteExceptionOnFail(outFilename, outImage, tiffParams);
+
+          std::lock_guard<std::mutex> lock(progressMutex);
+          const int frameIndex = FLAGS_start_frame * cameraCount + framesDone++;
+          if (frameIndex % 10 == 0 || frameIndex == lastFrame) {
+            int percentDoneCurr = (frameIndex + 1) * 100 / (lastFrame + 1);
+            LOG_IF(INFO, percentDoneCurr != percentDonePrev) << "Percent done " << percentDoneCurr << "%";
+            percentDonePrev = percentDoneCurr;
+          }
+        }
+      } catch (...) {
+        // Stop the reader and let the other workers drain
+        if (holdingFrame) {
+          footageReader.release(rawFrame.frame);
+        }
+        readFrames.close();
+        throw;
+      }
+    }));
+  }
+
+  for (auto& worker : workers) {
+    worker.get();
   }
+  reader.get();
+
+  const double elapsed = getCurrTimeSec() - startTime;
+  LOG(INFO) << "Unpacked " << framesDone << " frames in " << elapsed << " sec, "
+            << footageReader.getBytesRead() / elapsed / 1e6 << " MB/s read";
 
   // Rename directories
   int camIndex = 0;
@@ -48,11 +48,47 @@ void combineBottomImagesWithPoleRemoval(
 
   const string cameraDir = imagesDir + "/" + bottomCamId;
   const string camera2Dir = imagesDir + "/" + bottomCam2Id;
-  const string bottomImageFilename = frameNumber + ".png";
+  const string bottomImageFilename =
+    frameNumber + "." + getImageFileExtension(cameraDir);
   const string bottomImagePath = cameraDir + "/" + bottomImageFilename;
   const string bottomImagePath2 = camera2Dir + "/" + bottomImageFilename;
-  bottomImage = imreadExceptionOnFail(bottomImagePath, CV_LOAD_IMAGE_COLOR);
-  Mat bottomImage2 = imreadExceptionOnFail(bottomImagePath2, CV_LOAD_IMAGE_COLOR);
+  combineBottomImagesWithPoleRemoval(
+    imreadExceptionOnFail(bottomImagePath, CV_LOAD_IMAGE_COLOR),
+    imreadExceptionOnFail(bottomImagePath2, CV_LOAD_IMAGE_COLOR),
+    frameNumber,
+    poleMaskDir,
+    prevFrameDataDir,
+    outputDataDir,
+    saveDebugImages,
+    saveFlowDataForNextFrame,
+    flowAlgName,
+    alphaFeatherSize,
+    bottomCamId,
+    bottomCam2Id,
+    bottomCamUsablePixelsRadius,
+    bottomCam2UsablePixelsRadius,
+    flip180,
+    bottomImage);
+}
+
+void combineBottomImagesWithPoleRemoval(
+    const Mat& bottomCamImage,
+    const Mat& bottomCam2Image,
+    const string& frameNumber,
+    const string& poleMaskDir,
+    const string& prevFrameDataDir,
+    const string& outputDataDir,
+    const bool saveDebugImages,
+    const bool saveFlowDataForNextFrame,
+    const string& flowAlgName,
+    const int alphaFeatherSize,
+    const string& bottomCamId,
+    const string& bottomCam2Id,
+    const float bottomCamUsablePixelsRadius,
+    const float bottomCam2UsablePixelsRadius,
+    const bool flip180,
+    Mat& bottomImage) {
+
   const string poleMaskPath = poleMaskDir + "/" + bottomCamId + ".png";
   const string poleMaskPath2 = poleMaskDir + "/" + bottomCam2Id + ".png";
   Mat bottomRedMask = imreadExceptionOnFail(poleMaskPath, 1);
@@ -65,9 +101,10 @@ void combineBottomImagesWithPoleRemoval(
       "missing or bad pole mask:" + poleMaskPath + "," + poleMaskPath2);
   }
 
-  // make alpha channels from usable radius
-  cvtColor(bottomImage, bottomImage, CV_BGR2BGRA);
-  cvtColor(bottomImage2, bottomImage2, CV_BGR2BGRA);
+  // make alpha channels from usable radius. the inputs are left untouched
+  Mat bottomImage2;
+  cvtColor(bottomCamImage, bottomImage, CV_BGR2BGRA);
+  cvtColor(bottomCam2Image, bottomImage2, CV_BGR2BGRA);
   circleAlphaCut(bottomImage, bottomCamUsablePixelsRadius);
   circleAlphaCut(bottomImage2, bottomCam2UsablePixelsRadius);
 
@@ -39,4 +39,23 @@ void combineBottomImagesWithPoleRemoval(
   const bool flip180,
   Mat& bottomImage);
 
+// same as above, for bottom camera images that are already loaded
+void combineBottomImagesWithPoleRemoval(
+  const Mat& bottomCamImage,
+  const Mat& bottomCam2Image,
+  const string& frameNumber,
+  const string& poleMaskDir,
+  const string& prevFrameDataDir,
+  const string& outputDataDir,
+  const bool saveDebugImages,
+  const bool saveFlowDataForNextFrame,
+  const string& flowAlgName,
+  const int alphaFeatherSize,
+  const string& bottomCamId,
+  const string& bottomCam2Id,
+  const float bottomCamUsablePixelsRadius,
+  const float bottomCam2UsablePixelsRadius,
+  const bool flip180,
+  Mat& bottomImage);
+
 } // namespace surround360
@@ -0,0 +1,44 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include "CvUtil.h"
+
+#include <gflags/gflags.h>
+
+// The stereo panorama render shared by TestRenderStereoPanorama, which reads
+// the camera images of a frame from --imgs_dir, and StreamStereoPanorama,
+// which gets them straight from the ISP. All other settings are flags.
+
+DECLARE_string(imgs_dir);
+DECLARE_string(frame_number);
+DECLARE_string(output_data_dir);
+DECLARE_string(prev_frame_data_dir);
+DECLARE_string(output_cubemap_path);
+DECLARE_string(output_equirect_path);
+DECLARE_bool(save_debug_images);
+DECLARE_bool(new_rig_format);
+DECLARE_string(ring_rectify_file);
+
+// Returns the 8 bit BGR image of the frame being rendered for a camera id.
+// Called from several threads at once.
+typedef std::function<cv::Mat(const std::string&)> CameraImageLoader;
+
+// Loads <imagesDir>/<camera id>/<frameNumber>.<ext>
+CameraImageLoader makeImageDirLoader(
+  const std::string& imagesDir,
+  const std::string& frameNumber);
+
+// Renders frame --frame_number to --output_equirect_path and, if set,
+// --output_cubemap_path. Flow for the next frame goes to --output_data_dir.
+void renderStereoPanorama(const CameraImageLoader& loadImage);
@@ -0,0 +1,266 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+// Checks that BayerCodec restores frames exactly, including through
+// BinaryFootageFile, and measures its ratio and speed on synthetic frames
+// and, given --bin_file, on recorded ones.
+
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "BayerCodec.h"
+#include "BinaryFootageFile.hpp"
+#include "SystemUtil.h"
+#include "VrCamException.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace std;
+using namespace surround360;
+
+DEFINE_string(scratch_dir,    "/tmp", "directory for the scratch footage file");
+DEFINE_int32(seed,            0,      "random seed for the synthetic frames");
+DEFINE_int32(width,           2048,   "width of the synthetic frames");
+DEFINE_int32(height,          2048,   "height of the synthetic frames");
+DEFINE_int32(threads,         4,      "threads of the threaded encode");
+DEFINE_string(bin_file,       "",     "recorded .bin file to measure (optional)");
+DEFINE_int32(frame_count,     10,     "frames per camera to measure in --bin_file");
+
+// Packs pixels as Raw12Converter reads them, or one byte per pixel
+static vector<uint8_t> packFrame(
+    const vector<int>& pixels,
+    const uint32_t width,
+    const uint32_t height,
+    const uint32_t bpp) {
+
+  vector<uint8_t> raw(BayerCodec::getRawSize(width, height, bpp));
+  for (size_t i = 0; i < pixels.size(); i += 2) {
+    if (bpp == 8) {
+      raw[i] = pixels[i];
+      raw[i + 1] = pixels[i + 1];
+    } else {
+      uint8_t* dst = &raw[i / 2 * 3];
+      dst[0] = pixels[i] >> 4;
+      dst[1] = (pixels[i] & 0xF) | (pixels[i + 1] & 0xF) << 4;
+      dst[2] = pixels[i + 1] >> 4;
+    }
+  }
+  return raw;
+}
+
+// Smooth shading with a different level per Bayer channel, plus sensor
+// noise, or uniform noise, which doesn't compress
+static vector<uint8_t> makeFrame(
+    const uint32_t width,
+    const uint32_t height,
+    const uint32_t bpp,
+    const bool noise,
+    mt19937& rng) {
+
+  const int maxValue = (1 << bpp) - 1;
+  normal_distribution<double> sensorNoise(0, bpp == 12 ? 16 : 1);
+  vector<int> pixels(size_t(width) * height);
+  for (uint32_t y = 0; y < height; ++y) {
+    for (uint32_t x = 0; x < width; ++x) {
+      const int channel = (y % 2) * 2 + x % 2;
+      const double shading =
+        0.3 + 0.1 * channel + 0.2 * sin(x * 0.01) * cos(y * 0.013);
+      const int value = noise
+        ? int(rng() % (maxValue + 1))
+        : int(shading * maxValue + sensorNoise(rng));
+      pixels[size_t(y) * width + x] = max(0, min(maxValue, value));
+    }
+  }
+  return packFrame(pixels, width, height, bpp);
+}
+
+// Returns the encoded size
+static size_t checkRoundTrip(
+    const vector<uint8_t>& raw,
+    const uint32_t width,
+    const uint32_t height,
+    const uint32_t bpp,
+    const int threads) {
+
+  vector<uint8_t> encoded(BayerCodec::getMaxEncodedSize(width, height, bpp));
+  const size_t encodedSize =
+    BayerCodec::encode(raw.data(), width, height, bpp, encoded.data(), threads);
+  if (!BayerCodec::isEncoded(encoded.data(), width, height, bpp)) {
+    throw VrCamException("encoded frame not recognized");
+  }
+  vector<uint8_t> decoded(raw.size());
+  BayerCodec::decode(encoded.data(), decoded.data());
+  if (decoded != raw) {
+    throw VrCamException(
+      to_string(width) + "x" + to_string(height) + " " + to_string(bpp)
+      + " bit frame differs after decoding");
+  }
+  return encodedSize;
+}
+
+static void testRoundTrip() {
+  mt19937 rng(FLAGS_seed);
+  for (const uint32_t bpp : {8, 12}) {
+    for (const auto& size : vector<pair<uint32_t, uint32_t>>{{2, 1}, {130, 67}, {64, 200}}) {
+      for (const bool noise : {false, true}) {
+        const vector<uint8_t> raw = makeFrame(size.first, size.second, bpp, noise, rng);
+        const size_t serialSize = checkRoundTrip(raw, size.first, size.second, bpp, 1);
+        const size_t threadedSize = checkRoundTrip(raw, size.first, size.second, bpp, 3);
+        if (serialSize != threadedSize) {
+          throw VrCamException("threaded encode differs from serial encode");
+        }
+      }
+    }
+  }
+  LOG(INFO) << "Round trips identical";
+}
+
+static void benchmark(
+    const string& name,
+    const vector<vector<uint8_t>>& frames,
+    const uint32_t width,
+    const uint32_t height,
+    const uint32_t bpp) {
+
+  vector<uint8_t> encoded(BayerCodec::getMaxEncodedSize(width, height, bpp));
+  vector<uint8_t> decoded(BayerCodec::getRawSize(width, height, bpp));
+  size_t rawBytes = 0;
+  size_t encodedBytes = 0;
+  double encodeSec = 0;
+  double threadedEncodeSec = 0;
+  double decodeSec = 0;
+  for (const vector<uint8_t>& raw : frames) {
+    double startTime = getCurrTimeSec();
+    BayerCodec::encode(raw.data(), width, height, bpp, encoded.data(), FLAGS_threads);
+    threadedEncodeSec += getCurrTimeSec() - startTime;
+
+    startTime = getCurrTimeSec();
+    encodedBytes += BayerCodec::encode(raw.data(), width, height, bpp, encoded.data());
+    encodeSec += getCurrTimeSec() - startTime;
+
+    startTime = getCurrTimeSec();
+    BayerCodec::decode(encoded.data(), decoded.data());
+    decodeSec += getCurrTimeSec() - startTime;
+    if (decoded != raw) {
+      throw VrCamException(name + ": frame differs after decoding");
+    }
+    rawBytes += raw.size();
+  }
+
+  const double megapixels = double(width) * height * frames.size() / 1e6;
+  LOG(INFO) << name << ": ratio " << double(rawBytes) / encodedBytes
+            << ", encode " << megapixels / encodeSec << " Mpx/s ("
+            << megapixels / threadedEncodeSec << " with " << FLAGS_threads << " threads)"
+            << ", decode " << megapixels / decodeSec << " Mpx/s";
+}
+
+static void benchmarkSynthetic() {
+  mt19937 rng(FLAGS_seed);
+  for (const uint32_t bpp : {8, 12}) {
+    const vector<vector<uint8_t>> frames = {
+      makeFrame(FLAGS_width, FLAGS_height, bpp, false, rng)
+    };
+    benchmark("synthetic " + to_string(bpp) + " bit", frames, FLAGS_width, FLAGS_height, bpp);
+  }
+}
+
+// A footage file with a raw frame and an encoded one must read the same
+// through BinaryFootageFile
+static void testFootageFile() {
+  static const uint32_t kWidth = 256;
+  static const uint32_t kHeight = 128;
+  static const uint32_t kBpp = 12;
+  static const size_t kMetadataSize = 4096;
+
+  mt19937 rng(FLAGS_seed);
+  const vector<uint8_t> raw = makeFrame(kWidth, kHeight, kBpp, false, rng);
+  vector<uint8_t> encoded(BayerCodec::getMaxEncodedSize(kWidth, kHeight, kBpp));
+  const size_t encodedSize =
+    BayerCodec::encode(raw.data(), kWidth, kHeight, kBpp, encoded.data());
+  if (encodedSize >= raw.size()) {
+    throw VrCamException("test frame doesn't compress");
+  }
+
+  BinaryFootageFile::MetadataHeader metadata = {
+    0xfaceb00c, 0, 0, 1, kWidth, kHeight, kBpp, 2
+  };
+  vector<uint8_t> file(kMetadataSize + 2 * raw.size());
+  memcpy(file.data(), &metadata, sizeof(metadata));
+  memcpy(&file[kMetadataSize], raw.data(), raw.size());
+  memcpy(&file[kMetadataSize + raw.size()], encoded.data(), encodedSize);
+
+  const string filename = FLAGS_scratch_dir + "/TestBayerCodec.bin";
+  {
+    ofstream ofs(filename, ios::out | ios::binary | ios::trunc);
+    ofs.write(reinterpret_cast<const char*>(file.data()), file.size());
+    if (!ofs) {
+      throw VrCamException("failed to write " + filename);
+    }
+  }
+
+  BinaryFootageFile footage(filename);
+  footage.open();
+  vector<uint8_t> decodeBuffer;
+  for (uint32_t camera = 0; camera < 2; ++camera) {
+    if (footage.isFrameEncoded(0, camera) != (camera == 1)) {
+      throw VrCamException("camera " + to_string(camera) + " misdetected");
+    }
+    const uint8_t* frame = footage.getFrame(0, camera, decodeBuffer);
+    if (memcmp(frame, raw.data(), raw.size()) != 0) {
+      throw VrCamException("camera " + to_string(camera) + " reads a different frame");
+    }
+  }
+  footage.close();
+  unlink(filename.c_str());
+  LOG(INFO) << "Footage file reads raw and encoded frames alike";
+}
+
+static void benchmarkRecorded() {
+  BinaryFootageFile footage(FLAGS_bin_file);
+  footage.open();
+  const BinaryFootageFile::MetadataHeader& metadata = footage.getMetadata();
+  if (!BayerCodec::isSupported(metadata.width, metadata.bitsPerPixel)) {
+    throw VrCamException(
+      FLAGS_bin_file + " has " + to_string(metadata.bitsPerPixel) + " bit frames");
+  }
+
+  const size_t frameCount =
+    min(size_t(FLAGS_frame_count), footage.getNumberOfFrames());
+  vector<vector<uint8_t>> frames;
+  vector<uint8_t> decodeBuffer;
+  for (size_t frame = 0; frame < frameCount; ++frame) {
+    for (size_t camera = 0; camera < footage.getNumberOfCameras(); ++camera) {
+      const uint8_t* data = footage.getFrame(frame, camera, decodeBuffer);
+      frames.emplace_back(data, data + footage.getFrameSize());
+    }
+  }
+  footage.close();
+  benchmark(
+    FLAGS_bin_file, frames, metadata.width, metadata.height, metadata.bitsPerPixel);
+}
+
+int main(int argc, char** argv) {
+  initSurround360(argc, argv);
+
+  testRoundTrip();
+  testFootageFile();
+  benchmarkSynthetic();
+  if (!FLAGS_bin_file.empty()) {
+    benchmarkRecorded();
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,446 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+// Checks that the optimized stages of the CPU ISP produce the same output
+// as the reference stages they replace, and reports the runtime of each.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "CameraIsp.h"
+#include "ColorCalibration.h"
+#include "CompiledIspConfig.h"
+#include "CvUtil.h"
+#include "DefectPixelMap.h"
+#include "DngSerializer.h"
+#include "IspStatistics.h"
+#include "JsonUtil.h"
+#include "SystemUtil.h"
+#include "VrCamException.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace std;
+using namespace cv;
+using namespace surround360;
+using namespace surround360::color_calibration;
+using namespace surround360::math_util;
+using namespace surround360::util;
+
+DEFINE_string(isp_config_path,  "",     "ISP configuration file path");
+DEFINE_int32(image_width,       2048,   "width of the synthetic raw image");
+DEFINE_int32(image_height,      2048,   "height of the synthetic raw image");
+DEFINE_int32(seed,              0,      "random seed for the synthetic raw image");
+DEFINE_string(compiled_config_path, "/tmp/TestCameraIsp.ispc", "scratch file for the compiled ISP config");
+
+static const int kOutputBpp = 8;
+
+static Mat makeRandomRaw() {
+  Mat raw(FLAGS_image_height, FLAGS_image_width, CV_16U);
+  RNG rng(FLAGS_seed);
+  rng.fill(raw, RNG::UNIFORM, 0, 1 << 16);
+  return raw;
+}
+
+static void requireIdentical(
+    const Mat& expected,
+    const Mat& actual,
+    const string& testName) {
+
+  CHECK_EQ(expected.type(), actual.type());
+  const Mat diff = (expected != actual).reshape(1);
+  const int mismatches = countNonZero(diff);
+  if (mismatches != 0) {
+    throw VrCamException(
+      testName + ": " + to_string(mismatches) + " pixels differ");
+  }
+  LOG(INFO) << testName << ": output identical";
+}
+
+static void testFusedRawStages(const string& json, const Mat& raw) {
+  CameraIsp staged(json, kOutputBpp);
+  staged.loadImage(raw);
+  double startTime = getCurrTimeSec();
+  staged.blackLevelAdjust();
+  staged.antiVignette();
+  staged.whiteBalance();
+  staged.clampAndStretch();
+  const double stagedTime = getCurrTimeSec() - startTime;
+
+  CameraIsp fused(json, kOutputBpp);
+  fused.loadImage(raw);
+  startTime = getCurrTimeSec();
+  fused.rawStagesFused();
+  const double fusedTime = getCurrTimeSec() - startTime;
+
+  LOG(INFO) << "Raw stages: staged = " << stagedTime * 1000.0 << "ms"
+            << " fused = " << fusedTime * 1000.0 << "ms";
+  requireIdentical(staged.getRawImage(), fused.getRawImage(), "fused raw stages");
+}
+
+// Dark left half, bright right half and isolated hot pixels in the dark half
+static Mat makeStuckPixelRaw(vector<Point>& hotPixels) {
+  const int halfWidth = FLAGS_image_width / 2;
+  Mat raw(FLAGS_image_height, FLAGS_image_width, CV_16U);
+  RNG rng(FLAGS_seed);
+  rng.fill(raw.colRange(0, halfWidth), RNG::UNIFORM, 0, 3000);
+  rng.fill(raw.colRange(halfWidth, raw.cols), RNG::UNIFORM, 40000, 60000);
+
+  const int kHotPixelSpacing = 61;
+  for (int i = 4; i < raw.rows - 4; i += kHotPixelSpacing) {
+    for (int j = 4; j < halfWidth - 4; j += kHotPixelSpacing) {
+      raw.at<uint16_t>(i, j) = 0xffff;
+      hotPixels.push_back(Point(j, i));
+    }
+  }
+  return raw;
+}
+
+static void requireStuckPixelsRemoved(
+    const Mat& raw,
+    const Mat& filtered,
+    const vector<Point>& hotPixels,
+    const string& testName) {
+
+  // Hot pixels of every color of the bayer pattern, by position in its 2x2
+  int removed[2][2] = {{0, 0}, {0, 0}};
+  for (const Point& p : hotPixels) {
+    if (filtered.at<float>(p) >= 0.5f) {
+      throw VrCamException(
+        testName + ": hot pixel at " + to_string(p.x) + "," + to_string(p.y)
+        + " not removed");
+    }
+    ++removed[p.y % 2][p.x % 2];
+  }
+  for (int y = 0; y < 2; ++y) {
+    for (int x = 0; x < 2; ++x) {
+      if (removed[y][x] == 0) {
+        throw VrCamException(
+          testName + ": no hot pixel at bayer position " + to_string(x) + "," + to_string(y));
+      }
+    }
+  }
+
+  // Nothing in the bright half may change
+  const int x0 = raw.cols / 2 + 2;
+  Mat expected;
+  raw.colRange(x0, raw.cols).convertTo(expected, CV_32F, 1.0 / 0xffff);
+  const Mat actual = filtered.colRange(x0, raw.cols);
+  const int changed = countNonZero(expected != actual);
+  if (changed != 0) {
+    throw VrCamException(
+      testName + ": " + to_string(changed) + " bright pixels changed");
+  }
+  LOG(INFO) << testName << ": " << hotPixels.size() << " hot pixels removed";
+}
+
+static void requireClose(
+    const Mat& expected,
+    const Mat& actual,
+    const double maxMeanDiff,
+    const string& testName) {
+
+  CHECK_EQ(expected.type(), actual.type());
+  const double meanDiff =
+    norm(expected, actual, NORM_L1) / double(expected.total() * expected.channels());
+  if (meanDiff > maxMeanDiff) {
+    throw VrCamException(
+      testName + ": mean difference " + to_string(meanDiff) + " exceeds "
+      + to_string(maxMeanDiff));
+  }
+  LOG(INFO) << testName << ": mean difference " << meanDiff
+            << ", max difference " << norm(expected, actual, NORM_INF);
+}
+
+// Benchmarks the tiled RGB stages against demosaic(), colorCorrect() and
+// sharpen() for every demosaic filter
+static void testTiledRgbStages(const string& json, const Mat& raw) {
+  static const char* kFilterNames[] = { "bilinear", "frequency", "edge aware" };
+  for (int filter = 0; filter < LAST_DM_FILTER; ++filter) {
+    CameraIsp staged(json, kOutputBpp);
+    staged.setDemosaicFilter(filter);
+    staged.loadImage(raw);
+    staged.rawStagesFused();
+    double startTime = getCurrTimeSec();
+    staged.demosaic();
+    staged.colorCorrect();
+    staged.sharpen();
+    const double stagedTime = getCurrTimeSec() - startTime;
+
+    CameraIsp tiled(json, kOutputBpp);
+    tiled.setDemosaicFilter(filter);
+    tiled.loadImage(raw);
+    tiled.rawStagesFused();
+    startTime = getCurrTimeSec();
+    tiled.rgbStagesTiled();
+    const double tiledTime = getCurrTimeSec() - startTime;
+
+    const string testName = string("tiled RGB stages, ") + kFilterNames[filter];
+    LOG(INFO) << testName << ": staged = " << stagedTime * 1000.0 << "ms"
+              << " tiled = " << tiledTime * 1000.0 << "ms";
+
+    // The parallel DCT rounds differently from the full frame one
+    if (filter == FREQUENCY_DM_FILTER) {
+      requireClose(
+        staged.getDemosaicedImage(), tiled.getDemosaicedImage(), 0.05, testName);
+    } else {
+      requireIdentical(
+        staged.getDemosaicedImage(), tiled.getDemosaicedImage(), testName);
+    }
+  }
+}
+
+// The config's radius counts same color pixels, so 1 is the 3x3 lattice of
+// same color neighbors that removeStuckPixels runs the median network on
+static void testStuckPixelRemoval(const string& json) {
+  json::Value config = json::Deserialize(json);
+  config["CameraIsp"]["stuckPixelRadius"] = 1;
+  config["CameraIsp"]["stuckPixelThreshold"] = 2;
+  config["CameraIsp"]["stuckPixelDarknessThreshold"] = 0.25;
+  const string stuckPixelJson = json::Serialize(config);
+
+  vector<Point> hotPixels;
+  const Mat raw = makeStuckPixelRaw(hotPixels);
+
+  CameraIsp sorted(stuckPixelJson, kOutputBpp);
+  sorted.loadImage(raw);
+  double startTime = getCurrTimeSec();
+  sorted.removeStuckPixelsSorted();
+  const double sortedTime = getCurrTimeSec() - startTime;
+
+  CameraIsp network(stuckPixelJson, kOutputBpp);
+  network.loadImage(raw);
+  startTime = getCurrTimeSec();
+  network.removeStuckPixelsMedian9();
+  const double networkTime = getCurrTimeSec() - startTime;
+
+  // removeStuckPixels must take the network for this radius
+  CameraIsp dispatched(stuckPixelJson, kOutputBpp);
+  dispatched.loadImage(raw);
+  dispatched.removeStuckPixels();
+  requireIdentical(
+    network.getRawImage(), dispatched.getRawImage(), "stuck pixel removal dispatch");
+
+  LOG(INFO) << "Stuck pixels: sorted = " << sortedTime * 1000.0 << "ms"
+            << " median network = " << networkTime * 1000.0 << "ms";
+  requireStuckPixelsRemoved(
+    raw, sorted.getRawImage(), hotPixels, "sorted stuck pixels");
+  requireStuckPixelsRemoved(
+    raw, network.getRawImage(), hotPixels, "median network stuck pixels");
+}
+
+static void testDefectPixelMap(const string& json, const Mat& raw) {
+  DefectPixelMap defectPixelMap;
+  defectPixelMap.width = raw.cols;
+  defectPixelMap.height = raw.rows;
+  const int kDefectSpacing = 97;
+  for (int i = 0; i < raw.rows; i += kDefectSpacing) {
+    for (int j = 0; j < raw.cols; j += kDefectSpacing) {
+      defectPixelMap.defects.push_back(Point(j, i));
+    }
+  }
+  defectPixelMap.defects.push_back(Point(raw.cols - 1, raw.rows - 1));
+
+  CameraIsp isp(json, kOutputBpp);
+  isp.setDefectPixelMap(defectPixelMap);
+  isp.loadImage(raw);
+  Mat expected = isp.getRawImage().clone();
+  double startTime = getCurrTimeSec();
+  isp.removeStuckPixels();
+  const double correctTime = getCurrTimeSec() - startTime;
+
+  // Defects are isolated so each takes the median of the uncorrected image
+  const Mat source = expected.clone();
+  for (const Point& p : defectPixelMap.defects) {
+    vector<float> lattice;
+    for (int y = -2; y <= 2; y += 2) {
+      for (int x = -2; x <= 2; x += 2) {
+        lattice.push_back(source.at<float>(
+          reflect(p.y + y, raw.rows), reflect(p.x + x, raw.cols)));
+      }
+    }
+    nth_element(lattice.begin(), lattice.begin() + 4, lattice.end());
+    expected.at<float>(p) = lattice[4];
+  }
+
+  LOG(INFO) << "Defect pixel map: " << defectPixelMap.defects.size()
+            << " defects corrected in " << correctTime * 1000.0 << "ms";
+  requireIdentical(expected, isp.getRawImage(), "defect pixel map");
+}
+
+static void testCompiledConfig(const string& json, const Mat& raw) {
+  CameraIsp fromJson(json, kOutputBpp);
+  if (!fromJson.saveCompiledConfig(FLAGS_compiled_config_path, json)) {
+    throw VrCamException("failed to write " + FLAGS_compiled_config_path);
+  }
+
+  const CompiledIspConfig compiled(FLAGS_compiled_config_path);
+  if (!compiled.matches(json, kOutputBpp, false)) {
+    throw VrCamException("compiled config does not match its source");
+  }
+  if (compiled.matches(json + " ", kOutputBpp, false) ||
+      compiled.matches(json, 16, false) ||
+      compiled.matches(json, kOutputBpp, true)) {
+    throw VrCamException("compiled config matches a different config");
+  }
+
+  double startTime = getCurrTimeSec();
+  CameraIsp reparsed(json, kOutputBpp);
+  const double jsonTime = getCurrTimeSec() - startTime;
+  startTime = getCurrTimeSec();
+  CameraIsp fromCompiled(compiled);
+  const double compiledTime = getCurrTimeSec() - startTime;
+  LOG(INFO) << "Config: JSON = " << jsonTime * 1000.0 << "ms"
+            << " compiled = " << compiledTime * 1000.0 << "ms";
+
+  Mat expected(raw.rows, raw.cols, CV_8UC3);
+  fromJson.loadImage(raw);
+  fromJson.getImage(expected);
+  Mat actual(raw.rows, raw.cols, CV_8UC3);
+  fromCompiled.loadImage(raw);
+  fromCompiled.getImage(actual);
+  requireIdentical(expected, actual, "compiled config");
+}
+
+// The statistics have to agree with a direct count over the raw and output
+static void testStatistics(const string& json, const Mat& raw) {
+  CameraIsp isp(json, kOutputBpp);
+  isp.setCollectStatistics(true);
+  isp.loadImage(raw);
+  Mat output(raw.rows, raw.cols, CV_8UC3);
+  const double startTime = getCurrTimeSec();
+  isp.getImage(output);
+  LOG(INFO) << "Statistics: ISP with statistics = "
+            << (getCurrTimeSec() - startTime) * 1000.0 << "ms";
+  const IspStatistics& stats = isp.getStatistics();
+
+  int channels[2][2];
+  isp.getBayerChannels(channels);
+  uint64_t rawHistogram[3][IspStatistics::kHistogramBins] = {};
+  uint64_t outputHistogram[3][IspStatistics::kHistogramBins] = {};
+  uint64_t rawClipped[3] = {};
+  uint64_t outputClipped[3] = {};
+  for (int i = 0; i < raw.rows; ++i) {
+    for (int j = 0; j < raw.cols; ++j) {
+      const int channel = channels[i % 2][j % 2];
+      const uint16_t r = raw.at<uint16_t>(i, j);
+      ++rawHistogram[channel][r >> 8];
+      rawClipped[channel] += r == 65535;
+      const Vec3b bgr = output.at<Vec3b>(i, j);
+      for (int c = 0; c < 3; ++c) {
+        ++outputHistogram[c][bgr[2 - c]];
+        outputClipped[c] += bgr[2 - c] == 255;
+      }
+    }
+  }
+  for (int c = 0; c < 3; ++c) {
+    for (int b = 0; b < IspStatistics::kHistogramBins; ++b) {
+      if (stats.rawHistogram[c][b] != rawHistogram[c][b] ||
+          stats.outputHistogram[c][b] != outputHistogram[c][b]) {
+        throw VrCamException(
+          "statistics: histogram bin " + to_string(b) + " of channel "
+          + to_string(c) + " differs");
+      }
+    }
+    if (stats.rawClipped[c] != rawClipped[c] ||
+        stats.outputClipped[c] != outputClipped[c]) {
+      throw VrCamException(
+        "statistics: clipped count of channel " + to_string(c) + " differs");
+    }
+  }
+
+  const int n = IspStatistics::kGridSize;
+  for (int y = 0; y < n; ++y) {
+    for (int x = 0; x < n; ++x) {
+      const Rect cell(
+        x * raw.cols / n, y * raw.rows / n,
+        (x + 1) * raw.cols / n - x * raw.cols / n,
+        (y + 1) * raw.rows / n - y * raw.rows / n);
+      const Scalar bgr = mean(output(cell)) / 255.0;
+      const Vec3f expected(bgr[2], bgr[1], bgr[0]);
+      if (norm(expected - stats.gridMean[y][x]) > 1e-4) {
+        throw VrCamException(
+          "statistics: mean of grid cell " + to_string(x) + "," + to_string(y)
+          + " differs");
+      }
+    }
+  }
+  LOG(INFO) << "Statistics: histograms, clipped counts and grid means match";
+}
+
+// Reads the strips of a serialized DNG back and compares them to the raw
+static void testDngSerializer(const string& json, const Mat& raw) {
+  CameraIsp isp(json, kOutputBpp);
+  isp.setBitsPerPixel(16);
+  const double startTime = getCurrTimeSec();
+  const vector<uint8_t> dng = DngSerializer::serialize(isp, raw);
+  LOG(INFO) << "DNG: serialized " << dng.size() << " bytes in "
+            << (getCurrTimeSec() - startTime) * 1000.0 << "ms";
+
+  auto read32 = [&](const size_t offset) {
+    uint32_t v;
+    memcpy(&v, &dng[offset], sizeof(v));
+    return v;
+  };
+  const uint32_t ifdOffset = read32(4);
+  const uint16_t entryCount = dng[ifdOffset] | dng[ifdOffset + 1] << 8;
+  vector<uint32_t> stripOffsets;
+  vector<uint32_t> stripByteCounts;
+  for (int e = 0; e < entryCount; ++e) {
+    const size_t entry = ifdOffset + 2 + e * 12;
+    const uint16_t tag = dng[entry] | dng[entry + 1] << 8;
+    const uint32_t count = read32(entry + 4);
+    const uint32_t value = read32(entry + 8);
+    if (tag == kTiffTagStripOffsets || tag == kTiffTagStripByteCounts) {
+      vector<uint32_t>& values =
+        tag == kTiffTagStripOffsets ? stripOffsets : stripByteCounts;
+      for (uint32_t i = 0; i < count; ++i) {
+        values.push_back(count == 1 ? value : read32(value + i * 4));
+      }
+    }
+  }
+
+  vector<uint8_t> pixels;
+  for (size_t s = 0; s < stripOffsets.size(); ++s) {
+    pixels.insert(
+      pixels.end(),
+      dng.begin() + stripOffsets[s],
+      dng.begin() + stripOffsets[s] + stripByteCounts[s]);
+  }
+  if (pixels.size() != raw.total() * raw.elemSize()) {
+    throw VrCamException(
+      "DNG strips hold " + to_string(pixels.size()) + " bytes, expecting "
+      + to_string(raw.total() * raw.elemSize()));
+  }
+  const Mat actual(raw.rows, raw.cols, CV_16U, pixels.data());
+  requireIdentical(raw, actual, "DNG image data");
+}
+
+int main(int argc, char** argv) {
+  initSurround360(argc, argv);
+  requireArg(FLAGS_isp_config_path, "isp_config_path");
+
+  const string json = getJson(FLAGS_isp_config_path);
+  const Mat raw = makeRandomRaw();
+
+  testFusedRawStages(json, raw);
+  testStuckPixelRemoval(json);
+  testDefectPixelMap(json, raw);
+  testTiledRgbStages(json, raw);
+  testCompiledConfig(json, raw);
+  testStatistics(json, raw);
+  testDngSerializer(json, raw);
+
+  return EXIT_SUCCESS;
+}
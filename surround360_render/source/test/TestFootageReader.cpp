@@ -0,0 +1,165 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+// Checks that every FootageReader backend reads the same bytes as a plain
+// pread, including unaligned reads and reads past the end of the file, and
+// measures how fast each backend reads a file front to back.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "FootageReader.hpp"
+#include "SystemUtil.h"
+#include "VrCamException.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace std;
+using namespace surround360;
+
+DEFINE_string(scratch_dir,      "/tmp", "directory for the scratch file");
+DEFINE_int32(scratch_mb,        64,     "size of the scratch file in MB");
+DEFINE_int32(seed,              0,      "random seed for the scratch data and the reads");
+DEFINE_string(benchmark_file,   "",     "file to read front to back, e.g. a .bin on the array to measure (optional, the scratch file otherwise)");
+DEFINE_int32(read_size_kb,      6144,   "size of each benchmark read in KB, a 2048x2048 12 bit frame by default");
+DEFINE_int32(queue_depth,       32,     "reads in flight");
+DEFINE_int32(passes,            2,      "benchmark passes over the file");
+
+static const vector<FootageReader::Backend> kBackends = {
+  FootageReader::BACKEND_PREAD,
+  FootageReader::BACKEND_IO_URING
+};
+
+static void testBackend(
+    const string& filename,
+    const vector<uint8_t>& data,
+    const FootageReader::Backend backend) {
+
+  FootageReader reader({filename}, 1 << 20, 8, backend);
+  const string name = FootageReader::getBackendName(backend);
+
+  mt19937 rng(FLAGS_seed);
+  vector<FootageReader::Request> requests;
+  for (int i = 0; i < 1000; ++i) {
+    requests.push_back({0, rng() % data.size(), uint32_t(rng() % (1 << 20) + 1)});
+  }
+  requests.push_back({0, data.size() - 100, 1000});   // ends past the end of the file
+  requests.push_back({0, data.size() + 4096, 1000});  // starts past it
+  reader.enqueue(requests);
+
+  // Hold on to a few frames, so reads complete while slots are handed out
+  vector<FootageReader::Frame> held;
+  FootageReader::Frame frame;
+  size_t expectedIndex = 0;
+  while (reader.next(frame)) {
+    const FootageReader::Request& request = requests[frame.requestIndex];
+    if (frame.requestIndex != expectedIndex++) {
+      throw VrCamException(name + ": frames out of order");
+    }
+    const size_t offset = min(size_t(request.offset), data.size());
+    const size_t expectedSize = min(size_t(request.size), data.size() - offset);
+    if (frame.size != expectedSize ||
+        memcmp(frame.data, data.data() + offset, frame.size) != 0) {
+      throw VrCamException(
+        name + ": read " + to_string(frame.requestIndex) + " differs from the file");
+    }
+    held.push_back(frame);
+    if (held.size() > 3) {
+      reader.release(held.front());
+      held.erase(held.begin());
+    }
+  }
+  if (expectedIndex != requests.size()) {
+    throw VrCamException(name + ": missing reads");
+  }
+  LOG(INFO) << name << (reader.isDirect() ? " (direct I/O)" : " (buffered I/O)")
+            << ": " << requests.size() << " reads identical";
+}
+
+static void benchmarkBackend(
+    const string& filename,
+    const FootageReader::Backend backend) {
+
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw VrCamException("failed to open " + filename);
+  }
+  const size_t fileSize = lseek(fd, 0, SEEK_END);
+  close(fd);
+
+  const uint32_t readSize = FLAGS_read_size_kb * 1024;
+  FootageReader reader({filename}, readSize, FLAGS_queue_depth, backend);
+  vector<FootageReader::Request> requests;
+  for (int pass = 0; pass < FLAGS_passes; ++pass) {
+    for (size_t offset = 0; offset < fileSize; offset += readSize) {
+      requests.push_back({0, offset, readSize});
+    }
+  }
+
+  const double startTime = getCurrTimeSec();
+  reader.enqueue(requests);
+  FootageReader::Frame frame;
+  while (reader.next(frame)) {
+    reader.release(frame);
+  }
+  const double elapsed = getCurrTimeSec() - startTime;
+  LOG(INFO) << FootageReader::getBackendName(backend)
+            << (reader.isDirect() ? " (direct I/O)" : " (buffered I/O)")
+            << ": " << reader.getBytesRead() / elapsed / 1e9 << " GB/s, "
+            << FLAGS_queue_depth << " reads of " << FLAGS_read_size_kb << " KB in flight";
+}
+
+// False if io_uring isn't compiled in or the kernel doesn't allow it
+static bool isAvailable(const string& filename, const FootageReader::Backend backend) {
+  try {
+    FootageReader reader({filename}, 4096, 1, backend);
+    return true;
+  } catch (const exception& e) {
+    LOG(WARNING) << FootageReader::getBackendName(backend) << " skipped: " << e.what();
+    return false;
+  }
+}
+
+int main(int argc, char** argv) {
+  initSurround360(argc, argv);
+
+  const string scratchFile = FLAGS_scratch_dir + "/TestFootageReader.bin";
+  vector<uint8_t> data(size_t(FLAGS_scratch_mb) << 20);
+  mt19937 rng(FLAGS_seed);
+  for (uint8_t& byte : data) {
+    byte = rng();
+  }
+  {
+    ofstream ofs(scratchFile, ios::out | ios::binary | ios::trunc);
+    ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if (!ofs) {
+      throw VrCamException("failed to write " + scratchFile);
+    }
+  }
+
+  const string benchmarkFile =
+    FLAGS_benchmark_file.empty() ? scratchFile : FLAGS_benchmark_file;
+  for (const FootageReader::Backend backend : kBackends) {
+    if (isAvailable(scratchFile, backend)) {
+      testBackend(scratchFile, data, backend);
+      benchmarkBackend(benchmarkFile, backend);
+    }
+  }
+
+  unlink(scratchFile.c_str());
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+// Checks that frame files round trip, that an image loaded from one stays
+// valid and can be changed without changing the file, that reading them as
+// 8 bit matches a 16 bit PNG read the same way, and compares their load
+// time to PNG.
+
+#include <cstdlib>
+#include <string>
+
+#include "CvUtil.h"
+#include "FrameFile.h"
+#include "SystemUtil.h"
+#include "VrCamException.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace std;
+using namespace cv;
+using namespace surround360;
+using namespace surround360::util;
+
+DEFINE_int32(image_width,   2048,           "width of the synthetic frame");
+DEFINE_int32(image_height,  2048,           "height of the synthetic frame");
+DEFINE_int32(seed,          0,              "random seed for the synthetic frame");
+DEFINE_string(scratch_dir,  "/tmp",         "directory for the scratch files");
+
+static void requireIdentical(
+    const Mat& expected,
+    const Mat& actual,
+    const string& testName) {
+
+  CHECK_EQ(expected.type(), actual.type());
+  const int mismatches = countNonZero((expected != actual).reshape(1));
+  if (mismatches != 0) {
+    throw VrCamException(
+      testName + ": " + to_string(mismatches) + " pixels differ");
+  }
+  LOG(INFO) << testName << ": identical";
+}
+
+// A smooth ramp with noise, so LZ4 has something to compress
+static Mat makeFrame() {
+  Mat frame(FLAGS_image_height, FLAGS_image_width, CV_16UC3);
+  RNG rng(FLAGS_seed);
+  for (int y = 0; y < frame.rows; ++y) {
+    for (int x = 0; x < frame.cols; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        frame.at<Vec3w>(y, x)[c] =
+          saturate_cast<uint16_t>((x + y + c * 1000) * 8 + rng.uniform(0, 64));
+      }
+    }
+  }
+  return frame;
+}
+
+static void testFormat(
+    const Mat& frame,
+    const string& filename,
+    const FrameFileCompression compression) {
+
+  writeFrameFile(filename, frame, 1234, 42, compression);
+  {
+    const MappedFrameFile mapped(filename);
+    if (mapped.getHeader().cameraId != 1234 ||
+        mapped.getHeader().frameIndex != 42) {
+      throw VrCamException(filename + ": header mismatch");
+    }
+    LOG(INFO) << filename << ": " << mapped.getHeader().dataSize << " of "
+              << frame.total() * frame.elemSize() << " bytes stored";
+  }
+
+  double startTime = getCurrTimeSec();
+  Mat unchanged = imreadExceptionOnFail(filename, -1);
+  const double loadTime = getCurrTimeSec() - startTime;
+  requireIdentical(frame, unchanged, filename + " unchanged");
+
+  // The image of an uncompressed frame is the mapping of the file, which
+  // must outlive the load and not take writes through to the file
+  const Mat shared = unchanged;
+  unchanged.release();
+  Mat changed = shared;
+  changed.setTo(Scalar::all(0));
+  requireIdentical(frame, imreadExceptionOnFail(filename, -1), filename + " after a change");
+
+  startTime = getCurrTimeSec();
+  const Mat color8 = imreadExceptionOnFail(filename, IMREAD_COLOR);
+  const double load8Time = getCurrTimeSec() - startTime;
+  const string pngFilename = FLAGS_scratch_dir + "/TestFrameFile.png";
+  imwriteExceptionOnFail(pngFilename, frame);
+  startTime = getCurrTimeSec();
+  const Mat png8 = imreadExceptionOnFail(pngFilename, IMREAD_COLOR);
+  const double png8Time = getCurrTimeSec() - startTime;
+  requireIdentical(png8, color8, filename + " as 8 bit color");
+
+  LOG(INFO) << filename << ": load = " << loadTime * 1000.0 << "ms"
+            << " as 8 bit = " << load8Time * 1000.0 << "ms"
+            << " png as 8 bit = " << png8Time * 1000.0 << "ms";
+}
+
+int main(int argc, char** argv) {
+  initSurround360(argc, argv);
+
+  const Mat frame = makeFrame();
+  testFormat(
+    frame,
+    FLAGS_scratch_dir + "/TestFrameFile." + kFrameFileExtension,
+    FRAME_FILE_UNCOMPRESSED);
+  if (frameFileLz4Available()) {
+    testFormat(
+      frame,
+      FLAGS_scratch_dir + "/TestFrameFileLz4." + kFrameFileExtension,
+      FRAME_FILE_LZ4);
+  } else {
+    LOG(INFO) << "Built without LZ4, skipping compressed frame files";
+  }
+
+  return EXIT_SUCCESS;
+}
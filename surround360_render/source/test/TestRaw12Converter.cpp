@@ -0,0 +1,123 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+// Checks that the vectorized and row parallel Raw12 unpacking matches the
+// scalar reference on random data, and reports the runtime of each.
+
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Raw12Converter.hpp"
+#include "SystemUtil.h"
+#include "VrCamException.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace std;
+using namespace surround360;
+using namespace surround360::util;
+
+DEFINE_int32(image_width,   2048,   "width of the synthetic frame");
+DEFINE_int32(image_height,  2048,   "height of the synthetic frame");
+DEFINE_int32(iterations,    20,     "number of frames to unpack for timing");
+DEFINE_int32(seed,          0,      "random seed for the synthetic frames");
+
+static vector<uint8_t> makeRandomFrame(const int width, const int height) {
+  // One spare byte, the scalar reference reads one past the last pixel
+  vector<uint8_t> frame((width * height * 3 + 1) / 2 + 1);
+  mt19937 rng(FLAGS_seed);
+  for (uint8_t& b : frame) {
+    b = rng();
+  }
+  return frame;
+}
+
+static void requireIdentical(
+    const vector<uint16_t>& expected,
+    const vector<uint16_t>& actual,
+    const string& testName) {
+
+  for (size_t i = 0; i < expected.size(); ++i) {
+    if (expected[i] != actual[i]) {
+      throw VrCamException(
+        testName + ": pixel " + to_string(i) + " is " + to_string(actual[i])
+        + ", expecting " + to_string(expected[i]));
+    }
+  }
+}
+
+// Sizes around the vector widths exercise the scalar tails
+static void testSizes() {
+  const int kWidths[] = { 2, 4, 6, 8, 10, 16, 18, 20, 22, 34, 46, 7, 2046, 2050 };
+  const int kHeights[] = { 1, 3, 17 };
+  for (const int width : kWidths) {
+    for (const int height : kHeights) {
+      const vector<uint8_t> frame = makeRandomFrame(width, height);
+      vector<uint16_t> expected(width * height);
+      Raw12Converter::convertFrameScalar(frame.data(), width, height, expected.data());
+
+      for (const bool parallel : { false, true }) {
+        vector<uint16_t> actual(width * height);
+        Raw12Converter::convertFrame(
+          frame.data(), width, height, actual.data(), parallel);
+        requireIdentical(
+          expected, actual,
+          to_string(width) + "x" + to_string(height)
+          + (parallel ? " parallel" : ""));
+      }
+    }
+  }
+  LOG(INFO) << "Raw12 unpack: all sizes identical";
+}
+
+static void testFullFrame() {
+  const int width = FLAGS_image_width;
+  const int height = FLAGS_image_height;
+  const vector<uint8_t> frame = makeRandomFrame(width, height);
+
+  vector<uint16_t> expected(width * height);
+  double startTime = getCurrTimeSec();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    Raw12Converter::convertFrameScalar(frame.data(), width, height, expected.data());
+  }
+  const double scalarTime = (getCurrTimeSec() - startTime) / FLAGS_iterations;
+
+  vector<uint16_t> vectorized(width * height);
+  startTime = getCurrTimeSec();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    Raw12Converter::convertFrame(frame.data(), width, height, vectorized.data());
+  }
+  const double vectorizedTime = (getCurrTimeSec() - startTime) / FLAGS_iterations;
+
+  vector<uint16_t> parallel(width * height);
+  startTime = getCurrTimeSec();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    Raw12Converter::convertFrame(frame.data(), width, height, parallel.data(), true);
+  }
+  const double parallelTime = (getCurrTimeSec() - startTime) / FLAGS_iterations;
+
+  LOG(INFO) << "Raw12 unpack " << width << "x" << height << ": "
+            << "scalar = " << scalarTime * 1000.0 << "ms"
+            << " vectorized = " << vectorizedTime * 1000.0 << "ms"
+            << " parallel = " << parallelTime * 1000.0 << "ms";
+  requireIdentical(expected, vectorized, "vectorized full frame");
+  requireIdentical(expected, parallel, "parallel full frame");
+}
+
+int main(int argc, char** argv) {
+  initSurround360(argc, argv);
+
+  testSizes();
+  testFullFrame();
+
+  return EXIT_SUCCESS;
+}
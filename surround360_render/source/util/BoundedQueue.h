@@ -0,0 +1,85 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace surround360 {
+namespace util {
+
+using namespace std;
+
+// A blocking FIFO between pipeline stages that holds at most capacity
+// items, so a fast producer waits for the consumer instead of piling up
+// frames in memory. Once closed, push fails and pop drains what is left.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(const size_t capacity) :
+      capacity(capacity),
+      closed(false) {
+  }
+
+  // Blocks while the queue is full. Returns false if the queue was closed.
+  bool push(T item) {
+    unique_lock<mutex> lock(queueMutex);
+    notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(move(item));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Blocks while the queue is empty. Returns false once the queue is
+  // closed and drained.
+  bool pop(T& item) {
+    unique_lock<mutex> lock(queueMutex);
+    notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    item = move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // Wakes up all waiting producers and consumers
+  void close() {
+    lock_guard<mutex> lock(queueMutex);
+    closed = true;
+    notFull.notify_all();
+    notEmpty.notify_all();
+  }
+
+  size_t size() const {
+    lock_guard<mutex> lock(queueMutex);
+    return items.size();
+  }
+
+  size_t getCapacity() const {
+    return capacity;
+  }
+
+ private:
+  const size_t capacity;
+  bool closed;
+  deque<T> items;
+  mutable mutex queueMutex;
+  condition_variable notFull;
+  condition_variable notEmpty;
+};
+
+} // namespace util
+} // namespace surround360
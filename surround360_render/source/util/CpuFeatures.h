@@ -0,0 +1,76 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include <cstdint>
+
+namespace surround360 {
+namespace util {
+
+// Vector instruction sets the CPU and OS both support, checked once with
+// cpuid. A feature also needs the OS to save the wider registers on
+// context switches, which is what xgetbv reports.
+struct CpuFeatures {
+  bool sse41;
+  bool avx;
+  bool avx2; // with FMA and F16C
+  bool avx512; // Skylake subset: F, CD, BW, DQ and VL
+
+  static const CpuFeatures& get() {
+    static const CpuFeatures features = detect();
+    return features;
+  }
+
+ private:
+  static CpuFeatures detect() {
+    CpuFeatures features = {false, false, false, false};
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return features;
+    }
+    features.sse41 = ecx & bit_SSE4_1;
+
+    const bool osxsave = ecx & bit_OSXSAVE;
+    const uint64_t xcr0 = osxsave ? xgetbv() : 0;
+    const bool osAvx = (xcr0 & 0x06) == 0x06; // XMM and YMM state
+    const bool osAvx512 = (xcr0 & 0xe6) == 0xe6; // and opmask, ZMM state
+    features.avx = osAvx && (ecx & bit_AVX);
+    const bool fmaF16c = (ecx & bit_FMA) && (ecx & bit_F16C);
+
+    if (__get_cpuid_max(0, nullptr) < 7) {
+      return features;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    features.avx2 = features.avx && fmaF16c && (ebx & bit_AVX2);
+
+    const unsigned int kAvx512Skylake =
+      (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31);
+    features.avx512 =
+      features.avx2 && osAvx512 && (ebx & kAvx512Skylake) == kAvx512Skylake;
+#endif
+    return features;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  static uint64_t xgetbv() {
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (uint64_t(hi) << 32) | lo;
+  }
+#endif
+};
+
+} // namespace util
+} // namespace surround360
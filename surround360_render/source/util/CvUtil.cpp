@@ -20,6 +20,7 @@
 #include <vector>
 #include <random>
 
+#include "FrameFile.h"
 #include "MathUtil.h"
 #include "LinearRegression.h"
 #include "VrCamException.h"
@@ -33,6 +34,9 @@ using namespace math_util;
 using namespace linear_regression;
 
 Mat imreadExceptionOnFail(const string& filename, const int flags) {
+  if (isFrameFile(filename)) {
+    return imreadFrameFile(filename, flags);
+  }
   const Mat image = imread(filename, flags);
   if (image.empty()) {
     throw VrCamException("failed to load image: " + filename);
@@ -45,6 +49,10 @@ void imwriteExceptionOnFail(
     const Mat& image,
     const vector<int>& params) {
 
+  if (isFrameFile(filename)) {
+    writeFrameFile(filename, image);
+    return;
+  }
   if (!imwrite(filename, image, params)) {
     throw VrCamException("failed to write image: " + filename);
   }
@@ -29,10 +29,12 @@ using namespace cv;
 // 259: TIFF compression tag. 1: dump mode
 static const vector<int> tiffParams = {259, 1};
 
-// wrapper for cv::imread which throws an exception if loading fails
+// wrapper for cv::imread which throws an exception if loading fails. also
+// reads frame files, see FrameFile.h
 Mat imreadExceptionOnFail(const string& filename, const int flags = IMREAD_COLOR);
 
-// wrapper for cv::imwrite which throws an exception if writing fails
+// wrapper for cv::imwrite which throws an exception if writing fails. also
+// writes uncompressed frame files
 void imwriteExceptionOnFail(
   const string& filename,
   const Mat& image,
@@ -35,6 +35,83 @@ struct ReflectBoundary {
   }
 };
 
+// Number of columns the vertical IIR pass filters side by side, so that
+// each row it touches is read a cache line at a time
+const int kIirColumnBlock = 16;
+
+// Horizontal two-tap IIR pass over row i of the image. buffer needs at
+// least as many rows as the image has columns.
+template <typename H, typename P>
+void iirLowPassRow(
+    const Mat& inputImage,
+    const float alpha,
+    Mat& lpImage,
+    const int i,
+    const H& hBoundary,
+    const float maxVal,
+    Mat& buffer) {
+
+  const int width = inputImage.cols;
+
+  // Causal pass
+  Vec3f v(inputImage.at<P>(i, 0));
+  for (int j = 1; j <= width; ++j) {
+    Vec3f ip(inputImage.at<P>(i, hBoundary(j, width)));
+    v = lerp(ip, v, alpha);
+    buffer.at<Vec3f>(hBoundary(j - 1, width), 0) = v;
+  }
+
+  // Anticausal pass
+  for (int j = width - 2; j >= -1; --j) {
+    Vec3f ip(buffer.at<Vec3f>(hBoundary(j, width), 0));
+    v = lerp(ip, v, alpha);
+    lpImage.at<P>(i, j + 1)[0] = clamp(v[0], 0.0f, maxVal);
+    lpImage.at<P>(i, j + 1)[1] = clamp(v[1], 0.0f, maxVal);
+    lpImage.at<P>(i, j + 1)[2] = clamp(v[2], 0.0f, maxVal);
+  }
+}
+
+// Vertical two-tap IIR pass, in place, over columns [j0, j1) of the image.
+// At most kIirColumnBlock columns at a time; buffer needs at least as many
+// rows as the image and kIirColumnBlock columns.
+template <typename V, typename P>
+void iirLowPassColumns(
+    Mat& lpImage,
+    const float alpha,
+    const int j0,
+    const int j1,
+    const V& vBoundary,
+    const float maxVal,
+    Mat& buffer) {
+
+  assert(j1 - j0 <= kIirColumnBlock);
+  const int height = lpImage.rows;
+  Vec3f v[kIirColumnBlock];
+
+  // Causal pass
+  for (int j = j0; j < j1; ++j) {
+    v[j - j0] = Vec3f(lpImage.at<P>(0, j));
+  }
+  for (int i = 1; i <= height; ++i) {
+    for (int j = j0; j < j1; ++j) {
+      Vec3f ip(lpImage.at<P>(vBoundary(i, height), j));
+      v[j - j0] = lerp(ip, v[j - j0], alpha);
+      buffer.at<Vec3f>(vBoundary(i - 1, height), j - j0) = v[j - j0];
+    }
+  }
+
+  // Anticausal pass
+  for (int i = height - 2; i >= -1; --i) {
+    for (int j = j0; j < j1; ++j) {
+      Vec3f ip = buffer.at<Vec3f>(vBoundary(i, height), j - j0);
+      v[j - j0] = lerp(ip, v[j - j0], alpha);
+      lpImage.at<P>(i + 1, j)[0] = clamp(v[j - j0][0], 0.0f, maxVal);
+      lpImage.at<P>(i + 1, j)[1] = clamp(v[j - j0][1], 0.0f, maxVal);
+      lpImage.at<P>(i + 1, j)[2] = clamp(v[j - j0][2], 0.0f, maxVal);
+    }
+  }
+}
+
 // Implements a two-tap IIR low pass filter
 template <typename H, typename V, typename P>
 void iirLowPass(
@@ -49,50 +126,48 @@ void iirLowPass(
 
   const int width = inputImage.cols;
   const int height = inputImage.rows;
-  Mat buffer(std::max(width, height), 1, CV_32FC3);
-  const Vec3f zf(0, 0, 0);
+  Mat buffer(std::max(width, height), kIirColumnBlock, CV_32FC3);
   assert(width == lpImage.cols && height == lpImage.rows);
 
   // Horizontal pass
   for (int i = 0; i < height; ++i) {
-    // Causal pass
-    Vec3f v(inputImage.at<P>(i, 0));
-    for (int j = 1; j <= width; ++j) {
-      Vec3f ip(inputImage.at<P>(i, hBoundary(j, width)));
-      v = lerp(ip, v, alpha);
-      buffer.at<Vec3f>(hBoundary(j - 1, width)) = v;
-    }
-
-    // Anticausal pass
-    for (int j = width - 2; j >= -1; --j) {
-      Vec3f ip(buffer.at<Vec3f>(hBoundary(j, width)));
-      v = lerp(ip, v, alpha);
-      lpImage.at<P>(i, j + 1)[0] = clamp(v[0], 0.0f, maxVal);
-      lpImage.at<P>(i, j + 1)[1] = clamp(v[1], 0.0f, maxVal);
-      lpImage.at<P>(i, j + 1)[2] = clamp(v[2], 0.0f, maxVal);
-    }
+    iirLowPassRow<H, P>(inputImage, alpha, lpImage, i, hBoundary, maxVal, buffer);
   }
 
   // Vertical pass
-  for (int j = 0; j < width; ++j) {
-    // Causal pass
-    Vec3f v(lpImage.at<P>(0, j));
-    for (int i = 1; i <= height; ++i) {
-      Vec3f ip(lpImage.at<P>(vBoundary(i, height), j));
-      v = lerp(ip, v, alpha);
-      buffer.at<Vec3f>(vBoundary(i - 1, height)) = v;
-    }
-    // Anticausal pass
-    for (int i = height - 2; i >= -1; --i) {
-      Vec3f ip = buffer.at<Vec3f>(vBoundary(i, height));
-      v = lerp(ip, v, alpha);
-      lpImage.at<P>(i + 1, j)[0] = clamp(v[0], 0.0f, maxVal);
-      lpImage.at<P>(i + 1, j)[1] = clamp(v[1], 0.0f, maxVal);
-      lpImage.at<P>(i + 1, j)[2] = clamp(v[2], 0.0f, maxVal);
-    }
+  for (int j = 0; j < width; j += kIirColumnBlock) {
+    iirLowPassColumns<V, P>(
+      lpImage, alpha, j, std::min(j + kIirColumnBlock, width), vBoundary, maxVal, buffer);
   }
 }
 
+// Iir unsharp mask with noise coring of a single pixel
+template <typename P>
+inline void sharpenPixelWithIirLowPass(
+    P& p,
+    const Vec3f& lp,
+    const float rAmount,
+    const float gAmount,
+    const float bAmount,
+    const float noiseCore,
+    const float maxVal) {
+  // High pass signal - just the residual of the low pass
+  // subtracted from the original signal.
+  const Vec3f hp(
+      p[0] - lp[0],
+      p[1] - lp[1],
+      p[2] - lp[2]);
+  // Noise coring
+  const Vec3f ng(
+      1.0f - expf(-(square(hp[0]) * noiseCore)),
+      1.0f - expf(-(square(hp[1]) * noiseCore)),
+      1.0f - expf(-(square(hp[2]) * noiseCore)));
+  // Unsharp mask with coring
+  p[0] = clamp(lp[0] + hp[0] * ng[0] * rAmount,  0.0f, maxVal);
+  p[1] = clamp(lp[1] + hp[1] * ng[1] * gAmount,  0.0f, maxVal);
+  p[2] = clamp(lp[2] + hp[2] * ng[2] * bAmount,  0.0f, maxVal);
+}
+
 template <typename P>
 void sharpenWithIirLowPass(
     Mat& inputImage,
@@ -105,23 +180,14 @@ void sharpenWithIirLowPass(
   // Iir unsharp mask with noise coring
   for (int i = 0; i < inputImage.rows; ++i) {
     for (int j = 0; j < inputImage.cols; ++j) {
-      const Vec3f lp = lpImage.at<P>(i, j);
-      P& p = inputImage.at<P>(i, j);
-      // High pass signal - just the residual of the low pass
-      // subtracted from the original signal.
-      const Vec3f hp(
-          p[0] - lp[0],
-          p[1] - lp[1],
-          p[2] - lp[2]);
-      // Noise coring
-      const Vec3f ng(
-          1.0f - expf(-(square(hp[0]) * noiseCore)),
-          1.0f - expf(-(square(hp[1]) * noiseCore)),
-          1.0f - expf(-(square(hp[2]) * noiseCore)));
-      // Unsharp mask with coring
-      p[0] = clamp(lp[0] + hp[0] * ng[0] * rAmount,  0.0f, maxVal);
-      p[1] = clamp(lp[1] + hp[1] * ng[1] * gAmount,  0.0f, maxVal);
-      p[2] = clamp(lp[2] + hp[2] * ng[2] * bAmount,  0.0f, maxVal);
+      sharpenPixelWithIirLowPass<P>(
+        inputImage.at<P>(i, j),
+        lpImage.at<P>(i, j),
+        rAmount,
+        gAmount,
+        bAmount,
+        noiseCore,
+        maxVal);
     }
   }
 }
@@ -0,0 +1,262 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include "FrameFile.h"
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+#include <cstring>
+#include <vector>
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#include "VrCamException.h"
+
+namespace surround360 {
+namespace util {
+
+using namespace std;
+using namespace cv;
+
+// Owns the mapping of a frame file handed over by releaseImage, and unmaps
+// it once the last Mat referring to it is released. Never allocates.
+class FrameFileMappingAllocator : public MatAllocator {
+ public:
+  UMatData* allocate(
+      int dims,
+      const int* sizes,
+      int type,
+      void* data,
+      size_t* step,
+      int flags,
+      UMatUsageFlags usageFlags) const {
+    return nullptr;
+  }
+
+  bool allocate(UMatData* u, int accessFlags, UMatUsageFlags usageFlags) const {
+    return false;
+  }
+
+  void deallocate(UMatData* u) const {
+    if (u != nullptr) {
+      munmap(u->origdata, u->size);
+      delete u;
+    }
+  }
+};
+
+static FrameFileMappingAllocator mappingAllocator;
+
+bool isFrameFile(const string& filename) {
+  const string suffix = "." + kFrameFileExtension;
+  return
+    filename.size() >= suffix.size() &&
+    filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool frameFileLz4Available() {
+#ifdef USE_LZ4
+  return true;
+#else
+  return false;
+#endif
+}
+
+void writeFrameFile(
+    const string& filename,
+    const Mat& image,
+    const uint32_t cameraId,
+    const uint64_t frameIndex,
+    const FrameFileCompression compression) {
+
+  const Mat pixels = image.isContinuous() ? image : image.clone();
+  const size_t rawSize = pixels.total() * pixels.elemSize();
+
+  // The header is padded to the data alignment in the same page
+  vector<uint8_t> headerPage(kFrameFileDataAlignment, 0);
+  FrameFileHeader& header = *reinterpret_cast<FrameFileHeader*>(headerPage.data());
+  header.magic = kFrameFileMagic;
+  header.version = kFrameFileVersion;
+  header.width = pixels.cols;
+  header.height = pixels.rows;
+  header.type = pixels.type();
+  header.cameraId = cameraId;
+  header.frameIndex = frameIndex;
+  header.compression = compression;
+  header.dataOffset = kFrameFileDataAlignment;
+
+  const uint8_t* data = pixels.data;
+  vector<char> compressed;
+  if (compression == FRAME_FILE_LZ4) {
+#ifdef USE_LZ4
+    compressed.resize(LZ4_compressBound(rawSize));
+    const int compressedSize = LZ4_compress_default(
+      reinterpret_cast<const char*>(pixels.data),
+      compressed.data(),
+      rawSize,
+      compressed.size());
+    if (compressedSize <= 0) {
+      throw VrCamException("LZ4 compression failed: " + filename);
+    }
+    data = reinterpret_cast<const uint8_t*>(compressed.data());
+    header.dataSize = compressedSize;
+#else
+    throw VrCamException("frame file compression needs LZ4 support: " + filename);
+#endif
+  } else {
+    header.dataSize = rawSize;
+  }
+
+  const int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    throw VrCamException("failed to write frame file: " + filename);
+  }
+  struct iovec iov[2];
+  iov[0].iov_base = headerPage.data();
+  iov[0].iov_len = headerPage.size();
+  iov[1].iov_base = const_cast<uint8_t*>(data);
+  iov[1].iov_len = header.dataSize;
+  const ssize_t expected = iov[0].iov_len + iov[1].iov_len;
+  const ssize_t written = writev(fd, iov, 2);
+  ::close(fd);
+  if (written != expected) {
+    throw VrCamException("failed to write frame file: " + filename);
+  }
+}
+
+MappedFrameFile::MappedFrameFile(const string& filename) :
+    baseAddress(MAP_FAILED),
+    mappingSize(0) {
+
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw VrCamException("failed to open frame file: " + filename);
+  }
+  struct stat fileInfo;
+  if (fstat(fd, &fileInfo) == 0) {
+    mappingSize = fileInfo.st_size;
+    baseAddress = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  ::close(fd);
+  if (baseAddress == MAP_FAILED || mappingSize < sizeof(FrameFileHeader)) {
+    throw VrCamException("failed to map frame file: " + filename);
+  }
+  header = *reinterpret_cast<const FrameFileHeader*>(baseAddress);
+
+  if (header.magic != kFrameFileMagic || header.version != kFrameFileVersion) {
+    throw VrCamException("not a frame file: " + filename);
+  }
+  if (header.dataOffset + header.dataSize > mappingSize) {
+    throw VrCamException("truncated frame file: " + filename);
+  }
+
+  uint8_t* data = reinterpret_cast<uint8_t*>(baseAddress) + header.dataOffset;
+  if (header.compression == FRAME_FILE_UNCOMPRESSED) {
+    image = Mat(header.height, header.width, header.type, data);
+    if (header.dataSize != image.total() * image.elemSize()) {
+      throw VrCamException("frame file size mismatch: " + filename);
+    }
+    madvise(baseAddress, mappingSize, MADV_SEQUENTIAL);
+  } else if (header.compression == FRAME_FILE_LZ4) {
+#ifdef USE_LZ4
+    image.create(header.height, header.width, header.type);
+    const int rawSize = image.total() * image.elemSize();
+    const int decompressedSize = LZ4_decompress_safe(
+      reinterpret_cast<const char*>(data),
+      reinterpret_cast<char*>(image.data),
+      header.dataSize,
+      rawSize);
+    if (decompressedSize != rawSize) {
+      throw VrCamException("corrupt LZ4 frame file: " + filename);
+    }
+#else
+    throw VrCamException("frame file needs LZ4 support: " + filename);
+#endif
+  } else {
+    throw VrCamException("unknown frame file compression: " + filename);
+  }
+}
+
+MappedFrameFile::~MappedFrameFile() {
+  image.release();
+  if (baseAddress != MAP_FAILED) {
+    munmap(baseAddress, mappingSize);
+  }
+}
+
+Mat MappedFrameFile::releaseImage() {
+  if (header.compression != FRAME_FILE_UNCOMPRESSED) {
+    Mat released = image;
+    image.release();
+    return released;
+  }
+
+  UMatData* u = new UMatData(&mappingAllocator);
+  u->data = u->origdata = reinterpret_cast<uchar*>(baseAddress);
+  u->size = mappingSize;
+  u->refcount = 1;
+  Mat released(image.rows, image.cols, image.type(), image.data);
+  released.allocator = &mappingAllocator;
+  released.u = u;
+  image.release();
+  baseAddress = MAP_FAILED;
+  return released;
+}
+
+Mat imreadFrameFile(const string& filename, const int flags) {
+  MappedFrameFile frame(filename);
+  const Mat& src = frame.getImage();
+  if (flags < 0) {
+    return frame.releaseImage();
+  }
+
+  // Channels first, then depth, so a 16 bit color frame read as 8 bit
+  // color is converted in a single pass out of the mapping
+  Mat color = src;
+  const bool wantColor = (flags & IMREAD_COLOR) != 0;
+  if (wantColor && src.channels() == 1) {
+    cvtColor(src, color, COLOR_GRAY2BGR);
+  } else if (wantColor && src.channels() == 4) {
+    cvtColor(src, color, COLOR_BGRA2BGR);
+  } else if (!wantColor && src.channels() == 3) {
+    cvtColor(src, color, COLOR_BGR2GRAY);
+  } else if (!wantColor && src.channels() == 4) {
+    cvtColor(src, color, COLOR_BGRA2GRAY);
+  }
+
+  if ((flags & IMREAD_ANYDEPTH) || color.depth() == CV_8U) {
+    return color.data == src.data ? frame.releaseImage() : color;
+  }
+  if (color.depth() != CV_16U) {
+    throw VrCamException("expecting an 8 or 16 bit frame file: " + filename);
+  }
+
+  Mat image8(color.rows, color.cols, CV_MAKETYPE(CV_8U, color.channels()));
+  const int rowLength = color.cols * color.channels();
+  for (int y = 0; y < color.rows; ++y) {
+    const uint16_t* srcRow = color.ptr<uint16_t>(y);
+    uint8_t* dstRow = image8.ptr<uint8_t>(y);
+    for (int x = 0; x < rowLength; ++x) {
+      dstRow[x] = srcRow[x] >> 8;
+    }
+  }
+  return image8;
+}
+
+} // namespace util
+} // namespace surround360
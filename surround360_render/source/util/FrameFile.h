@@ -0,0 +1,107 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+*
+* This source code is licensed under the BSD-style license found in the
+* LICENSE_render file in the root directory of this subproject. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#pragma once
+
+#include <string>
+
+#include "CvUtil.h"
+
+namespace surround360 {
+namespace util {
+
+using namespace std;
+using namespace cv;
+
+// Frame files hold one uncompressed or LZ4 compressed image with a small
+// header, so intermediate frames are mapped rather than decoded. Files
+// with this extension are handled by imreadExceptionOnFail and
+// imwriteExceptionOnFail.
+const string kFrameFileExtension = "frm";
+
+const uint32_t kFrameFileMagic = 0x4d524646; // "FFRM"
+const uint32_t kFrameFileVersion = 1;
+
+// Pixel data starts on a page boundary so it can be used in place
+const size_t kFrameFileDataAlignment = 4096;
+
+enum FrameFileCompression {
+  FRAME_FILE_UNCOMPRESSED = 0,
+  FRAME_FILE_LZ4 = 1
+};
+
+struct FrameFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  int32_t width;
+  int32_t height;
+  int32_t type; // OpenCV type of the pixels, e.g. CV_16UC3
+  uint32_t cameraId;
+  uint64_t frameIndex;
+  uint32_t compression;
+  uint32_t reserved;
+  uint64_t dataOffset;
+  uint64_t dataSize; // bytes stored, compressed or not
+};
+
+// True if filename has the frame file extension
+bool isFrameFile(const string& filename);
+
+// True if LZ4 support was compiled in
+bool frameFileLz4Available();
+
+// Writes image with a single write. Throws if compression is requested but
+// LZ4 support isn't compiled in.
+void writeFrameFile(
+  const string& filename,
+  const Mat& image,
+  const uint32_t cameraId = 0,
+  const uint64_t frameIndex = 0,
+  const FrameFileCompression compression = FRAME_FILE_UNCOMPRESSED);
+
+// A frame file mapped copy on write, so the image can be changed without
+// changing the file. The image of an uncompressed frame refers to the
+// mapping and is only valid while this is alive, unless it is taken with
+// releaseImage.
+class MappedFrameFile {
+ public:
+  explicit MappedFrameFile(const string& filename);
+  ~MappedFrameFile();
+
+  MappedFrameFile(const MappedFrameFile&) = delete;
+  MappedFrameFile& operator=(const MappedFrameFile&) = delete;
+
+  const FrameFileHeader& getHeader() const {
+    return header;
+  }
+
+  const Mat& getImage() const {
+    return image;
+  }
+
+  // Hands the image over. The image of an uncompressed frame keeps the
+  // mapping alive until its last copy is released, and this no longer
+  // refers to either.
+  Mat releaseImage();
+
+ private:
+  void* baseAddress;
+  size_t mappingSize;
+  FrameFileHeader header;
+  Mat image;
+};
+
+// Loads a frame file converted like imread would with flags. 16 bit frames
+// read without IMREAD_ANYDEPTH keep their high byte, as with 16 bit PNGs.
+// An uncompressed frame that needs no conversion isn't copied, the image
+// is the mapping of the file.
+Mat imreadFrameFile(const string& filename, const int flags = IMREAD_COLOR);
+
+} // namespace util
+} // namespace surround360